@@ -34,6 +34,8 @@ extern "C" {
 #include <sys/socket.h>
 #include <qb/qbhdb.h>
 #include <qb/qbipc_common.h>
+#include <qb/qbloop.h>
+#include <qb/qbrb.h>
 
 /**
  * @file qbipcc.h
@@ -52,6 +54,13 @@ extern "C" {
  * The function qb_ipcc_sendv() sends an iovector request.
  * The function qb_ipcc_send() sends an message buffer request.
  *
+ * @par Pipelined requests
+ * Once qb_ipcc_async_start() has tied a connection (made with
+ * qb_ipcc_connect_2() and QB_IPCC_FLAG_ASYNC) to a qb_loop_t,
+ * qb_ipcc_send_async() sends a request without waiting for the response,
+ * which is handed to the request's callback from the loop. Many requests
+ * can be in flight at once, up to the window given.
+ *
  * @par Asynchronous events from the server
  * The qb_ipcc_event_recv() function receives an out-of-band asyncronous message.
  * The asynchronous messages are queued and can provide very high out-of-band performance.
@@ -83,6 +92,25 @@ typedef struct qb_ipcc_connection qb_ipcc_connection_t;
 qb_ipcc_connection_t*
 qb_ipcc_connect(const char *name, size_t max_msg_size);
 
+/**
+ * The connection will be used with qb_ipcc_async_start(): have shared
+ * memory responses signalled on an fd as well. This costs a syscall
+ * per response, so leave it out for connections that only wait for
+ * their responses.
+ */
+#define QB_IPCC_FLAG_ASYNC 0x01
+
+/**
+ * Create a connection to an IPC service, with flags.
+ *
+ * @param name name of the service.
+ * @param max_msg_size biggest msg size.
+ * @param flags QB_IPCC_FLAG_* or 0 (which is qb_ipcc_connect()).
+ * @return NULL (error: see errno) or a connection object.
+ */
+qb_ipcc_connection_t*
+qb_ipcc_connect_2(const char *name, size_t max_msg_size, uint32_t flags);
+
 /**
  * Test kernel dgram socket buffers to verify the largest size up
  * to the max_msg_size value a single msg can be. Rounds down to the
@@ -164,6 +192,61 @@ ssize_t qb_ipcc_sendv(qb_ipcc_connection_t* c, const struct iovec* iov,
 ssize_t qb_ipcc_recv(qb_ipcc_connection_t* c, void *msg_ptr,
                      size_t msg_len, int32_t ms_timeout);
 
+/**
+ * Get space to build a request in.
+ *
+ * With shared memory this points straight into the request buffer, so
+ * the request can be serialized in place instead of being built
+ * elsewhere and copied in by qb_ipcc_send(). Other transports hand out
+ * a buffer of the connection and qb_ipcc_send_commit() sends it.
+ *
+ * @param c connection instance
+ * @param size the size of the request
+ * @return where to build the request or NULL with errno set (EAGAIN
+ * if there is no space or the server asked us to slow down, EMSGSIZE
+ * if it will never fit).
+ *
+ * @note the request must start with a qb_ipc_request_header. Nothing
+ * else may be sent until it is committed; an allocation that is never
+ * committed is simply reused by the next one.
+ * @see qb_ipcc_send_commit()
+ */
+void *qb_ipcc_send_alloc(qb_ipcc_connection_t *c, size_t size);
+
+/**
+ * Send the request built by qb_ipcc_send_alloc().
+ *
+ * @param c connection instance
+ * @param size the size of the request, at most the size allocated
+ * @return (size sent, -errno == error)
+ */
+ssize_t qb_ipcc_send_commit(qb_ipcc_connection_t *c, size_t size);
+
+/**
+ * Receive a response without copying it.
+ *
+ * With shared memory msg_out points at the response where it lies in
+ * the response buffer, otherwise at a buffer of the connection. Either
+ * way it stays valid until qb_ipcc_recv_release(), which must be called
+ * before the next response can be received.
+ *
+ * @param c connection instance
+ * @param msg_out (out) the response, starting with its
+ * qb_ipc_response_header
+ * @param ms_timeout max time to wait for a response
+ * @return (size recv'ed, -errno == error)
+ * @see qb_ipcc_recv_release()
+ */
+ssize_t qb_ipcc_recv_peek(qb_ipcc_connection_t *c, void **msg_out,
+			  int32_t ms_timeout);
+
+/**
+ * Let go of the response returned by qb_ipcc_recv_peek().
+ *
+ * @param c connection instance
+ */
+void qb_ipcc_recv_release(qb_ipcc_connection_t *c);
+
 /**
  * This is a convenience function that simply sends and then recvs.
  *
@@ -187,6 +270,110 @@ ssize_t qb_ipcc_sendv_recv(qb_ipcc_connection_t *c,
 			   void *msg_ptr, size_t msg_len,
 			   int32_t ms_timeout);
 
+/**
+ * This is called with the response to a request sent with
+ * qb_ipcc_send_async().
+ *
+ * @param c connection instance
+ * @param id the id the request was sent with
+ * @param response the response, starting with its qb_ipc_response_header;
+ * only valid during the call, NULL if there is no response
+ * @param size the size of the response, or -errno if the request won't
+ * get one: -ENOTCONN if the server went away, -ECANCELED after
+ * qb_ipcc_async_stop()
+ * @param data as passed to qb_ipcc_send_async()
+ *
+ * @note this may call qb_ipcc_async_stop() or qb_ipcc_disconnect(). The
+ * requests still in flight get their callbacks (with -ECANCELED) before
+ * that returns, and none come after. Don't use @a c any more after
+ * qb_ipcc_disconnect().
+ */
+typedef void (*qb_ipcc_async_fn) (qb_ipcc_connection_t *c, uint64_t id,
+				  const void *response, ssize_t size,
+				  void *data);
+
+/**
+ * Receive responses in a main loop instead of waiting for them.
+ *
+ * Adds the fd that signals responses to @a l (for shared memory
+ * connections, the setup socket too, to notice the server going away).
+ * From then on responses go to the callbacks of the requests sent with
+ * qb_ipcc_send_async(), in the order the requests were sent; the server
+ * must answer every request, in order.
+ *
+ * @param c connection instance
+ * @param l the loop to dispatch responses from
+ * @param window the most requests in flight at any time
+ * @return 0 or -errno (-ENOTSUP if responses aren't signalled on an fd:
+ * a shared memory connection not made with QB_IPCC_FLAG_ASYNC, or a
+ * server that can't; -EBUSY if already started)
+ *
+ * @note don't mix this with qb_ipcc_recv(), qb_ipcc_recv_peek() or
+ * qb_ipcc_sendv_recv() on the same connection. Events still go through
+ * qb_ipcc_fd_get() and qb_ipcc_event_recv().
+ */
+int32_t qb_ipcc_async_start(qb_ipcc_connection_t *c, qb_loop_t *l,
+			    uint32_t window);
+
+/**
+ * Send a request and have its response handed to @a fn later.
+ *
+ * @param c connection instance
+ * @param iov the request, iov[0] starting with its qb_ipc_request_header
+ * @param iov_len the number of iovecs
+ * @param id anything to tell the request apart by, passed to @a fn
+ * @param fn called with the response
+ * @param data passed to @a fn
+ * @return size sent or -errno; -EAGAIN when the window is full or the
+ * server applies flow control, so try again once a response came in.
+ * @see qb_ipcc_async_start()
+ */
+ssize_t qb_ipcc_send_async(qb_ipcc_connection_t *c,
+			   const struct iovec *iov, size_t iov_len,
+			   uint64_t id, qb_ipcc_async_fn fn, void *data);
+
+/**
+ * Stop receiving responses in the loop.
+ *
+ * The requests still in flight get their callbacks called with
+ * -ECANCELED. Their responses may still come in and are left for
+ * qb_ipcc_recv(), so this is mostly for shutting down;
+ * qb_ipcc_disconnect() does it as well.
+ *
+ * @param c connection instance
+ */
+void qb_ipcc_async_stop(qb_ipcc_connection_t *c);
+
+/**
+ * Busy poll for responses: spin for up to @a usecs waiting for a
+ * response before going to sleep.
+ *
+ * For request/response traffic where the server answers within a few
+ * microseconds this saves two wakeups per round trip, at the cost of a
+ * busy cpu while waiting. The budget adapts to how often it pays off,
+ * see qb_rb_busy_poll_set(). With qb_ipcc_async_start() the dispatcher
+ * spins for the rest of the window before going back to the loop.
+ *
+ * @param c connection instance
+ * @param usecs the most to spin for, 0 (the default) to turn it off.
+ * @retval 0 == ok
+ * @retval -ENOTSUP not a shared memory connection
+ * @retval -EINVAL usecs is over a second
+ * @see qb_ipcs_connection_busy_poll_set()
+ */
+int32_t qb_ipcc_busy_poll_set(qb_ipcc_connection_t *c, uint32_t usecs);
+
+/**
+ * Get the time spent spinning and sleeping waiting for responses.
+ *
+ * @param c connection instance
+ * @param stats (out) the statistics
+ * @retval 0 == ok
+ * @retval -ENOTSUP not a shared memory connection
+ */
+int32_t qb_ipcc_busy_poll_stats_get(qb_ipcc_connection_t *c,
+				    struct qb_rb_busy_poll_stats *stats);
+
 /**
  * Receive an event.
  *
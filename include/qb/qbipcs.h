@@ -34,6 +34,7 @@ extern "C" {
 #include <qb/qbipc_common.h>
 #include <qb/qbhdb.h>
 #include <qb/qbloop.h>
+#include <qb/qbrb.h>
 
 /**
  * @file qbipcs.h
@@ -51,6 +52,14 @@ enum qb_ipcs_rate_limit {
 	QB_IPCS_RATE_OFF_2,
 };
 
+/**
+ * How qb_ipcs_workers_set() spreads new connections over the workers.
+ */
+enum qb_ipcs_worker_policy {
+	QB_IPCS_WORKER_ROUND_ROBIN,
+	QB_IPCS_WORKER_LEAST_LOADED,
+};
+
 struct qb_ipcs_connection;
 typedef struct qb_ipcs_connection qb_ipcs_connection_t;
 
@@ -157,6 +166,17 @@ typedef void (*qb_ipcs_connection_destroyed_fn) (qb_ipcs_connection_t *c);
 typedef int32_t (*qb_ipcs_msg_process_fn) (qb_ipcs_connection_t *c,
 		void *data, size_t size);
 
+/**
+ * This is the batched message processing callback,
+ * see qb_ipcs_msg_process_batch_set().
+ *
+ * It is called with the requests that were queued on the connection,
+ * oldest first, each iov_base pointing at a struct qb_ipc_request_header.
+ * @return 0, or a negative value to back off (as msg_process)
+ */
+typedef int32_t (*qb_ipcs_msg_process_batch_fn) (qb_ipcs_connection_t *c,
+		const struct iovec *msgs, size_t n_msgs);
+
 struct qb_ipcs_service_handlers {
 	qb_ipcs_connection_accept_fn connection_accept;
 	qb_ipcs_connection_created_fn connection_created;
@@ -203,6 +223,53 @@ void qb_ipcs_unref(qb_ipcs_service_t *s);
 void qb_ipcs_poll_handlers_set(qb_ipcs_service_t* s,
 	struct qb_ipcs_poll_handlers *handlers);
 
+/**
+ * Serve connections from worker threads.
+ *
+ * Starts (in qb_ipcs_run()) @a workers threads, each running its own
+ * qb_loop_t. New connections are still accepted in the loop behind
+ * qb_ipcs_poll_handlers_set(), then handed to a worker, which
+ * authenticates the client and from then on runs all of the
+ * connection's service handlers: connection_accept, connection_created,
+ * msg_process, connection_closed and connection_destroyed.
+ *
+ * @param s service instance
+ * @param workers the number of worker threads, 0 (the default) to
+ * serve every connection in the service's own loop
+ * @param policy how to pick the worker for a new connection
+ * @return 0 or -errno (-EBUSY once the service is running)
+ *
+ * @note call this before qb_ipcs_run(). The handlers of different
+ * connections then run concurrently; qb_ipcs_connection_ref(),
+ * qb_ipcs_connection_unref() and the statistics are thread safe, but
+ * anything else that acts on a connection (sending events, flow
+ * control, disconnecting) has to happen in its worker, e.g. from the
+ * handlers. qb_ipcs_destroy() stops and joins the workers.
+ */
+int32_t qb_ipcs_workers_set(qb_ipcs_service_t* s, uint32_t workers,
+			    enum qb_ipcs_worker_policy policy);
+
+/**
+ * Hand requests to the service in batches instead of one by one.
+ *
+ * When set, @a fn is called in place of msg_process with up to
+ * @a max_msgs requests at a time. On shared memory connections these
+ * are the requests already waiting in the ringbuffer, which stay in
+ * place until @a fn returns and are then reclaimed all together, so
+ * don't keep pointers into them. Transports that can't look ahead
+ * (sockets) pass one request per call.
+ *
+ * @param s service instance
+ * @param fn the batch handler, NULL to go back to msg_process
+ * @param max_msgs the most requests to pass in one call; this is also
+ * bounded by how many requests the poll priority lets the service
+ * handle per dispatch (see qb_ipcs_request_rate_limit())
+ * @return 0 or -errno (-EBUSY once the service is running)
+ */
+int32_t qb_ipcs_msg_process_batch_set(qb_ipcs_service_t* s,
+				      qb_ipcs_msg_process_batch_fn fn,
+				      uint32_t max_msgs);
+
 /**
  * Associate a "user" pointer with this service.
  *
@@ -277,6 +344,36 @@ ssize_t qb_ipcs_response_send(qb_ipcs_connection_t *c, const void *data,
 ssize_t qb_ipcs_response_sendv(qb_ipcs_connection_t *c,
 			       const struct iovec * iov, size_t iov_len);
 
+/**
+ * Get space to build a response in.
+ *
+ * With shared memory this points straight into the connection's
+ * response buffer, so the response doesn't have to be built elsewhere
+ * and copied in. Other transports hand out a buffer of the connection
+ * and qb_ipcs_response_commit() sends it.
+ *
+ * @param c connection instance
+ * @param size the size of the response
+ * @return where to build the response or NULL with errno set
+ * (EAGAIN if there is no space yet, EMSGSIZE if it will never fit).
+ *
+ * @note the response must start with a qb_ipc_response_header, as for
+ * qb_ipcs_response_send(). Nothing else may be sent to the client until
+ * it is committed; an allocation that is never committed is simply
+ * reused by the next one.
+ * @see qb_ipcs_response_commit()
+ */
+void *qb_ipcs_response_alloc(qb_ipcs_connection_t *c, size_t size);
+
+/**
+ * Send the response built by qb_ipcs_response_alloc().
+ *
+ * @param c connection instance
+ * @param size the size of the response, at most the size allocated
+ * @return size sent or -errno for errors
+ */
+ssize_t qb_ipcs_response_commit(qb_ipcs_connection_t *c, size_t size);
+
 /**
  * Send an asyncronous event message to the client.
  *
@@ -314,6 +411,69 @@ ssize_t qb_ipcs_event_send(qb_ipcs_connection_t *c, const void *data,
 ssize_t qb_ipcs_event_sendv(qb_ipcs_connection_t *c, const struct iovec * iov,
 			    size_t iov_len);
 
+/**
+ * This is called for each connection qb_ipcs_event_broadcast() couldn't
+ * send the event to.
+ *
+ * @param c connection instance
+ * @param error -errno as qb_ipcs_event_send() would have returned it
+ * @param data the data passed to qb_ipcs_event_broadcast()
+ */
+typedef void (*qb_ipcs_event_broadcast_fail_fn) (qb_ipcs_connection_t *c,
+						 int32_t error, void *data);
+
+/**
+ * Send the same asyncronous event to every connected client.
+ *
+ * The message is gathered from @a iov once and copied straight into
+ * each connection's event buffer. On connections whose client is
+ * already behind on reading events the notification is only queued up
+ * rather than retried, so a few slow clients don't slow the others
+ * down. A client the event can't be sent to (full buffer, too large,
+ * ...) doesn't stop it going out to the rest.
+ *
+ * With workers (qb_ipcs_workers_set()) each worker sends the event to
+ * its connections from its own thread, so it may not have gone out yet
+ * when this returns, and @a fail_fn is called from the workers' threads.
+ *
+ * @param s service instance
+ * @param iov the iovec struct that points to the message to send
+ * @param iov_len the number of iovecs.
+ * @param fail_fn called for each connection the send failed on, may be
+ * NULL
+ * @param data passed to fail_fn
+ * @return the number of connections the event was sent (or, with
+ * workers, handed over) to or -errno
+ *
+ * @note the iov[0] must be a qb_ipc_response_header, as with
+ * qb_ipcs_event_sendv().
+ */
+ssize_t qb_ipcs_event_broadcast(qb_ipcs_service_t *s,
+				const struct iovec *iov, size_t iov_len,
+				qb_ipcs_event_broadcast_fail_fn fail_fn,
+				void *data);
+
+/**
+ * Get space to build an event in.
+ *
+ * The event counterpart of qb_ipcs_response_alloc().
+ *
+ * @param c connection instance
+ * @param size the size of the event
+ * @return where to build the event or NULL with errno set
+ * @see qb_ipcs_event_commit()
+ */
+void *qb_ipcs_event_alloc(qb_ipcs_connection_t *c, size_t size);
+
+/**
+ * Send the event built by qb_ipcs_event_alloc().
+ *
+ * @param c connection instance
+ * @param size the size of the event, at most the size allocated
+ * @return size sent or -errno for errors
+ */
+ssize_t qb_ipcs_event_commit(qb_ipcs_connection_t *c, size_t size);
+
 /**
  * Increment the connection's reference counter.
  *
@@ -394,6 +554,41 @@ struct qb_ipcs_connection_stats_2*
 qb_ipcs_connection_stats_get_2(qb_ipcs_connection_t *c,
 			       int32_t clear_after_read);
 
+/**
+ * Busy poll for requests: after handling a batch of requests the
+ * connection's dispatcher spins for up to @a usecs for the next one
+ * before it goes back to the main loop.
+ *
+ * This trades a busy cpu for latency, see qb_rb_busy_poll_set() for how
+ * the budget adapts to the traffic. Call it from
+ * qb_ipcs_connection_created_fn() or the connection's other callbacks.
+ *
+ * @param c connection instance
+ * @param usecs the most to spin for, 0 (the default) to turn it off.
+ * @retval 0 == ok
+ * @retval -ENOTSUP not a shared memory connection
+ * @retval -errno to indicate a failure
+ * @see qb_ipcc_busy_poll_set()
+ */
+int32_t qb_ipcs_connection_busy_poll_set(qb_ipcs_connection_t *c,
+					 uint32_t usecs);
+
+/**
+ * Get the time the connection's dispatcher spent spinning and how often
+ * that found a request.
+ *
+ * The dispatcher sleeps in the main loop rather than in the ringbuffer,
+ * so there is little to see in the sleep counters.
+ *
+ * @param c connection instance
+ * @param stats (out) the statistics
+ * @retval 0 == ok
+ * @retval -ENOTSUP not a shared memory connection
+ * @retval -errno to indicate a failure
+ */
+int32_t qb_ipcs_connection_busy_poll_stats_get(qb_ipcs_connection_t *c,
+					       struct qb_rb_busy_poll_stats *stats);
+
 /**
  * Get the service statistics.
  *
@@ -28,6 +28,7 @@ extern "C" {
 /* *INDENT-ON* */
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stdint.h>
 
 /**
@@ -40,7 +41,8 @@ extern "C" {
  * is full.
  *
  * This implementation is capable of working across processes, but one process
- * must only write and the other prrocess read.
+ * must only write and the other prrocess read (see QB_RB_FLAG_MULTI_PRODUCER
+ * for more than one writer).
  *
  * The read process will do the following:
  * @code
@@ -106,6 +108,176 @@ extern "C" {
  */
 #define QB_RB_FLAG_NO_SEMAPHORE		0x10
 
+/**
+ * Allow several threads or processes to call qb_rb_chunk_write()
+ * concurrently.
+ *
+ * Writers reserve space with an atomic compare-and-swap on the write
+ * pointer and publish their chunks in reservation order, so the reader
+ * sees the same stream it would with a single writer.
+ *
+ * A writer that waits more than a second for the one ahead of it (which
+ * died, or is stopped) gives that reservation up: the reader never sees
+ * that chunk and, if its writer comes back, its qb_rb_chunk_write()
+ * returns -ETIMEDOUT. If the reservation can't be stepped over (its
+ * writer died right after claiming it) the waiting writer gives up its
+ * own chunk and returns -ETIMEDOUT instead of waiting for good.
+ *
+ * @note This can not be combined with QB_RB_FLAG_OVERWRITE and
+ * qb_rb_chunk_alloc()/qb_rb_chunk_commit() are not available.
+ * @see qb_rb_open()
+ */
+#define QB_RB_FLAG_MULTI_PRODUCER	0x20
+
+/**
+ * Use a futex in the shared header instead of a semaphore to notify
+ * the reader.
+ *
+ * A reader that finds the ringbuffer empty spins for a short while
+ * before going to sleep, and a writer only makes the wake-up system call
+ * when a reader is actually asleep, so a busy ringbuffer is driven
+ * without any system calls. Both sides must open the ringbuffer with
+ * this flag.
+ *
+ * @note Only available on Linux, qb_rb_open() fails with ENOTSUP
+ * elsewhere.
+ * @see qb_rb_open()
+ */
+#define QB_RB_FLAG_FUTEX		0x40
+
+/**
+ * Back the ringbuffer data with huge pages.
+ *
+ * The data file is created on a mounted hugetlbfs (and the size rounded
+ * up to the huge page size). If there is no usable hugetlbfs, or its
+ * page pool is exhausted, the ringbuffer silently falls back to normal
+ * shared memory and asks for transparent huge pages instead.
+ *
+ * @note Only used when creating the ringbuffer.
+ * @see qb_rb_open()
+ */
+#define QB_RB_FLAG_HUGEPAGES		0x80
+
+/**
+ * Fault in and lock the ringbuffer memory when it is opened.
+ *
+ * This moves the page fault cost out of the first writes (and reads)
+ * into qb_rb_open(). Locking is best effort, exceeding RLIMIT_MEMLOCK
+ * is not an error.
+ *
+ * @see qb_rb_open()
+ */
+#define QB_RB_FLAG_PREFAULT		0x100
+
+/**
+ * Create the ringbuffer in anonymous memory (memfd_create()) rather
+ * than in named files under /dev/shm.
+ *
+ * Nothing is left in the filesystem, not even after a crash. The peer
+ * opens the ringbuffer from file descriptors handed over by the creator
+ * (e.g. with SCM_RIGHTS), not by name.
+ *
+ * @note Only valid together with QB_RB_FLAG_CREATE; fails with ENOTSUP
+ * when memfd_create() isn't available.
+ * @see qb_rb_memfds_get(), qb_rb_open_from_memfds()
+ */
+#define QB_RB_FLAG_MEMFD		0x200
+
+/**
+ * Notify the reader through an eventfd instead of a semaphore.
+ *
+ * The reader can then poll the ringbuffer like any other file
+ * descriptor (e.g. with qb_loop_poll_add()) and read all the chunks
+ * that are ready on each wakeup. The writer only touches the eventfd
+ * when the ringbuffer goes from empty to non-empty.
+ *
+ * The eventfd can't be opened by name: the creator passes it on (see
+ * qb_rb_fd_get()), dup()'ed or to another process, and whoever opens
+ * the ringbuffer without QB_RB_FLAG_CREATE hands it to qb_rb_fd_set().
+ *
+ * @note Can't be combined with QB_RB_FLAG_FUTEX; fails with ENOTSUP
+ * where eventfd() isn't available.
+ * @see qb_rb_open()
+ */
+#define QB_RB_FLAG_EVENTFD		0x400
+
+/**
+ * One writer, many readers that each see every chunk.
+ *
+ * The creator writes. Every handle opened without QB_RB_FLAG_CREATE
+ * (up to 64 at a time) is a reader with its own read position, starting
+ * at the chunks written after it joined. Space is only reused once the
+ * slowest reader has read it; by default the writer gets -EAGAIN until
+ * then, with QB_RB_FLAG_OVERWRITE the slowest reader is evicted instead
+ * and its reads fail with -EPIPE from then on.
+ *
+ * qb_rb_chunk_reclaim() only releases the chunk for the calling reader.
+ *
+ * @note Can't be combined with QB_RB_FLAG_MULTI_PRODUCER or
+ * QB_RB_FLAG_EVENTFD, and unless QB_RB_FLAG_NO_SEMAPHORE is given,
+ * needs a futex (Linux).
+ * @see qb_rb_open()
+ */
+#define QB_RB_FLAG_BROADCAST		0x800
+
+/**
+ * Keep the ringbuffer in regular files and make it survive a crash.
+ *
+ * The name is a path prefix: the files are "<name>-header" and
+ * "<name>-data" ("./" is prepended if the name has no '/'), and they are
+ * kept when the ringbuffer is closed. The first commit starts a thread
+ * that flushes every commit made within qb_rb_journal_ctl()'s limits in
+ * one go, so committing never waits for the disk; qb_rb_journal_sync()
+ * flushes on demand.
+ *
+ * After a crash, qb_rb_create_from_file() on the header file brings the
+ * ringbuffer back as it was at the last flush.
+ *
+ * @note Can't be combined with QB_RB_FLAG_MEMFD, QB_RB_FLAG_HUGEPAGES or
+ * QB_RB_FLAG_BROADCAST, and can't be resized.
+ * @see qb_rb_open()
+ */
+#define QB_RB_FLAG_JOURNAL		0x1000
+
+/**
+ * Map a dump read by qb_rb_create_from_file() instead of copying it.
+ *
+ * The data stays in the file's page cache and is only read as the
+ * chunks are; nothing is ever written back to the file. Nothing can be
+ * written to the ringbuffer either.
+ *
+ * @note Only for dumps written by qb_rb_write_to_file_mappable(); other
+ * dumps, and files that can't be mapped, are copied as before.
+ * @see qb_rb_create_from_file(), qb_rb_write_to_file_mappable()
+ */
+#define QB_RB_FLAG_READONLY		0x2000
+
+/**
+ * Time how long chunks wait to be read.
+ *
+ * Every commit stamps the chunk with the time (two more words of chunk
+ * header) and the reader adds the time it waited to a histogram in the
+ * shared header when it reads or reclaims it.
+ *
+ * @note Can't be combined with QB_RB_FLAG_MULTI_PRODUCER,
+ * QB_RB_FLAG_BROADCAST or fixed slots, and qb_rb_write_to_file() isn't
+ * supported.
+ * @see qb_rb_dwell_stats_get(), qb_rb_dwell_stats_get_by_name()
+ */
+#define QB_RB_FLAG_TIMESTAMPS		0x4000
+
+/**
+ * Copy large chunks in with non-temporal stores.
+ *
+ * qb_rb_chunk_write() and qb_rb_chunk_writev() copy data of 16 KiB or
+ * more past the writer's caches, so that bulk payloads don't evict its
+ * working set. This only pays off when the reader is on another core
+ * and doesn't read the chunk straight away, so it is only a hint for
+ * this handle; where the cpu has no such stores it is ignored.
+ * @see qb_rb_chunk_writev()
+ */
+#define QB_RB_FLAG_NT_STORES		0x8000
+
 struct qb_ringbuffer_s;
 typedef struct qb_ringbuffer_s qb_ringbuffer_t;
 
@@ -119,12 +291,81 @@ typedef struct qb_ringbuffer_s qb_ringbuffer_t;
  * @param flags or'ed flags
  * @param shared_user_data_size size for a shared data area.
  * @note the actual size will be rounded up to the next page size.
+ * @note opening a ringbuffer created by a libqb with a different shared
+ * header layout fails with errno set to EPROTO.
  * @return a new ring buffer or NULL if there was a problem.
- * @see QB_RB_FLAG_CREATE, QB_RB_FLAG_OVERWRITE, QB_RB_FLAG_SHARED_THREAD, QB_RB_FLAG_SHARED_PROCESS
+ * @see QB_RB_FLAG_CREATE, QB_RB_FLAG_OVERWRITE, QB_RB_FLAG_SHARED_THREAD,
+ * QB_RB_FLAG_SHARED_PROCESS, QB_RB_FLAG_MULTI_PRODUCER, QB_RB_FLAG_FUTEX,
+ * QB_RB_FLAG_HUGEPAGES, QB_RB_FLAG_PREFAULT, QB_RB_FLAG_MEMFD,
+ * QB_RB_FLAG_EVENTFD, QB_RB_FLAG_BROADCAST, QB_RB_FLAG_JOURNAL
  */
 qb_ringbuffer_t *qb_rb_open(const char *name, size_t size, uint32_t flags,
 			    size_t shared_user_data_size);
 
+/**
+ * Create a ring buffer of fixed size slots.
+ *
+ * Every chunk takes exactly one slot and has no header, and the read and
+ * write positions are plain slot counters. This suits small records of
+ * a uniform size (telemetry samples, fixed size events) for which the
+ * chunk header and the variable step would cost more than the data.
+ *
+ * The chunk API is used as for any other ring buffer, except that:
+ * - qb_rb_chunk_alloc() and qb_rb_chunk_write() refuse anything bigger
+ *   than a slot, and
+ * - a chunk always reads back as a whole slot, i.e. slot_size rounded up
+ *   to a multiple of 4 bytes.
+ *
+ * The notifiers and QB_RB_FLAG_OVERWRITE work as usual (overwriting
+ * drops the oldest slot). Readers can open the ring buffer with this
+ * function or with qb_rb_open(): the slot layout is taken from the
+ * creator.
+ *
+ * @param name the unique name of this ringbuffer.
+ * @param slot_size the size of each chunk.
+ * @param slot_count the number of slots (rounded up to fill the pages).
+ * @param flags or'ed flags, as for qb_rb_open()
+ * @param shared_user_data_size size for a shared data area.
+ * @note Can't be combined with QB_RB_FLAG_MULTI_PRODUCER or
+ * QB_RB_FLAG_BROADCAST; qb_rb_chunk_alloc_batch(),
+ * qb_rb_chunk_commit_batch() and qb_rb_write_to_file() aren't supported.
+ * @return a new ring buffer or NULL if there was a problem.
+ * @see qb_rb_open()
+ */
+qb_ringbuffer_t *qb_rb_open_slots(const char *name, size_t slot_size,
+				  size_t slot_count, uint32_t flags,
+				  size_t shared_user_data_size);
+
+/**
+ * Open a ringbuffer created with QB_RB_FLAG_MEMFD.
+ *
+ * @param hdr_fd the header file descriptor.
+ * @param data_fd the data file descriptor.
+ * @param flags same flags as passed into qb_rb_open() (without
+ * QB_RB_FLAG_CREATE)
+ * @note Both file descriptors are consumed (closed), even on failure.
+ * @return a ring buffer or NULL if there was a problem.
+ * @see qb_rb_memfds_get()
+ */
+qb_ringbuffer_t *qb_rb_open_from_memfds(int32_t hdr_fd, int32_t data_fd,
+					uint32_t flags);
+
+/**
+ * Take the file descriptors of a QB_RB_FLAG_MEMFD ringbuffer.
+ *
+ * They are needed by the peer to call qb_rb_open_from_memfds(). The
+ * caller becomes their owner and closes them once they have been
+ * passed on, the ringbuffer itself stays mapped.
+ *
+ * @param rb ringbuffer instance
+ * @param hdr_fd (out) the header file descriptor.
+ * @param data_fd (out) the data file descriptor.
+ * @retval 0 == ok
+ * @retval -EBADF not a memfd ringbuffer or the fds were already taken
+ */
+int32_t qb_rb_memfds_get(qb_ringbuffer_t * rb, int32_t * hdr_fd,
+			 int32_t * data_fd);
+
 /**
  * Dereference the ringbuffer and if we are the last user destroy it.
  *
@@ -134,6 +375,71 @@ qb_ringbuffer_t *qb_rb_open(const char *name, size_t size, uint32_t flags,
  */
 void qb_rb_close(qb_ringbuffer_t * rb);
 
+/**
+ * Give an empty ringbuffer a new size while readers have it open.
+ *
+ * The writer swaps in a new data segment of the given size; readers
+ * that have the ringbuffer open map it the next time they peek or read.
+ *
+ * Only the (one) writer may call this, and only while the ringbuffer is
+ * empty. Nothing is copied over, so a ringbuffer that has filled up
+ * can't be grown out of its backlog: it has to be drained first, which
+ * is exactly when more room is no longer needed. Resize between bursts
+ * instead, e.g. grow once a write has failed with -EAGAIN and the
+ * reader has caught up, or shrink after a quiet period.
+ *
+ * Readers find the new segment by its path, so QB_RB_FLAG_MEMFD
+ * ringbuffers, whose segments are only passed around as file
+ * descriptors, can't be resized. That includes the ones behind shared
+ * memory IPC connections (see qbipcs.h): their size is fixed when the
+ * connection is set up.
+ *
+ * @param rb ringbuffer instance
+ * @param size the new size, as passed to qb_rb_open() (or the number
+ * of bytes of slots for qb_rb_open_slots()), rounded up to the page
+ * size.
+ * @retval 0 resized (or already that size)
+ * @retval -EAGAIN the ringbuffer isn't empty, try again later
+ * @retval -ENOTSUP for QB_RB_FLAG_MULTI_PRODUCER, QB_RB_FLAG_BROADCAST,
+ * QB_RB_FLAG_MEMFD, QB_RB_FLAG_HUGEPAGES, QB_RB_FLAG_JOURNAL and
+ * QB_RB_FLAG_READONLY ringbuffers
+ * @retval -errno failed to create the new segment, the old one is
+ * still in use
+ */
+int32_t qb_rb_resize(qb_ringbuffer_t * rb, size_t size);
+
+/**
+ * Tune when a QB_RB_FLAG_JOURNAL ringbuffer is flushed.
+ *
+ * Commits are flushed together, max_delay_ms after the first one that
+ * isn't on disk yet or as soon as max_bytes have been committed,
+ * whichever comes first. A limit of 0 is no limit; with both at 0
+ * every commit is flushed before it returns.
+ *
+ * The defaults are 100ms and half the size of the ringbuffer.
+ *
+ * @param rb ringbuffer instance
+ * @param max_delay_ms how long a commit may stay unflushed.
+ * @param max_bytes how many bytes may be committed unflushed.
+ * @retval 0 == ok
+ * @retval -ENOTSUP not a journal ringbuffer
+ */
+int32_t qb_rb_journal_ctl(qb_ringbuffer_t * rb, uint32_t max_delay_ms,
+			  size_t max_bytes);
+
+/**
+ * Flush a QB_RB_FLAG_JOURNAL ringbuffer now.
+ *
+ * On return everything committed (and reclaimed) so far survives a
+ * crash.
+ *
+ * @param rb ringbuffer instance
+ * @retval 0 == ok
+ * @retval -ENOTSUP not a journal ringbuffer
+ * @retval -errno the flush failed
+ */
+int32_t qb_rb_journal_sync(qb_ringbuffer_t * rb);
+
 /**
  * Get the name of the ringbuffer.
  * @param rb ringbuffer instance
@@ -141,6 +447,39 @@ void qb_rb_close(qb_ringbuffer_t * rb);
  */
 char *qb_rb_name_get(qb_ringbuffer_t * rb);
 
+/**
+ * Get the file descriptor to poll for new chunks.
+ *
+ * The file descriptor becomes readable when chunks are written to an
+ * empty QB_RB_FLAG_EVENTFD ringbuffer. On a wakeup, read chunks (with a
+ * zero timeout) until there are none left, the descriptor is cleared
+ * when the reader finds the ringbuffer empty.
+ *
+ * @note The descriptor still belongs to the ringbuffer, dup() it to
+ * keep it past qb_rb_close().
+ *
+ * @param rb ringbuffer instance
+ * @param fd (out) the file descriptor.
+ * @retval 0 == ok
+ * @retval -ENOTSUP not a QB_RB_FLAG_EVENTFD ringbuffer
+ * @retval -EBADF the peer's descriptor hasn't been set yet
+ */
+int32_t qb_rb_fd_get(qb_ringbuffer_t * rb, int32_t * fd);
+
+/**
+ * Give a QB_RB_FLAG_EVENTFD ringbuffer the creator's eventfd.
+ *
+ * A ringbuffer opened without QB_RB_FLAG_CREATE must be given it
+ * before reading or writing.
+ *
+ * @param rb ringbuffer instance
+ * @param fd the eventfd, owned (and closed) by the ringbuffer from now
+ * on.
+ * @retval 0 == ok
+ * @retval -ENOTSUP not a QB_RB_FLAG_EVENTFD ringbuffer
+ */
+int32_t qb_rb_fd_set(qb_ringbuffer_t * rb, int32_t fd);
+
 /**
  * Get a point to user shared data area.
  *
@@ -157,6 +496,9 @@ void *qb_rb_shared_user_data_get(qb_ringbuffer_t * rb);
  * This simply calls qb_rb_chunk_alloc() and then
  * qb_rb_chunk_commit().
  *
+ * @note With QB_RB_FLAG_MULTI_PRODUCER this may be called from several
+ * writers at once.
+ *
  * @param rb ringbuffer instance
  * @param data (in) the data to write
  * @param len (in) the size of the chunk.
@@ -167,6 +509,51 @@ void *qb_rb_shared_user_data_get(qb_ringbuffer_t * rb);
  */
 ssize_t qb_rb_chunk_write(qb_ringbuffer_t * rb, const void *data, size_t len);
 
+/**
+ * Write a chunk gathered from several buffers.
+ *
+ * The buffers are copied one after the other straight into a single
+ * chunk, so a message built from fragments (a header and a payload, say)
+ * doesn't have to be assembled in a buffer of its own first.
+ *
+ * @note With QB_RB_FLAG_MULTI_PRODUCER this may be called from several
+ * writers at once.
+ *
+ * @param rb ringbuffer instance
+ * @param iov (in) the buffers making up the chunk.
+ * @param iov_len (in) the number of entries in iov.
+ * @return the size of the chunk written or -errno (-EAGAIN if there is
+ * no space).
+ *
+ * @see qb_rb_chunk_write(), QB_RB_FLAG_NT_STORES
+ */
+ssize_t qb_rb_chunk_writev(qb_ringbuffer_t * rb, const struct iovec *iov,
+			   size_t iov_len);
+
+/**
+ * Reserve space for a chunk of unknown size.
+ *
+ * Like qb_rb_chunk_alloc(), but the region returned covers all the free
+ * space (at least min_len bytes) rather than a fixed size, so the caller
+ * can fill it in bit by bit and only then decide how long the chunk is.
+ * Nothing is visible to the reader until qb_rb_chunk_commit() is called
+ * with the number of bytes used, which may be anything up to the size
+ * returned.
+ *
+ * @param rb ringbuffer instance
+ * @param min_len (in) the least space that will do.
+ * @param data_out (out) where to write the chunk.
+ * @return the number of bytes that may be written (>= min_len),
+ * -EAGAIN if there is less space than min_len, or -errno.
+ * @note With fixed slots the region is always one slot; with
+ * QB_RB_FLAG_OVERWRITE only min_len bytes are reclaimed to make room.
+ * Returns -ENOTSUP on a QB_RB_FLAG_MULTI_PRODUCER ringbuffer.
+ *
+ * @see qb_rb_chunk_commit()
+ */
+ssize_t qb_rb_chunk_reserve(qb_ringbuffer_t * rb, size_t min_len,
+			    void **data_out);
+
 /**
  * Allocate space for a chunk of the given size.
  *
@@ -178,6 +565,8 @@ ssize_t qb_rb_chunk_write(qb_ringbuffer_t * rb, const void *data, size_t len);
  * @param rb ringbuffer instance
  * @param len (in) the size to allocate.
  * @return pointer to chunk to write to, or NULL (if no space).
+ * @note Returns NULL with errno set to ENOTSUP on a
+ * QB_RB_FLAG_MULTI_PRODUCER ringbuffer, use qb_rb_chunk_write() instead.
  *
  * @see qb_rb_chunk_alloc()
  */
@@ -190,6 +579,41 @@ void *qb_rb_chunk_alloc(qb_ringbuffer_t * rb, size_t len);
  */
 int32_t qb_rb_chunk_commit(qb_ringbuffer_t * rb, size_t len);
 
+/**
+ * Allocate space for several chunks at once.
+ *
+ * Set iov_len of each entry to the size wanted, on return iov_base of
+ * the allocated entries points to where that chunk's data goes.
+ * The chunks are not visible to the reader until
+ * qb_rb_chunk_commit_batch() is called.
+ *
+ * @param rb ringbuffer instance
+ * @param chunks (in/out) one entry per chunk.
+ * @param count (in) the number of entries in chunks.
+ * @return the number of chunks allocated (the first n entries), which
+ * may be less than count if the ringbuffer is short of space, -EAGAIN if
+ * not even the first chunk fits, or -errno.
+ *
+ * @see qb_rb_chunk_commit_batch()
+ */
+ssize_t qb_rb_chunk_alloc_batch(qb_ringbuffer_t * rb, struct iovec *chunks,
+				size_t count);
+
+/**
+ * finalize several chunks allocated by qb_rb_chunk_alloc_batch().
+ *
+ * All the chunks are published with a single write pointer update and
+ * a single notification to the reader (where the notifier supports it).
+ *
+ * @param rb ringbuffer instance
+ * @param chunks (in) the chunks as returned by qb_rb_chunk_alloc_batch(),
+ * the lengths must not be changed.
+ * @param count (in) the number of chunks to commit.
+ * @return 0 or -errno
+ */
+int32_t qb_rb_chunk_commit_batch(qb_ringbuffer_t * rb,
+				 const struct iovec *chunks, size_t count);
+
 /**
  * Read (without reclaiming) the last chunk.
  *
@@ -214,6 +638,33 @@ ssize_t qb_rb_chunk_peek(qb_ringbuffer_t * rb, void **data_out,
  */
 void qb_rb_chunk_reclaim(qb_ringbuffer_t * rb);
 
+/**
+ * Read (without reclaiming) up to max_chunks of the oldest chunks.
+ *
+ * This waits for the first chunk like qb_rb_chunk_peek() and then hands
+ * out whatever else is ready without waiting again.
+ *
+ * @param rb ringbuffer instance
+ * @param chunks (out) a pointer to and the size of each chunk (not copied).
+ * @param max_chunks (in) the number of entries in chunks.
+ * @param ms_timeout (in) time to wait for new data.
+ *
+ * @return the number of chunks filled in (0 if buffer empty) or -errno.
+ * @see qb_rb_chunk_reclaim_batch()
+ */
+ssize_t qb_rb_chunk_peek_batch(qb_ringbuffer_t * rb, struct iovec *chunks,
+			       size_t max_chunks, int32_t ms_timeout);
+
+/**
+ * Reclaim the count oldest chunks in one go.
+ *
+ * Use this to release the chunks returned by qb_rb_chunk_peek_batch().
+ * @param rb ringbuffer instance
+ * @param count (in) the number of chunks to reclaim.
+ * @return 0 or -errno
+ */
+int32_t qb_rb_chunk_reclaim_batch(qb_ringbuffer_t * rb, size_t count);
+
 /**
  * Read the oldest chunk into data_out.
  *
@@ -259,16 +710,149 @@ ssize_t qb_rb_space_used(qb_ringbuffer_t * rb);
  */
 ssize_t qb_rb_chunks_used(qb_ringbuffer_t * rb);
 
+/**
+ * How long chunks waited in a QB_RB_FLAG_TIMESTAMPS ringbuffer, and
+ * what is in it now.
+ *
+ * The percentiles are the top of the histogram bucket they fall in,
+ * i.e. at most 12.5% over.
+ */
+struct qb_rb_dwell_stats {
+	uint64_t count;		/**< chunks read since it was created */
+	uint64_t p50_ns;
+	uint64_t p99_ns;
+	uint64_t p999_ns;
+	uint64_t max_ns;
+	uint32_t chunks_used;	/**< chunks waiting to be read */
+	size_t bytes_used;	/**< space they take, headers included */
+};
+
+/**
+ * Get the dwell time statistics of a ringbuffer.
+ *
+ * @param rb ringbuffer instance
+ * @param stats (out) the statistics
+ * @retval 0 == ok
+ * @retval -ENOTSUP the ringbuffer wasn't created with
+ * QB_RB_FLAG_TIMESTAMPS
+ */
+int32_t qb_rb_dwell_stats_get(qb_ringbuffer_t * rb,
+			      struct qb_rb_dwell_stats *stats);
+
+/**
+ * Get the dwell time statistics of a ringbuffer by name.
+ *
+ * This only maps the shared header for a moment, so any process that
+ * can read it can watch a ringbuffer without taking part in it.
+ *
+ * @param name the name passed to qb_rb_open() by the creator.
+ * @param stats (out) the statistics
+ * @retval 0 == ok
+ * @retval -ENOTSUP the ringbuffer wasn't created with
+ * QB_RB_FLAG_TIMESTAMPS
+ * @retval -EPROTO created by an incompatible version of libqb
+ * @retval -errno the header couldn't be opened
+ */
+int32_t qb_rb_dwell_stats_get_by_name(const char *name,
+				      struct qb_rb_dwell_stats *stats);
+
+/**
+ * Busy polling: have the reader spin on the ringbuffer for a while
+ * before it goes to sleep waiting for a chunk.
+ *
+ * A reader that sleeps pays for a wakeup (a futex, eventfd or semaphore
+ * syscall on both sides and a context switch) on every chunk. If the
+ * next chunk comes in within the budget, spinning saves all of that at
+ * the cost of a busy cpu. The budget adapts: it halves each time the
+ * spin comes to nothing (down to 1/16th of usecs) and doubles again
+ * when it pays off, so a quiet ringbuffer soon stops burning cpu.
+ *
+ * This only changes blocking reads, i.e. those with a non-zero timeout,
+ * and only for this handle. On a single cpu, where the writer can't run
+ * while the reader spins, it does nothing.
+ *
+ * @param rb ringbuffer instance
+ * @param usecs the most to spin for each time, 0 to turn it off.
+ * @retval 0 == ok
+ * @retval -EINVAL rb is NULL or usecs is over a second
+ * @see qb_rb_busy_poll(), qb_rb_busy_poll_stats_get()
+ */
+int32_t qb_rb_busy_poll_set(qb_ringbuffer_t * rb, uint32_t usecs);
+
+/**
+ * Spin once, within the budget set with qb_rb_busy_poll_set(), waiting
+ * for a chunk to read.
+ *
+ * This is for readers that sleep somewhere else (e.g. in poll() on
+ * qb_rb_fd_get()), to call just before they do.
+ *
+ * @param rb ringbuffer instance
+ * @retval 1 there is a chunk to read
+ * @retval 0 nothing came in, or busy polling is off
+ * @retval -EINVAL rb is NULL
+ */
+int32_t qb_rb_busy_poll(qb_ringbuffer_t * rb);
+
+/**
+ * What busy polling did for a ringbuffer handle.
+ */
+struct qb_rb_busy_poll_stats {
+	uint64_t spins;		/**< times the reader spun */
+	uint64_t spin_hits;	/**< ... and found a chunk */
+	uint64_t spin_ns;	/**< time spent spinning */
+	uint64_t sleeps;	/**< times it went to sleep after a spin */
+	uint64_t sleep_ns;	/**< time spent asleep */
+	uint32_t budget_ns;	/**< what the next spin may take */
+};
+
+/**
+ * Get the busy polling statistics of this ringbuffer handle.
+ *
+ * @param rb ringbuffer instance
+ * @param stats (out) the statistics
+ * @retval 0 == ok
+ * @retval -EINVAL rb or stats is NULL
+ */
+int32_t qb_rb_busy_poll_stats_get(qb_ringbuffer_t * rb,
+				  struct qb_rb_busy_poll_stats *stats);
+
 /**
  * Write the contents of the Ring Buffer to file.
+ *
+ * Where the kernel allows it the data is copied file to file
+ * (copy_file_range() or sendfile()) without passing through user space.
+ *
  * @param fd open file to write the ringbuffer data to.
  * @param rb ringbuffer instance
- * @see qb_rb_create_from_file()
+ * @see qb_rb_create_from_file(), qb_rb_write_to_file_mappable()
  */
 ssize_t qb_rb_write_to_file(qb_ringbuffer_t * rb, int32_t fd);
 
+/**
+ * Write the contents of the Ring Buffer to file, laid out so that
+ * QB_RB_FLAG_READONLY can map it.
+ *
+ * The data starts 64 KiB into the file (a hole where the file system
+ * allows it) instead of right after the header.
+ *
+ * @note Only libqb versions that have this function can read the
+ * result; use qb_rb_write_to_file() for dumps that older tools must read.
+ *
+ * @param fd open file to write the ringbuffer data to.
+ * @param rb ringbuffer instance
+ * @see qb_rb_write_to_file(), QB_RB_FLAG_READONLY
+ */
+ssize_t qb_rb_write_to_file_mappable(qb_ringbuffer_t * rb, int32_t fd);
+
 /**
  * Load the saved ring buffer from file into tempory memory.
+ *
+ * With QB_RB_FLAG_JOURNAL, fd is instead the header file of a journal
+ * ringbuffer, which is reopened in place at the last flush; the new
+ * instance owns the journal from then on.
+ *
+ * With QB_RB_FLAG_READONLY the dump is mapped rather than loaded.
+ *
  * @param fd file with saved ringbuffer data.
  * @param flags same flags as passed into qb_rb_open()
  * @return new ringbuffer instance
@@ -279,6 +863,8 @@ qb_ringbuffer_t *qb_rb_create_from_file(int32_t fd, uint32_t flags);
 /**
  * Like 'chown' it changes the owner and group of the ringbuffers
  * resources.
+ * @note This does nothing for QB_RB_FLAG_MEMFD ringbuffers, access to
+ * them is given by passing on the file descriptors.
  * @param owner uid of the owner to change to
  * @param group gid of the group to change to
  * @param rb ringbuffer instance
@@ -288,6 +874,7 @@ int32_t qb_rb_chown(qb_ringbuffer_t * rb, uid_t owner, gid_t group);
 
 /**
  * Like 'chmod' it changes the mode of the ringbuffers resources.
+ * @note This does nothing for QB_RB_FLAG_MEMFD ringbuffers.
  * @param mode mode to change to
  * @param rb ringbuffer instance
  * @retval 0 == ok
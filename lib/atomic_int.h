@@ -128,4 +128,59 @@ qb_atomic_int_set_ex(volatile int32_t QB_GNUC_MAY_ALIAS * atomic,
 #endif
 }
 
+/**
+ * Adds val to the 64 bit counter pointed to by atomic.
+ *
+ * Relaxed: only good for statistics, not for ordering other accesses.
+ *
+ * @param atomic a pointer to a 64 bit counter
+ * @param val the value to add
+ */
+static inline void
+qb_atomic_uint64_add(volatile uint64_t QB_GNUC_MAY_ALIAS * atomic,
+		     uint64_t val)
+{
+#if defined(HAVE_GCC_BUILTINS_FOR_ATOMIC_OPERATIONS)
+	(void)__atomic_fetch_add(atomic, val, __ATOMIC_RELAXED);
+#elif defined(HAVE_GCC_BUILTINS_FOR_SYNC_OPERATIONS)
+	(void)__sync_fetch_and_add(atomic, val);
+#else
+	*atomic += val;
+#endif
+}
+
+/**
+ * Reads a 64 bit counter updated with qb_atomic_uint64_add(), and
+ * optionally resets it in the same step.
+ *
+ * @param atomic a pointer to a 64 bit counter
+ * @param clear reset the counter to 0
+ * @return the value of atomic
+ */
+static inline uint64_t
+qb_atomic_uint64_get(volatile uint64_t QB_GNUC_MAY_ALIAS * atomic,
+		     int32_t clear)
+{
+#if defined(HAVE_GCC_BUILTINS_FOR_ATOMIC_OPERATIONS)
+	if (clear) {
+		return __atomic_exchange_n(atomic, 0, __ATOMIC_RELAXED);
+	}
+	return __atomic_load_n(atomic, __ATOMIC_RELAXED);
+#elif defined(HAVE_GCC_BUILTINS_FOR_SYNC_OPERATIONS)
+	uint64_t val = __sync_fetch_and_add(atomic, 0);
+
+	if (clear) {
+		(void)__sync_fetch_and_sub(atomic, val);
+	}
+	return val;
+#else
+	uint64_t val = *atomic;
+
+	if (clear) {
+		*atomic = 0;
+	}
+	return val;
+#endif
+}
+
 #endif /* QB_ATOMIC_INT_H_DEFINED */
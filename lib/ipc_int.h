@@ -25,6 +25,7 @@
 #include "os_base.h"
 
 #include <dirent.h>
+#include <pthread.h>
 #include <qb/qblist.h>
 #include <qb/qbloop.h>
 #include <qb/qbipcc.h>
@@ -42,9 +43,45 @@ SEND CONN REQ ->
 	<-	SEND ACCEPT(with details)/DENY
 */
 
+/*
+ * qb_ipc_connection_request.flags
+ */
+/* the client can open QB_IPC_SHM ringbuffers from fds (SCM_RIGHTS) */
+#define QB_IPC_CONN_FLAG_SHM_FDS	0x01
+/*
+ * ... and take the request and event ringbuffers' eventfds, which then
+ * replace the byte per message on the setup socket
+ */
+#define QB_IPC_CONN_FLAG_SHM_EVENTFD	0x02
+/*
+ * ... and the response ringbuffer's eventfd as well, so that responses
+ * can be waited for in a poll loop (qb_ipcc_async_start()). Only asked
+ * for with QB_IPCC_FLAG_ASYNC: it's a write per response.
+ */
+#define QB_IPC_CONN_FLAG_SHM_RESPONSE_EVENTFD	0x04
+
+/*
+ * With QB_IPC_CONN_FLAG_SHM_FDS the server may attach the header and
+ * data fds of the request, response and event ringbuffers (in that
+ * order) to the connection response instead of making the client open
+ * them by name. With QB_IPC_CONN_FLAG_SHM_EVENTFD as well, the eventfds
+ * of the request and event ringbuffers may follow, and with
+ * QB_IPC_CONN_FLAG_SHM_RESPONSE_EVENTFD the response one after them.
+ */
+#define QB_IPC_SHM_RB_FDS 6
+#define QB_IPC_SHM_EVENTFD_FDS 8
+#define QB_IPC_SHM_FDS_MAX 9
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_SYS_EVENTFD_H) && \
+    defined(HAVE_EPOLL_CREATE1)
+#define QB_IPC_HAVE_SHM_EVENTFD 1
+#endif
+
 struct qb_ipc_connection_request {
 	struct qb_ipc_request_header hdr;
 	uint32_t max_msg_size;
+	/* used to be padding, so older clients always send 0 */
+	uint32_t flags;
 } __attribute__ ((aligned(8)));
 
 struct qb_ipc_event_connection_request {
@@ -84,27 +121,78 @@ struct qb_ipcc_funcs {
 	ssize_t (*recv)(struct qb_ipc_one_way *one_way, void *buf, size_t buf_size, int32_t timeout);
 	ssize_t (*send)(struct qb_ipc_one_way *one_way, const void *data, size_t size);
 	ssize_t (*sendv)(struct qb_ipc_one_way *one_way, const struct iovec *iov, size_t iov_len);
+	void *(*alloc)(struct qb_ipc_one_way *one_way, size_t size);
+	int32_t (*commit)(struct qb_ipc_one_way *one_way, size_t size);
+	ssize_t (*peek)(struct qb_ipc_one_way *one_way, void **data_out, int32_t timeout);
+	void (*reclaim)(struct qb_ipc_one_way *one_way);
 	void (*disconnect)(struct qb_ipcc_connection* c);
 	int32_t (*fc_get)(struct qb_ipc_one_way *one_way);
 };
 
+/*
+ * A request sent with qb_ipcc_send_async(), waiting for its response.
+ */
+struct qb_ipcc_async_req {
+	uint64_t id;
+	qb_ipcc_async_fn fn;
+	void *data;
+};
+
+/*
+ * Responses come back in the order the requests went out, so the
+ * requests in flight are a ring of window entries, the oldest at head.
+ */
+struct qb_ipcc_async {
+	qb_loop_t *loop;
+	int32_t response_fd;
+	/* -1 unless the setup socket is watched for the server going away */
+	int32_t setup_fd;
+	uint32_t window;
+	uint32_t head;
+	uint32_t count;
+	/*
+	 * Held across the callbacks, which may stop it or disconnect: the
+	 * last one out after qb_ipcc_async_stop() frees it.
+	 */
+	uint32_t holds;
+	int32_t stopped;
+	/* stopped by qb_ipcc_disconnect(), the connection is gone */
+	int32_t disconnected;
+	struct qb_ipcc_async_req reqs[];
+};
+
 struct qb_ipcc_connection {
 	char name[NAME_MAX];
 	int32_t needs_sock_for_poll;
+	/* QB_IPCC_FLAG_* given to qb_ipcc_connect_2() */
+	uint32_t flags;
 	struct qb_ipc_one_way setup;
 	struct qb_ipc_one_way request;
 	struct qb_ipc_one_way response;
 	struct qb_ipc_one_way event;
 	struct qb_ipcc_funcs funcs;
 	struct qb_ipc_request_header *receive_buf;
+	/* where qb_ipcc_send_alloc() requests are built without funcs.alloc */
+	void *send_buf;
+	/*
+	 * QB_IPC_CONN_FLAG_SHM_EVENTFD: an epoll fd over the setup socket
+	 * and the event eventfd for qb_ipcc_fd_get(), -1 otherwise
+	 */
+	int32_t poll_fd;
 	uint32_t fc_enable_max;
 	int32_t is_connected;
 	void * context;
+	int32_t setup_fds[QB_IPC_SHM_FDS_MAX];
+	uint32_t setup_fds_count;
+	struct qb_ipcc_async *async;
 };
 
 int32_t qb_ipcc_us_setup_connect(struct qb_ipcc_connection *c,
 				   struct qb_ipc_connection_response *r);
 ssize_t qb_ipc_us_send(struct qb_ipc_one_way *one_way, const void *msg, size_t len);
+ssize_t qb_ipc_us_send_fds(struct qb_ipc_one_way *one_way, const void *msg, size_t len,
+			   const int32_t *fds, uint32_t fds_count);
+void qb_ipc_fds_close(int32_t *fds, uint32_t *fds_count);
 ssize_t qb_ipc_us_recv(struct qb_ipc_one_way *one_way, void *msg, size_t len, int32_t timeout);
 int32_t qb_ipc_us_ready(struct qb_ipc_one_way *ow_data, struct qb_ipc_one_way *ow_conn,
 			int32_t ms_timeout, int32_t events);
@@ -124,12 +212,40 @@ struct qb_ipcs_funcs {
 	ssize_t (*recv)(struct qb_ipc_one_way *one_way, void *buf, size_t buf_size, int32_t timeout);
 	ssize_t (*peek)(struct qb_ipc_one_way *one_way, void **data_out, int32_t timeout);
 	void (*reclaim)(struct qb_ipc_one_way *one_way);
+	ssize_t (*peek_batch)(struct qb_ipc_one_way *one_way, struct iovec *msgs,
+			      size_t max_msgs, int32_t timeout);
+	void (*reclaim_batch)(struct qb_ipc_one_way *one_way, size_t count);
 	ssize_t (*send)(struct qb_ipc_one_way *one_way, const void *data, size_t size);
 	ssize_t (*sendv)(struct qb_ipc_one_way *one_way, const struct iovec* iov, size_t iov_len);
+	void *(*alloc)(struct qb_ipc_one_way *one_way, size_t size);
+	int32_t (*commit)(struct qb_ipc_one_way *one_way, size_t size);
 	void (*fc_set)(struct qb_ipc_one_way *one_way, int32_t fc_enable);
 	ssize_t (*q_len_get)(struct qb_ipc_one_way *one_way);
 };
 
+/*
+ * A thread with its own loop serving some of a service's connections,
+ * see qb_ipcs_workers_set().
+ */
+struct qb_ipcs_worker {
+	struct qb_ipcs_service *service;
+	qb_loop_t *loop;
+	pthread_t thread;
+	int32_t started;
+	/* new sockets and QB_IPCS_WORKER_* messages, as int32_t's */
+	int32_t pipe_fds[2];
+	/* handed over but not set up yet */
+	int32_t pending;
+	int32_t connections;
+	/* qb_ipcs_event_broadcast()s for QB_IPCS_WORKER_BROADCAST */
+	pthread_mutex_t broadcasts_lock;
+	struct qb_list_head broadcasts;
+};
+
+#define QB_IPCS_WORKER_STOP		-1
+#define QB_IPCS_WORKER_RATE_LIMIT	-2
+#define QB_IPCS_WORKER_BROADCAST	-3
+
 struct qb_ipcs_service {
 	enum qb_ipc_type type;
 	char name[NAME_MAX];
@@ -146,9 +262,20 @@ struct qb_ipcs_service {
 	enum qb_loop_priority poll_priority;
 
 	struct qb_list_head connections;
+	/* guards connections against the workers */
+	pthread_mutex_t connections_lock;
 	struct qb_list_head list;
 	struct qb_ipcs_stats stats;
 
+	struct qb_ipcs_worker *workers;
+	uint32_t n_workers;
+	enum qb_ipcs_worker_policy worker_policy;
+	uint32_t worker_next;
+	enum qb_ipcs_rate_limit rate_limit;
+
+	qb_ipcs_msg_process_batch_fn msg_process_batch;
+	uint32_t msg_batch_max;
+
 	void *context;
 };
 
@@ -179,14 +306,22 @@ struct qb_ipcs_connection {
 	struct qb_ipc_one_way response;
 	struct qb_ipc_one_way event;
 	struct qb_ipcs_service *service;
+	/* the worker serving this connection, NULL for the service's loop */
+	struct qb_ipcs_worker *worker;
 	struct qb_list_head list;
 	struct qb_ipc_request_header *receive_buf;
+	/* where qb_ipcs_*_alloc() messages are built without funcs.alloc */
+	void *response_buf;
+	void *event_buf;
 	void *context;
 	int32_t fc_enabled;
 	int32_t poll_events;
 	int32_t outstanding_notifiers;
 	char description[CONNECTION_DESCRIPTION];
 	struct qb_ipcs_connection_stats_2 stats;
+	uint32_t setup_flags;
+	int32_t setup_fds[QB_IPC_SHM_FDS_MAX];
+	uint32_t setup_fds_count;
 };
 
 void qb_ipcs_us_init(struct qb_ipcs_service *s);
@@ -199,6 +334,42 @@ int32_t qb_ipcc_us_sock_connect(const char *socket_name, int32_t * sock_pt);
 int32_t qb_ipcs_dispatch_connection_request(int32_t fd, int32_t revents, void *data);
 struct qb_ipcs_connection* qb_ipcs_connection_alloc(struct qb_ipcs_service *s);
 
+/* poll the connection's fds in its worker's loop or the service's */
+int32_t qb_ipcs_connection_dispatch_add(struct qb_ipcs_connection *c,
+					int32_t fd, int32_t events,
+					qb_ipcs_dispatch_fn_t fn);
+int32_t qb_ipcs_connection_dispatch_mod(struct qb_ipcs_connection *c,
+					int32_t fd, int32_t events,
+					qb_ipcs_dispatch_fn_t fn);
+int32_t qb_ipcs_connection_dispatch_del(struct qb_ipcs_connection *c,
+					int32_t fd);
+int32_t qb_ipcs_connection_job_add(struct qb_ipcs_connection *c,
+				   enum qb_loop_priority p, void *data,
+				   qb_loop_job_dispatch_fn fn);
+void qb_ipcs_connection_rate_limit(struct qb_ipcs_connection *c,
+				   enum qb_ipcs_rate_limit rl,
+				   int32_t requeue);
+
+int32_t qb_ipcs_us_connection_setup(struct qb_ipcs_service *s,
+				    struct qb_ipcs_worker *w, int32_t sock);
+
+int32_t qb_ipcs_workers_start(struct qb_ipcs_service *s);
+void qb_ipcs_workers_stop(struct qb_ipcs_service *s);
+void qb_ipcs_workers_free(struct qb_ipcs_service *s);
+int32_t qb_ipcs_worker_handoff(struct qb_ipcs_service *s, int32_t sock);
+void qb_ipcs_workers_post(struct qb_ipcs_service *s, int32_t msg);
+ssize_t qb_ipcs_workers_broadcast(struct qb_ipcs_service *s,
+				  const struct iovec *iov, size_t iov_len,
+				  size_t size,
+				  qb_ipcs_event_broadcast_fail_fn fail_fn,
+				  void *data);
+/* broadcast to the connections served by w (NULL: the service's loop) */
+ssize_t qb_ipcs_event_broadcast_run(struct qb_ipcs_service *s,
+				    struct qb_ipcs_worker *w,
+				    const void *msg, size_t size,
+				    qb_ipcs_event_broadcast_fail_fn fail_fn,
+				    void *data);
+
 int32_t qb_ipcs_process_request(struct qb_ipcs_service *s,
 	struct qb_ipc_request_header *hdr);
 
@@ -82,6 +82,163 @@ retry_send:
 	return processed;
 }
 
+#ifdef SCM_RIGHTS
+ssize_t
+qb_ipc_us_send_fds(struct qb_ipc_one_way *one_way, const void *msg, size_t len,
+		   const int32_t *fds, uint32_t fds_count)
+{
+	struct msghdr msg_send;
+	struct iovec iov_send;
+	struct cmsghdr *cmsg;
+	char cmsg_buf[CMSG_SPACE(sizeof(int32_t) * QB_IPC_SHM_FDS_MAX)];
+	ssize_t result;
+
+	if (fds_count == 0 || fds_count > QB_IPC_SHM_FDS_MAX) {
+		return -EINVAL;
+	}
+
+	memset(&msg_send, 0, sizeof(msg_send));
+	memset(cmsg_buf, 0, sizeof(cmsg_buf));
+	iov_send.iov_base = (void *)msg;
+	iov_send.iov_len = len;
+	msg_send.msg_iov = &iov_send;
+	msg_send.msg_iovlen = 1;
+	msg_send.msg_control = cmsg_buf;
+	msg_send.msg_controllen = CMSG_SPACE(sizeof(int32_t) * fds_count);
+
+	cmsg = CMSG_FIRSTHDR(&msg_send);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int32_t) * fds_count);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int32_t) * fds_count);
+
+	qb_sigpipe_ctl(QB_SIGPIPE_IGNORE);
+	result = sendmsg(one_way->u.us.sock, &msg_send, MSG_NOSIGNAL);
+	qb_sigpipe_ctl(QB_SIGPIPE_DEFAULT);
+	if (result == -1) {
+		return -errno;
+	}
+
+	/*
+	 * The fds went with the first byte, the rest is a normal stream.
+	 */
+	if (result != len) {
+		ssize_t res = qb_ipc_us_send(one_way, (char *)msg + result,
+					     len - result);
+		if (res < 0) {
+			return res;
+		}
+	}
+	return len;
+}
+
+/*
+ * Like qb_ipc_us_recv() but also collect any fds sent with
+ * qb_ipc_us_send_fds().
+ */
+static ssize_t
+qb_ipc_us_recv_fds(struct qb_ipc_one_way *one_way, void *msg, size_t len,
+		   int32_t *fds, uint32_t *fds_count, int32_t timeout)
+{
+	struct msghdr msg_recv;
+	struct iovec iov_recv;
+	struct cmsghdr *cmsg;
+	char cmsg_buf[CMSG_SPACE(sizeof(int32_t) * QB_IPC_SHM_FDS_MAX)
+#ifdef SO_PASSCRED
+		      /* in case our SO_PASSCRED was still on */
+		      + CMSG_SPACE(sizeof(struct ucred))
+#endif /* SO_PASSCRED */
+		     ];
+	ssize_t result;
+	size_t n;
+	int flags = MSG_NOSIGNAL;
+
+#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif /* MSG_CMSG_CLOEXEC */
+
+	*fds_count = 0;
+	memset(&msg_recv, 0, sizeof(msg_recv));
+	iov_recv.iov_base = msg;
+	iov_recv.iov_len = len;
+	msg_recv.msg_iov = &iov_recv;
+	msg_recv.msg_iovlen = 1;
+	msg_recv.msg_control = cmsg_buf;
+	msg_recv.msg_controllen = sizeof(cmsg_buf);
+
+	qb_sigpipe_ctl(QB_SIGPIPE_IGNORE);
+
+retry_recv:
+	result = recvmsg(one_way->u.us.sock, &msg_recv, flags);
+	if (result == -1 && errno == EAGAIN) {
+		result = qb_ipc_us_ready(one_way, NULL, timeout, POLLIN);
+		if (result == 0 || (result == -EAGAIN && timeout == -1)) {
+			goto retry_recv;
+		}
+		qb_sigpipe_ctl(QB_SIGPIPE_DEFAULT);
+		return result;
+	}
+	qb_sigpipe_ctl(QB_SIGPIPE_DEFAULT);
+	if (result == -1) {
+		if (errno == ECONNRESET || errno == EPIPE) {
+			return -ENOTCONN;
+		}
+		return -errno;
+	}
+	if (result == 0) {
+		return -ENOTCONN;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg_recv); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(&msg_recv, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int32_t);
+		n = QB_MIN(n, QB_IPC_SHM_FDS_MAX - *fds_count);
+		memcpy(&fds[*fds_count], CMSG_DATA(cmsg), n * sizeof(int32_t));
+		*fds_count += n;
+	}
+	if (msg_recv.msg_flags & MSG_CTRUNC) {
+		qb_util_log(LOG_ERR, "fds passed with the response were lost");
+		qb_ipc_fds_close(fds, fds_count);
+		return -EPROTO;
+	}
+
+	if (result != len) {
+		ssize_t res = qb_ipc_us_recv(one_way, (char *)msg + result,
+					     len - result, timeout);
+		if (res < 0) {
+			qb_ipc_fds_close(fds, fds_count);
+			return res;
+		}
+	}
+	return len;
+}
+#else
+ssize_t
+qb_ipc_us_send_fds(struct qb_ipc_one_way *one_way, const void *msg, size_t len,
+		   const int32_t *fds, uint32_t fds_count)
+{
+	return -ENOTSUP;
+}
+#endif /* SCM_RIGHTS */
+
+void
+qb_ipc_fds_close(int32_t *fds, uint32_t *fds_count)
+{
+	uint32_t i;
+
+	for (i = 0; i < *fds_count; i++) {
+		if (fds[i] >= 0) {
+			close(fds[i]);
+			fds[i] = -1;
+		}
+	}
+	*fds_count = 0;
+}
+
 static ssize_t
 qb_ipc_us_recv_msghdr(int32_t s, struct msghdr *hdr, char *msg, size_t len)
 {
@@ -316,6 +473,15 @@ qb_ipcc_us_setup_connect(struct qb_ipcc_connection *c,
 	request.hdr.id = QB_IPC_MSG_AUTHENTICATE;
 	request.hdr.size = sizeof(request);
 	request.max_msg_size = c->setup.max_msg_size;
+#ifdef SCM_RIGHTS
+	request.flags = QB_IPC_CONN_FLAG_SHM_FDS;
+#ifdef QB_IPC_HAVE_SHM_EVENTFD
+	request.flags |= QB_IPC_CONN_FLAG_SHM_EVENTFD;
+	if (c->flags & QB_IPCC_FLAG_ASYNC) {
+		request.flags |= QB_IPC_CONN_FLAG_SHM_RESPONSE_EVENTFD;
+	}
+#endif /* QB_IPC_HAVE_SHM_EVENTFD */
+#endif /* SCM_RIGHTS */
 	res = qb_ipc_us_send(&c->setup, &request, request.hdr.size);
 	if (res < 0) {
 		qb_ipcc_us_sock_close(c->setup.u.us.sock);
@@ -326,9 +492,15 @@ qb_ipcc_us_setup_connect(struct qb_ipcc_connection *c,
 		   sizeof(off));
 #endif
 
+#ifdef SCM_RIGHTS
+	res = qb_ipc_us_recv_fds(&c->setup, r,
+				 sizeof(struct qb_ipc_connection_response),
+				 c->setup_fds, &c->setup_fds_count, -1);
+#else
 	res =
 	    qb_ipc_us_recv(&c->setup, r,
 			   sizeof(struct qb_ipc_connection_response), -1);
+#endif /* SCM_RIGHTS */
 	if (res < 0) {
 		return res;
 	}
@@ -439,6 +611,7 @@ qb_ipcs_us_withdraw(struct qb_ipcs_service * s)
 
 static int32_t
 handle_new_connection(struct qb_ipcs_service *s,
+		      struct qb_ipcs_worker *w,
 		      int32_t auth_result,
 		      int32_t sock,
 		      void *msg, size_t len, struct ipc_auth_ugp *ugp)
@@ -461,7 +634,12 @@ handle_new_connection(struct qb_ipcs_service *s,
 		qb_ipcc_us_sock_close(sock);
 		return -ENOMEM;
 	}
+	if (w) {
+		c->worker = w;
+		qb_atomic_int_inc(&w->connections);
+	}
 	c->setup.u.us.sock = sock;
+	c->setup_flags = req->flags;
 	c->request.max_msg_size = QB_MAX(req->max_msg_size, s->max_buffer_size);
 	c->response.max_msg_size = QB_MAX(req->max_msg_size, s->max_buffer_size);
 	c->event.max_msg_size = QB_MAX(req->max_msg_size, s->max_buffer_size);
@@ -495,7 +673,9 @@ handle_new_connection(struct qb_ipcs_service *s,
 	 * The connection is good, add it to the active connection list
 	 */
 	c->state = QB_IPCS_CONNECTION_ACTIVE;
+	(void)pthread_mutex_lock(&s->connections_lock);
 	qb_list_add(&c->list, &s->connections);
+	(void)pthread_mutex_unlock(&s->connections_lock);
 
 send_response:
 	response.hdr.id = QB_IPC_MSG_AUTHENTICATE;
@@ -505,10 +685,18 @@ send_response:
 		response.connection = (intptr_t) c;
 		response.connection_type = s->type;
 		response.max_msg_size = c->request.max_msg_size;
-		s->stats.active_connections++;
+		qb_atomic_int_inc((int32_t *)&s->stats.active_connections);
 	}
 
-	res2 = qb_ipc_us_send(&c->setup, &response, response.hdr.size);
+	if (res == 0 && c->setup_fds_count > 0) {
+		res2 = qb_ipc_us_send_fds(&c->setup, &response,
+					  response.hdr.size,
+					  c->setup_fds, c->setup_fds_count);
+	} else {
+		res2 = qb_ipc_us_send(&c->setup, &response, response.hdr.size);
+	}
+	/* the client has its own copies now */
+	qb_ipc_fds_close(c->setup_fds, &c->setup_fds_count);
 	if (res == 0 && res2 != response.hdr.size) {
 		res = res2;
 	}
@@ -665,8 +853,6 @@ qb_ipcs_us_connection_acceptor(int fd, int revent, void *data)
 	int32_t new_fd;
 	struct qb_ipcs_service *s = (struct qb_ipcs_service *)data;
 	int32_t res;
-	struct qb_ipc_connection_request setup_msg;
-	struct ipc_auth_ugp ugp;
 	socklen_t addrlen = sizeof(struct sockaddr_un);
 
 	if (revent & (POLLNVAL | POLLHUP | POLLERR)) {
@@ -706,22 +892,39 @@ retry_accept:
 		return 0;
 	}
 
-	res = qb_ipcs_uc_recv_and_auth(new_fd, &setup_msg, sizeof(setup_msg),
+	if (s->n_workers > 0) {
+		if (qb_ipcs_worker_handoff(s, new_fd) < 0) {
+			close(new_fd);
+		}
+		return 0;
+	}
+	(void)qb_ipcs_us_connection_setup(s, NULL, new_fd);
+	return 0;
+}
+
+/*
+ * Authenticate a freshly accepted client and set up its connection, to
+ * be served by worker w (NULL for the service's own loop).
+ */
+int32_t
+qb_ipcs_us_connection_setup(struct qb_ipcs_service *s,
+			    struct qb_ipcs_worker *w, int32_t sock)
+{
+	int32_t res;
+	struct qb_ipc_connection_request setup_msg;
+	struct ipc_auth_ugp ugp;
+
+	res = qb_ipcs_uc_recv_and_auth(sock, &setup_msg, sizeof(setup_msg),
 				       &ugp);
 	if (res < 0) {
-		close(new_fd);
-		/* This is an error, but -1 would indicate disconnect
-		 * from the poll loop
-		 */
-		return 0;
+		close(sock);
+		return res;
 	}
 
 	if (setup_msg.hdr.id == QB_IPC_MSG_AUTHENTICATE) {
-		(void)handle_new_connection(s, res, new_fd, &setup_msg,
-					    sizeof(setup_msg), &ugp);
-	} else {
-		close(new_fd);
+		return handle_new_connection(s, w, res, sock, &setup_msg,
+					     sizeof(setup_msg), &ugp);
 	}
-
-	return 0;
+	close(sock);
+	return -EINVAL;
 }
@@ -27,6 +27,9 @@
 #include <qb/qbatomic.h>
 #include <qb/qbloop.h>
 #include <qb/qbrb.h>
+#ifdef QB_IPC_HAVE_SHM_EVENTFD
+#include <sys/epoll.h>
+#endif /* QB_IPC_HAVE_SHM_EVENTFD */
 
 /*
  * utility functions
@@ -40,6 +43,10 @@ static void
 qb_ipcc_shm_disconnect(struct qb_ipcc_connection *c)
 {
 	qb_ipcc_us_sock_close(c->setup.u.us.sock);
+	if (c->poll_fd >= 0) {
+		close(c->poll_fd);
+		c->poll_fd = -1;
+	}
 	if (c->is_connected) {
 		qb_rb_close(c->request.u.shm.rb);
 		qb_rb_close(c->response.u.shm.rb);
@@ -62,34 +69,29 @@ static ssize_t
 qb_ipc_shm_sendv(struct qb_ipc_one_way *one_way,
 		 const struct iovec *iov, size_t iov_len)
 {
-	char *dest;
-	int32_t res = 0;
-	int32_t total_size = 0;
-	int32_t i;
-	char *pt = NULL;
-
 	if (one_way->u.shm.rb == NULL) {
 		return -ENOTCONN;
 	}
+	return qb_rb_chunk_writev(one_way->u.shm.rb, iov, iov_len);
+}
 
-	for (i = 0; i < iov_len; i++) {
-		total_size += iov[i].iov_len;
-	}
-	dest = qb_rb_chunk_alloc(one_way->u.shm.rb, total_size);
-	if (dest == NULL) {
-		return -errno;
+static void *
+qb_ipc_shm_alloc(struct qb_ipc_one_way *one_way, size_t size)
+{
+	if (one_way->u.shm.rb == NULL) {
+		errno = ENOTCONN;
+		return NULL;
 	}
-	pt = dest;
+	return qb_rb_chunk_alloc(one_way->u.shm.rb, size);
+}
 
-	for (i = 0; i < iov_len; i++) {
-		memcpy(pt, iov[i].iov_base, iov[i].iov_len);
-		pt += iov[i].iov_len;
-	}
-	res = qb_rb_chunk_commit(one_way->u.shm.rb, total_size);
-	if (res < 0) {
-		return res;
+static int32_t
+qb_ipc_shm_commit(struct qb_ipc_one_way *one_way, size_t size)
+{
+	if (one_way->u.shm.rb == NULL) {
+		return -ENOTCONN;
 	}
-	return total_size;
+	return qb_rb_chunk_commit(one_way->u.shm.rb, size);
 }
 
 static ssize_t
@@ -126,6 +128,30 @@ qb_ipc_shm_reclaim(struct qb_ipc_one_way *one_way)
 	}
 }
 
+static ssize_t
+qb_ipc_shm_peek_batch(struct qb_ipc_one_way *one_way, struct iovec *msgs,
+		      size_t max_msgs, int32_t ms_timeout)
+{
+	ssize_t rc;
+	if (one_way->u.shm.rb == NULL) {
+		return -ENOTCONN;
+	}
+	rc = qb_rb_chunk_peek_batch(one_way->u.shm.rb, msgs, max_msgs,
+				    ms_timeout);
+	if (rc == 0)  {
+		return -EAGAIN;
+	}
+	return rc;
+}
+
+static void
+qb_ipc_shm_reclaim_batch(struct qb_ipc_one_way *one_way, size_t count)
+{
+	if (one_way->u.shm.rb != NULL) {
+		(void)qb_rb_chunk_reclaim_batch(one_way->u.shm.rb, count);
+	}
+}
+
 static void
 qb_ipc_shm_fc_set(struct qb_ipc_one_way *one_way, int32_t fc_enable)
 {
@@ -157,6 +183,84 @@ qb_ipc_shm_q_len_get(struct qb_ipc_one_way *one_way)
 	return qb_rb_chunks_used(one_way->u.shm.rb);
 }
 
+/*
+ * Open one of the ringbuffers, by name or from the fds the server
+ * passed along with the connection response.
+ */
+static qb_ringbuffer_t *
+qb_ipcc_shm_rb_open(struct qb_ipcc_connection *c, uint32_t idx,
+		    const char *rb_name, size_t size,
+		    size_t shared_user_data_size, int32_t *event_fd)
+{
+	qb_ringbuffer_t *rb;
+	uint32_t flags = QB_RB_FLAG_SHARED_PROCESS;
+
+	if (c->setup_fds_count == 0) {
+		return qb_rb_open(rb_name, size, flags,
+				  shared_user_data_size);
+	}
+	if (event_fd && *event_fd >= 0) {
+		flags |= QB_RB_FLAG_EVENTFD;
+	}
+	rb = qb_rb_open_from_memfds(c->setup_fds[2 * idx],
+				    c->setup_fds[2 * idx + 1], flags);
+	c->setup_fds[2 * idx] = -1;
+	c->setup_fds[2 * idx + 1] = -1;
+	if (rb && (flags & QB_RB_FLAG_EVENTFD)) {
+		(void)qb_rb_fd_set(rb, *event_fd);
+		*event_fd = -1;
+	}
+	return rb;
+}
+
+/*
+ * The i-th eventfd the server sent after the memfds (request, event,
+ * response), NULL if it didn't send that many.
+ */
+static int32_t *
+qb_ipcc_shm_eventfd_get(struct qb_ipcc_connection *c, uint32_t i)
+{
+	if (c->setup_fds_count <= QB_IPC_SHM_RB_FDS + i) {
+		return NULL;
+	}
+	return &c->setup_fds[QB_IPC_SHM_RB_FDS + i];
+}
+
+#ifdef QB_IPC_HAVE_SHM_EVENTFD
+/*
+ * qb_ipcc_fd_get() has to show both new events (the event eventfd) and
+ * the server going away (the setup socket), so it hands out an epoll fd
+ * watching the two.
+ */
+static int32_t
+qb_ipcc_shm_poll_fd_create(struct qb_ipcc_connection *c)
+{
+	struct epoll_event ev;
+	int32_t event_fd;
+	int32_t res;
+
+	res = qb_rb_fd_get(c->event.u.shm.rb, &event_fd);
+	if (res != 0) {
+		return res;
+	}
+	c->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (c->poll_fd == -1) {
+		return -errno;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	if (epoll_ctl(c->poll_fd, EPOLL_CTL_ADD, c->setup.u.us.sock,
+		      &ev) == -1 ||
+	    epoll_ctl(c->poll_fd, EPOLL_CTL_ADD, event_fd, &ev) == -1) {
+		res = -errno;
+		close(c->poll_fd);
+		c->poll_fd = -1;
+		return res;
+	}
+	return 0;
+}
+#endif /* QB_IPC_HAVE_SHM_EVENTFD */
+
 int32_t
 qb_ipcc_shm_connect(struct qb_ipcc_connection * c,
 		    struct qb_ipc_connection_response * response)
@@ -165,6 +269,10 @@ qb_ipcc_shm_connect(struct qb_ipcc_connection * c,
 
 	c->funcs.send = qb_ipc_shm_send;
 	c->funcs.sendv = qb_ipc_shm_sendv;
+	c->funcs.alloc = qb_ipc_shm_alloc;
+	c->funcs.commit = qb_ipc_shm_commit;
+	c->funcs.peek = qb_ipc_shm_peek;
+	c->funcs.reclaim = qb_ipc_shm_reclaim;
 	c->funcs.recv = qb_ipc_shm_recv;
 	c->funcs.fc_get = qb_ipc_shm_fc_get;
 	c->funcs.disconnect = qb_ipcc_shm_disconnect;
@@ -175,33 +283,52 @@ qb_ipcc_shm_connect(struct qb_ipcc_connection * c,
 		return -errno;
 	}
 
-	c->request.u.shm.rb = qb_rb_open(response->request,
-					 c->request.max_msg_size,
-					 QB_RB_FLAG_SHARED_PROCESS,
-					 sizeof(int32_t));
+	if (c->setup_fds_count != 0 &&
+	    c->setup_fds_count != QB_IPC_SHM_RB_FDS &&
+	    c->setup_fds_count != QB_IPC_SHM_EVENTFD_FDS &&
+	    c->setup_fds_count != QB_IPC_SHM_FDS_MAX) {
+		qb_util_log(LOG_ERR, "server sent %u fds, expected %d, %d or %d",
+			    c->setup_fds_count, QB_IPC_SHM_RB_FDS,
+			    QB_IPC_SHM_EVENTFD_FDS, QB_IPC_SHM_FDS_MAX);
+		res = -EPROTO;
+		goto return_error;
+	}
+	c->request.u.shm.rb = qb_ipcc_shm_rb_open(c, 0, response->request,
+						  c->request.max_msg_size,
+						  sizeof(int32_t),
+						  qb_ipcc_shm_eventfd_get(c, 0));
 	if (c->request.u.shm.rb == NULL) {
 		res = -errno;
 		qb_util_perror(LOG_ERR, "qb_rb_open:REQUEST");
 		goto return_error;
 	}
-	c->response.u.shm.rb = qb_rb_open(response->response,
-					  c->response.max_msg_size,
-					  QB_RB_FLAG_SHARED_PROCESS, 0);
+	c->response.u.shm.rb = qb_ipcc_shm_rb_open(c, 1, response->response,
+						   c->response.max_msg_size,
+						   0, qb_ipcc_shm_eventfd_get(c, 2));
 
 	if (c->response.u.shm.rb == NULL) {
 		res = -errno;
 		qb_util_perror(LOG_ERR, "qb_rb_open:RESPONSE");
 		goto cleanup_request;
 	}
-	c->event.u.shm.rb = qb_rb_open(response->event,
-				       c->response.max_msg_size,
-				       QB_RB_FLAG_SHARED_PROCESS, 0);
+	c->event.u.shm.rb = qb_ipcc_shm_rb_open(c, 2, response->event,
+						c->response.max_msg_size, 0,
+						qb_ipcc_shm_eventfd_get(c, 1));
 
 	if (c->event.u.shm.rb == NULL) {
 		res = -errno;
 		qb_util_perror(LOG_ERR, "qb_rb_open:EVENT");
 		goto cleanup_request_response;
 	}
+#ifdef QB_IPC_HAVE_SHM_EVENTFD
+	if (c->setup_fds_count >= QB_IPC_SHM_EVENTFD_FDS) {
+		res = qb_ipcc_shm_poll_fd_create(c);
+		if (res != 0) {
+			qb_rb_close(c->event.u.shm.rb);
+			goto cleanup_request_response;
+		}
+	}
+#endif /* QB_IPC_HAVE_SHM_EVENTFD */
 	return 0;
 
 cleanup_request_response:
@@ -222,14 +349,34 @@ return_error:
  * --------------------------------------------------------
  */
 
+/*
+ * With QB_IPC_CONN_FLAG_SHM_EVENTFD the request ringbuffer's eventfd is
+ * polled for requests; the setup socket stays in the loop to notice the
+ * client going away.
+ */
+static void
+qb_ipcs_shm_request_fd_del(struct qb_ipcs_connection *c)
+{
+	int32_t fd;
+
+	if ((c->setup_flags & QB_IPC_CONN_FLAG_SHM_EVENTFD) == 0 ||
+	    c->request.u.shm.rb == NULL) {
+		return;
+	}
+	if (qb_rb_fd_get(c->request.u.shm.rb, &fd) == 0) {
+		(void)qb_ipcs_connection_dispatch_del(c, fd);
+	}
+}
+
 static void
 qb_ipcs_shm_disconnect(struct qb_ipcs_connection *c)
 {
 	if (c->state == QB_IPCS_CONNECTION_ESTABLISHED ||
 	    c->state == QB_IPCS_CONNECTION_ACTIVE) {
+		qb_ipcs_shm_request_fd_del(c);
 		if (c->setup.u.us.sock > 0) {
 			qb_ipcc_us_sock_close(c->setup.u.us.sock);
-			(void)c->service->poll_fns.dispatch_del(c->setup.u.us.sock);
+			(void)qb_ipcs_connection_dispatch_del(c, c->setup.u.us.sock);
 			c->setup.u.us.sock = -1;
 		}
 	}
@@ -253,14 +400,49 @@ qb_ipcs_shm_disconnect(struct qb_ipcs_connection *c)
 static int32_t
 qb_ipcs_shm_rb_open(struct qb_ipcs_connection *c,
 		    struct qb_ipc_one_way *ow,
-		    const char *rb_name)
+		    const char *rb_name, uint32_t notify_flags)
 {
 	int32_t res = 0;
+	uint32_t flags = QB_RB_FLAG_CREATE | QB_RB_FLAG_SHARED_PROCESS;
+
+	/*
+	 * If the client can take fds, hand it memfd ringbuffers: nothing
+	 * to create (or leave behind) in /dev/shm. If memfd isn't
+	 * available fall back to named files for the whole connection.
+	 */
+#ifdef HAVE_MEMFD_CREATE
+	if (c->setup_flags & QB_IPC_CONN_FLAG_SHM_FDS) {
+		if (c->setup_flags & QB_IPC_CONN_FLAG_SHM_EVENTFD) {
+			flags |= notify_flags;
+		}
+		ow->u.shm.rb = qb_rb_open(rb_name, ow->max_msg_size,
+					  flags | QB_RB_FLAG_MEMFD,
+					  sizeof(int32_t));
+		if (ow->u.shm.rb != NULL) {
+			res = qb_rb_memfds_get(ow->u.shm.rb,
+					       &c->setup_fds[c->setup_fds_count],
+					       &c->setup_fds[c->setup_fds_count + 1]);
+			if (res != 0) {
+				qb_rb_close(ow->u.shm.rb);
+				return res;
+			}
+			c->setup_fds_count += 2;
+			return 0;
+		}
+		if (c->setup_fds_count > 0) {
+			res = -errno;
+			qb_util_perror(LOG_ERR, "qb_rb_open:%s", rb_name);
+			return res;
+		}
+		qb_util_perror(LOG_DEBUG, "no memfd for %s", rb_name);
+		c->setup_flags &= ~(QB_IPC_CONN_FLAG_SHM_FDS |
+				    QB_IPC_CONN_FLAG_SHM_EVENTFD |
+				    QB_IPC_CONN_FLAG_SHM_RESPONSE_EVENTFD);
+		flags &= ~notify_flags;
+	}
+#endif /* HAVE_MEMFD_CREATE */
 
-	ow->u.shm.rb = qb_rb_open(rb_name,
-				  ow->max_msg_size,
-				  QB_RB_FLAG_CREATE |
-				  QB_RB_FLAG_SHARED_PROCESS,
+	ow->u.shm.rb = qb_rb_open(rb_name, ow->max_msg_size, flags,
 				  sizeof(int32_t));
 	if (ow->u.shm.rb == NULL) {
 		res = -errno;
@@ -284,6 +466,51 @@ cleanup:
 	return res;
 }
 
+#ifdef QB_IPC_HAVE_SHM_EVENTFD
+/*
+ * Pass the client the eventfds of the request (which it kicks), event
+ * and maybe response (which it polls) ringbuffers after the memfds, and
+ * poll the request one ourselves.
+ */
+static int32_t
+qb_ipcs_shm_eventfds_add(struct qb_ipcs_connection *c)
+{
+	struct qb_ipc_one_way *ows[] = { &c->request, &c->event, &c->response };
+	int32_t n = 2;
+	int32_t fd;
+	int32_t res;
+	int32_t i;
+
+	if (c->setup_flags & QB_IPC_CONN_FLAG_SHM_RESPONSE_EVENTFD) {
+		n = 3;
+	}
+	for (i = 0; i < n; i++) {
+		res = qb_rb_fd_get(ows[i]->u.shm.rb, &fd);
+		if (res != 0) {
+			return res;
+		}
+		c->setup_fds[QB_IPC_SHM_RB_FDS + i] = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if (c->setup_fds[QB_IPC_SHM_RB_FDS + i] == -1) {
+			res = -errno;
+			qb_util_perror(LOG_ERR, "couldn't dup eventfd");
+			return res;
+		}
+		c->setup_fds_count++;
+	}
+
+	(void)qb_rb_fd_get(c->request.u.shm.rb, &fd);
+	res = qb_ipcs_connection_dispatch_add(c, fd,
+					      POLLIN | POLLPRI | POLLNVAL,
+					      qb_ipcs_dispatch_connection_request);
+	if (res != 0) {
+		qb_util_log(LOG_ERR,
+			    "Error adding eventfd to mainloop (%s).",
+			    c->description);
+	}
+	return res;
+}
+#endif /* QB_IPC_HAVE_SHM_EVENTFD */
+
 static int32_t
 qb_ipcs_shm_connect(struct qb_ipcs_service *s,
 		    struct qb_ipcs_connection *c,
@@ -300,43 +527,73 @@ qb_ipcs_shm_connect(struct qb_ipcs_service *s,
 	snprintf(r->event, NAME_MAX, "%s-event-%s",
 		 s->name, c->description);
 
+	/* eventfds need fd passing, and memfds to go with them */
+#ifdef QB_IPC_HAVE_SHM_EVENTFD
+	if ((c->setup_flags & QB_IPC_CONN_FLAG_SHM_FDS) == 0) {
+		c->setup_flags &= ~QB_IPC_CONN_FLAG_SHM_EVENTFD;
+	}
+	if ((c->setup_flags & QB_IPC_CONN_FLAG_SHM_EVENTFD) == 0) {
+		c->setup_flags &= ~QB_IPC_CONN_FLAG_SHM_RESPONSE_EVENTFD;
+	}
+#else
+	c->setup_flags &= ~(QB_IPC_CONN_FLAG_SHM_EVENTFD |
+			    QB_IPC_CONN_FLAG_SHM_RESPONSE_EVENTFD);
+#endif /* QB_IPC_HAVE_SHM_EVENTFD */
+
 	res = qb_ipcs_shm_rb_open(c, &c->request,
-				  r->request);
+				  r->request, QB_RB_FLAG_EVENTFD);
 	if (res != 0) {
 		goto cleanup;
 	}
 
-	res = qb_ipcs_shm_rb_open(c, &c->response,
-				  r->response);
+	res = qb_ipcs_shm_rb_open(c, &c->response, r->response,
+				  (c->setup_flags &
+				   QB_IPC_CONN_FLAG_SHM_RESPONSE_EVENTFD) ?
+				  QB_RB_FLAG_EVENTFD : 0);
 	if (res != 0) {
 		goto cleanup_request;
 	}
 
 	res = qb_ipcs_shm_rb_open(c, &c->event,
-				  r->event);
+				  r->event, QB_RB_FLAG_EVENTFD);
 	if (res != 0) {
 		goto cleanup_request_response;
 	}
 
-	res = s->poll_fns.dispatch_add(s->poll_priority,
-				       c->setup.u.us.sock,
-				       POLLIN | POLLPRI | POLLNVAL,
-				       c, qb_ipcs_dispatch_connection_request);
+#ifdef QB_IPC_HAVE_SHM_EVENTFD
+	if (c->setup_flags & QB_IPC_CONN_FLAG_SHM_EVENTFD) {
+		res = qb_ipcs_shm_eventfds_add(c);
+		if (res != 0) {
+			goto cleanup_all;
+		}
+	}
+#endif /* QB_IPC_HAVE_SHM_EVENTFD */
+
+	res = qb_ipcs_connection_dispatch_add(c, c->setup.u.us.sock,
+					      POLLIN | POLLPRI | POLLNVAL,
+					      qb_ipcs_dispatch_connection_request);
 	if (res != 0) {
 		qb_util_log(LOG_ERR,
 			    "Error adding socket to mainloop (%s).",
 			    c->description);
-		goto cleanup_request_response;
+		qb_ipcs_shm_request_fd_del(c);
+		goto cleanup_all;
 	}
 
 	r->hdr.error = 0;
 	return 0;
 
+cleanup_all:
+	qb_rb_close(c->event.u.shm.rb);
+	c->event.u.shm.rb = NULL;
+
 cleanup_request_response:
-	qb_rb_close(c->request.u.shm.rb);
+	qb_rb_close(c->response.u.shm.rb);
+	c->response.u.shm.rb = NULL;
 
 cleanup_request:
-	qb_rb_close(c->response.u.shm.rb);
+	qb_rb_close(c->request.u.shm.rb);
+	c->request.u.shm.rb = NULL;
 
 cleanup:
 	r->hdr.error = res;
@@ -355,8 +612,12 @@ qb_ipcs_shm_init(struct qb_ipcs_service *s)
 	s->funcs.recv = qb_ipc_shm_recv;
 	s->funcs.peek = qb_ipc_shm_peek;
 	s->funcs.reclaim = qb_ipc_shm_reclaim;
+	s->funcs.peek_batch = qb_ipc_shm_peek_batch;
+	s->funcs.reclaim_batch = qb_ipc_shm_reclaim_batch;
 	s->funcs.send = qb_ipc_shm_send;
 	s->funcs.sendv = qb_ipc_shm_sendv;
+	s->funcs.alloc = qb_ipc_shm_alloc;
+	s->funcs.commit = qb_ipc_shm_commit;
 
 	s->funcs.fc_set = qb_ipc_shm_fc_set;
 	s->funcs.q_len_get = qb_ipc_shm_q_len_get;
@@ -362,15 +362,19 @@ qb_ipc_socket_sendv(struct qb_ipc_one_way *one_way, const struct iovec *iov,
 
 /*
  * recv a message of unknown size.
+ *
+ * The channels are datagram sockets, so one recvmsg() gets exactly one
+ * message, straight into msg: no need to peek at the header first.
  */
 static ssize_t
 qb_ipc_us_recv_at_most(struct qb_ipc_one_way *one_way,
 		       void *msg, size_t len, int32_t timeout)
 {
-	int32_t result;
-	int32_t final_rc = 0;
-	int32_t to_recv = 0;
-	char *data = msg;
+	ssize_t result;
+	ssize_t final_rc = 0;
+	struct msghdr msg_recv;
+	struct iovec iov_recv;
+	struct qb_ipc_request_header *hdr;
 	struct ipc_us_control *ctl = NULL;
 	int32_t time_waited = 0;
 	int32_t time_to_wait = timeout;
@@ -379,40 +383,34 @@ qb_ipc_us_recv_at_most(struct qb_ipc_one_way *one_way,
 		time_to_wait = 1000;
 	}
 
+	iov_recv.iov_base = msg;
+	iov_recv.iov_len = len;
+	memset(&msg_recv, 0, sizeof(msg_recv));
+	msg_recv.msg_iov = &iov_recv;
+	msg_recv.msg_iovlen = 1;
+
 	qb_sigpipe_ctl(QB_SIGPIPE_IGNORE);
 
-retry_peek:
-	result = recv(one_way->u.us.sock, data,
-		      sizeof(struct qb_ipc_request_header),
-		      MSG_NOSIGNAL | MSG_PEEK);
+retry_recv:
+	result = recvmsg(one_way->u.us.sock, &msg_recv, MSG_NOSIGNAL);
 
 	if (result == -1) {
 		if (errno != EAGAIN) {
-			return -errno;
+			final_rc = -errno;
+			goto cleanup_sigpipe;
 		}
 
 		/* check to see if we have enough time left to try again */
 		if (time_waited < timeout || timeout == -1) {
 			result = qb_ipc_us_ready(one_way, NULL, time_to_wait, POLLIN);
 			if (qb_ipc_us_sock_error_is_disconnected(result)) {
-				return result;
+				final_rc = result;
+				goto cleanup_sigpipe;
 			}
 			time_waited += time_to_wait;
-			goto retry_peek;
-		} else if (time_waited >= timeout) {
-			return -ETIMEDOUT;
+			goto retry_recv;
 		}
-	}
-	if (result >= sizeof(struct qb_ipc_request_header)) {
-		struct qb_ipc_request_header *hdr = NULL;
-		hdr = (struct qb_ipc_request_header *)msg;
-		to_recv = hdr->size;
-	}
-
-	result = recv(one_way->u.us.sock, data, to_recv,
-		      MSG_NOSIGNAL | MSG_WAITALL);
-	if (result == -1) {
-		final_rc = -errno;
+		final_rc = -ETIMEDOUT;
 		goto cleanup_sigpipe;
 	} else if (result == 0) {
 		qb_util_log(LOG_DEBUG, "recv == 0 -> ENOTCONN");
@@ -421,13 +419,27 @@ retry_peek:
 		goto cleanup_sigpipe;
 	}
 
-	final_rc = result;
-
 	ctl = (struct ipc_us_control *)one_way->u.us.shared_data;
 	if (ctl) {
 		(void)qb_atomic_int_dec_and_test(&ctl->sent);
 	}
 
+	if (msg_recv.msg_flags & MSG_TRUNC) {
+		qb_util_log(LOG_ERR, "message bigger than the %zu byte buffer",
+			    len);
+		final_rc = -EMSGSIZE;
+		goto cleanup_sigpipe;
+	}
+
+	final_rc = result;
+	if (result >= sizeof(struct qb_ipc_request_header)) {
+		/* the header has the final say on the message size */
+		hdr = (struct qb_ipc_request_header *)msg;
+		if (hdr->size > 0 && hdr->size < result) {
+			final_rc = hdr->size;
+		}
+	}
+
 cleanup_sigpipe:
 	qb_sigpipe_ctl(QB_SIGPIPE_DEFAULT);
 	return final_rc;
@@ -579,11 +591,9 @@ _sock_add_to_mainloop(struct qb_ipcs_connection *c)
 {
 	int res;
 
-	res = c->service->poll_fns.dispatch_add(c->service->poll_priority,
-						c->request.u.us.sock,
-						POLLIN | POLLPRI | POLLNVAL,
-						c,
-						qb_ipcs_dispatch_connection_request);
+	res = qb_ipcs_connection_dispatch_add(c, c->request.u.us.sock,
+					      POLLIN | POLLPRI | POLLNVAL,
+					      qb_ipcs_dispatch_connection_request);
 
 	if (res < 0) {
 		qb_util_log(LOG_ERR,
@@ -592,15 +602,14 @@ _sock_add_to_mainloop(struct qb_ipcs_connection *c)
 		return res;
 	}
 
-	res = c->service->poll_fns.dispatch_add(c->service->poll_priority,
-						c->setup.u.us.sock,
-						POLLIN | POLLPRI | POLLNVAL,
-						c, _sock_connection_liveliness);
+	res = qb_ipcs_connection_dispatch_add(c, c->setup.u.us.sock,
+					      POLLIN | POLLPRI | POLLNVAL,
+					      _sock_connection_liveliness);
 	qb_util_log(LOG_DEBUG, "added %d to poll loop (liveness)",
 		    c->setup.u.us.sock);
 	if (res < 0) {
 		qb_util_perror(LOG_ERR, "Error adding setupfd to mainloop");
-		(void)c->service->poll_fns.dispatch_del(c->request.u.us.sock);
+		(void)qb_ipcs_connection_dispatch_del(c, c->request.u.us.sock);
 		return res;
 	}
 	return res;
@@ -609,8 +618,8 @@ _sock_add_to_mainloop(struct qb_ipcs_connection *c)
 static void
 _sock_rm_from_mainloop(struct qb_ipcs_connection *c)
 {
-	(void)c->service->poll_fns.dispatch_del(c->request.u.us.sock);
-	(void)c->service->poll_fns.dispatch_del(c->setup.u.us.sock);
+	(void)qb_ipcs_connection_dispatch_del(c, c->request.u.us.sock);
+	(void)qb_ipcs_connection_dispatch_del(c, c->setup.u.us.sock);
 }
 
 static void
@@ -757,6 +766,8 @@ qb_ipcs_us_init(struct qb_ipcs_service *s)
 	s->funcs.reclaim = NULL;
 	s->funcs.send = qb_ipc_socket_send;
 	s->funcs.sendv = qb_ipc_socket_sendv;
+	s->funcs.alloc = NULL;
+	s->funcs.commit = NULL;
 
 	s->funcs.fc_set = qb_ipc_us_fc_set;
 	s->funcs.q_len_get = qb_ipc_us_q_len_get;
@@ -27,6 +27,12 @@
 
 qb_ipcc_connection_t *
 qb_ipcc_connect(const char *name, size_t max_msg_size)
+{
+	return qb_ipcc_connect_2(name, max_msg_size, 0);
+}
+
+qb_ipcc_connection_t *
+qb_ipcc_connect_2(const char *name, size_t max_msg_size, uint32_t flags)
 {
 	int32_t res;
 	qb_ipcc_connection_t *c = NULL;
@@ -36,6 +42,8 @@ qb_ipcc_connect(const char *name, size_t max_msg_size)
 	if (c == NULL) {
 		return NULL;
 	}
+	c->poll_fd = -1;
+	c->flags = flags;
 
 	c->setup.max_msg_size = QB_MAX(max_msg_size,
 				       sizeof(struct qb_ipc_connection_response));
@@ -74,6 +82,8 @@ qb_ipcc_connect(const char *name, size_t max_msg_size)
 		res = -EINVAL;
 		break;
 	}
+	/* anything that wasn't used by the connect functions */
+	qb_ipc_fds_close(c->setup_fds, &c->setup_fds_count);
 	if (res != 0) {
 		goto disconnect_and_cleanup;
 	}
@@ -81,6 +91,7 @@ qb_ipcc_connect(const char *name, size_t max_msg_size)
 	return c;
 
 disconnect_and_cleanup:
+	qb_ipc_fds_close(c->setup_fds, &c->setup_fds_count);
 	qb_ipcc_us_sock_close(c->setup.u.us.sock);
 	free(c->receive_buf);
 	free(c);
@@ -163,11 +174,57 @@ _response_sock_one_way_get(struct qb_ipcc_connection * c)
 	return &c->response;
 }
 
+/*
+ * With shared memory the server polls the setup socket for requests,
+ * so every request is followed by a byte there (unless the request
+ * ringbuffer has already kicked the server's eventfd).
+ */
+static ssize_t
+_request_notify(struct qb_ipcc_connection * c, ssize_t res)
+{
+	char one_byte = 1;
+	ssize_t res2;
+
+	if (c->poll_fd >= 0) {
+		return res;
+	}
+
+	do {
+		res2 = qb_ipc_us_send(&c->setup, &one_byte, 1);
+	} while (res2 == -EAGAIN);
+	if (res2 == -EPIPE) {
+		res2 = -ENOTCONN;
+	}
+	if (res2 != 1) {
+		return res2;
+	}
+	return res;
+}
+
+/*
+ * Can a request go out now, as far as flow control goes?
+ */
+static int32_t
+_request_fc_check(struct qb_ipcc_connection * c)
+{
+	int32_t res;
+
+	if (c->funcs.fc_get == NULL) {
+		return 0;
+	}
+	res = c->funcs.fc_get(&c->request);
+	if (res < 0) {
+		return res;
+	} else if (res > 0 && res <= c->fc_enable_max) {
+		return -EAGAIN;
+	}
+	return 0;
+}
+
 ssize_t
 qb_ipcc_send(struct qb_ipcc_connection * c, const void *msg_ptr, size_t msg_len)
 {
 	ssize_t res;
-	ssize_t res2;
 
 	if (c == NULL) {
 		return -EINVAL;
@@ -175,30 +232,14 @@ qb_ipcc_send(struct qb_ipcc_connection * c, const void *msg_ptr, size_t msg_len)
 	if (msg_len > c->request.max_msg_size) {
 		return -EMSGSIZE;
 	}
-	if (c->funcs.fc_get) {
-		res = c->funcs.fc_get(&c->request);
-		if (res < 0) {
-			return res;
-		} else if (res > 0 && res <= c->fc_enable_max) {
-			return -EAGAIN;
-		} else {
-			/*
-			 * we can transmit
-			 */
-		}
+	res = _request_fc_check(c);
+	if (res < 0) {
+		return res;
 	}
 
 	res = c->funcs.send(&c->request, msg_ptr, msg_len);
 	if (res == msg_len && c->needs_sock_for_poll) {
-		do {
-			res2 = qb_ipc_us_send(&c->setup, msg_ptr, 1);
-		} while (res2 == -EAGAIN);
-		if (res2 == -EPIPE) {
-			res2 = -ENOTCONN;
-		}
-		if (res2 != 1) {
-			res = res2;
-		}
+		res = _request_notify(c, res);
 	}
 	return _check_connection_state(c, res);
 }
@@ -220,7 +261,6 @@ qb_ipcc_sendv(struct qb_ipcc_connection * c, const struct iovec * iov,
 	int32_t total_size = 0;
 	int32_t i;
 	int32_t res;
-	int32_t res2;
 
 	for (i = 0; i < iov_len; i++) {
 		total_size += iov[i].iov_len;
@@ -232,29 +272,71 @@ qb_ipcc_sendv(struct qb_ipcc_connection * c, const struct iovec * iov,
 		return -EMSGSIZE;
 	}
 
-	if (c->funcs.fc_get) {
-		res = c->funcs.fc_get(&c->request);
-		if (res < 0) {
-			return res;
-		} else if (res > 0 && res <= c->fc_enable_max) {
-			return -EAGAIN;
-		} else {
-			/*
-			 * we can transmit
-			 */
-		}
+	res = _request_fc_check(c);
+	if (res < 0) {
+		return res;
 	}
 
 	res = c->funcs.sendv(&c->request, iov, iov_len);
 	if (res > 0 && c->needs_sock_for_poll) {
-		do {
-			res2 = qb_ipc_us_send(&c->setup, &res, 1);
-		} while (res2 == -EAGAIN);
-		if (res2 == -EPIPE) {
-			res2 = -ENOTCONN;
+		res = _request_notify(c, res);
+	}
+	return _check_connection_state(c, res);
+}
+
+void *
+qb_ipcc_send_alloc(struct qb_ipcc_connection * c, size_t size)
+{
+	int32_t res;
+	void *msg;
+
+	if (c == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (size > c->request.max_msg_size) {
+		errno = EMSGSIZE;
+		return NULL;
+	}
+	res = _request_fc_check(c);
+	if (res < 0) {
+		errno = -res;
+		return NULL;
+	}
+
+	if (c->funcs.alloc == NULL) {
+		if (c->send_buf == NULL) {
+			c->send_buf = malloc(c->request.max_msg_size);
 		}
-		if (res2 != 1) {
-			res = res2;
+		return c->send_buf;
+	}
+	msg = c->funcs.alloc(&c->request, size);
+	if (msg == NULL) {
+		errno = -_check_connection_state(c, -errno);
+	}
+	return msg;
+}
+
+ssize_t
+qb_ipcc_send_commit(struct qb_ipcc_connection * c, size_t size)
+{
+	ssize_t res;
+
+	if (c == NULL) {
+		return -EINVAL;
+	}
+	if (c->funcs.commit == NULL) {
+		if (c->send_buf == NULL) {
+			return -EINVAL;
+		}
+		return qb_ipcc_send(c, c->send_buf, size);
+	}
+
+	res = c->funcs.commit(&c->request, size);
+	if (res == 0) {
+		res = size;
+		if (c->needs_sock_for_poll) {
+			res = _request_notify(c, res);
 		}
 	}
 	return _check_connection_state(c, res);
@@ -288,6 +370,48 @@ qb_ipcc_recv(struct qb_ipcc_connection * c, void *msg_ptr,
 	return res;
 }
 
+ssize_t
+qb_ipcc_recv_peek(struct qb_ipcc_connection * c, void **msg_out,
+		  int32_t ms_timeout)
+{
+	ssize_t res;
+	int32_t connect_res;
+
+	if (c == NULL || msg_out == NULL) {
+		return -EINVAL;
+	}
+
+	if (c->funcs.peek) {
+		res = c->funcs.peek(&c->response, msg_out, ms_timeout);
+	} else {
+		res = c->funcs.recv(&c->response, c->receive_buf,
+				    c->response.max_msg_size, ms_timeout);
+		*msg_out = c->receive_buf;
+	}
+	if (res >= 0) {
+		return res;
+	}
+
+	connect_res = _check_connection_state_with(c, res,
+						   _response_sock_one_way_get(c),
+						   ms_timeout, POLLIN);
+	if (connect_res < 0) {
+		return connect_res;
+	}
+	return res;
+}
+
+void
+qb_ipcc_recv_release(struct qb_ipcc_connection * c)
+{
+	if (c == NULL) {
+		return;
+	}
+	if (c->funcs.reclaim) {
+		c->funcs.reclaim(&c->response);
+	}
+}
+
 ssize_t
 qb_ipcc_sendv_recv(qb_ipcc_connection_t * c,
 		   const struct iovec * iov, uint32_t iov_len,
@@ -301,17 +425,9 @@ qb_ipcc_sendv_recv(qb_ipcc_connection_t * c,
 		return -EINVAL;
 	}
 
-	if (c->funcs.fc_get) {
-		res = c->funcs.fc_get(&c->request);
-		if (res < 0) {
-			return res;
-		} else if (res > 0 && res <= c->fc_enable_max) {
-			return -EAGAIN;
-		} else {
-			/*
-			 * we can transmit
-			 */
-		}
+	res = _request_fc_check(c);
+	if (res < 0) {
+		return res;
 	}
 
 	res = qb_ipcc_sendv(c, iov, iov_len);
@@ -355,12 +471,72 @@ qb_ipcc_fd_get(struct qb_ipcc_connection * c, int32_t * fd)
 	}
 	if (c->event.type == QB_IPC_SOCKET) {
 		*fd = c->event.u.us.sock;
+	} else if (c->poll_fd >= 0) {
+		*fd = c->poll_fd;
 	} else {
 		*fd = c->setup.u.us.sock;
 	}
 	return 0;
 }
 
+int32_t
+qb_ipcc_busy_poll_set(struct qb_ipcc_connection * c, uint32_t usecs)
+{
+	if (c == NULL) {
+		return -EINVAL;
+	}
+	if (c->response.type != QB_IPC_SHM) {
+		return -ENOTSUP;
+	}
+	return qb_rb_busy_poll_set(c->response.u.shm.rb, usecs);
+}
+
+int32_t
+qb_ipcc_busy_poll_stats_get(struct qb_ipcc_connection * c,
+			    struct qb_rb_busy_poll_stats *stats)
+{
+	if (c == NULL || stats == NULL) {
+		return -EINVAL;
+	}
+	if (c->response.type != QB_IPC_SHM) {
+		return -ENOTSUP;
+	}
+	return qb_rb_busy_poll_stats_get(c->response.u.shm.rb, stats);
+}
+
+/*
+ * Events without a byte per event on the setup socket: wait on poll_fd
+ * for the event eventfd or the server going away.
+ */
+static ssize_t
+_event_recv_from_poll_fd(struct qb_ipcc_connection * c, void *msg_pt,
+			 size_t msg_len, int32_t ms_timeout)
+{
+	struct pollfd pfd;
+	int32_t res;
+	ssize_t size;
+
+	size = c->funcs.recv(&c->event, msg_pt, msg_len, 0);
+	if (size == -ETIMEDOUT && ms_timeout != 0) {
+		pfd.fd = c->poll_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, ms_timeout) > 0) {
+			size = c->funcs.recv(&c->event, msg_pt, msg_len, 0);
+		}
+	}
+	if (size == -ETIMEDOUT) {
+		size = -EAGAIN;
+	}
+	if (size == -EAGAIN) {
+		res = qb_ipc_us_ready(&c->setup, NULL, 0, POLLIN);
+		if (qb_ipc_us_sock_error_is_disconnected(res)) {
+			size = res;
+		}
+	}
+	return _check_connection_state(c, size);
+}
+
 ssize_t
 qb_ipcc_event_recv(struct qb_ipcc_connection * c, void *msg_pt,
 		   size_t msg_len, int32_t ms_timeout)
@@ -372,6 +548,10 @@ qb_ipcc_event_recv(struct qb_ipcc_connection * c, void *msg_pt,
 	if (c == NULL) {
 		return -EINVAL;
 	}
+	if (c->poll_fd >= 0) {
+		return _event_recv_from_poll_fd(c, msg_pt, msg_len,
+						ms_timeout);
+	}
 	res = _check_connection_state_with(c, -EAGAIN, _event_sock_one_way_get(c),
 					   ms_timeout, POLLIN);
 	if (res < 0) {
@@ -387,6 +567,282 @@ qb_ipcc_event_recv(struct qb_ipcc_connection * c, void *msg_pt,
 	return _check_connection_state(c, size);
 }
 
+/*
+ * Responses of requests sent with qb_ipcc_send_async()
+ * --------------------------------------------------------
+ */
+static int32_t
+_async_response_fd_get(struct qb_ipcc_connection *c, int32_t *fd)
+{
+	if (c->response.type == QB_IPC_SOCKET) {
+		*fd = c->response.u.us.sock;
+		return 0;
+	}
+	if (c->response.type == QB_IPC_SHM) {
+		/*
+		 * only with QB_IPCC_FLAG_ASYNC (that is,
+		 * QB_IPC_CONN_FLAG_SHM_RESPONSE_EVENTFD)
+		 */
+		return qb_rb_fd_get(c->response.u.shm.rb, fd);
+	}
+	return -ENOTSUP;
+}
+
+static void
+_async_hold(struct qb_ipcc_async *a)
+{
+	a->holds++;
+}
+
+/*
+ * Returns whether the async state was stopped meanwhile, in which case
+ * it (and, if a->disconnected was set, the connection) may be gone.
+ */
+static int32_t
+_async_release(struct qb_ipcc_async *a)
+{
+	int32_t stopped = a->stopped;
+
+	if (--a->holds == 0 && stopped) {
+		free(a);
+	}
+	return stopped;
+}
+
+/*
+ * Fail every request in flight. The callbacks may send new requests,
+ * so only the ones that were there to begin with. The caller holds a.
+ */
+static void
+_async_fail_all(struct qb_ipcc_connection *c, struct qb_ipcc_async *a,
+		int32_t err)
+{
+	struct qb_ipcc_async_req req;
+	uint32_t n = a->count;
+
+	while (n > 0 && a->count > 0 && !a->disconnected) {
+		req = a->reqs[a->head];
+		a->head = (a->head + 1) % a->window;
+		a->count--;
+		n--;
+		req.fn(c, req.id, NULL, err, req.data);
+	}
+}
+
+static void
+_async_poll_del(struct qb_ipcc_async *a)
+{
+	if (a->response_fd >= 0) {
+		(void)qb_loop_poll_del(a->loop, a->response_fd);
+		a->response_fd = -1;
+	}
+	if (a->setup_fd >= 0) {
+		(void)qb_loop_poll_del(a->loop, a->setup_fd);
+		a->setup_fd = -1;
+	}
+}
+
+static int32_t
+_async_response_dispatch(int32_t fd, int32_t revents, void *data)
+{
+	struct qb_ipcc_connection *c = (struct qb_ipcc_connection *)data;
+	struct qb_ipcc_async *a = c->async;
+	struct qb_ipcc_async_req req;
+	uint32_t polls = 0;
+	void *msg;
+	ssize_t res;
+
+	/*
+	 * Read until there is nothing left, even with no request in flight:
+	 * that's what clears a shared memory response eventfd.
+	 */
+	for (;;) {
+		res = qb_ipcc_recv_peek(c, &msg, 0);
+		if (res == -EAGAIN || res == -ETIMEDOUT) {
+			/* qb_ipcc_busy_poll_set(): wait a moment for the rest */
+			if (a->count > 0 && polls++ < a->window &&
+			    c->response.type == QB_IPC_SHM &&
+			    qb_rb_busy_poll(c->response.u.shm.rb) > 0) {
+				continue;
+			}
+			return 0;
+		}
+		if (res < 0) {
+			a->response_fd = -1;
+			_async_poll_del(a);
+			_async_hold(a);
+			_async_fail_all(c, a, -ENOTCONN);
+			(void)_async_release(a);
+			return -1;
+		}
+		if (a->count == 0) {
+			qb_util_log(LOG_WARNING,
+				    "dropping a response nobody waits for");
+			qb_ipcc_recv_release(c);
+			continue;
+		}
+		req = a->reqs[a->head];
+		a->head = (a->head + 1) % a->window;
+		a->count--;
+		_async_hold(a);
+		req.fn(c, req.id, msg, res, req.data);
+		if (a->disconnected) {
+			/* c is gone, and the response with it */
+			(void)_async_release(a);
+			return -1;
+		}
+		qb_ipcc_recv_release(c);
+		if (_async_release(a)) {
+			return -1;
+		}
+	}
+}
+
+static int32_t
+_async_setup_dispatch(int32_t fd, int32_t revents, void *data)
+{
+	struct qb_ipcc_connection *c = (struct qb_ipcc_connection *)data;
+	struct qb_ipcc_async *a = c->async;
+	int32_t res;
+
+	res = qb_ipc_us_ready(&c->setup, NULL, 0, POLLIN);
+	if ((revents & (POLLHUP | POLLERR | POLLNVAL)) == 0 &&
+	    !qb_ipc_us_sock_error_is_disconnected(res)) {
+		return 0;
+	}
+	c->is_connected = QB_FALSE;
+	a->setup_fd = -1;
+	_async_poll_del(a);
+	_async_hold(a);
+	_async_fail_all(c, a, -ENOTCONN);
+	(void)_async_release(a);
+	return -1;
+}
+
+/*
+ * Also called from the callbacks, directly or through
+ * qb_ipcc_disconnect(): the requests left are failed before the
+ * connection goes, and whoever still holds a frees it.
+ */
+static void
+_async_stop(struct qb_ipcc_connection *c, int32_t disconnect)
+{
+	struct qb_ipcc_async *a = c->async;
+
+	if (a == NULL) {
+		return;
+	}
+	a->stopped = QB_TRUE;
+	_async_poll_del(a);
+	_async_hold(a);
+	_async_fail_all(c, a, -ECANCELED);
+	if (!a->disconnected) {
+		/* else a callback disconnected, c is gone */
+		c->async = NULL;
+		a->disconnected = disconnect;
+	}
+	(void)_async_release(a);
+}
+
+int32_t
+qb_ipcc_async_start(struct qb_ipcc_connection *c, qb_loop_t *l,
+		    uint32_t window)
+{
+	struct qb_ipcc_async *a;
+	int32_t fd;
+	int32_t res;
+
+	if (c == NULL || window == 0) {
+		return -EINVAL;
+	}
+	if (c->async) {
+		return -EBUSY;
+	}
+	res = _async_response_fd_get(c, &fd);
+	if (res != 0) {
+		return res;
+	}
+
+	a = calloc(1, sizeof(*a) + window * sizeof(a->reqs[0]));
+	if (a == NULL) {
+		return -ENOMEM;
+	}
+	a->loop = l;
+	a->window = window;
+	a->response_fd = -1;
+	a->setup_fd = -1;
+	c->async = a;
+
+	res = qb_loop_poll_add(l, QB_LOOP_MED, fd, POLLIN | POLLPRI, c,
+			       _async_response_dispatch);
+	if (res != 0) {
+		goto cleanup;
+	}
+	a->response_fd = fd;
+	if (c->needs_sock_for_poll) {
+		/* the server going away doesn't show on the eventfd */
+		res = qb_loop_poll_add(l, QB_LOOP_MED, c->setup.u.us.sock,
+				       POLLIN | POLLPRI, c,
+				       _async_setup_dispatch);
+		if (res != 0) {
+			goto cleanup;
+		}
+		a->setup_fd = c->setup.u.us.sock;
+	}
+	return 0;
+
+cleanup:
+	_async_poll_del(a);
+	free(a);
+	c->async = NULL;
+	return res;
+}
+
+ssize_t
+qb_ipcc_send_async(struct qb_ipcc_connection *c,
+		   const struct iovec *iov, size_t iov_len,
+		   uint64_t id, qb_ipcc_async_fn fn, void *data)
+{
+	struct qb_ipcc_async *a;
+	struct qb_ipcc_async_req *req;
+	ssize_t res;
+
+	if (c == NULL || fn == NULL) {
+		return -EINVAL;
+	}
+	a = c->async;
+	if (a == NULL) {
+		return -EINVAL;
+	}
+	if (a->response_fd < 0) {
+		return -ENOTCONN;
+	}
+	if (a->count == a->window) {
+		return -EAGAIN;
+	}
+
+	res = qb_ipcc_sendv(c, iov, iov_len);
+	if (res < 0) {
+		return res;
+	}
+	/* the response can only be dispatched once we're back in the loop */
+	req = &a->reqs[(a->head + a->count) % a->window];
+	req->id = id;
+	req->fn = fn;
+	req->data = data;
+	a->count++;
+	return res;
+}
+
+void
+qb_ipcc_async_stop(struct qb_ipcc_connection *c)
+{
+	if (c == NULL) {
+		return;
+	}
+	_async_stop(c, QB_FALSE);
+}
+
 void
 qb_ipcc_disconnect(struct qb_ipcc_connection *c)
 {
@@ -397,6 +853,7 @@ qb_ipcc_disconnect(struct qb_ipcc_connection *c)
 	if (c == NULL) {
 		return;
 	}
+	_async_stop(c, QB_TRUE);
 
 	ow = _event_sock_one_way_get(c);
 	(void)_check_connection_state_with(c, -EAGAIN, ow, 0, POLLIN);
@@ -405,6 +862,7 @@ qb_ipcc_disconnect(struct qb_ipcc_connection *c)
 		c->funcs.disconnect(c);
 	}
 	free(c->receive_buf);
+	free(c->send_buf);
 	free(c);
 }
 
@@ -22,10 +22,14 @@
 
 #include "util_int.h"
 #include "ipc_int.h"
+#include "atomic_int.h"
 #include <qb/qbdefs.h>
 #include <qb/qbatomic.h>
 #include <qb/qbipcs.h>
 
+/* the most requests handled in one go, whatever the poll priority */
+#define MAX_RECV_MSGS 50
+
 static void qb_ipcs_flowcontrol_set(struct qb_ipcs_connection *c,
 				    int32_t fc_enable);
 static int32_t
@@ -71,6 +75,8 @@ qb_ipcs_create(const char *name,
 	s->serv_fns.connection_destroyed = handlers->connection_destroyed;
 
 	qb_list_init(&s->connections);
+	(void)pthread_mutex_init(&s->connections_lock, NULL);
+	s->rate_limit = QB_IPCS_RATE_NORMAL;
 	qb_list_init(&s->list);
 	qb_list_add(&s->list, &qb_ipc_services);
 
@@ -87,6 +93,42 @@ qb_ipcs_poll_handlers_set(struct qb_ipcs_service *s,
 	s->poll_fns.dispatch_del = handlers->dispatch_del;
 }
 
+int32_t
+qb_ipcs_workers_set(struct qb_ipcs_service *s, uint32_t workers,
+		    enum qb_ipcs_worker_policy policy)
+{
+	if (s == NULL) {
+		return -EINVAL;
+	}
+	if (policy != QB_IPCS_WORKER_ROUND_ROBIN &&
+	    policy != QB_IPCS_WORKER_LEAST_LOADED) {
+		return -EINVAL;
+	}
+	/* the transport is set up by qb_ipcs_run() */
+	if (s->funcs.connect != NULL) {
+		return -EBUSY;
+	}
+	s->n_workers = workers;
+	s->worker_policy = policy;
+	return 0;
+}
+
+int32_t
+qb_ipcs_msg_process_batch_set(struct qb_ipcs_service *s,
+			      qb_ipcs_msg_process_batch_fn fn,
+			      uint32_t max_msgs)
+{
+	if (s == NULL || (fn != NULL && max_msgs == 0)) {
+		return -EINVAL;
+	}
+	if (s->funcs.connect != NULL) {
+		return -EBUSY;
+	}
+	s->msg_process_batch = fn;
+	s->msg_batch_max = QB_MIN(max_msgs, MAX_RECV_MSGS);
+	return 0;
+}
+
 void
 qb_ipcs_service_context_set(qb_ipcs_service_t* s,
 			    void *context)
@@ -133,6 +175,10 @@ qb_ipcs_run(struct qb_ipcs_service *s)
 		break;
 	}
 
+	if (res == 0 && s->n_workers > 0) {
+		res = qb_ipcs_workers_start(s);
+	}
+
 	if (res == 0) {
 		res = qb_ipcs_us_publish(s);
 		if (res < 0) {
@@ -143,6 +189,7 @@ qb_ipcs_run(struct qb_ipcs_service *s)
 
 run_cleanup:
 	if (res < 0) {
+		qb_ipcs_workers_stop(s);
 		/* Failed to run services, removing initial alloc reference. */
 		qb_ipcs_unref(s);
 	}
@@ -150,25 +197,91 @@ run_cleanup:
 	return res;
 }
 
+int32_t
+qb_ipcs_connection_dispatch_add(struct qb_ipcs_connection *c, int32_t fd,
+				int32_t events, qb_ipcs_dispatch_fn_t fn)
+{
+	struct qb_ipcs_service *s = c->service;
+
+	if (c->worker) {
+		return qb_loop_poll_add(c->worker->loop, s->poll_priority,
+					fd, events, c, fn);
+	}
+	return s->poll_fns.dispatch_add(s->poll_priority, fd, events, c, fn);
+}
+
+int32_t
+qb_ipcs_connection_dispatch_mod(struct qb_ipcs_connection *c, int32_t fd,
+				int32_t events, qb_ipcs_dispatch_fn_t fn)
+{
+	struct qb_ipcs_service *s = c->service;
+
+	if (c->worker) {
+		return qb_loop_poll_mod(c->worker->loop, s->poll_priority,
+					fd, events, c, fn);
+	}
+	return s->poll_fns.dispatch_mod(s->poll_priority, fd, events, c, fn);
+}
+
+int32_t
+qb_ipcs_connection_dispatch_del(struct qb_ipcs_connection *c, int32_t fd)
+{
+	if (c->worker) {
+		return qb_loop_poll_del(c->worker->loop, fd);
+	}
+	return c->service->poll_fns.dispatch_del(fd);
+}
+
+int32_t
+qb_ipcs_connection_job_add(struct qb_ipcs_connection *c,
+			   enum qb_loop_priority p, void *data,
+			   qb_loop_job_dispatch_fn fn)
+{
+	if (c->worker) {
+		return qb_loop_job_add(c->worker->loop, p, data, fn);
+	}
+	return c->service->poll_fns.job_add(p, data, fn);
+}
+
 static int32_t
 _modify_dispatch_descriptor_(struct qb_ipcs_connection *c)
 {
-	qb_ipcs_dispatch_mod_fn disp_mod = c->service->poll_fns.dispatch_mod;
-
 	if (c->service->type == QB_IPC_SOCKET) {
-		return disp_mod(c->service->poll_priority,
-				c->event.u.us.sock,
-				c->poll_events, c,
-				qb_ipcs_dispatch_connection_request);
+		return qb_ipcs_connection_dispatch_mod(c, c->event.u.us.sock,
+						       c->poll_events,
+						       qb_ipcs_dispatch_connection_request);
 	} else {
-		return disp_mod(c->service->poll_priority,
-				c->setup.u.us.sock,
-				c->poll_events, c,
-				qb_ipcs_dispatch_connection_request);
+		int32_t fd;
+
+		if ((c->setup_flags & QB_IPC_CONN_FLAG_SHM_EVENTFD) &&
+		    qb_rb_fd_get(c->request.u.shm.rb, &fd) == 0) {
+			(void)qb_ipcs_connection_dispatch_mod(c, fd,
+							      POLLIN | POLLPRI | POLLNVAL,
+							      qb_ipcs_dispatch_connection_request);
+		}
+		return qb_ipcs_connection_dispatch_mod(c, c->setup.u.us.sock,
+						       c->poll_events,
+						       qb_ipcs_dispatch_connection_request);
 	}
 	return -EINVAL;
 }
 
+void
+qb_ipcs_connection_rate_limit(struct qb_ipcs_connection *c,
+			      enum qb_ipcs_rate_limit rl, int32_t requeue)
+{
+	if (rl == QB_IPCS_RATE_OFF) {
+		qb_ipcs_flowcontrol_set(c, 1);
+	} else if (rl == QB_IPCS_RATE_OFF_2) {
+		qb_ipcs_flowcontrol_set(c, 2);
+	} else {
+		qb_ipcs_flowcontrol_set(c, QB_FALSE);
+	}
+	if (requeue) {
+		(void)_modify_dispatch_descriptor_(c);
+	}
+}
+
 void
 qb_ipcs_request_rate_limit(struct qb_ipcs_service *s,
 			   enum qb_ipcs_rate_limit rl)
@@ -193,21 +306,19 @@ qb_ipcs_request_rate_limit(struct qb_ipcs_service *s,
 		break;
 	}
 
+	s->rate_limit = rl;
+	if (s->n_workers > 0) {
+		/* the workers apply it to their own connections */
+		qb_ipcs_workers_post(s, QB_IPCS_WORKER_RATE_LIMIT);
+		return;
+	}
+
 	qb_list_for_each_safe(pos, n, &s->connections) {
 
 		c = qb_list_entry(pos, struct qb_ipcs_connection, list);
 		qb_ipcs_connection_ref(c);
-
-		if (rl == QB_IPCS_RATE_OFF) {
-			qb_ipcs_flowcontrol_set(c, 1);
-		} else if (rl == QB_IPCS_RATE_OFF_2) {
-			qb_ipcs_flowcontrol_set(c, 2);
-		} else {
-			qb_ipcs_flowcontrol_set(c, QB_FALSE);
-		}
-		if (old_p != s->poll_priority) {
-			(void)_modify_dispatch_descriptor_(c);
-		}
+		qb_ipcs_connection_rate_limit(c, rl,
+					      old_p != s->poll_priority);
 		qb_ipcs_connection_unref(c);
 	}
 }
@@ -227,6 +338,8 @@ qb_ipcs_unref(struct qb_ipcs_service *s)
 	free_it = qb_atomic_int_dec_and_test(&s->ref_count);
 	if (free_it) {
 		qb_util_log(LOG_DEBUG, "%s() - destroying", __func__);
+		qb_ipcs_workers_free(s);
+		(void)pthread_mutex_destroy(&s->connections_lock);
 		free(s);
 	}
 }
@@ -241,6 +354,9 @@ qb_ipcs_destroy(struct qb_ipcs_service *s)
 	if (s == NULL) {
 		return;
 	}
+	/* from here on the connections are only touched from this thread */
+	qb_ipcs_workers_stop(s);
+
 	qb_list_for_each_safe(pos, n, &s->connections) {
 		c = qb_list_entry(pos, struct qb_ipcs_connection, list);
 		if (c == NULL) {
@@ -293,7 +409,7 @@ qb_ipcs_response_send(struct qb_ipcs_connection *c, const void *data,
 	qb_ipcs_connection_ref(c);
 	res = c->service->funcs.send(&c->response, data, size);
 	if (res == size) {
-		c->stats.responses++;
+		qb_atomic_uint64_add(&c->stats.responses, 1);
 	} else if (res == -EAGAIN || res == -ETIMEDOUT) {
 		struct qb_ipc_one_way *ow = _response_sock_one_way_get(c);
 		if (ow) {
@@ -302,7 +418,7 @@ qb_ipcs_response_send(struct qb_ipcs_connection *c, const void *data,
 				res = res2;
 			}
 		}
-		c->stats.send_retries++;
+		qb_atomic_uint64_add(&c->stats.send_retries, 1);
 	}
 	qb_ipcs_connection_unref(c);
 
@@ -321,7 +437,7 @@ qb_ipcs_response_sendv(struct qb_ipcs_connection * c, const struct iovec * iov,
 	qb_ipcs_connection_ref(c);
 	res = c->service->funcs.sendv(&c->response, iov, iov_len);
 	if (res > 0) {
-		c->stats.responses++;
+		qb_atomic_uint64_add(&c->stats.responses, 1);
 	} else if (res == -EAGAIN || res == -ETIMEDOUT) {
 		struct qb_ipc_one_way *ow = _response_sock_one_way_get(c);
 		if (ow) {
@@ -330,19 +446,92 @@ qb_ipcs_response_sendv(struct qb_ipcs_connection * c, const struct iovec * iov,
 				res = res2;
 			}
 		}
-		c->stats.send_retries++;
+		qb_atomic_uint64_add(&c->stats.send_retries, 1);
 	}
 	qb_ipcs_connection_unref(c);
 
 	return res;
 }
 
+/*
+ * Where qb_ipcs_response_alloc() and qb_ipcs_event_alloc() build a
+ * message: in place in shared memory if the transport can, in a buffer
+ * of the connection's otherwise, which the commit then sends.
+ */
+static void *
+_ipcs_msg_alloc(struct qb_ipcs_connection *c, struct qb_ipc_one_way *ow,
+		void **buf, size_t size)
+{
+	if (size > ow->max_msg_size) {
+		errno = EMSGSIZE;
+		return NULL;
+	}
+	if (c->service->funcs.alloc) {
+		return c->service->funcs.alloc(ow, size);
+	}
+	if (*buf == NULL) {
+		*buf = malloc(ow->max_msg_size);
+	}
+	return *buf;
+}
+
+void *
+qb_ipcs_response_alloc(struct qb_ipcs_connection *c, size_t size)
+{
+	struct qb_ipc_one_way *ow;
+	ssize_t res;
+	void *msg;
+
+	if (c == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	msg = _ipcs_msg_alloc(c, &c->response, &c->response_buf, size);
+	if (msg == NULL && (errno == EAGAIN || errno == ETIMEDOUT)) {
+		ow = _response_sock_one_way_get(c);
+		if (ow) {
+			res = qb_ipc_us_ready(ow, &c->setup, 0, POLLOUT);
+			if (res < 0) {
+				errno = -res;
+			}
+		}
+		qb_atomic_uint64_add(&c->stats.send_retries, 1);
+	}
+	return msg;
+}
+
+ssize_t
+qb_ipcs_response_commit(struct qb_ipcs_connection *c, size_t size)
+{
+	ssize_t res;
+
+	if (c == NULL) {
+		return -EINVAL;
+	}
+	if (c->service->funcs.commit == NULL) {
+		if (c->response_buf == NULL) {
+			return -EINVAL;
+		}
+		return qb_ipcs_response_send(c, c->response_buf, size);
+	}
+
+	qb_ipcs_connection_ref(c);
+	res = c->service->funcs.commit(&c->response, size);
+	if (res == 0) {
+		qb_atomic_uint64_add(&c->stats.responses, 1);
+		res = size;
+	}
+	qb_ipcs_connection_unref(c);
+	return res;
+}
+
 static int32_t
 resend_event_notifications(struct qb_ipcs_connection *c)
 {
 	ssize_t res = 0;
 
-	if (!c->service->needs_sock_for_poll) {
+	if (!c->service->needs_sock_for_poll ||
+	    (c->setup_flags & QB_IPC_CONN_FLAG_SHM_EVENTFD)) {
 		return res;
 	}
 
@@ -367,7 +556,8 @@ new_event_notification(struct qb_ipcs_connection * c)
 {
 	ssize_t res = 0;
 
-	if (!c->service->needs_sock_for_poll) {
+	if (!c->service->needs_sock_for_poll ||
+	    (c->setup_flags & QB_IPC_CONN_FLAG_SHM_EVENTFD)) {
 		return res;
 	}
 
@@ -404,7 +594,7 @@ qb_ipcs_event_send(struct qb_ipcs_connection * c, const void *data, size_t size)
 	qb_ipcs_connection_ref(c);
 	res = c->service->funcs.send(&c->event, data, size);
 	if (res == size) {
-		c->stats.events++;
+		qb_atomic_uint64_add(&c->stats.events, 1);
 		resn = new_event_notification(c);
 		if (resn < 0 && resn != -EAGAIN && resn != -ENOBUFS) {
 			errno = -resn;
@@ -425,13 +615,145 @@ qb_ipcs_event_send(struct qb_ipcs_connection * c, const void *data, size_t size)
 				res = resn;
 			}
 		}
-		c->stats.send_retries++;
+		qb_atomic_uint64_add(&c->stats.send_retries, 1);
 	}
 
 	qb_ipcs_connection_unref(c);
 	return res;
 }
 
+/*
+ * Put a broadcast event on one connection's event channel. Where the
+ * transport can, it's copied straight into the ringbuffer, so all it
+ * takes is the one copy; the eventfd of a QB_IPC_CONN_FLAG_SHM_EVENTFD
+ * client is kicked by the commit, and only when the client had caught
+ * up. A client notified over the setup socket that is already behind
+ * just gets one more byte added to those waiting for POLLOUT.
+ *
+ * Unlike qb_ipcs_event_send() a full channel isn't waited on here: the
+ * event is dropped for that client and the others go ahead.
+ */
+static ssize_t
+_event_broadcast_one_(struct qb_ipcs_connection *c, const void *msg,
+		      size_t size)
+{
+	void *dst;
+	ssize_t res;
+
+	if (size > c->event.max_msg_size) {
+		return -EMSGSIZE;
+	}
+	if (c->service->funcs.alloc && c->service->funcs.commit) {
+		dst = c->service->funcs.alloc(&c->event, size);
+		if (dst == NULL) {
+			res = -errno;
+		} else {
+			memcpy(dst, msg, size);
+			res = c->service->funcs.commit(&c->event, size);
+		}
+	} else {
+		res = c->service->funcs.send(&c->event, msg, size);
+		if (res == size) {
+			res = 0;
+		} else if (res >= 0) {
+			res = -EIO;
+		}
+	}
+	if (res != 0) {
+		if (res == -EAGAIN || res == -ETIMEDOUT) {
+			qb_atomic_uint64_add(&c->stats.send_retries, 1);
+		}
+		return res;
+	}
+	qb_atomic_uint64_add(&c->stats.events, 1);
+
+	if (c->outstanding_notifiers > 0) {
+		c->outstanding_notifiers++;
+		return size;
+	}
+	res = new_event_notification(c);
+	if (res < 0 && res != -EAGAIN && res != -ENOBUFS) {
+		errno = -res;
+		qb_util_perror(LOG_WARNING, "new_event_notification (%s)",
+			       c->description);
+		return res;
+	}
+	return size;
+}
+
+ssize_t
+qb_ipcs_event_broadcast_run(struct qb_ipcs_service *s,
+			    struct qb_ipcs_worker *w,
+			    const void *msg, size_t size,
+			    qb_ipcs_event_broadcast_fail_fn fail_fn,
+			    void *data)
+{
+	struct qb_ipcs_connection *c;
+	struct qb_ipcs_connection *prev;
+	ssize_t res;
+	ssize_t sent = 0;
+
+	for (c = qb_ipcs_connection_first_get(s); c; ) {
+		if (c->worker == w &&
+		    c->state == QB_IPCS_CONNECTION_ESTABLISHED) {
+			res = _event_broadcast_one_(c, msg, size);
+			if (res == size) {
+				sent++;
+			} else if (fail_fn) {
+				fail_fn(c, res < 0 ? res : -EIO, data);
+			}
+		}
+		prev = c;
+		c = qb_ipcs_connection_next_get(s, prev);
+		qb_ipcs_connection_unref(prev);
+	}
+	return sent;
+}
+
+ssize_t
+qb_ipcs_event_broadcast(struct qb_ipcs_service *s,
+			const struct iovec *iov, size_t iov_len,
+			qb_ipcs_event_broadcast_fail_fn fail_fn, void *data)
+{
+	void *flat = NULL;
+	const void *msg;
+	size_t size = 0;
+	size_t i;
+	ssize_t res;
+
+	if (s == NULL || iov == NULL || iov_len == 0) {
+		return -EINVAL;
+	}
+	for (i = 0; i < iov_len; i++) {
+		size += iov[i].iov_len;
+	}
+	if (s->n_workers > 0) {
+		/* the workers send it to their own connections */
+		return qb_ipcs_workers_broadcast(s, iov, iov_len, size,
+						 fail_fn, data);
+	}
+
+	/* gather the event once rather than once per connection */
+	if (iov_len == 1) {
+		msg = iov[0].iov_base;
+	} else {
+		flat = malloc(size);
+		if (flat == NULL) {
+			return -ENOMEM;
+		}
+		size = 0;
+		for (i = 0; i < iov_len; i++) {
+			memcpy((char *)flat + size, iov[i].iov_base,
+			       iov[i].iov_len);
+			size += iov[i].iov_len;
+		}
+		msg = flat;
+	}
+	res = qb_ipcs_event_broadcast_run(s, NULL, msg, size, fail_fn, data);
+	free(flat);
+	return res;
+}
+
 ssize_t
 qb_ipcs_event_sendv(struct qb_ipcs_connection * c,
 		    const struct iovec * iov, size_t iov_len)
@@ -446,7 +768,7 @@ qb_ipcs_event_sendv(struct qb_ipcs_connection * c,
 
 	res = c->service->funcs.sendv(&c->event, iov, iov_len);
 	if (res > 0) {
-		c->stats.events++;
+		qb_atomic_uint64_add(&c->stats.events, 1);
 		resn = new_event_notification(c);
 		if (resn < 0 && resn != -EAGAIN) {
 			errno = -resn;
@@ -467,25 +789,87 @@ qb_ipcs_event_sendv(struct qb_ipcs_connection * c,
 				res = resn;
 			}
 		}
-		c->stats.send_retries++;
+		qb_atomic_uint64_add(&c->stats.send_retries, 1);
 	}
 
 	qb_ipcs_connection_unref(c);
 	return res;
 }
 
-qb_ipcs_connection_t *
-qb_ipcs_connection_first_get(struct qb_ipcs_service * s)
+void *
+qb_ipcs_event_alloc(struct qb_ipcs_connection *c, size_t size)
 {
-	struct qb_ipcs_connection *c;
+	struct qb_ipc_one_way *ow;
+	ssize_t res;
+	void *msg;
 
-	if (qb_list_empty(&s->connections)) {
+	if (c == NULL) {
+		errno = EINVAL;
 		return NULL;
 	}
+	msg = _ipcs_msg_alloc(c, &c->event, &c->event_buf, size);
+	if (msg == NULL && (errno == EAGAIN || errno == ETIMEDOUT)) {
+		if (c->outstanding_notifiers > 0) {
+			(void)resend_event_notifications(c);
+		}
+		ow = _event_sock_one_way_get(c);
+		if (ow) {
+			res = qb_ipc_us_ready(ow, &c->setup, 0, POLLOUT);
+			if (res < 0) {
+				errno = -res;
+			}
+		}
+		qb_atomic_uint64_add(&c->stats.send_retries, 1);
+	}
+	return msg;
+}
+
+ssize_t
+qb_ipcs_event_commit(struct qb_ipcs_connection *c, size_t size)
+{
+	ssize_t res;
+	ssize_t resn;
+
+	if (c == NULL) {
+		return -EINVAL;
+	}
+	if (c->service->funcs.commit == NULL) {
+		if (c->event_buf == NULL) {
+			return -EINVAL;
+		}
+		return qb_ipcs_event_send(c, c->event_buf, size);
+	}
 
-	c = qb_list_first_entry(&s->connections, struct qb_ipcs_connection,
-				list);
 	qb_ipcs_connection_ref(c);
+	res = c->service->funcs.commit(&c->event, size);
+	if (res == 0) {
+		qb_atomic_uint64_add(&c->stats.events, 1);
+		res = size;
+		resn = new_event_notification(c);
+		if (resn < 0 && resn != -EAGAIN && resn != -ENOBUFS) {
+			errno = -resn;
+			qb_util_perror(LOG_WARNING,
+				       "new_event_notification (%s)",
+				       c->description);
+			res = resn;
+		}
+	}
+	qb_ipcs_connection_unref(c);
+	return res;
+}
+
+qb_ipcs_connection_t *
+qb_ipcs_connection_first_get(struct qb_ipcs_service * s)
+{
+	struct qb_ipcs_connection *c = NULL;
+
+	(void)pthread_mutex_lock(&s->connections_lock);
+	if (!qb_list_empty(&s->connections)) {
+		c = qb_list_first_entry(&s->connections,
+					struct qb_ipcs_connection, list);
+		qb_ipcs_connection_ref(c);
+	}
+	(void)pthread_mutex_unlock(&s->connections_lock);
 
 	return c;
 }
@@ -494,16 +878,18 @@ qb_ipcs_connection_t *
 qb_ipcs_connection_next_get(struct qb_ipcs_service * s,
 			    struct qb_ipcs_connection * current)
 {
-	struct qb_ipcs_connection *c;
+	struct qb_ipcs_connection *c = NULL;
 
-	if (current == NULL ||
-	    qb_list_is_last(&current->list, &s->connections)) {
+	if (current == NULL) {
 		return NULL;
 	}
-
-	c = qb_list_first_entry(&current->list, struct qb_ipcs_connection,
-				list);
-	qb_ipcs_connection_ref(c);
+	(void)pthread_mutex_lock(&s->connections_lock);
+	if (!qb_list_is_last(&current->list, &s->connections)) {
+		c = qb_list_first_entry(&current->list,
+					struct qb_ipcs_connection, list);
+		qb_ipcs_connection_ref(c);
+	}
+	(void)pthread_mutex_unlock(&s->connections_lock);
 
 	return c;
 }
@@ -580,7 +966,12 @@ qb_ipcs_connection_unref(struct qb_ipcs_connection *c)
 	}
 	free_it = qb_atomic_int_dec_and_test(&c->refcount);
 	if (free_it) {
+		(void)pthread_mutex_lock(&c->service->connections_lock);
 		qb_list_del(&c->list);
+		(void)pthread_mutex_unlock(&c->service->connections_lock);
+		if (c->worker) {
+			qb_atomic_int_add(&c->worker->connections, -1);
+		}
 		if (c->service->serv_fns.connection_destroyed) {
 			c->service->serv_fns.connection_destroyed(c);
 		}
@@ -588,6 +979,8 @@ qb_ipcs_connection_unref(struct qb_ipcs_connection *c)
 		/* Let go of the connection's reference to the service */
 		qb_ipcs_unref(c->service);
 		free(c->receive_buf);
+		free(c->response_buf);
+		free(c->event_buf);
 		free(c);
 	}
 }
@@ -607,7 +1000,7 @@ qb_ipcs_disconnect(struct qb_ipcs_connection *c)
 	if (c->state == QB_IPCS_CONNECTION_ACTIVE) {
 		c->service->funcs.disconnect(c);
 		c->state = QB_IPCS_CONNECTION_INACTIVE;
-		c->service->stats.closed_connections++;
+		qb_atomic_int_inc((int32_t *)&c->service->stats.closed_connections);
 
 		/* This removes the initial alloc ref */
 		qb_ipcs_connection_unref(c);
@@ -619,8 +1012,8 @@ qb_ipcs_disconnect(struct qb_ipcs_connection *c)
 	if (c->state == QB_IPCS_CONNECTION_ESTABLISHED) {
 		c->service->funcs.disconnect(c);
 		c->state = QB_IPCS_CONNECTION_SHUTTING_DOWN;
-		c->service->stats.active_connections--;
-		c->service->stats.closed_connections++;
+		qb_atomic_int_add((int32_t *)&c->service->stats.active_connections, -1);
+		qb_atomic_int_inc((int32_t *)&c->service->stats.closed_connections);
 	}
 	if (c->state == QB_IPCS_CONNECTION_SHUTTING_DOWN) {
 		int scheduled_retry = 0;
@@ -633,8 +1026,8 @@ qb_ipcs_disconnect(struct qb_ipcs_connection *c)
 			 * function re-run */
 			rerun_job =
 			    (qb_loop_job_dispatch_fn) qb_ipcs_disconnect;
-			res = c->service->poll_fns.job_add(QB_LOOP_LOW,
-							   c, rerun_job);
+			res = qb_ipcs_connection_job_add(c, QB_LOOP_LOW,
+							 c, rerun_job);
 			if (res == 0) {
 				/* this function is going to be called again.
 				 * so hold off on the unref */
@@ -659,7 +1052,7 @@ qb_ipcs_flowcontrol_set(struct qb_ipcs_connection *c, int32_t fc_enable)
 		c->service->funcs.fc_set(&c->request, fc_enable);
 		c->fc_enabled = fc_enable;
 		c->stats.flow_control_state = fc_enable;
-		c->stats.flow_control_count++;
+		qb_atomic_uint64_add(&c->stats.flow_control_count, 1);
 	}
 }
 
@@ -685,8 +1078,9 @@ _process_request_(struct qb_ipcs_connection *c, int32_t ms_timeout)
 			qb_util_perror(LOG_DEBUG,
 				       "recv from client connection failed (%s)",
 				       c->description);
-		} else {
-			c->stats.recv_retries++;
+		} else if (ms_timeout != 0) {
+			/* without a timeout it was only clearing the eventfd */
+			qb_atomic_uint64_add(&c->stats.recv_retries, 1);
 		}
 		res = size;
 		goto cleanup;
@@ -696,7 +1090,7 @@ _process_request_(struct qb_ipcs_connection *c, int32_t ms_timeout)
 		res = -ESHUTDOWN;
 		goto cleanup;
 	} else {
-		c->stats.requests++;
+		qb_atomic_uint64_add(&c->stats.requests, 1);
 		res = c->service->serv_fns.msg_process(c, hdr, hdr->size);
 		/* 0 == good, negative == backoff */
 		if (res < 0) {
@@ -714,8 +1108,86 @@ cleanup:
 	return res;
 }
 
+/*
+ * Hand up to max_msgs queued requests to msg_process_batch in one call.
+ * Returns the number handled (or -errno) and sets *consumed to the number
+ * of requests taken off the queue, as _process_request_() takes one.
+ */
+static int32_t
+_process_request_batch_(struct qb_ipcs_connection *c, ssize_t max_msgs,
+			int32_t ms_timeout, int32_t *consumed)
+{
+	struct iovec msgs[MAX_RECV_MSGS];
+	struct qb_ipc_request_header *hdr;
+	int32_t batched = (c->service->funcs.peek_batch &&
+			   c->service->funcs.reclaim_batch);
+	ssize_t n;
+	ssize_t i;
+	int32_t res;
+
+	*consumed = 1;
+	max_msgs = QB_MIN(max_msgs, (ssize_t)c->service->msg_batch_max);
+	if (batched) {
+		n = c->service->funcs.peek_batch(&c->request, msgs,
+						 QB_MAX(max_msgs, 1),
+						 ms_timeout);
+	} else {
+		/* no looking ahead, so one request at a time */
+		hdr = c->receive_buf;
+		n = c->service->funcs.recv(&c->request,
+					   hdr,
+					   c->request.max_msg_size,
+					   ms_timeout);
+		if (n > 0) {
+			msgs[0].iov_base = hdr;
+			msgs[0].iov_len = n;
+			n = 1;
+		}
+	}
+	if (n < 0) {
+		if (n != -EAGAIN && n != -ETIMEDOUT) {
+			qb_util_perror(LOG_DEBUG,
+				       "recv from client connection failed (%s)",
+				       c->description);
+		} else if (ms_timeout != 0) {
+			qb_atomic_uint64_add(&c->stats.recv_retries, 1);
+		}
+		return n;
+	}
+
+	/* whatever comes after a disconnect request doesn't matter */
+	for (i = 0; i < n; i++) {
+		hdr = (struct qb_ipc_request_header *)msgs[i].iov_base;
+		if (msgs[i].iov_len == 0 || hdr->id == QB_IPC_MSG_DISCONNECT) {
+			break;
+		}
+	}
+	if (i == 0) {
+		qb_util_log(LOG_DEBUG, "client requesting a disconnect (%s)",
+			    c->description);
+		return -ESHUTDOWN;
+	}
+
+	qb_atomic_uint64_add(&c->stats.requests, i);
+	res = c->service->msg_process_batch(c, msgs, i);
+	if (batched) {
+		c->service->funcs.reclaim_batch(&c->request, i);
+	}
+	*consumed = i;
+
+	if (i < n) {
+		qb_util_log(LOG_DEBUG, "client requesting a disconnect (%s)",
+			    c->description);
+		return -ESHUTDOWN;
+	}
+	/* 0 == good, negative == backoff */
+	if (res < 0) {
+		return -ENOBUFS;
+	}
+	return i;
+}
+
 #define IPC_REQUEST_TIMEOUT 10
-#define MAX_RECV_MSGS 50
 
 static ssize_t
 _request_q_len_get(struct qb_ipcs_connection *c)
@@ -747,6 +1219,10 @@ qb_ipcs_dispatch_connection_request(int32_t fd, int32_t revents, void *data)
 	int32_t res = 0;
 	int32_t res2;
 	int32_t recvd = 0;
+	int32_t consumed;
+	int32_t ms_timeout = IPC_REQUEST_TIMEOUT;
+	int32_t use_sock = c->service->needs_sock_for_poll;
+	int32_t drain_eventfd = QB_FALSE;
 	ssize_t avail;
 
 	if (revents & POLLNVAL) {
@@ -781,7 +1257,35 @@ qb_ipcs_dispatch_connection_request(int32_t fd, int32_t revents, void *data)
 	}
 	avail = _request_q_len_get(c);
 
-	if (c->service->needs_sock_for_poll && avail == 0) {
+	/*
+	 * QB_IPC_CONN_FLAG_SHM_EVENTFD: requests are signalled on the request
+	 * eventfd and the setup socket only says the client has gone.
+	 *
+	 * The eventfd is an edge per burst that only a read finding the
+	 * ringbuffer empty clears. So once a burst is through we keep reading
+	 * without a timeout until one comes back empty, rather than coming
+	 * back from the loop for it, and that empty read isn't a retry.
+	 */
+	if (c->setup_flags & QB_IPC_CONN_FLAG_SHM_EVENTFD) {
+		use_sock = QB_FALSE;
+		drain_eventfd = QB_TRUE;
+		if (fd == c->setup.u.us.sock) {
+			res2 = qb_ipc_us_recv(&c->setup, bytes, 1, 0);
+			if (qb_ipc_us_sock_error_is_disconnected(res2)) {
+				qb_util_log(LOG_DEBUG, "conn (%s) disconnected",
+					    c->description);
+				res = -ESHUTDOWN;
+			}
+			goto dispatch_cleanup;
+		}
+		if (avail == 0) {
+			/* a stale edge: clear it, unless a request just came in */
+			avail = 1;
+			ms_timeout = 0;
+		}
+	}
+
+	if (use_sock && avail == 0) {
 		res2 = qb_ipc_us_recv(&c->setup, bytes, 1, 0);
 		if (qb_ipc_us_sock_error_is_disconnected(res2)) {
 			errno = -res2;
@@ -799,21 +1303,43 @@ qb_ipcs_dispatch_connection_request(int32_t fd, int32_t revents, void *data)
 	}
 
 	do {
-		res = _process_request_(c, IPC_REQUEST_TIMEOUT);
+		if (c->service->msg_process_batch) {
+			res = _process_request_batch_(c, avail, ms_timeout,
+						      &consumed);
+		} else {
+			res = _process_request_(c, ms_timeout);
+			consumed = 1;
+		}
 
 		if (res == -ESHUTDOWN) {
 			goto dispatch_cleanup;
 		}
 
 		if (res > 0 || res == -ENOBUFS || res == -EINVAL) {
-			recvd++;
+			recvd += consumed;
 		}
 		if (res > 0) {
-			avail--;
+			avail -= consumed;
+		}
+
+		/*
+		 * qb_ipcs_connection_busy_poll_set(): give the client a
+		 * moment to send the next one before going back to the loop.
+		 */
+		if (avail == 0 && res > 0 && !use_sock &&
+		    recvd < MAX_RECV_MSGS && c->request.type == QB_IPC_SHM &&
+		    qb_rb_busy_poll(c->request.u.shm.rb) > 0) {
+			avail = _request_q_len_get(c);
+		}
+		if (avail == 0 && res > 0 && drain_eventfd &&
+		    recvd < MAX_RECV_MSGS && _request_q_len_get(c) == 0) {
+			/* clears the eventfd, unless a request just came in */
+			avail = 1;
+			ms_timeout = 0;
 		}
 	} while (avail > 0 && res > 0 && !c->fc_enabled);
 
-	if (c->service->needs_sock_for_poll && recvd > 0) {
+	if (use_sock && recvd > 0) {
 		res2 = qb_ipc_us_recv(&c->setup, bytes, recvd, -1);
 		if (qb_ipc_us_sock_error_is_disconnected(res2)) {
 			errno = -res2;
@@ -873,19 +1399,43 @@ qb_ipcs_connection_service_context_get(qb_ipcs_connection_t *c)
 	return c->service->context;
 }
 
+/*
+ * The counters are bumped by whichever thread serves the connection,
+ * so read (and clear) them one by one instead of copying them.
+ */
+static void
+_connection_stats_read(struct qb_ipcs_connection *c,
+		       struct qb_ipcs_connection_stats_2 *stats,
+		       int32_t clear)
+{
+	stats->client_pid = c->stats.client_pid;
+	stats->requests = qb_atomic_uint64_get(&c->stats.requests, clear);
+	stats->responses = qb_atomic_uint64_get(&c->stats.responses, clear);
+	stats->events = qb_atomic_uint64_get(&c->stats.events, clear);
+	stats->send_retries = qb_atomic_uint64_get(&c->stats.send_retries,
+						   clear);
+	stats->recv_retries = qb_atomic_uint64_get(&c->stats.recv_retries,
+						   clear);
+	stats->flow_control_state = c->stats.flow_control_state;
+	stats->flow_control_count =
+		qb_atomic_uint64_get(&c->stats.flow_control_count, clear);
+	if (clear) {
+		c->stats.flow_control_state = 0;
+	}
+}
+
 int32_t
 qb_ipcs_connection_stats_get(qb_ipcs_connection_t * c,
 			     struct qb_ipcs_connection_stats * stats,
 			     int32_t clear_after_read)
 {
+	struct qb_ipcs_connection_stats_2 stats_2;
+
 	if (c == NULL) {
 		return -EINVAL;
 	}
-	memcpy(stats, &c->stats, sizeof(struct qb_ipcs_connection_stats));
-	if (clear_after_read) {
-		memset(&c->stats, 0, sizeof(struct qb_ipcs_connection_stats_2));
-		c->stats.client_pid = c->pid;
-	}
+	_connection_stats_read(c, &stats_2, clear_after_read);
+	memcpy(stats, &stats_2, sizeof(struct qb_ipcs_connection_stats));
 	return 0;
 }
 
@@ -904,20 +1454,47 @@ qb_ipcs_connection_stats_get_2(qb_ipcs_connection_t *c,
 		return NULL;
 	}
 
-	memcpy(stats, &c->stats, sizeof(struct qb_ipcs_connection_stats_2));
+	_connection_stats_read(c, stats, clear_after_read);
 
 	if (c->service->funcs.q_len_get) {
 		stats->event_q_length = c->service->funcs.q_len_get(&c->event);
 	} else {
 		stats->event_q_length = 0;
 	}
-	if (clear_after_read) {
-		memset(&c->stats, 0, sizeof(struct qb_ipcs_connection_stats_2));
-		c->stats.client_pid = c->pid;
-	}
 	return stats;
 }
 
+int32_t
+qb_ipcs_connection_busy_poll_set(qb_ipcs_connection_t *c, uint32_t usecs)
+{
+	if (c == NULL) {
+		return -EINVAL;
+	}
+	if (c->request.type != QB_IPC_SHM) {
+		return -ENOTSUP;
+	}
+	if (c->request.u.shm.rb == NULL) {
+		return -ENOTCONN;
+	}
+	return qb_rb_busy_poll_set(c->request.u.shm.rb, usecs);
+}
+
+int32_t
+qb_ipcs_connection_busy_poll_stats_get(qb_ipcs_connection_t *c,
+				       struct qb_rb_busy_poll_stats *stats)
+{
+	if (c == NULL || stats == NULL) {
+		return -EINVAL;
+	}
+	if (c->request.type != QB_IPC_SHM) {
+		return -ENOTSUP;
+	}
+	if (c->request.u.shm.rb == NULL) {
+		return -ENOTCONN;
+	}
+	return qb_rb_busy_poll_stats_get(c->request.u.shm.rb, stats);
+}
+
 int32_t
 qb_ipcs_stats_get(struct qb_ipcs_service * s,
 		  struct qb_ipcs_stats * stats, int32_t clear_after_read)
@@ -925,9 +1502,15 @@ qb_ipcs_stats_get(struct qb_ipcs_service * s,
 	if (s == NULL) {
 		return -EINVAL;
 	}
-	memcpy(stats, &s->stats, sizeof(struct qb_ipcs_stats));
+	stats->active_connections =
+		qb_atomic_int_get((int32_t *)&s->stats.active_connections);
+	stats->closed_connections =
+		qb_atomic_int_get((int32_t *)&s->stats.closed_connections);
 	if (clear_after_read) {
-		memset(&s->stats, 0, sizeof(struct qb_ipcs_stats));
+		qb_atomic_int_add((int32_t *)&s->stats.active_connections,
+				  -(int32_t)stats->active_connections);
+		qb_atomic_int_add((int32_t *)&s->stats.closed_connections,
+				  -(int32_t)stats->closed_connections);
 	}
 	return 0;
 }
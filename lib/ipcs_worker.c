@@ -0,0 +1,452 @@
+/*
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * This file is part of libqb.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "os_base.h"
+#include <pthread.h>
+
+#include "ipc_int.h"
+#include "loop_int.h"
+#include "util_int.h"
+#include <qb/qbdefs.h>
+#include <qb/qbatomic.h>
+#include <qb/qbloop.h>
+
+/*
+ * IPC workers (qb_ipcs_workers_set()) each run a qb_loop_t of their own
+ * in a thread. The loops aren't thread safe, so nothing but the worker
+ * ever touches its loop: the service's loop accepts new clients and
+ * passes the sockets down the worker's pipe, and the worker sets the
+ * connection up (and so adds its fds) itself. The same pipe carries
+ * the QB_IPCS_WORKER_* messages.
+ */
+#define WORKER_PIPE_BATCH 16
+
+/*
+ * A qb_ipcs_event_broadcast() on a service with workers. The event is
+ * gathered once and shared by the workers it's queued on, the last one
+ * done with it frees it.
+ */
+struct qb_ipcs_broadcast {
+	int32_t refcount;
+	qb_ipcs_event_broadcast_fail_fn fail_fn;
+	void *data;
+	size_t size;
+	char msg[];
+};
+
+struct qb_ipcs_broadcast_item {
+	struct qb_list_head list;
+	struct qb_ipcs_broadcast *b;
+};
+
+static int32_t
+_worker_post(struct qb_ipcs_worker *w, int32_t msg)
+{
+	ssize_t res;
+
+	do {
+		res = write(w->pipe_fds[1], &msg, sizeof(msg));
+	} while (res == -1 && errno == EINTR);
+	if (res == -1) {
+		return -errno;
+	}
+	return 0;
+}
+
+static void
+_worker_rate_limit(struct qb_ipcs_worker *w)
+{
+	struct qb_ipcs_service *s = w->service;
+	struct qb_ipcs_connection *c;
+	struct qb_list_head *pos;
+
+	(void)pthread_mutex_lock(&s->connections_lock);
+	qb_list_for_each(pos, &s->connections) {
+		c = qb_list_entry(pos, struct qb_ipcs_connection, list);
+		if (c->worker == w &&
+		    c->state == QB_IPCS_CONNECTION_ESTABLISHED) {
+			qb_ipcs_connection_rate_limit(c, s->rate_limit,
+						      QB_TRUE);
+		}
+	}
+	(void)pthread_mutex_unlock(&s->connections_lock);
+}
+
+static void
+_broadcast_unref(struct qb_ipcs_broadcast *b)
+{
+	if (qb_atomic_int_dec_and_test(&b->refcount)) {
+		free(b);
+	}
+}
+
+static void
+_worker_broadcasts_run(struct qb_ipcs_worker *w)
+{
+	struct qb_ipcs_broadcast_item *item;
+	struct qb_list_head *pos;
+	struct qb_list_head *n;
+	struct qb_list_head todo;
+
+	qb_list_init(&todo);
+	(void)pthread_mutex_lock(&w->broadcasts_lock);
+	qb_list_splice(&w->broadcasts, &todo);
+	qb_list_init(&w->broadcasts);
+	(void)pthread_mutex_unlock(&w->broadcasts_lock);
+
+	qb_list_for_each_safe(pos, n, &todo) {
+		item = qb_list_entry(pos, struct qb_ipcs_broadcast_item, list);
+		qb_list_del(pos);
+		(void)qb_ipcs_event_broadcast_run(w->service, w,
+						  item->b->msg, item->b->size,
+						  item->b->fail_fn,
+						  item->b->data);
+		_broadcast_unref(item->b);
+		free(item);
+	}
+}
+
+static void
+_worker_broadcasts_free(struct qb_ipcs_worker *w)
+{
+	struct qb_ipcs_broadcast_item *item;
+	struct qb_list_head *pos;
+	struct qb_list_head *n;
+
+	qb_list_for_each_safe(pos, n, &w->broadcasts) {
+		item = qb_list_entry(pos, struct qb_ipcs_broadcast_item, list);
+		qb_list_del(pos);
+		_broadcast_unref(item->b);
+		free(item);
+	}
+}
+
+static int32_t
+_worker_pipe_dispatch(int32_t fd, int32_t revents, void *data)
+{
+	struct qb_ipcs_worker *w = (struct qb_ipcs_worker *)data;
+	int32_t msgs[WORKER_PIPE_BATCH];
+	ssize_t res;
+	ssize_t i;
+
+	do {
+		res = read(fd, msgs, sizeof(msgs));
+	} while (res == -1 && errno == EINTR);
+	if (res <= 0) {
+		return 0;
+	}
+
+	/* writes of one int32_t are atomic, so reads come in whole ones */
+	for (i = 0; i < res / (ssize_t)sizeof(int32_t); i++) {
+		if (msgs[i] == QB_IPCS_WORKER_STOP) {
+			qb_loop_stop(w->loop);
+		} else if (msgs[i] == QB_IPCS_WORKER_RATE_LIMIT) {
+			_worker_rate_limit(w);
+		} else if (msgs[i] == QB_IPCS_WORKER_BROADCAST) {
+			_worker_broadcasts_run(w);
+		} else {
+			(void)qb_ipcs_us_connection_setup(w->service, w,
+							  msgs[i]);
+			qb_atomic_int_add(&w->pending, -1);
+		}
+	}
+	return 0;
+}
+
+static void *
+_worker_thread(void *arg)
+{
+	struct qb_ipcs_worker *w = (struct qb_ipcs_worker *)arg;
+
+	qb_loop_run(w->loop);
+	return NULL;
+}
+
+static int32_t
+_worker_init(struct qb_ipcs_service *s, struct qb_ipcs_worker *w)
+{
+	int32_t res;
+
+	w->service = s;
+	w->pipe_fds[0] = -1;
+	w->pipe_fds[1] = -1;
+	(void)pthread_mutex_init(&w->broadcasts_lock, NULL);
+	qb_list_init(&w->broadcasts);
+	w->loop = qb_loop_thread_create();
+	if (w->loop == NULL) {
+		return -ENOMEM;
+	}
+	if (pipe(w->pipe_fds) == -1) {
+		res = -errno;
+		qb_util_perror(LOG_ERR, "couldn't create IPC worker pipe");
+		return res;
+	}
+	(void)qb_sys_fd_nonblock_cloexec_set(w->pipe_fds[0]);
+	/* the writer may block: a full pipe means a swamped worker */
+	(void)fcntl(w->pipe_fds[1], F_SETFD, FD_CLOEXEC);
+
+	res = qb_loop_poll_add(w->loop, QB_LOOP_HIGH, w->pipe_fds[0],
+			       POLLIN | POLLPRI | POLLNVAL, w,
+			       _worker_pipe_dispatch);
+	if (res != 0) {
+		return res;
+	}
+
+	res = -pthread_create(&w->thread, NULL, _worker_thread, w);
+	if (res != 0) {
+		errno = -res;
+		qb_util_perror(LOG_ERR, "couldn't start IPC worker");
+		return res;
+	}
+	w->started = QB_TRUE;
+	return 0;
+}
+
+int32_t
+qb_ipcs_workers_start(struct qb_ipcs_service *s)
+{
+	uint32_t i;
+	int32_t res;
+
+	s->workers = calloc(s->n_workers, sizeof(struct qb_ipcs_worker));
+	if (s->workers == NULL) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < s->n_workers; i++) {
+		res = _worker_init(s, &s->workers[i]);
+		if (res != 0) {
+			return res;
+		}
+	}
+	qb_util_log(LOG_DEBUG, "started %u IPC workers for %s",
+		    s->n_workers, s->name);
+	return 0;
+}
+
+void
+qb_ipcs_workers_stop(struct qb_ipcs_service *s)
+{
+	struct qb_ipcs_worker *w;
+	uint32_t i;
+
+	if (s->workers == NULL) {
+		return;
+	}
+	for (i = 0; i < s->n_workers; i++) {
+		w = &s->workers[i];
+		if (!w->started) {
+			continue;
+		}
+		if (_worker_post(w, QB_IPCS_WORKER_STOP) == 0) {
+			(void)pthread_join(w->thread, NULL);
+		}
+		w->started = QB_FALSE;
+	}
+}
+
+/*
+ * The loops go with the service, not with qb_ipcs_destroy(): connections
+ * still referenced after that take their fds out of them when they go.
+ */
+void
+qb_ipcs_workers_free(struct qb_ipcs_service *s)
+{
+	struct qb_ipcs_worker *w;
+	int32_t msg;
+	uint32_t i;
+
+	if (s->workers == NULL) {
+		return;
+	}
+	qb_ipcs_workers_stop(s);
+	for (i = 0; i < s->n_workers; i++) {
+		w = &s->workers[i];
+		if (w->service == NULL) {
+			/* qb_ipcs_workers_start() failed before this one */
+			break;
+		}
+		if (w->pipe_fds[0] >= 0) {
+			/* sockets handed over too late to be set up */
+			while (read(w->pipe_fds[0], &msg, sizeof(msg)) ==
+			       sizeof(msg)) {
+				if (msg >= 0) {
+					close(msg);
+				}
+			}
+			close(w->pipe_fds[0]);
+			close(w->pipe_fds[1]);
+		}
+		if (w->loop) {
+			qb_loop_destroy(w->loop);
+		}
+		_worker_broadcasts_free(w);
+		(void)pthread_mutex_destroy(&w->broadcasts_lock);
+	}
+	free(s->workers);
+	s->workers = NULL;
+}
+
+static struct qb_ipcs_worker *
+_worker_pick(struct qb_ipcs_service *s)
+{
+	struct qb_ipcs_worker *w;
+	int32_t load;
+	int32_t min_load = -1;
+	uint32_t i;
+
+	if (s->worker_policy == QB_IPCS_WORKER_ROUND_ROBIN) {
+		return &s->workers[s->worker_next++ % s->n_workers];
+	}
+
+	w = &s->workers[0];
+	for (i = 0; i < s->n_workers; i++) {
+		load = qb_atomic_int_get(&s->workers[i].connections) +
+			qb_atomic_int_get(&s->workers[i].pending);
+		if (min_load < 0 || load < min_load) {
+			min_load = load;
+			w = &s->workers[i];
+		}
+	}
+	return w;
+}
+
+int32_t
+qb_ipcs_worker_handoff(struct qb_ipcs_service *s, int32_t sock)
+{
+	struct qb_ipcs_worker *w;
+	int32_t res;
+
+	if (s->workers == NULL) {
+		return -ESRCH;
+	}
+	w = _worker_pick(s);
+	qb_atomic_int_inc(&w->pending);
+	res = _worker_post(w, sock);
+	if (res != 0) {
+		qb_atomic_int_add(&w->pending, -1);
+		errno = -res;
+		qb_util_perror(LOG_ERR, "couldn't hand connection to worker");
+	}
+	return res;
+}
+
+void
+qb_ipcs_workers_post(struct qb_ipcs_service *s, int32_t msg)
+{
+	uint32_t i;
+
+	if (s->workers == NULL) {
+		return;
+	}
+	for (i = 0; i < s->n_workers; i++) {
+		(void)_worker_post(&s->workers[i], msg);
+	}
+}
+
+/*
+ * Each worker sends the event to its own connections from its own
+ * thread. A worker calling this (from a connection's handler, say) does
+ * its share right away rather than writing to its own pipe, which it
+ * might find full. The others' shares are counted as the connections
+ * they have now.
+ */
+ssize_t
+qb_ipcs_workers_broadcast(struct qb_ipcs_service *s,
+			  const struct iovec *iov, size_t iov_len,
+			  size_t size,
+			  qb_ipcs_event_broadcast_fail_fn fail_fn,
+			  void *data)
+{
+	struct qb_ipcs_broadcast *b;
+	struct qb_ipcs_broadcast_item *item;
+	struct qb_ipcs_connection *c;
+	struct qb_ipcs_worker *self = NULL;
+	struct qb_ipcs_worker *w;
+	struct qb_list_head *pos;
+	size_t off = 0;
+	ssize_t sent = 0;
+	ssize_t res;
+	uint32_t i;
+
+	if (s->workers == NULL) {
+		return -ESRCH;
+	}
+	b = malloc(sizeof(*b) + size);
+	if (b == NULL) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < iov_len; i++) {
+		memcpy(b->msg + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+	b->size = size;
+	b->fail_fn = fail_fn;
+	b->data = data;
+	/* held by this function until all the workers have theirs */
+	b->refcount = 1;
+
+	for (i = 0; i < s->n_workers; i++) {
+		w = &s->workers[i];
+		if (!w->started) {
+			continue;
+		}
+		if (pthread_equal(w->thread, pthread_self())) {
+			self = w;
+			continue;
+		}
+		item = malloc(sizeof(*item));
+		if (item == NULL) {
+			qb_util_perror(LOG_WARNING,
+				       "couldn't queue broadcast for worker");
+			continue;
+		}
+		item->b = b;
+		qb_atomic_int_inc(&b->refcount);
+		(void)pthread_mutex_lock(&w->broadcasts_lock);
+		qb_list_add_tail(&item->list, &w->broadcasts);
+		(void)pthread_mutex_unlock(&w->broadcasts_lock);
+		res = _worker_post(w, QB_IPCS_WORKER_BROADCAST);
+		if (res != 0) {
+			/* it goes out with the worker's next broadcast */
+			errno = -res;
+			qb_util_perror(LOG_WARNING,
+				       "couldn't post broadcast to worker");
+		}
+
+		(void)pthread_mutex_lock(&s->connections_lock);
+		qb_list_for_each(pos, &s->connections) {
+			c = qb_list_entry(pos, struct qb_ipcs_connection,
+					  list);
+			if (c->worker == w &&
+			    c->state == QB_IPCS_CONNECTION_ESTABLISHED) {
+				sent++;
+			}
+		}
+		(void)pthread_mutex_unlock(&s->connections_lock);
+	}
+
+	if (self) {
+		res = qb_ipcs_event_broadcast_run(s, self, b->msg, b->size,
+						  fail_fn, data);
+		if (res > 0) {
+			sent += res;
+		}
+	}
+	_broadcast_unref(b);
+	return sent;
+}
@@ -195,7 +195,7 @@ qb_log_blackbox_print_from_file(const char *bb_filename)
 		qb_util_perror(LOG_ERR, "qb_log_blackbox_print_from_file");
 		return;
 	}
-	instance = qb_rb_create_from_file(fd, 0);
+	instance = qb_rb_create_from_file(fd, QB_RB_FLAG_READONLY);
 	close(fd);
 	if (instance == NULL) {
 		return;
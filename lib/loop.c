@@ -80,8 +80,8 @@ qb_loop_default_get(void)
 	return default_intance;
 }
 
-struct qb_loop *
-qb_loop_create(void)
+static struct qb_loop *
+_loop_create(int32_t with_signals)
 {
 	struct qb_loop *l = malloc(sizeof(struct qb_loop));
 	int32_t p;
@@ -103,21 +103,39 @@ qb_loop_create(void)
 	l->timer_source = qb_loop_timer_create(l);
 	l->job_source = qb_loop_jobs_create(l);
 	l->fd_source = qb_loop_poll_create(l);
-	l->signal_source = qb_loop_signals_create(l);
+	l->signal_source = NULL;
+	if (with_signals) {
+		l->signal_source = qb_loop_signals_create(l);
+	}
+	return l;
+}
+
+struct qb_loop *
+qb_loop_create(void)
+{
+	struct qb_loop *l = _loop_create(QB_TRUE);
 
-	if (default_intance == NULL) {
+	if (l && default_intance == NULL) {
 		default_intance = l;
 	}
 	return l;
 }
 
+struct qb_loop *
+qb_loop_thread_create(void)
+{
+	return _loop_create(QB_FALSE);
+}
+
 void
 qb_loop_destroy(struct qb_loop *l)
 {
 	qb_loop_timer_destroy(l);
 	qb_loop_jobs_destroy(l);
 	qb_loop_poll_destroy(l);
-	qb_loop_signals_destroy(l);
+	if (l->signal_source) {
+		qb_loop_signals_destroy(l);
+	}
 
 	if (default_intance == l) {
 		default_intance = NULL;
@@ -69,6 +69,14 @@ struct qb_loop {
 struct qb_loop *
 qb_loop_default_get(void);
 
+/*
+ * A loop for a thread of the library's own (e.g. an IPC worker): it never
+ * becomes the default loop and can't take signals, which are process
+ * wide and left to the application's loop.
+ */
+struct qb_loop *
+qb_loop_thread_create(void);
+
 struct qb_loop_source *
 qb_loop_jobs_create(struct qb_loop *l);
 
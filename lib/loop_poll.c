@@ -669,6 +669,9 @@ qb_loop_signal_add(qb_loop_t * lp,
 	if (p < QB_LOOP_LOW || p > QB_LOOP_HIGH) {
 		return -EINVAL;
 	}
+	if (l->signal_source == NULL) {
+		return -ENOTSUP;
+	}
 	s = (struct qb_signal_source *)l->signal_source;
 	sig = calloc(1, sizeof(struct qb_loop_sig));
 	if (sig == NULL) {
@@ -21,8 +21,46 @@
 #include "ringbuffer_int.h"
 #include <qb/qbdefs.h>
 #include "atomic_int.h"
+#include <sched.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
 
 #define QB_RB_FILE_HEADER_VERSION 1
+/*
+ * Version 2, written only by qb_rb_write_to_file_mappable(), starts the
+ * data this far into the file so that QB_RB_FLAG_READONLY can map it in
+ * place on any page size. Older libqb can't read it.
+ */
+#define QB_RB_FILE_HEADER_VERSION_MAPPABLE 2
+#define QB_RB_FILE_DATA_OFFSET (64 * 1024)
+
+#if defined(MAP_ANON) && ! defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+ * How many times a multi-producer writer polls commit_pt waiting for
+ * the writers ahead of it before giving up the cpu.
+ */
+#define QB_RB_MP_SPINS 128
+
+/*
+ * How long a multi-producer writer waits for the writer ahead of it
+ * before giving that reservation up as abandoned.
+ */
+#define QB_RB_MP_ABANDON_NS (1000 * QB_TIME_NS_IN_MSEC)
+
+/*
+ * How many times a busy polling reader looks at the ringbuffer between
+ * looks at the clock, which costs more.
+ */
+#define QB_RB_BUSY_POLL_CLOCK_SPINS 32
+
+/*
+ * QB_RB_FLAG_NT_STORES: the smallest copy that bypasses the cache.
+ */
+#define QB_RB_NT_COPY_MIN (16 * 1024)
 
 /*
  * #define CRAZY_DEBUG_PRINTFS 1
@@ -49,8 +87,8 @@ do {					\
 	if (idx % QB_CACHE_LINE_WORDS) {			\
 		idx += (QB_CACHE_LINE_WORDS - (idx % QB_CACHE_LINE_WORDS));	\
 	}				\
-	if (idx > (rb->shared_hdr->word_size - 1)) {		\
-		idx = ((idx) % (rb->shared_hdr->word_size));	\
+	if (idx > (rb->word_size - 1)) {		\
+		idx = ((idx) % (rb->word_size));	\
 	}						\
 } while (0)
 #else
@@ -58,8 +96,8 @@ do {					\
 #define QB_CACHE_LINE_WORDS 0
 #define idx_cache_line_step(idx)			\
 do {							\
-	if (idx > (rb->shared_hdr->word_size - 1)) {		\
-		idx = ((idx) % (rb->shared_hdr->word_size));	\
+	if (idx > (rb->word_size - 1)) {		\
+		idx = ((idx) % (rb->word_size));	\
 	}						\
 } while (0)
 #endif
@@ -71,6 +109,13 @@ do {							\
  */
 #define QB_RB_CHUNK_HEADER_WORDS 2
 #define QB_RB_CHUNK_HEADER_SIZE (sizeof(uint32_t) * QB_RB_CHUNK_HEADER_WORDS)
+/*
+ * QB_RB_FLAG_TIMESTAMPS extends it with
+ * 3) + 4) the commit time (CLOCK_MONOTONIC ns), low word first
+ */
+#define QB_RB_CHUNK_STAMP_WORDS 2
+#define QB_RB_CHUNK_STAMP_SIZE(rb) \
+	(sizeof(uint32_t) * ((rb)->chunk_hdr_words - QB_RB_CHUNK_HEADER_WORDS))
 /*
  * margin is the gap we leave when checking to see if we have enough
  * space for a new chunk.
@@ -87,15 +132,22 @@ do {							\
 #define QB_RB_CHUNK_MAGIC		0xA1A1A1A1
 #define QB_RB_CHUNK_MAGIC_DEAD		0xD0D0D0D0
 #define QB_RB_CHUNK_MAGIC_ALLOC		0xA110CED0
+/* a multi-producer reservation that was given up, see _rb_mp_recover() */
+#define QB_RB_CHUNK_MAGIC_PAD		0xDEADA110
+/*
+ * Indexes wrap at rb->word_size, the size of the segment this handle has
+ * mapped: qb_rb_resize() publishes shared_hdr->word_size before other
+ * handles have remapped (see _rb_generation_check()).
+ */
 #define QB_RB_CHUNK_SIZE_GET(rb, pointer) rb->shared_data[pointer]
 #define QB_RB_CHUNK_MAGIC_GET(rb, pointer) \
-	qb_atomic_int_get_ex((int32_t*)&rb->shared_data[(pointer + 1) % rb->shared_hdr->word_size], \
+	qb_atomic_int_get_ex((int32_t*)&rb->shared_data[(pointer + 1) % rb->word_size], \
                              QB_ATOMIC_ACQUIRE)
 #define QB_RB_CHUNK_MAGIC_SET(rb, pointer, new_val) \
-	qb_atomic_int_set_ex((int32_t*)&rb->shared_data[(pointer + 1) % rb->shared_hdr->word_size], \
+	qb_atomic_int_set_ex((int32_t*)&rb->shared_data[(pointer + 1) % rb->word_size], \
 			     new_val, QB_ATOMIC_RELEASE)
 #define QB_RB_CHUNK_DATA_GET(rb, pointer) \
-	&rb->shared_data[(pointer + QB_RB_CHUNK_HEADER_WORDS) % rb->shared_hdr->word_size]
+	&rb->shared_data[(pointer + rb->chunk_hdr_words) % rb->word_size]
 
 #define QB_MAGIC_ASSERT(_ptr_) \
 do {							\
@@ -106,25 +158,129 @@ do {							\
 
 #define idx_step(idx)					\
 do {							\
-	if (idx > (rb->shared_hdr->word_size - 1)) {		\
-		idx = ((idx) % (rb->shared_hdr->word_size));	\
+	if (idx > (rb->word_size - 1)) {		\
+		idx = ((idx) % (rb->word_size));	\
 	}						\
 } while (0)
 
 static void print_header(struct qb_ringbuffer_s * rb);
+static int32_t _rb_shared_hdr_check(struct qb_ringbuffer_shared_s *hdr,
+				    const char *name);
+static int32_t _rb_bcast_join(struct qb_ringbuffer_s * rb);
+static void _rb_bcast_leave(struct qb_ringbuffer_s * rb);
 static int _rb_chunk_reclaim(struct qb_ringbuffer_s * rb);
+static int _rb_overwrite_reclaim(struct qb_ringbuffer_s * rb, size_t needed);
+static uint32_t _rb_chunk_step(struct qb_ringbuffer_s * rb, uint32_t pointer,
+			       uint32_t chunk_size);
+static uint32_t qb_rb_chunk_step(struct qb_ringbuffer_s * rb, uint32_t pointer);
 
 qb_ringbuffer_t *
 qb_rb_open(const char *name, size_t size, uint32_t flags,
 	   size_t shared_user_data_size)
 {
-	return qb_rb_open_2(name, size, flags, shared_user_data_size, NULL);
+	return qb_rb_open_2(name, size, flags, shared_user_data_size, NULL, 0);
+}
+
+qb_ringbuffer_t *
+qb_rb_open_slots(const char *name, size_t slot_size, size_t slot_count,
+		 uint32_t flags, size_t shared_user_data_size)
+{
+	if (slot_size == 0 || slot_count == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return qb_rb_open_2(name,
+			    QB_ROUNDUP(slot_size, sizeof(uint32_t)) * slot_count,
+			    flags, shared_user_data_size, NULL, slot_size);
+}
+
+/*
+ * Try to create and map the data file on hugetlbfs. On failure nothing
+ * is left behind so the caller can fall back to normal pages.
+ */
+static int32_t
+_rb_hugetlb_data_open(struct qb_ringbuffer_s *rb, const char *dir,
+		      const char *filename, size_t real_size,
+		      uint32_t file_flags, uint32_t mmap_flags)
+{
+	char path[PATH_MAX];
+	void *shm_addr;
+	int32_t fd;
+	int32_t res;
+
+	fd = qb_sys_hugetlb_file_open(path, dir, filename,
+				      real_size, file_flags);
+	if (fd < 0) {
+		return fd;
+	}
+	/* this function closes fd */
+	res = qb_sys_circular_mmap_2(fd, &shm_addr, real_size, mmap_flags);
+	if (res != 0) {
+		unlink(path);
+		return res;
+	}
+	rb->shared_data = shm_addr;
+	(void)strlcpy(rb->shared_hdr->data_path, path, PATH_MAX);
+	qb_util_log(LOG_DEBUG, "using huge pages for %s", path);
+	return 0;
+}
+
+/*
+ * Create and map the data memfd, trying a hugetlb one first if asked to.
+ * The fd is kept in rb->memfd_data for qb_rb_memfds_get().
+ */
+static int32_t
+_rb_memfd_data_open(struct qb_ringbuffer_s *rb, const char *filename,
+		    size_t size, size_t page_size, uint32_t mmap_flags)
+{
+	char path[PATH_MAX];
+	void *shm_addr;
+	size_t real_size;
+	int32_t fd;
+	int32_t res;
+
+	if (mmap_flags & QB_SYS_MMAP_HUGEPAGE) {
+		real_size = size;
+		fd = qb_sys_memfd_open(path, filename, &real_size,
+				       QB_SYS_MMAP_HUGEPAGE);
+		if (fd >= 0) {
+			/* this function closes the dup'ed fd */
+			res = qb_sys_circular_mmap_2(dup(fd), &shm_addr,
+						     real_size, mmap_flags);
+			if (res == 0) {
+				goto mapped;
+			}
+			close(fd);
+		}
+		qb_util_log(LOG_INFO,
+			    "couldn't get huge pages for %s, "
+			    "using normal pages", filename);
+	}
+
+	real_size = QB_ROUNDUP(size, page_size);
+	fd = qb_sys_memfd_open(path, filename, &real_size, 0);
+	if (fd < 0) {
+		return fd;
+	}
+	res = qb_sys_circular_mmap_2(dup(fd), &shm_addr, real_size,
+				     mmap_flags);
+	if (res != 0) {
+		close(fd);
+		return res;
+	}
+
+mapped:
+	rb->shared_data = shm_addr;
+	rb->shared_hdr->word_size = real_size / sizeof(uint32_t);
+	rb->memfd_data = fd;
+	(void)strlcpy(rb->shared_hdr->data_path, path, PATH_MAX);
+	return 0;
 }
 
 qb_ringbuffer_t *
 qb_rb_open_2(const char *name, size_t size, uint32_t flags,
 	     size_t shared_user_data_size,
-	     struct qb_rb_notifier *notifiers)
+	     struct qb_rb_notifier *notifiers, size_t slot_size)
 {
 	struct qb_ringbuffer_s *rb;
 	size_t real_size;
@@ -137,6 +293,10 @@ qb_rb_open_2(const char *name, size_t size, uint32_t flags,
 	int32_t error = 0;
 	void *shm_addr;
 	long page_size = sysconf(_SC_PAGESIZE);
+	uint32_t mmap_flags = 0;
+	int mmap_hdr_flags = MAP_SHARED;
+	char huge_dir[PATH_MAX];
+	ssize_t huge_size = -ENOENT;
 
 #ifdef QB_FORCE_SHM_ALIGN
 	page_size = QB_MAX(page_size, 16 * 1024);
@@ -145,10 +305,87 @@ qb_rb_open_2(const char *name, size_t size, uint32_t flags,
 	 * to be reflective of the max size single write we can do to the 
 	 * ringbuffer.  This means we have to add both the 'margin' space used
 	 * to calculate if there is enough space for a new chunk as well as the '+1' that
-	 * prevents overlap of the read/write pointers */
-	size += QB_RB_CHUNK_MARGIN + 1;
+	 * prevents overlap of the read/write pointers. Fixed slots have
+	 * neither. */
+	if (slot_size == 0) {
+		size += QB_RB_CHUNK_MARGIN + 1;
+	}
 	real_size = QB_ROUNDUP(size, page_size);
 
+	if (flags & QB_RB_FLAG_PREFAULT) {
+		mmap_flags |= QB_SYS_MMAP_POPULATE;
+#ifdef MAP_POPULATE
+		mmap_hdr_flags |= MAP_POPULATE;
+#endif /* MAP_POPULATE */
+	}
+	if ((flags & QB_RB_FLAG_HUGEPAGES) && (flags & QB_RB_FLAG_CREATE)) {
+		mmap_flags |= QB_SYS_MMAP_HUGEPAGE;
+	}
+	if ((mmap_flags & QB_SYS_MMAP_HUGEPAGE) &&
+	    !(flags & QB_RB_FLAG_MEMFD)) {
+		huge_size = qb_sys_hugetlbfs_get(huge_dir);
+		if (huge_size > 0) {
+			real_size = QB_ROUNDUP(size, huge_size);
+		} else {
+			qb_util_log(LOG_DEBUG,
+				    "no hugetlbfs mounted, using normal pages");
+		}
+	}
+
+	if ((flags & QB_RB_FLAG_MULTI_PRODUCER) &&
+	    (flags & QB_RB_FLAG_OVERWRITE)) {
+		qb_util_log(LOG_ERR,
+			    "multi producer ringbuffers can't overwrite");
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((flags & QB_RB_FLAG_BROADCAST) &&
+	    (flags & (QB_RB_FLAG_MULTI_PRODUCER | QB_RB_FLAG_EVENTFD))) {
+		qb_util_log(LOG_ERR,
+			    "broadcast ringbuffers have one writer and "
+			    "can't use an eventfd");
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((flags & QB_RB_FLAG_FUTEX) && (flags & QB_RB_FLAG_EVENTFD)) {
+		qb_util_log(LOG_ERR,
+			    "a ringbuffer has either a futex or an eventfd");
+		errno = EINVAL;
+		return NULL;
+	}
+	if (slot_size &&
+	    (flags & (QB_RB_FLAG_MULTI_PRODUCER | QB_RB_FLAG_BROADCAST))) {
+		qb_util_log(LOG_ERR,
+			    "fixed slot ringbuffers have one writer and "
+			    "one reader");
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((flags & QB_RB_FLAG_MEMFD) && !(flags & QB_RB_FLAG_CREATE)) {
+		qb_util_log(LOG_ERR,
+			    "memfd ringbuffers can only be opened from fds");
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((flags & QB_RB_FLAG_TIMESTAMPS) &&
+	    (slot_size ||
+	     (flags & (QB_RB_FLAG_MULTI_PRODUCER | QB_RB_FLAG_BROADCAST)))) {
+		qb_util_log(LOG_ERR,
+			    "timestamped ringbuffers need variable size chunks, "
+			    "one writer and one reader");
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((flags & QB_RB_FLAG_JOURNAL) &&
+	    (flags & (QB_RB_FLAG_MEMFD | QB_RB_FLAG_HUGEPAGES |
+		      QB_RB_FLAG_BROADCAST))) {
+		qb_util_log(LOG_ERR,
+			    "journal ringbuffers need a regular file and "
+			    "one reader");
+		errno = EINVAL;
+		return NULL;
+	}
+
 	shared_size =
 	    sizeof(struct qb_ringbuffer_shared_s) + shared_user_data_size;
 
@@ -160,13 +397,26 @@ qb_rb_open_2(const char *name, size_t size, uint32_t flags,
 	if (rb == NULL) {
 		return NULL;
 	}
+	rb->memfd_hdr = -1;
+	rb->memfd_data = -1;
+	rb->notifier_fd = -1;
+	rb->bcast_reader = -1;
 
 	/*
 	 * Create a shared_hdr memory segment for the header.
 	 */
-	snprintf(filename, PATH_MAX, "qb-%s-header", name);
-	fd_hdr = qb_sys_mmap_file_open(path, filename,
-				       shared_size, file_flags);
+	if (flags & QB_RB_FLAG_JOURNAL) {
+		snprintf(filename, PATH_MAX, "%s%s-header",
+			 strchr(name, '/') ? "" : "./", name);
+	} else {
+		snprintf(filename, PATH_MAX, "qb-%s-header", name);
+	}
+	if (flags & QB_RB_FLAG_MEMFD) {
+		fd_hdr = qb_sys_memfd_open(path, filename, &shared_size, 0);
+	} else {
+		fd_hdr = qb_sys_mmap_file_open(path, filename,
+					       shared_size, file_flags);
+	}
 	if (fd_hdr < 0) {
 		error = fd_hdr;
 		qb_util_log(LOG_ERR, "couldn't create file for mmap");
@@ -175,13 +425,16 @@ qb_rb_open_2(const char *name, size_t size, uint32_t flags,
 
 	rb->shared_hdr = mmap(0,
 			      shared_size,
-			      PROT_READ | PROT_WRITE, MAP_SHARED, fd_hdr, 0);
+			      PROT_READ | PROT_WRITE, mmap_hdr_flags, fd_hdr, 0);
 
 	if (rb->shared_hdr == MAP_FAILED) {
 		error = -errno;
 		qb_util_log(LOG_ERR, "couldn't create mmap for header");
 		goto cleanup_hdr;
 	}
+	if (flags & QB_RB_FLAG_PREFAULT) {
+		qb_sys_mmap_prefault(rb->shared_hdr, shared_size);
+	}
 	qb_atomic_init();
 
 	rb->flags = flags;
@@ -193,10 +446,44 @@ qb_rb_open_2(const char *name, size_t size, uint32_t flags,
 		rb->shared_data = NULL;
 		/* rb->shared_hdr->word_size tracks data by ints and not bytes/chars. */
 		rb->shared_hdr->word_size = real_size / sizeof(uint32_t);
+		rb->shared_hdr->magic = QB_RB_SHARED_HDR_MAGIC;
+		rb->shared_hdr->version = QB_RB_SHARED_HDR_VERSION;
+		rb->shared_hdr->v1_word_size = 0;
 		rb->shared_hdr->write_pt = 0;
 		rb->shared_hdr->read_pt = 0;
+		rb->shared_hdr->commit_pt = 0;
+		rb->shared_hdr->journal_write_pt = 0;
+		rb->shared_hdr->journal_read_pt = 0;
+		rb->shared_hdr->generation = 0;
+		rb->shared_hdr->slot_words = 0;
+		rb->shared_hdr->slot_count = 0;
+		rb->shared_hdr->chunk_hdr_words = QB_RB_CHUNK_HEADER_WORDS;
+		if (flags & QB_RB_FLAG_TIMESTAMPS) {
+			rb->shared_hdr->chunk_hdr_words +=
+				QB_RB_CHUNK_STAMP_WORDS;
+		}
+		rb->shared_hdr->chunks_committed = 0;
+		rb->shared_hdr->chunks_dropped = 0;
+		rb->shared_hdr->chunks_consumed = 0;
+		rb->shared_hdr->dwell_max = 0;
+		memset((void *)rb->shared_hdr->dwell_hist, 0,
+		       sizeof(rb->shared_hdr->dwell_hist));
+		memset(rb->shared_hdr->readers, 0,
+		       sizeof(rb->shared_hdr->readers));
 		(void)strlcpy(rb->shared_hdr->hdr_path, path, PATH_MAX);
-	}
+	} else if ((error = _rb_shared_hdr_check(rb->shared_hdr, name)) != 0) {
+		goto cleanup_hdr;
+	} else {
+		/*
+		 * map what the creator made (or last resized it to), whatever
+		 * size we were given. If a resize is under way the first read
+		 * maps the new segment.
+		 */
+		rb->generation = qb_atomic_int_get(&rb->shared_hdr->generation) & ~1;
+		real_size = rb->shared_hdr->word_size * sizeof(uint32_t);
+	}
+	rb->read_pt_cache = rb->shared_hdr->read_pt;
+	rb->write_pt_cache = rb->shared_hdr->write_pt;
 	if (notifiers && notifiers->post_fn) {
 		error = 0;
 		memcpy(&rb->notifier,
@@ -215,7 +502,36 @@ qb_rb_open_2(const char *name, size_t size, uint32_t flags,
 	 * They have to be separate.
 	 */
 	if (flags & QB_RB_FLAG_CREATE) {
-		snprintf(filename, PATH_MAX, "qb-%s-data", name);
+		if (flags & QB_RB_FLAG_JOURNAL) {
+			snprintf(filename, PATH_MAX, "%s%s-data",
+				 strchr(name, '/') ? "" : "./", name);
+		} else {
+			snprintf(filename, PATH_MAX, "qb-%s-data", name);
+		}
+		if (flags & QB_RB_FLAG_MEMFD) {
+			error = _rb_memfd_data_open(rb, filename, size,
+						    page_size, mmap_flags);
+			if (error != 0) {
+				qb_util_log(LOG_ERR,
+					    "couldn't create memfd for %s",
+					    name);
+				goto cleanup_hdr;
+			}
+			goto data_mapped;
+		}
+		if (huge_size > 0) {
+			error = _rb_hugetlb_data_open(rb, huge_dir, filename,
+						      real_size, file_flags,
+						      mmap_flags);
+			if (error == 0) {
+				goto data_mapped;
+			}
+			qb_util_log(LOG_INFO,
+				    "couldn't get huge pages for %s (%d), "
+				    "using normal pages", name, error);
+			real_size = QB_ROUNDUP(size, page_size);
+			rb->shared_hdr->word_size = real_size / sizeof(uint32_t);
+		}
 		fd_data = qb_sys_mmap_file_open(path,
 						filename,
 						real_size, file_flags);
@@ -236,7 +552,8 @@ qb_rb_open_2(const char *name, size_t size, uint32_t flags,
 		    real_size, rb->shared_hdr->word_size);
 
 	/* this function closes fd_data */
-	error = qb_sys_circular_mmap(fd_data, &shm_addr, real_size);
+	error = qb_sys_circular_mmap_2(fd_data, &shm_addr, real_size,
+				       mmap_flags);
 	rb->shared_data = shm_addr;
 	if (error != 0) {
 		qb_util_log(LOG_ERR, "couldn't create circular mmap on %s",
@@ -244,15 +561,51 @@ qb_rb_open_2(const char *name, size_t size, uint32_t flags,
 		goto cleanup_data;
 	}
 
+data_mapped:
 	if (flags & QB_RB_FLAG_CREATE) {
-		memset(rb->shared_data, 0, real_size);
+		memset(rb->shared_data, 0,
+		       rb->shared_hdr->word_size * sizeof(uint32_t));
 		rb->shared_data[rb->shared_hdr->word_size] = 5;
+		if (slot_size) {
+			rb->shared_hdr->slot_words =
+				QB_ROUNDUP(slot_size, sizeof(uint32_t)) /
+				sizeof(uint32_t);
+			rb->shared_hdr->slot_count =
+				rb->shared_hdr->word_size /
+				rb->shared_hdr->slot_words;
+		}
 		rb->shared_hdr->ref_count = 1;
 	} else {
+		if (flags & QB_RB_FLAG_BROADCAST) {
+			error = _rb_bcast_join(rb);
+			if (error != 0) {
+				munmap(rb->shared_data,
+				       (rb->shared_hdr->word_size *
+					sizeof(uint32_t)) << 1);
+				goto cleanup_hdr;
+			}
+		}
 		qb_atomic_int_inc(&rb->shared_hdr->ref_count);
 	}
+	rb->slot_words = rb->shared_hdr->slot_words;
+	rb->chunk_hdr_words = rb->shared_hdr->chunk_hdr_words;
+	rb->slot_count = rb->shared_hdr->slot_count;
+	if (flags & QB_RB_FLAG_CREATE) {
+		rb->word_size = rb->shared_hdr->word_size;
+	} else {
+		rb->word_size = real_size / sizeof(uint32_t);
+	}
+	if ((flags & QB_RB_FLAG_JOURNAL) &&
+	    (error = qb_rb_journal_create(rb)) != 0) {
+		munmap(rb->shared_data, (rb->word_size * sizeof(uint32_t)) << 1);
+		goto cleanup_data;
+	}
 
-	close(fd_hdr);
+	if (flags & QB_RB_FLAG_MEMFD) {
+		rb->memfd_hdr = fd_hdr;
+	} else {
+		close(fd_hdr);
+	}
 	return rb;
 
 cleanup_data:
@@ -264,8 +617,17 @@ cleanup_hdr:
 	if (fd_hdr >= 0) {
 		close(fd_hdr);
 	}
-	if (rb && (flags & QB_RB_FLAG_CREATE)) {
-		unlink(rb->shared_hdr->hdr_path);
+	if (rb->memfd_data >= 0) {
+		close(rb->memfd_data);
+	}
+	if (rb->notifier_fd >= 0) {
+		close(rb->notifier_fd);
+	}
+	if ((flags & QB_RB_FLAG_CREATE) &&
+	    rb->shared_hdr != MAP_FAILED && rb->shared_hdr != NULL) {
+		if (!(flags & QB_RB_FLAG_MEMFD)) {
+			unlink(rb->shared_hdr->hdr_path);
+		}
 		if (rb->notifier.destroy_fn) {
 			(void)rb->notifier.destroy_fn(rb->notifier.instance);
 		}
@@ -278,6 +640,164 @@ cleanup_hdr:
 	return NULL;
 }
 
+qb_ringbuffer_t *
+qb_rb_open_from_memfds(int32_t hdr_fd, int32_t data_fd, uint32_t flags)
+{
+	struct qb_ringbuffer_s *rb = NULL;
+	struct stat st;
+	size_t real_size;
+	uint32_t mmap_flags = 0;
+	int mmap_hdr_flags = MAP_SHARED;
+	void *shm_addr;
+	int32_t error = 0;
+
+	if (flags & QB_RB_FLAG_CREATE) {
+		error = -EINVAL;
+		goto cleanup_fds;
+	}
+	if (flags & QB_RB_FLAG_PREFAULT) {
+		mmap_flags |= QB_SYS_MMAP_POPULATE;
+#ifdef MAP_POPULATE
+		mmap_hdr_flags |= MAP_POPULATE;
+#endif /* MAP_POPULATE */
+	}
+
+	if (fstat(hdr_fd, &st) == -1) {
+		error = -errno;
+		goto cleanup_fds;
+	}
+	if (st.st_size < sizeof(struct qb_ringbuffer_shared_s)) {
+		qb_util_log(LOG_ERR, "memfd ringbuffer header is too small");
+		error = -EINVAL;
+		goto cleanup_fds;
+	}
+
+	rb = calloc(1, sizeof(struct qb_ringbuffer_s));
+	if (rb == NULL) {
+		error = -ENOMEM;
+		goto cleanup_fds;
+	}
+	rb->flags = flags | QB_RB_FLAG_MEMFD;
+	rb->memfd_hdr = -1;
+	rb->memfd_data = -1;
+	rb->notifier_fd = -1;
+	rb->bcast_reader = -1;
+
+	rb->shared_hdr = mmap(0, st.st_size, PROT_READ | PROT_WRITE,
+			      mmap_hdr_flags, hdr_fd, 0);
+	if (rb->shared_hdr == MAP_FAILED) {
+		error = -errno;
+		qb_util_log(LOG_ERR, "couldn't create mmap for header");
+		goto cleanup_fds;
+	}
+	if (flags & QB_RB_FLAG_PREFAULT) {
+		qb_sys_mmap_prefault(rb->shared_hdr, st.st_size);
+	}
+	qb_atomic_init();
+
+	error = _rb_shared_hdr_check(rb->shared_hdr, "memfd");
+	if (error != 0) {
+		goto cleanup_hdr;
+	}
+
+	/*
+	 * Don't trust word_size blindly, mapping past the end of the
+	 * memfd would only show up later as SIGBUS.
+	 */
+	real_size = rb->shared_hdr->word_size * sizeof(uint32_t);
+	if (fstat(data_fd, &st) == -1) {
+		error = -errno;
+		goto cleanup_hdr;
+	}
+	if (real_size == 0 || st.st_size != real_size) {
+		qb_util_log(LOG_ERR, "memfd ringbuffer %s has the wrong size",
+			    rb->shared_hdr->data_path);
+		error = -EINVAL;
+		goto cleanup_hdr;
+	}
+
+	rb->read_pt_cache = rb->shared_hdr->read_pt;
+	rb->write_pt_cache = rb->shared_hdr->write_pt;
+	error = qb_rb_sem_create(rb, rb->flags);
+	if (error < 0) {
+		errno = -error;
+		qb_util_perror(LOG_ERR, "couldn't create a semaphore");
+		goto cleanup_hdr;
+	}
+
+	/* this function closes data_fd */
+	error = qb_sys_circular_mmap_2(data_fd, &shm_addr, real_size,
+				       mmap_flags);
+	data_fd = -1;
+	if (error != 0) {
+		qb_util_log(LOG_ERR, "couldn't create circular mmap on %s",
+			    rb->shared_hdr->data_path);
+		goto cleanup_hdr;
+	}
+	rb->shared_data = shm_addr;
+	if (flags & QB_RB_FLAG_BROADCAST) {
+		error = _rb_bcast_join(rb);
+		if (error != 0) {
+			munmap(rb->shared_data, real_size << 1);
+			goto cleanup_hdr;
+		}
+	}
+	qb_atomic_int_inc(&rb->shared_hdr->ref_count);
+	rb->slot_words = rb->shared_hdr->slot_words;
+	rb->chunk_hdr_words = rb->shared_hdr->chunk_hdr_words;
+	rb->slot_count = rb->shared_hdr->slot_count;
+	rb->word_size = real_size / sizeof(uint32_t);
+
+	close(hdr_fd);
+	qb_util_log(LOG_DEBUG, "opened ringbuffer %s from fds",
+		    rb->shared_hdr->hdr_path);
+	return rb;
+
+cleanup_hdr:
+	if (rb->notifier_fd >= 0) {
+		close(rb->notifier_fd);
+	}
+	munmap(rb->shared_hdr, sizeof(struct qb_ringbuffer_shared_s));
+
+cleanup_fds:
+	close(hdr_fd);
+	if (data_fd >= 0) {
+		close(data_fd);
+	}
+	free(rb);
+	errno = -error;
+	return NULL;
+}
+
+int32_t
+qb_rb_memfds_get(struct qb_ringbuffer_s * rb, int32_t * hdr_fd,
+		 int32_t * data_fd)
+{
+	if (rb == NULL || hdr_fd == NULL || data_fd == NULL) {
+		return -EINVAL;
+	}
+	if (rb->memfd_hdr < 0 || rb->memfd_data < 0) {
+		return -EBADF;
+	}
+	*hdr_fd = rb->memfd_hdr;
+	*data_fd = rb->memfd_data;
+	rb->memfd_hdr = -1;
+	rb->memfd_data = -1;
+	return 0;
+}
+
+static void
+_rb_memfds_close(struct qb_ringbuffer_s * rb)
+{
+	if (rb->memfd_hdr >= 0) {
+		close(rb->memfd_hdr);
+		rb->memfd_hdr = -1;
+	}
+	if (rb->memfd_data >= 0) {
+		close(rb->memfd_data);
+		rb->memfd_data = -1;
+	}
+}
 
 void
 qb_rb_close(struct qb_ringbuffer_s * rb)
@@ -287,13 +807,22 @@ qb_rb_close(struct qb_ringbuffer_s * rb)
 	}
 	qb_enter();
 
+	if (rb->notifier_fd >= 0) {
+		close(rb->notifier_fd);
+	}
+	_rb_bcast_leave(rb);
+	qb_rb_journal_destroy(rb);
 	(void)qb_atomic_int_dec_and_test(&rb->shared_hdr->ref_count);
 	if (rb->flags & QB_RB_FLAG_CREATE) {
 		if (rb->notifier.destroy_fn) {
 			(void)rb->notifier.destroy_fn(rb->notifier.instance);
 		}
-		unlink(rb->shared_hdr->data_path);
-		unlink(rb->shared_hdr->hdr_path);
+		if (rb->flags & QB_RB_FLAG_MEMFD) {
+			_rb_memfds_close(rb);
+		} else if (!(rb->flags & QB_RB_FLAG_JOURNAL)) {
+			unlink(rb->shared_hdr->data_path);
+			unlink(rb->shared_hdr->hdr_path);
+		}
 		qb_util_log(LOG_DEBUG,
 			    "Free'ing ringbuffer: %s",
 			    rb->shared_hdr->hdr_path);
@@ -301,7 +830,7 @@ qb_rb_close(struct qb_ringbuffer_s * rb)
 		qb_util_log(LOG_DEBUG,
 			    "Closing ringbuffer: %s", rb->shared_hdr->hdr_path);
 	}
-	munmap(rb->shared_data, (rb->shared_hdr->word_size * sizeof(uint32_t)) << 1);
+	munmap(rb->shared_data, (rb->word_size * sizeof(uint32_t)) << 1);
 	munmap(rb->shared_hdr, sizeof(struct qb_ringbuffer_shared_s));
 	free(rb);
 }
@@ -317,6 +846,22 @@ qb_rb_force_close(struct qb_ringbuffer_s * rb)
 	if (rb->notifier.destroy_fn) {
 		(void)rb->notifier.destroy_fn(rb->notifier.instance);
 	}
+	if (rb->notifier_fd >= 0) {
+		close(rb->notifier_fd);
+	}
+	_rb_bcast_leave(rb);
+	qb_rb_journal_destroy(rb);
+
+	if (rb->flags & QB_RB_FLAG_MEMFD) {
+		_rb_memfds_close(rb);
+		qb_util_log(LOG_DEBUG, "Force free'ing ringbuffer: %s",
+			    rb->shared_hdr->hdr_path);
+		goto unmap;
+	}
+	if (rb->flags & QB_RB_FLAG_JOURNAL) {
+		/* the files are the journal */
+		goto unmap;
+	}
 
         errno = 0;
 	unlink(rb->shared_hdr->data_path);
@@ -329,7 +874,8 @@ qb_rb_force_close(struct qb_ringbuffer_s * rb)
 	qb_util_perror(LOG_DEBUG,
 		    "Force free'ing ringbuffer: %s",
 		    rb->shared_hdr->hdr_path);
-	munmap(rb->shared_data, (rb->shared_hdr->word_size * sizeof(uint32_t)) << 1);
+unmap:
+	munmap(rb->shared_data, (rb->word_size * sizeof(uint32_t)) << 1);
 	munmap(rb->shared_hdr, sizeof(struct qb_ringbuffer_shared_s));
 	free(rb);
 }
@@ -343,6 +889,38 @@ qb_rb_name_get(struct qb_ringbuffer_s * rb)
 	return rb->shared_hdr->hdr_path;
 }
 
+int32_t
+qb_rb_fd_get(struct qb_ringbuffer_s * rb, int32_t * fd)
+{
+	if (rb == NULL || fd == NULL) {
+		return -EINVAL;
+	}
+	if ((rb->flags & QB_RB_FLAG_EVENTFD) == 0) {
+		return -ENOTSUP;
+	}
+	if (rb->notifier_fd < 0) {
+		return -EBADF;
+	}
+	*fd = rb->notifier_fd;
+	return 0;
+}
+
+int32_t
+qb_rb_fd_set(struct qb_ringbuffer_s * rb, int32_t fd)
+{
+	if (rb == NULL || fd < 0) {
+		return -EINVAL;
+	}
+	if ((rb->flags & QB_RB_FLAG_EVENTFD) == 0) {
+		return -ENOTSUP;
+	}
+	if (rb->notifier_fd >= 0) {
+		close(rb->notifier_fd);
+	}
+	rb->notifier_fd = fd;
+	return 0;
+}
+
 void *
 qb_rb_shared_user_data_get(struct qb_ringbuffer_s * rb)
 {
@@ -361,38 +939,652 @@ qb_rb_refcount_get(struct qb_ringbuffer_s * rb)
 	return qb_atomic_int_get(&rb->shared_hdr->ref_count);
 }
 
-ssize_t
-qb_rb_space_free(struct qb_ringbuffer_s * rb)
+/*
+ * Broadcast ringbuffers.
+ *
+ * Each reader owns a slot in shared_hdr->readers and only ever moves its
+ * own cursor. The (single) writer keeps shared_hdr->read_pt at the
+ * slowest cursor when it runs short of space; the chunks behind it are
+ * free again. Nobody marks reclaimed chunks as dead, so a reader is at
+ * the end of the data when its cursor reaches write_pt.
+ */
+static struct qb_rb_bcast_reader *
+_rb_bcast_reader_get(struct qb_ringbuffer_s * rb)
 {
-	uint32_t write_size;
-	uint32_t read_size;
-	size_t space_free = 0;
+	return &rb->shared_hdr->readers[rb->bcast_reader];
+}
 
-	if (rb == NULL) {
-		return -EINVAL;
+static uint32_t
+_rb_bcast_lag(struct qb_ringbuffer_s * rb, uint32_t pointer, uint32_t write_pt)
+{
+	return (write_pt - pointer + rb->word_size) %
+		rb->word_size;
+}
+
+static int32_t
+_rb_bcast_join(struct qb_ringbuffer_s * rb)
+{
+	struct qb_rb_bcast_reader *r;
+	uint32_t write_pt;
+	int32_t i;
+
+	for (i = 0; i < QB_RB_BCAST_READERS_MAX; i++) {
+		r = &rb->shared_hdr->readers[i];
+		if (qb_atomic_int_compare_and_exchange(&r->state,
+						       QB_RB_BCAST_FREE,
+						       QB_RB_BCAST_JOINING)) {
+			break;
+		}
 	}
-	if (rb->notifier.space_used_fn) {
-		return (rb->shared_hdr->word_size * sizeof(uint32_t)) -
-			rb->notifier.space_used_fn(rb->notifier.instance);
+	if (i == QB_RB_BCAST_READERS_MAX) {
+		qb_util_log(LOG_ERR, "ringbuffer %s has no free reader slot",
+			    rb->shared_hdr->hdr_path);
+		return -EBUSY;
 	}
-	write_size = rb->shared_hdr->write_pt;
-	read_size = rb->shared_hdr->read_pt;
+	rb->bcast_reader = i;
 
-	if (write_size > read_size) {
-		space_free =
-		    (read_size - write_size + rb->shared_hdr->word_size) - 1;
-	} else if (write_size < read_size) {
-		space_free = (read_size - write_size) - 1;
-	} else {
-		if (rb->notifier.q_len_fn && rb->notifier.q_len_fn(rb->notifier.instance) > 0) {
-			space_free = 0;
+	/*
+	 * Start at the end of the data. The writer ignores us until we are
+	 * active, so if it wrote (and maybe reclaimed past our cursor) in
+	 * the meantime, catch up again: once write_pt stands still while we
+	 * are active the writer can't reclaim past us any more.
+	 */
+	write_pt = qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->write_pt,
+					QB_ATOMIC_ACQUIRE);
+	r->read_pt = write_pt;
+	qb_atomic_int_set(&r->state, QB_RB_BCAST_ACTIVE);
+	while (qb_atomic_int_get((int32_t *)&rb->shared_hdr->write_pt) !=
+	       write_pt) {
+		write_pt = rb->shared_hdr->write_pt;
+		qb_atomic_int_set((int32_t *)&r->read_pt, write_pt);
+	}
+	rb->write_pt_cache = write_pt;
+	qb_util_log(LOG_DEBUG, "joined ringbuffer %s as reader %d",
+		    rb->shared_hdr->hdr_path, i);
+	return 0;
+}
+
+static void
+_rb_bcast_leave(struct qb_ringbuffer_s * rb)
+{
+	if (rb->bcast_reader < 0) {
+		return;
+	}
+	qb_atomic_int_set(&_rb_bcast_reader_get(rb)->state, QB_RB_BCAST_FREE);
+	rb->bcast_reader = -1;
+}
+
+static int32_t
+_rb_bcast_evicted(struct qb_ringbuffer_s * rb)
+{
+	return (rb->bcast_reader >= 0 &&
+		qb_atomic_int_get(&_rb_bcast_reader_get(rb)->state) !=
+		QB_RB_BCAST_ACTIVE);
+}
+
+/*
+ * Move read_pt up to the slowest active reader (or write_pt if there are
+ * none). Cursors outside [read_pt, write_pt] belong to readers that are
+ * still joining.
+ */
+static uint32_t
+_rb_bcast_read_pt_update(struct qb_ringbuffer_s * rb)
+{
+	struct qb_rb_bcast_reader *r;
+	uint32_t write_pt = rb->shared_hdr->write_pt;
+	uint32_t lag_max = _rb_bcast_lag(rb, rb->shared_hdr->read_pt, write_pt);
+	uint32_t slowest = write_pt;
+	uint32_t lag_slowest = 0;
+	uint32_t cursor;
+	uint32_t lag;
+	int32_t i;
+
+	for (i = 0; i < QB_RB_BCAST_READERS_MAX; i++) {
+		r = &rb->shared_hdr->readers[i];
+		if (qb_atomic_int_get(&r->state) != QB_RB_BCAST_ACTIVE) {
+			continue;
+		}
+		cursor = qb_atomic_int_get_ex((int32_t *)&r->read_pt,
+					      QB_ATOMIC_ACQUIRE);
+		lag = _rb_bcast_lag(rb, cursor, write_pt);
+		if (lag > lag_max) {
+			continue;
+		}
+		if (lag > lag_slowest) {
+			lag_slowest = lag;
+			slowest = cursor;
+		}
+	}
+	qb_atomic_int_set_ex((int32_t *)&rb->shared_hdr->read_pt, slowest,
+			     QB_ATOMIC_RELEASE);
+	return slowest;
+}
+
+/*
+ * QB_RB_FLAG_OVERWRITE on a broadcast ringbuffer: make room by evicting
+ * the reader(s) at read_pt.
+ */
+static int
+_rb_bcast_evict(struct qb_ringbuffer_s * rb)
+{
+	struct qb_rb_bcast_reader *r;
+	uint32_t read_pt = _rb_bcast_read_pt_update(rb);
+	int32_t evicted = 0;
+	int32_t i;
+
+	if (read_pt == rb->shared_hdr->write_pt) {
+		return -ENOSPC;
+	}
+	for (i = 0; i < QB_RB_BCAST_READERS_MAX; i++) {
+		r = &rb->shared_hdr->readers[i];
+		if (r->read_pt == read_pt &&
+		    qb_atomic_int_compare_and_exchange(&r->state,
+						       QB_RB_BCAST_ACTIVE,
+						       QB_RB_BCAST_EVICTED)) {
+			qb_util_log(LOG_WARNING,
+				    "ringbuffer %s: evicting lagging reader %d",
+				    rb->shared_hdr->hdr_path, i);
+			evicted++;
+		}
+	}
+	rb->read_pt_cache = _rb_bcast_read_pt_update(rb);
+	return evicted ? 0 : -ENOSPC;
+}
+
+/*
+ * Where this handle reads from: its own cursor for a broadcast reader.
+ */
+static uint32_t
+_rb_read_pt_get(struct qb_ringbuffer_s * rb)
+{
+	if (rb->bcast_reader >= 0) {
+		return _rb_bcast_reader_get(rb)->read_pt;
+	}
+	return rb->shared_hdr->read_pt;
+}
+
+/*
+ * The reader's read_pt, past any multi-producer reservations that were
+ * given up (see _rb_mp_recover()). Those are only dropped once commit_pt
+ * has moved on, until then their space can't be reserved again.
+ */
+static uint32_t
+_rb_reader_pt_get(struct qb_ringbuffer_s * rb)
+{
+	uint32_t read_pt = _rb_read_pt_get(rb);
+	uint32_t next_pt;
+	int32_t skipped = QB_FALSE;
+
+	if (rb->bcast_reader >= 0 || rb->slot_words) {
+		return read_pt;
+	}
+	while (QB_RB_CHUNK_MAGIC_GET(rb, read_pt) == QB_RB_CHUNK_MAGIC_PAD &&
+	       qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->commit_pt,
+				    QB_ATOMIC_ACQUIRE) != read_pt) {
+		next_pt = qb_rb_chunk_step(rb, read_pt);
+		QB_RB_CHUNK_MAGIC_SET(rb, read_pt, QB_RB_CHUNK_MAGIC_DEAD);
+		read_pt = next_pt;
+		skipped = QB_TRUE;
+	}
+	if (skipped) {
+		qb_atomic_int_set_ex((int32_t *)&rb->shared_hdr->read_pt,
+				     read_pt, QB_ATOMIC_RELEASE);
+		rb->read_pt_cache = read_pt;
+	}
+	return read_pt;
+}
+
+/*
+ * Fixed slot ringbuffers.
+ *
+ * A chunk is one slot of slot_words words without a header, and
+ * write_pt/read_pt count slots instead of words. They run from 0 to
+ * 2 * slot_count - 1 so that a full ringbuffer can be told apart from
+ * an empty one without giving up a slot.
+ */
+#define QB_RB_SLOT_SIZE(rb) ((rb)->slot_words * sizeof(uint32_t))
+#define QB_RB_SLOT_GET(rb, pointer) \
+	((void *)&(rb)->shared_data[((pointer) % (rb)->slot_count) * \
+				    (rb)->slot_words])
+
+static uint32_t
+_rb_slot_step(struct qb_ringbuffer_s * rb, uint32_t pointer, uint32_t n)
+{
+	return (pointer + n) % (rb->slot_count << 1);
+}
+
+static uint32_t
+_rb_slots_used(struct qb_ringbuffer_s * rb, uint32_t write_pt,
+	       uint32_t read_pt)
+{
+	return (write_pt - read_pt + (rb->slot_count << 1)) %
+		(rb->slot_count << 1);
+}
+
+/*
+ * The slots used as the reader sees them. An overwriting writer moves
+ * read_pt behind the reader's back (maybe right past its copy of
+ * write_pt), so the copy is only good enough without QB_RB_FLAG_OVERWRITE.
+ */
+static uint32_t
+_rb_slots_ready(struct qb_ringbuffer_s * rb, uint32_t read_pt)
+{
+	if (read_pt == rb->write_pt_cache ||
+	    (rb->flags & QB_RB_FLAG_OVERWRITE)) {
+		rb->write_pt_cache =
+			qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->write_pt,
+					     QB_ATOMIC_ACQUIRE);
+	}
+	return _rb_slots_used(rb, rb->write_pt_cache, read_pt);
+}
+
+/*
+ * ... and as the writer sees them, reloading read_pt when it looks full.
+ */
+static uint32_t
+_rb_slots_free(struct qb_ringbuffer_s * rb)
+{
+	uint32_t write_pt = rb->shared_hdr->write_pt;
+	uint32_t used = _rb_slots_used(rb, write_pt, rb->read_pt_cache);
+
+	if (used == rb->slot_count) {
+		rb->read_pt_cache =
+			qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->read_pt,
+					     QB_ATOMIC_ACQUIRE);
+		used = _rb_slots_used(rb, write_pt, rb->read_pt_cache);
+	}
+	return rb->slot_count - used;
+}
+
+static void *
+_rb_slot_alloc(struct qb_ringbuffer_s * rb, size_t len)
+{
+	if (len > QB_RB_SLOT_SIZE(rb)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (_rb_slots_free(rb) == 0) {
+		if ((rb->flags & QB_RB_FLAG_OVERWRITE) == 0) {
+			errno = EAGAIN;
+			return NULL;
+		}
+		/* drop the oldest slot */
+		rb->read_pt_cache = _rb_slot_step(rb, rb->read_pt_cache, 1);
+		qb_atomic_int_set_ex((int32_t *)&rb->shared_hdr->read_pt,
+				     rb->read_pt_cache, QB_ATOMIC_RELEASE);
+		if (rb->notifier.reclaim_fn) {
+			(void)rb->notifier.reclaim_fn(rb->notifier.instance,
+						      QB_RB_SLOT_SIZE(rb));
+		}
+	}
+	return QB_RB_SLOT_GET(rb, rb->shared_hdr->write_pt);
+}
+
+static int32_t
+_rb_slot_commit(struct qb_ringbuffer_s * rb, size_t len)
+{
+	rb->write_pt_cache = _rb_slot_step(rb, rb->shared_hdr->write_pt, 1);
+	qb_atomic_int_set_ex((int32_t *)&rb->shared_hdr->write_pt,
+			     rb->write_pt_cache, QB_ATOMIC_RELEASE);
+	if (rb->journal) {
+		qb_rb_journal_committed(rb, len);
+	}
+	if (rb->notifier.post_fn) {
+		return rb->notifier.post_fn(rb->notifier.instance, len);
+	}
+	return 0;
+}
+
+static int
+_rb_slot_reclaim_n(struct qb_ringbuffer_s * rb, size_t count)
+{
+	uint32_t read_pt = rb->shared_hdr->read_pt;
+	uint32_t n = QB_MIN(count, _rb_slots_ready(rb, read_pt));
+	uint32_t i;
+
+	if (n == 0) {
+		return -EINVAL;
+	}
+	if (rb->notifier.reclaim_fn) {
+		for (i = 0; i < n; i++) {
+			(void)rb->notifier.reclaim_fn(rb->notifier.instance,
+						      QB_RB_SLOT_SIZE(rb));
+		}
+	}
+	rb->read_pt_cache = _rb_slot_step(rb, read_pt, n);
+	qb_atomic_int_set_ex((int32_t *)&rb->shared_hdr->read_pt,
+			     rb->read_pt_cache, QB_ATOMIC_RELEASE);
+	if (rb->journal) {
+		qb_rb_journal_committed(rb, n * QB_RB_SLOT_SIZE(rb));
+	}
+	return (n == count) ? 0 : -EINVAL;
+}
+
+/*
+ * Is there a committed chunk at read_pt? Broadcast readers also have to
+ * check write_pt as chunks they have read keep their magic, and slots
+ * have no magic at all.
+ */
+static int32_t
+_rb_chunk_ready(struct qb_ringbuffer_s * rb, uint32_t read_pt)
+{
+	if (rb->slot_words) {
+		return _rb_slots_ready(rb, read_pt) > 0;
+	}
+	if (rb->bcast_reader >= 0 && read_pt == rb->write_pt_cache) {
+		rb->write_pt_cache =
+			qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->write_pt,
+					     QB_ATOMIC_ACQUIRE);
+		if (read_pt == rb->write_pt_cache) {
+			return QB_FALSE;
+		}
+	}
+	return QB_RB_CHUNK_MAGIC_GET(rb, read_pt) == QB_RB_CHUNK_MAGIC;
+}
+
+static uint32_t
+_rb_chunk_size_get(struct qb_ringbuffer_s * rb, uint32_t read_pt)
+{
+	if (rb->slot_words) {
+		return QB_RB_SLOT_SIZE(rb);
+	}
+	return QB_RB_CHUNK_SIZE_GET(rb, read_pt);
+}
+
+static void *
+_rb_chunk_data_get(struct qb_ringbuffer_s * rb, uint32_t read_pt)
+{
+	if (rb->slot_words) {
+		return QB_RB_SLOT_GET(rb, read_pt);
+	}
+	return QB_RB_CHUNK_DATA_GET(rb, read_pt);
+}
+
+/*
+ * Resizing.
+ *
+ * The writer swaps in a new data segment (a new file, the old one is
+ * unlinked) while the ringbuffer is empty and bumps the generation. The
+ * reader can't be looking at a chunk then, and it only sees the next one
+ * after the writer has posted it, so checking the generation once it has
+ * been woken up is enough to find the new segment in time.
+ */
+static int32_t
+_rb_empty(struct qb_ringbuffer_s * rb)
+{
+	uint32_t write_pt = rb->shared_hdr->write_pt;
+	uint32_t read_pt =
+		qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->read_pt,
+				     QB_ATOMIC_ACQUIRE);
+
+	if (rb->slot_words) {
+		return _rb_slots_used(rb, write_pt, read_pt) == 0;
+	}
+	if (write_pt != read_pt) {
+		return QB_FALSE;
+	}
+	/* equal pointers can mean full as well */
+	return !(rb->notifier.q_len_fn &&
+		 rb->notifier.q_len_fn(rb->notifier.instance) > 0);
+}
+
+/*
+ * Map the data segment of the current generation, if it isn't ours.
+ */
+static int32_t
+_rb_generation_check(struct qb_ringbuffer_s * rb)
+{
+	char data_path[PATH_MAX];
+	char path[PATH_MAX];
+	uint32_t word_size;
+	uint32_t slot_count;
+	int32_t generation;
+	void *shm_addr;
+	int32_t fd;
+	int32_t res;
+
+	generation = qb_atomic_int_get_ex(&rb->shared_hdr->generation,
+					  QB_ATOMIC_ACQUIRE);
+	if (generation == rb->generation) {
+		return 0;
+	}
+	do {
+		if (generation & 1) {
+			/* the writer is half way through */
+			return -EAGAIN;
+		}
+		(void)strlcpy(data_path, rb->shared_hdr->data_path, PATH_MAX);
+		word_size = rb->shared_hdr->word_size;
+		slot_count = rb->shared_hdr->slot_count;
+		res = generation;
+		generation = qb_atomic_int_get_ex(&rb->shared_hdr->generation,
+						  QB_ATOMIC_ACQUIRE);
+	} while (res != generation);
+
+	fd = qb_sys_mmap_file_open(path, data_path,
+				   word_size * sizeof(uint32_t), O_RDWR);
+	if (fd < 0) {
+		return fd;
+	}
+	/* this function closes fd */
+	res = qb_sys_circular_mmap_2(fd, &shm_addr,
+				     word_size * sizeof(uint32_t),
+				     (rb->flags & QB_RB_FLAG_PREFAULT) ?
+				     QB_SYS_MMAP_POPULATE : 0);
+	if (res != 0) {
+		return res;
+	}
+	munmap(rb->shared_data, (rb->word_size * sizeof(uint32_t)) << 1);
+	rb->shared_data = shm_addr;
+	rb->word_size = word_size;
+	rb->slot_count = slot_count;
+	rb->generation = generation;
+	rb->read_pt_cache = rb->shared_hdr->read_pt;
+	rb->write_pt_cache = rb->shared_hdr->write_pt;
+	qb_util_log(LOG_DEBUG, "ringbuffer %s resized to %zu bytes",
+		    rb->shared_hdr->hdr_path, word_size * sizeof(uint32_t));
+	return 1;
+}
+
+int32_t
+qb_rb_resize(struct qb_ringbuffer_s * rb, size_t size)
+{
+	char filename[PATH_MAX];
+	char old_path[PATH_MAX];
+	char path[PATH_MAX];
+	char suffix[32];
+	long page_size = sysconf(_SC_PAGESIZE);
+	uint32_t *old_data;
+	uint32_t old_word_size;
+	size_t real_size;
+	size_t len;
+	void *shm_addr;
+	int32_t fd;
+	int32_t res;
+
+	if (rb == NULL || size == 0) {
+		return -EINVAL;
+	}
+	if (rb->flags & (QB_RB_FLAG_MULTI_PRODUCER | QB_RB_FLAG_BROADCAST |
+			 QB_RB_FLAG_MEMFD | QB_RB_FLAG_HUGEPAGES |
+			 QB_RB_FLAG_JOURNAL | QB_RB_FLAG_READONLY)) {
+		return -ENOTSUP;
+	}
+#ifdef QB_FORCE_SHM_ALIGN
+	page_size = QB_MAX(page_size, 16 * 1024);
+#endif /* QB_FORCE_SHM_ALIGN */
+	if (rb->slot_words == 0) {
+		/* as in qb_rb_open_2() */
+		size += QB_RB_CHUNK_MARGIN + 1;
+	}
+	real_size = QB_ROUNDUP(size, page_size);
+	if (real_size == rb->word_size * sizeof(uint32_t)) {
+		return 0;
+	}
+	if (!_rb_empty(rb)) {
+		return -EAGAIN;
+	}
+
+	/* qb-NAME-data[-gen<N>] */
+	(void)strlcpy(filename, rb->shared_hdr->data_path, PATH_MAX);
+	snprintf(suffix, sizeof(suffix), "-gen%d", rb->generation);
+	len = strlen(filename);
+	if (rb->generation > 0 && len > strlen(suffix) &&
+	    strcmp(filename + len - strlen(suffix), suffix) == 0) {
+		filename[len - strlen(suffix)] = '\0';
+	}
+	snprintf(suffix, sizeof(suffix), "-gen%d", rb->generation + 2);
+	(void)strlcat(filename, suffix, PATH_MAX);
+
+	fd = qb_sys_mmap_file_open(path, filename, real_size,
+				   O_RDWR | O_CREAT | O_TRUNC);
+	if (fd < 0) {
+		return fd;
+	}
+	/* this function closes fd */
+	res = qb_sys_circular_mmap_2(fd, &shm_addr, real_size,
+				     (rb->flags & QB_RB_FLAG_PREFAULT) ?
+				     QB_SYS_MMAP_POPULATE : 0);
+	if (res != 0) {
+		unlink(path);
+		return res;
+	}
+
+	(void)strlcpy(old_path, rb->shared_hdr->data_path, PATH_MAX);
+	old_data = rb->shared_data;
+	old_word_size = rb->word_size;
+
+	qb_atomic_int_inc(&rb->shared_hdr->generation);
+	(void)strlcpy(rb->shared_hdr->data_path, path, PATH_MAX);
+	rb->shared_hdr->word_size = real_size / sizeof(uint32_t);
+	if (rb->slot_words) {
+		rb->shared_hdr->slot_count =
+			rb->shared_hdr->word_size / rb->slot_words;
+	}
+	rb->shared_hdr->write_pt = 0;
+	rb->shared_hdr->read_pt = 0;
+	rb->shared_hdr->commit_pt = 0;
+	qb_atomic_int_inc(&rb->shared_hdr->generation);
+
+	rb->shared_data = shm_addr;
+	rb->word_size = rb->shared_hdr->word_size;
+	rb->slot_count = rb->shared_hdr->slot_count;
+	rb->generation += 2;
+	rb->read_pt_cache = 0;
+	rb->write_pt_cache = 0;
+
+	munmap(old_data, (old_word_size * sizeof(uint32_t)) << 1);
+	unlink(old_path);
+	qb_util_log(LOG_DEBUG, "resized ringbuffer %s to %zu bytes",
+		    rb->shared_hdr->hdr_path, real_size);
+	return 0;
+}
+
+int32_t
+qb_rb_bcast_ready(struct qb_ringbuffer_s * rb)
+{
+	if (rb->bcast_reader < 0) {
+		return QB_FALSE;
+	}
+	if (_rb_bcast_evicted(rb)) {
+		/* let the caller find out */
+		return QB_TRUE;
+	}
+	return _rb_chunk_ready(rb, _rb_bcast_reader_get(rb)->read_pt);
+}
+
+/*
+ * A broadcast reader "reclaims" by moving its own cursor on.
+ */
+static int
+_rb_bcast_advance(struct qb_ringbuffer_s * rb, size_t count)
+{
+	struct qb_rb_bcast_reader *r = _rb_bcast_reader_get(rb);
+	uint32_t read_pt = r->read_pt;
+	size_t i;
+
+	if (_rb_bcast_evicted(rb)) {
+		return -EPIPE;
+	}
+	for (i = 0; i < count; i++) {
+		if (!_rb_chunk_ready(rb, read_pt)) {
+			break;
+		}
+		read_pt = _rb_chunk_step(rb, read_pt,
+					 QB_RB_CHUNK_SIZE_GET(rb, read_pt));
+	}
+	qb_atomic_int_set_ex((int32_t *)&r->read_pt, read_pt,
+			     QB_ATOMIC_RELEASE);
+	return (i == count) ? 0 : -EINVAL;
+}
+
+static uint32_t
+_rb_space_free_words(struct qb_ringbuffer_s * rb, uint32_t write_pt,
+		     uint32_t read_pt)
+{
+	if (write_pt > read_pt) {
+		return (read_pt - write_pt + rb->word_size) - 1;
+	} else if (write_pt < read_pt) {
+		return (read_pt - write_pt) - 1;
+	}
+	if (rb->notifier.q_len_fn &&
+	    rb->notifier.q_len_fn(rb->notifier.instance) > 0) {
+		return 0;
+	}
+	return rb->word_size;
+}
+
+/*
+ * The free space (in bytes) as the producer sees it. The producer's
+ * copy of read_pt is only reloaded when it doesn't leave room for
+ * "needed" bytes, so in the common case this doesn't touch the
+ * consumer's cache line at all.
+ */
+static size_t
+_rb_space_free_get(struct qb_ringbuffer_s * rb, size_t needed)
+{
+	uint32_t write_pt = rb->shared_hdr->write_pt;
+	size_t space_free;
+
+	if (rb->flags & QB_RB_FLAG_MULTI_PRODUCER) {
+		/* the writers share this struct, so there is no private copy */
+		return _rb_space_free_words(rb, write_pt,
+					    rb->shared_hdr->read_pt) *
+			sizeof(uint32_t);
+	}
+
+	space_free = _rb_space_free_words(rb, write_pt, rb->read_pt_cache) *
+		sizeof(uint32_t);
+	if (space_free < needed) {
+		if (rb->flags & QB_RB_FLAG_BROADCAST) {
+			rb->read_pt_cache = _rb_bcast_read_pt_update(rb);
 		} else {
-			space_free = rb->shared_hdr->word_size;
+			rb->read_pt_cache =
+				qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->read_pt,
+						     QB_ATOMIC_ACQUIRE);
 		}
+		space_free = _rb_space_free_words(rb, write_pt,
+						  rb->read_pt_cache) *
+			sizeof(uint32_t);
 	}
+	return space_free;
+}
 
-	/* word -> bytes */
-	return (space_free * sizeof(uint32_t));
+ssize_t
+qb_rb_space_free(struct qb_ringbuffer_s * rb)
+{
+	if (rb == NULL) {
+		return -EINVAL;
+	}
+	if (rb->slot_words) {
+		return _rb_slots_free(rb) * QB_RB_SLOT_SIZE(rb);
+	}
+	if (rb->notifier.space_used_fn) {
+		return (rb->word_size * sizeof(uint32_t)) -
+			rb->notifier.space_used_fn(rb->notifier.instance);
+	}
+	return _rb_space_free_get(rb, QB_RB_CHUNK_MARGIN +
+				  QB_RB_CHUNK_STAMP_SIZE(rb) + 1);
 }
 
 ssize_t
@@ -405,17 +1597,32 @@ qb_rb_space_used(struct qb_ringbuffer_s * rb)
 	if (rb == NULL) {
 		return -EINVAL;
 	}
+	if (rb->slot_words) {
+		return _rb_slots_ready(rb, rb->shared_hdr->read_pt) *
+			QB_RB_SLOT_SIZE(rb);
+	}
 	if (rb->notifier.space_used_fn) {
 		return rb->notifier.space_used_fn(rb->notifier.instance);
 	}
-	write_size = rb->shared_hdr->write_pt;
-	read_size = rb->shared_hdr->read_pt;
+	read_size = _rb_read_pt_get(rb);
+	if (read_size == rb->write_pt_cache ||
+	    (rb->flags & (QB_RB_FLAG_OVERWRITE | QB_RB_FLAG_MULTI_PRODUCER))) {
+		/*
+		 * Looks empty: see if the producer has moved on. Overwriting
+		 * producers move read_pt behind our back, so don't trust the
+		 * copy for those.
+		 */
+		rb->write_pt_cache =
+			qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->write_pt,
+					     QB_ATOMIC_ACQUIRE);
+	}
+	write_size = rb->write_pt_cache;
 
 	if (write_size > read_size) {
 		space_used = write_size - read_size;
 	} else if (write_size < read_size) {
 		space_used =
-		    (write_size - read_size + rb->shared_hdr->word_size) - 1;
+		    (write_size - read_size + rb->word_size) - 1;
 	} else {
 		space_used = 0;
 	}
@@ -432,90 +1639,563 @@ qb_rb_chunks_used(struct qb_ringbuffer_s *rb)
 	if (rb->notifier.q_len_fn) {
 		return rb->notifier.q_len_fn(rb->notifier.instance);
 	}
+	if (rb->slot_words) {
+		return _rb_slots_ready(rb, rb->shared_hdr->read_pt);
+	}
 	return -ENOTSUP;
 }
 
+/*
+ * QB_RB_FLAG_TIMESTAMPS
+ */
+static void
+_rb_chunk_stamp(struct qb_ringbuffer_s * rb, uint32_t pointer, uint64_t now)
+{
+	uint32_t word_size = rb->word_size;
+
+	rb->shared_data[(pointer + QB_RB_CHUNK_HEADER_WORDS) % word_size] =
+		(uint32_t)now;
+	rb->shared_data[(pointer + QB_RB_CHUNK_HEADER_WORDS + 1) % word_size] =
+		(uint32_t)(now >> 32);
+}
+
+static uint64_t
+_rb_chunk_stamp_get(struct qb_ringbuffer_s * rb, uint32_t pointer)
+{
+	uint32_t word_size = rb->word_size;
+
+	return rb->shared_data[(pointer + QB_RB_CHUNK_HEADER_WORDS) % word_size] |
+		((uint64_t)rb->shared_data[(pointer + QB_RB_CHUNK_HEADER_WORDS + 1) %
+					   word_size] << 32);
+}
+
+static uint32_t
+_rb_dwell_bucket(uint64_t ns)
+{
+	uint32_t msb;
+
+	if (ns < (1 << QB_RB_DWELL_SUB_BITS)) {
+		return ns;
+	}
+	msb = 63 - __builtin_clzll(ns);
+	return ((msb - QB_RB_DWELL_SUB_BITS + 1) << QB_RB_DWELL_SUB_BITS) +
+		((ns >> (msb - QB_RB_DWELL_SUB_BITS)) &
+		 ((1 << QB_RB_DWELL_SUB_BITS) - 1));
+}
+
+/* the smallest value that goes into bucket i */
+static uint64_t
+_rb_dwell_bucket_min(uint32_t i)
+{
+	uint32_t group = i >> QB_RB_DWELL_SUB_BITS;
+	uint64_t sub = i & ((1 << QB_RB_DWELL_SUB_BITS) - 1);
+
+	if (group == 0) {
+		return i;
+	}
+	return ((1 << QB_RB_DWELL_SUB_BITS) + sub) << (group - 1);
+}
+
+static void
+_rb_dwell_record(struct qb_ringbuffer_s * rb, uint32_t pointer, uint64_t now)
+{
+	uint64_t stamp = _rb_chunk_stamp_get(rb, pointer);
+	uint64_t dwell = (now > stamp) ? now - stamp : 0;
+
+	rb->shared_hdr->dwell_hist[_rb_dwell_bucket(dwell)]++;
+	if (dwell > rb->shared_hdr->dwell_max) {
+		rb->shared_hdr->dwell_max = dwell;
+	}
+}
+
+static uint64_t
+_rb_dwell_percentile(const uint64_t *hist, uint64_t total, uint32_t per_mille)
+{
+	uint64_t wanted = (total * per_mille + 999) / 1000;
+	uint64_t seen = 0;
+	uint32_t i;
+
+	for (i = 0; i < QB_RB_DWELL_BUCKETS - 1; i++) {
+		seen += hist[i];
+		if (seen >= wanted) {
+			break;
+		}
+	}
+	if (i == QB_RB_DWELL_BUCKETS - 1) {
+		return UINT64_MAX;
+	}
+	/* the top of the bucket */
+	return _rb_dwell_bucket_min(i + 1) - 1;
+}
+
+static int32_t
+_rb_dwell_stats_fill(struct qb_ringbuffer_shared_s *hdr,
+		     struct qb_rb_dwell_stats *stats)
+{
+	uint64_t hist[QB_RB_DWELL_BUCKETS];
+	uint32_t write_pt;
+	uint32_t read_pt;
+	int32_t chunks;
+	uint32_t i;
+
+	if (hdr->chunk_hdr_words == QB_RB_CHUNK_HEADER_WORDS ||
+	    hdr->slot_words) {
+		return -ENOTSUP;
+	}
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < QB_RB_DWELL_BUCKETS; i++) {
+		hist[i] = hdr->dwell_hist[i];
+		stats->count += hist[i];
+	}
+	if (stats->count) {
+		stats->p50_ns = _rb_dwell_percentile(hist, stats->count, 500);
+		stats->p99_ns = _rb_dwell_percentile(hist, stats->count, 990);
+		stats->p999_ns = _rb_dwell_percentile(hist, stats->count, 999);
+		/* the exact maximum beats the top of its bucket */
+		stats->max_ns = hdr->dwell_max;
+		stats->p50_ns = QB_MIN(stats->p50_ns, stats->max_ns);
+		stats->p99_ns = QB_MIN(stats->p99_ns, stats->max_ns);
+		stats->p999_ns = QB_MIN(stats->p999_ns, stats->max_ns);
+	}
+
+	read_pt = qb_atomic_int_get_ex((int32_t *)&hdr->read_pt,
+				       QB_ATOMIC_ACQUIRE);
+	write_pt = qb_atomic_int_get_ex((int32_t *)&hdr->write_pt,
+					QB_ATOMIC_ACQUIRE);
+	stats->bytes_used = ((write_pt - read_pt + hdr->word_size) %
+			     hdr->word_size) * sizeof(uint32_t);
+	/* the counters are read one by one, don't show a glitch */
+	chunks = hdr->chunks_committed - hdr->chunks_consumed -
+		hdr->chunks_dropped;
+	stats->chunks_used = QB_MAX(chunks, 0);
+	return 0;
+}
+
+int32_t
+qb_rb_dwell_stats_get(struct qb_ringbuffer_s * rb,
+		      struct qb_rb_dwell_stats *stats)
+{
+	if (rb == NULL || stats == NULL) {
+		return -EINVAL;
+	}
+	return _rb_dwell_stats_fill(rb->shared_hdr, stats);
+}
+
+int32_t
+qb_rb_dwell_stats_get_by_name(const char *name,
+			      struct qb_rb_dwell_stats *stats)
+{
+	struct qb_ringbuffer_shared_s *hdr;
+	char path[PATH_MAX];
+	int32_t fd = -1;
+	int32_t res;
+
+	if (name == NULL || stats == NULL) {
+		return -EINVAL;
+	}
+	/* the same places qb_rb_open() puts the header */
+	if (strchr(name, '/')) {
+		snprintf(path, PATH_MAX, "%s-header", name);
+		fd = open(path, O_RDONLY);
+	} else {
+#if defined(QB_LINUX) || defined(QB_CYGWIN)
+		snprintf(path, PATH_MAX, "/dev/shm/qb-%s-header", name);
+		fd = open(path, O_RDONLY);
+#endif
+		if (fd < 0) {
+			snprintf(path, PATH_MAX, LOCALSTATEDIR "/run/qb-%s-header",
+				 name);
+			fd = open(path, O_RDONLY);
+		}
+	}
+	if (fd < 0) {
+		return -errno;
+	}
+
+	hdr = mmap(0, sizeof(struct qb_ringbuffer_shared_s), PROT_READ,
+		   MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+	close(fd);
+	res = _rb_shared_hdr_check(hdr, name);
+	if (res == 0) {
+		res = _rb_dwell_stats_fill(hdr, stats);
+	}
+	munmap(hdr, sizeof(struct qb_ringbuffer_shared_s));
+	return res;
+}
+
 void *
 qb_rb_chunk_alloc(struct qb_ringbuffer_s * rb, size_t len)
 {
 	uint32_t write_pt;
+	size_t needed;
 
 	if (rb == NULL) {
 		errno = EINVAL;
 		return NULL;
 	}
+	if (rb->flags & QB_RB_FLAG_MULTI_PRODUCER) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	if (rb->flags & QB_RB_FLAG_READONLY) {
+		errno = EROFS;
+		return NULL;
+	}
+	if (rb->slot_words) {
+		return _rb_slot_alloc(rb, len);
+	}
 	/*
 	 * Reclaim data if we are over writing and we need space
 	 */
+	needed = len + QB_RB_CHUNK_MARGIN + QB_RB_CHUNK_STAMP_SIZE(rb);
 	if (rb->flags & QB_RB_FLAG_OVERWRITE) {
-		while (qb_rb_space_free(rb) < (len + QB_RB_CHUNK_MARGIN)) {
-			int rc = _rb_chunk_reclaim(rb);
-			if (rc != 0) {
-				errno = rc;
-				return NULL;
-			}
+		int rc = _rb_overwrite_reclaim(rb, needed);
+		if (rc != 0) {
+			errno = -rc;
+			return NULL;
+		}
+	} else {
+		if (_rb_space_free_get(rb, needed) < needed) {
+			errno = EAGAIN;
+			return NULL;
+		}
+	}
+
+	write_pt = rb->shared_hdr->write_pt;
+	/*
+	 * insert the chunk header
+	 */
+	rb->shared_data[write_pt] = 0;
+	QB_RB_CHUNK_MAGIC_SET(rb, write_pt, QB_RB_CHUNK_MAGIC_ALLOC);
+
+	/*
+	 * return a pointer to the beginning of the chunk data
+	 */
+	return (void *)QB_RB_CHUNK_DATA_GET(rb, write_pt);
+
+}
+
+ssize_t
+qb_rb_chunk_reserve(struct qb_ringbuffer_s * rb, size_t min_len,
+		    void **data_out)
+{
+	size_t overhead;
+	size_t space_free;
+	void *data;
+
+	if (rb == NULL || data_out == NULL) {
+		return -EINVAL;
+	}
+	data = qb_rb_chunk_alloc(rb, min_len);
+	if (data == NULL) {
+		return -errno;
+	}
+	*data_out = data;
+	if (rb->slot_words) {
+		return QB_RB_SLOT_SIZE(rb);
+	}
+
+	/*
+	 * the allocation made sure this much is free, so the cached
+	 * read_pt is only reloaded if it is too stale to show it
+	 */
+	overhead = QB_RB_CHUNK_MARGIN + QB_RB_CHUNK_STAMP_SIZE(rb);
+	space_free = _rb_space_free_get(rb, min_len + overhead);
+	if (space_free < min_len + overhead) {
+		return min_len;
+	}
+	return space_free - overhead;
+}
+
+/*
+ * QB_RB_FLAG_OVERWRITE: the writer reclaims without clearing the chunk
+ * headers, so the free space may still hold headers with a valid magic.
+ * Kill the one at the new write pointer before publishing it, the reader
+ * stops there. The chunk margin guarantees that it is free space.
+ */
+static void
+_rb_write_pt_seal(struct qb_ringbuffer_s * rb, uint32_t write_pt)
+{
+	if (rb->flags & QB_RB_FLAG_OVERWRITE) {
+		QB_RB_CHUNK_MAGIC_SET(rb, write_pt, QB_RB_CHUNK_MAGIC_DEAD);
+	}
+}
+
+static uint32_t
+_rb_chunk_step(struct qb_ringbuffer_s * rb, uint32_t pointer,
+	       uint32_t chunk_size)
+{
+	/*
+	 * skip over the chunk header
+	 */
+	pointer += rb->chunk_hdr_words;
+
+	/*
+	 * skip over the user's data.
+	 */
+	pointer += (chunk_size / sizeof(uint32_t));
+	/* make allowance for non-word sizes */
+	if ((chunk_size % (sizeof(uint32_t) * QB_RB_WORD_ALIGN)) != 0) {
+		pointer++;
+	}
+
+	idx_cache_line_step(pointer);
+	return pointer;
+}
+
+static uint32_t
+qb_rb_chunk_step(struct qb_ringbuffer_s * rb, uint32_t pointer)
+{
+	return _rb_chunk_step(rb, pointer, QB_RB_CHUNK_SIZE_GET(rb, pointer));
+}
+
+/*
+ * Copy into a chunk, with non-temporal stores for big copies when the
+ * handle asked for them. Those stores are weakly ordered, hence the
+ * fence before the chunk can be published.
+ */
+static void
+_rb_data_copy(struct qb_ringbuffer_s * rb, char *dest, const char *src,
+	      size_t len)
+{
+#ifdef __SSE2__
+	size_t head;
+
+	if ((rb->flags & QB_RB_FLAG_NT_STORES) && len >= QB_RB_NT_COPY_MIN) {
+		head = (16 - ((uintptr_t)dest & 15)) & 15;
+		memcpy(dest, src, head);
+		dest += head;
+		src += head;
+		len -= head;
+		for (; len >= 64; len -= 64, dest += 64, src += 64) {
+			_mm_stream_si128((__m128i *)dest,
+					 _mm_loadu_si128((const __m128i *)src));
+			_mm_stream_si128((__m128i *)(dest + 16),
+					 _mm_loadu_si128((const __m128i *)(src + 16)));
+			_mm_stream_si128((__m128i *)(dest + 32),
+					 _mm_loadu_si128((const __m128i *)(src + 32)));
+			_mm_stream_si128((__m128i *)(dest + 48),
+					 _mm_loadu_si128((const __m128i *)(src + 48)));
+		}
+		memcpy(dest, src, len);
+		_mm_sfence();
+		return;
+	}
+#endif /* __SSE2__ */
+	memcpy(dest, src, len);
+}
+
+static void
+_rb_iov_copy(struct qb_ringbuffer_s * rb, char *dest,
+	     const struct iovec *iov, size_t iov_len)
+{
+	size_t i;
+
+	for (i = 0; i < iov_len; i++) {
+		_rb_data_copy(rb, dest, iov[i].iov_base, iov[i].iov_len);
+		dest += iov[i].iov_len;
+	}
+}
+
+/*
+ * Multi producer writes.
+ *
+ * write_pt is the reservation pointer: a writer claims [write_pt, next)
+ * by moving write_pt forward with a compare-and-swap. commit_pt trails it
+ * and marks the oldest reservation that has not been published yet, so
+ * chunks become visible (and the reader is notified) in the same order
+ * they were reserved even if the writers finish out of order.
+ */
+static int32_t
+_rb_chunk_reserve_mp(struct qb_ringbuffer_s * rb, size_t len,
+		     uint32_t *reserved_pt)
+{
+	uint32_t write_pt;
+	uint32_t read_pt;
+	uint32_t next_pt;
+	uint32_t space_free;
+
+	do {
+		write_pt = qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->write_pt,
+						QB_ATOMIC_ACQUIRE);
+		read_pt = qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->read_pt,
+					       QB_ATOMIC_ACQUIRE);
+		if (write_pt >= read_pt) {
+			space_free = read_pt - write_pt +
+				rb->word_size - 1;
+		} else {
+			space_free = read_pt - write_pt - 1;
 		}
-	} else {
-		if (qb_rb_space_free(rb) < (len + QB_RB_CHUNK_MARGIN)) {
-			errno = EAGAIN;
-			return NULL;
+		if ((space_free * sizeof(uint32_t)) < (len + QB_RB_CHUNK_MARGIN)) {
+			return -EAGAIN;
 		}
-	}
+		next_pt = _rb_chunk_step(rb, write_pt, len);
+	} while (!qb_atomic_int_compare_and_exchange((volatile int32_t *)
+						     &rb->shared_hdr->write_pt,
+						     write_pt, next_pt));
 
-	write_pt = rb->shared_hdr->write_pt;
-	/*
-	 * insert the chunk header
-	 */
-	rb->shared_data[write_pt] = 0;
+	/* the size first, _rb_mp_recover() may have to step over it */
+	rb->shared_data[write_pt] = len;
 	QB_RB_CHUNK_MAGIC_SET(rb, write_pt, QB_RB_CHUNK_MAGIC_ALLOC);
+	*reserved_pt = write_pt;
+	return 0;
+}
+
+/*
+ * Get commit_pt past the reservation at "pt", which hasn't been
+ * published for too long: its writer died, or will find out it was too
+ * slow when its qb_rb_chunk_write() returns -ETIMEDOUT. The magic decides
+ * who gets it: the writer turns ALLOC into MAGIC, anybody else into PAD,
+ * and PAD chunks are stepped over by the reader (_rb_pad_skip()).
+ *
+ * A reservation whose header isn't stamped yet (its writer died right
+ * after claiming it) can't be stepped over, its size is unknown.
+ */
+static int32_t
+_rb_mp_recover(struct qb_ringbuffer_s * rb, uint32_t pt, int32_t expired)
+{
+	uint32_t magic = QB_RB_CHUNK_MAGIC_GET(rb, pt);
+
+	if (magic == QB_RB_CHUNK_MAGIC_ALLOC && expired &&
+	    qb_atomic_int_compare_and_exchange((volatile int32_t *)
+					       &rb->shared_data[(pt + 1) % rb->word_size],
+					       QB_RB_CHUNK_MAGIC_ALLOC,
+					       QB_RB_CHUNK_MAGIC_PAD)) {
+		qb_util_log(LOG_WARNING,
+			    "ringbuffer %s: dropping a chunk of %u bytes "
+			    "that was reserved but never committed",
+			    rb->shared_hdr->hdr_path, QB_RB_CHUNK_SIZE_GET(rb, pt));
+		magic = QB_RB_CHUNK_MAGIC_PAD;
+	}
+	if (magic != QB_RB_CHUNK_MAGIC_PAD &&
+	    !(magic == QB_RB_CHUNK_MAGIC && expired)) {
+		/* a published chunk only if its writer died publishing it */
+		return QB_FALSE;
+	}
+	/* whoever gets there first */
+	(void)qb_atomic_int_compare_and_exchange((volatile int32_t *)
+						 &rb->shared_hdr->commit_pt, pt,
+						 qb_rb_chunk_step(rb, pt));
+	return QB_TRUE;
+}
+
+static int32_t
+_rb_chunk_publish_mp(struct qb_ringbuffer_s * rb, uint32_t reserved_pt,
+		     size_t len)
+{
+	uint32_t spins = 0;
+	uint32_t commit_pt;
+	uint32_t last_pt;
+	uint64_t since = 0;
+	uint64_t now;
 
 	/*
-	 * return a pointer to the beginning of the chunk data
+	 * wait for the writers that reserved before us
 	 */
-	return (void *)QB_RB_CHUNK_DATA_GET(rb, write_pt);
+	last_pt = reserved_pt;
+	while ((commit_pt = qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->commit_pt,
+						 QB_ATOMIC_ACQUIRE)) != reserved_pt) {
+		if (++spins % QB_RB_MP_SPINS != 0) {
+			continue;
+		}
+		now = qb_util_nano_current_get();
+		if (commit_pt != last_pt) {
+			last_pt = commit_pt;
+			since = now;
+		}
+		if (_rb_mp_recover(rb, commit_pt,
+				   now - since > QB_RB_MP_ABANDON_NS)) {
+			since = now;
+		} else if (now - since > QB_RB_MP_ABANDON_NS) {
+			/*
+			 * Stuck behind a reservation we can't step over:
+			 * give ours up too rather than wait for good.
+			 */
+			if (_rb_mp_recover(rb, reserved_pt, QB_TRUE)) {
+				return -ETIMEDOUT;
+			}
+		}
+		sched_yield();
+	}
+	if (!qb_atomic_int_compare_and_exchange((volatile int32_t *)
+						&rb->shared_data[(reserved_pt + 1) % rb->word_size],
+						QB_RB_CHUNK_MAGIC_ALLOC,
+						QB_RB_CHUNK_MAGIC)) {
+		/* we took too long and were given up on */
+		return -ETIMEDOUT;
+	}
+	(void)qb_atomic_int_compare_and_exchange((volatile int32_t *)
+						 &rb->shared_hdr->commit_pt,
+						 reserved_pt,
+						 _rb_chunk_step(rb, reserved_pt, len));
+	if (rb->journal) {
+		qb_rb_journal_committed(rb, len);
+	}
 
+	if (rb->notifier.post_fn) {
+		return rb->notifier.post_fn(rb->notifier.instance, len);
+	}
+	return 0;
 }
 
-static uint32_t
-qb_rb_chunk_step(struct qb_ringbuffer_s * rb, uint32_t pointer)
+static ssize_t
+_rb_chunk_write_mp(struct qb_ringbuffer_s * rb, const void *data, size_t len)
 {
-	uint32_t chunk_size = QB_RB_CHUNK_SIZE_GET(rb, pointer);
-	/*
-	 * skip over the chunk header
-	 */
-	pointer += QB_RB_CHUNK_HEADER_WORDS;
+	uint32_t reserved_pt;
+	int32_t res;
 
-	/*
-	 * skip over the user's data.
-	 */
-	pointer += (chunk_size / sizeof(uint32_t));
-	/* make allowance for non-word sizes */
-	if ((chunk_size % (sizeof(uint32_t) * QB_RB_WORD_ALIGN)) != 0) {
-		pointer++;
+	res = _rb_chunk_reserve_mp(rb, len, &reserved_pt);
+	if (res < 0) {
+		return res;
 	}
 
-	idx_cache_line_step(pointer);
-	return pointer;
+	_rb_data_copy(rb, (char *)QB_RB_CHUNK_DATA_GET(rb, reserved_pt), data,
+		      len);
+
+	res = _rb_chunk_publish_mp(rb, reserved_pt, len);
+	if (res < 0) {
+		return res;
+	}
+	return len;
 }
 
 int32_t
 qb_rb_chunk_commit(struct qb_ringbuffer_s * rb, size_t len)
 {
 	uint32_t old_write_pt;
+	uint32_t write_pt;
 
 	if (rb == NULL) {
 		return -EINVAL;
 	}
+	if (rb->flags & QB_RB_FLAG_MULTI_PRODUCER) {
+		return -ENOTSUP;
+	}
+	if (rb->slot_words) {
+		return _rb_slot_commit(rb, len);
+	}
 	/*
 	 * commit the magic & chunk_size
 	 */
 	old_write_pt = rb->shared_hdr->write_pt;
 	rb->shared_data[old_write_pt] = len;
+	if (rb->chunk_hdr_words > QB_RB_CHUNK_HEADER_WORDS) {
+		_rb_chunk_stamp(rb, old_write_pt, qb_util_nano_current_get());
+		rb->shared_hdr->chunks_committed++;
+	}
 
 	/*
 	 * commit the new write pointer
 	 */
-	rb->shared_hdr->write_pt = qb_rb_chunk_step(rb, old_write_pt);
+	write_pt = qb_rb_chunk_step(rb, old_write_pt);
+	_rb_write_pt_seal(rb, write_pt);
+	rb->shared_hdr->write_pt = write_pt;
+	rb->write_pt_cache = write_pt;
 	QB_RB_CHUNK_MAGIC_SET(rb, old_write_pt, QB_RB_CHUNK_MAGIC);
 
 	DEBUG_PRINTF("commit [%zd] read: %u, write: %u -> %u (%u)\n",
@@ -526,6 +2206,10 @@ qb_rb_chunk_commit(struct qb_ringbuffer_s * rb, size_t len)
 		     rb->shared_hdr->write_pt,
 		     rb->shared_hdr->word_size);
 
+	if (rb->journal) {
+		qb_rb_journal_committed(rb, len);
+	}
+
 	/*
 	 * post the notification to the reader
 	 */
@@ -535,88 +2219,503 @@ qb_rb_chunk_commit(struct qb_ringbuffer_s * rb, size_t len)
 	return 0;
 }
 
+ssize_t
+qb_rb_chunk_alloc_batch(struct qb_ringbuffer_s * rb, struct iovec *chunks,
+			size_t count)
+{
+	uint32_t write_pt;
+	size_t needed;
+	size_t n;
+
+	if (rb == NULL || chunks == NULL || count == 0) {
+		return -EINVAL;
+	}
+	if (rb->flags & QB_RB_FLAG_MULTI_PRODUCER || rb->slot_words) {
+		return -ENOTSUP;
+	}
+	if (rb->flags & QB_RB_FLAG_READONLY) {
+		return -EROFS;
+	}
+
+	needed = QB_RB_CHUNK_MARGIN + QB_RB_CHUNK_STAMP_SIZE(rb);
+	write_pt = rb->shared_hdr->write_pt;
+	for (n = 0; n < count; n++) {
+		needed += QB_RB_CHUNK_HEADER_SIZE + QB_RB_CHUNK_STAMP_SIZE(rb) +
+			QB_ROUNDUP(chunks[n].iov_len, sizeof(uint32_t));
+		if (rb->flags & QB_RB_FLAG_OVERWRITE) {
+			if (needed > (rb->word_size - 1) *
+			    sizeof(uint32_t)) {
+				break;
+			}
+			if (_rb_overwrite_reclaim(rb, needed) != 0) {
+				return -EINVAL;
+			}
+		} else if (_rb_space_free_get(rb, needed) < needed) {
+			break;
+		}
+
+		rb->shared_data[write_pt] = 0;
+		QB_RB_CHUNK_MAGIC_SET(rb, write_pt, QB_RB_CHUNK_MAGIC_ALLOC);
+		chunks[n].iov_base = QB_RB_CHUNK_DATA_GET(rb, write_pt);
+		write_pt = _rb_chunk_step(rb, write_pt, chunks[n].iov_len);
+	}
+	if (n == 0) {
+		return -EAGAIN;
+	}
+	return n;
+}
+
+int32_t
+qb_rb_chunk_commit_batch(struct qb_ringbuffer_s * rb,
+			 const struct iovec *chunks, size_t count)
+{
+	uint32_t old_write_pt;
+	uint32_t write_pt;
+	uint64_t now = 0;
+	size_t total = 0;
+	size_t i;
+	int32_t res;
+
+	if (rb == NULL || chunks == NULL) {
+		return -EINVAL;
+	}
+	if (rb->flags & QB_RB_FLAG_MULTI_PRODUCER || rb->slot_words) {
+		return -ENOTSUP;
+	}
+	if (count == 0) {
+		return 0;
+	}
+
+	/*
+	 * fill in the chunk sizes, then publish the whole batch with one
+	 * write pointer update
+	 */
+	if (rb->chunk_hdr_words > QB_RB_CHUNK_HEADER_WORDS) {
+		now = qb_util_nano_current_get();
+		rb->shared_hdr->chunks_committed += count;
+	}
+	old_write_pt = rb->shared_hdr->write_pt;
+	write_pt = old_write_pt;
+	for (i = 0; i < count; i++) {
+		rb->shared_data[write_pt] = chunks[i].iov_len;
+		if (rb->chunk_hdr_words > QB_RB_CHUNK_HEADER_WORDS) {
+			_rb_chunk_stamp(rb, write_pt, now);
+		}
+		total += chunks[i].iov_len;
+		write_pt = qb_rb_chunk_step(rb, write_pt);
+	}
+	_rb_write_pt_seal(rb, write_pt);
+	rb->shared_hdr->write_pt = write_pt;
+	rb->write_pt_cache = write_pt;
+
+	write_pt = old_write_pt;
+	for (i = 0; i < count; i++) {
+		QB_RB_CHUNK_MAGIC_SET(rb, write_pt, QB_RB_CHUNK_MAGIC);
+		write_pt = qb_rb_chunk_step(rb, write_pt);
+	}
+	if (rb->journal) {
+		qb_rb_journal_committed(rb, total);
+	}
+
+	/*
+	 * and tell the reader about all of it at once
+	 */
+	if (rb->notifier.post_batch_fn) {
+		return rb->notifier.post_batch_fn(rb->notifier.instance,
+						  count, total);
+	}
+	if (rb->notifier.post_fn) {
+		for (i = 0; i < count; i++) {
+			res = rb->notifier.post_fn(rb->notifier.instance,
+						   chunks[i].iov_len);
+			if (res < 0) {
+				return res;
+			}
+		}
+	}
+	return 0;
+}
+
 ssize_t
 qb_rb_chunk_write(struct qb_ringbuffer_s * rb, const void *data, size_t len)
 {
-	char *dest = qb_rb_chunk_alloc(rb, len);
+	char *dest;
 	int32_t res = 0;
 
 	if (rb == NULL) {
 		return -EINVAL;
 	}
+	if (rb->flags & QB_RB_FLAG_MULTI_PRODUCER) {
+		return _rb_chunk_write_mp(rb, data, len);
+	}
+
+	dest = qb_rb_chunk_alloc(rb, len);
 
 	if (dest == NULL) {
 		return -errno;
 	}
 
-	memcpy(dest, data, len);
+	_rb_data_copy(rb, dest, data, len);
+
+	res = qb_rb_chunk_commit(rb, len);
+	if (res < 0) {
+		return res;
+	}
+
+	return len;
+}
+
+ssize_t
+qb_rb_chunk_writev(struct qb_ringbuffer_s * rb, const struct iovec *iov,
+		   size_t iov_len)
+{
+	uint32_t reserved_pt;
+	size_t total = 0;
+	size_t i;
+	char *dest;
+	int32_t res;
+
+	if (rb == NULL || (iov == NULL && iov_len > 0)) {
+		return -EINVAL;
+	}
+	for (i = 0; i < iov_len; i++) {
+		total += iov[i].iov_len;
+	}
+
+	if (rb->flags & QB_RB_FLAG_MULTI_PRODUCER) {
+		res = _rb_chunk_reserve_mp(rb, total, &reserved_pt);
+		if (res < 0) {
+			return res;
+		}
+		_rb_iov_copy(rb, (char *)QB_RB_CHUNK_DATA_GET(rb, reserved_pt),
+			     iov, iov_len);
+		res = _rb_chunk_publish_mp(rb, reserved_pt, total);
+	} else {
+		dest = qb_rb_chunk_alloc(rb, total);
+		if (dest == NULL) {
+			return -errno;
+		}
+		_rb_iov_copy(rb, dest, iov, iov_len);
+		res = qb_rb_chunk_commit(rb, total);
+	}
+	if (res < 0) {
+		return res;
+	}
+	return total;
+}
+
+/*
+ * Reclaim the "count" oldest chunks, clearing their headers on the way
+ * and publishing the new read pointer once at the end.
+ */
+static int
+_rb_chunk_reclaim_n(struct qb_ringbuffer_s * rb, size_t count)
+{
+	uint32_t old_read_pt;
+	uint32_t read_pt;
+	uint32_t new_read_pt;
+	uint32_t old_chunk_size;
+	uint32_t chunk_magic;
+	uint64_t now = 0;
+	int32_t stamped = (rb->chunk_hdr_words > QB_RB_CHUNK_HEADER_WORDS);
+	size_t freed = 0;
+	size_t i;
+	int rc = 0;
+
+	if (rb->bcast_reader >= 0) {
+		return _rb_bcast_advance(rb, count);
+	}
+	if (rb->slot_words) {
+		return _rb_slot_reclaim_n(rb, count);
+	}
+
+	if (stamped) {
+		now = qb_util_nano_current_get();
+	}
+	old_read_pt = rb->shared_hdr->read_pt;
+	read_pt = old_read_pt;
+	for (i = 0; i < count; i++) {
+		chunk_magic = QB_RB_CHUNK_MAGIC_GET(rb, read_pt);
+		if (chunk_magic != QB_RB_CHUNK_MAGIC) {
+			rc = -EINVAL;
+			break;
+		}
+
+		old_chunk_size = QB_RB_CHUNK_SIZE_GET(rb, read_pt);
+		new_read_pt = qb_rb_chunk_step(rb, read_pt);
+		if (stamped) {
+			_rb_dwell_record(rb, read_pt, now);
+		}
+
+		/*
+		 * clear the header; a journal keeps the size so that
+		 * _rb_journal_reopen() can step over chunks consumed after
+		 * the last flush.
+		 */
+		if (rb->journal == NULL) {
+			rb->shared_data[read_pt] = 0;
+		}
+		QB_RB_CHUNK_MAGIC_SET(rb, read_pt, QB_RB_CHUNK_MAGIC_DEAD);
+		freed += QB_RB_CHUNK_HEADER_SIZE + old_chunk_size;
+
+		/*
+		 * Keep the private copies from falling behind the index they
+		 * are compared with: write_pt can't be behind a chunk we just
+		 * consumed.
+		 */
+		if (rb->write_pt_cache == read_pt) {
+			rb->write_pt_cache = new_read_pt;
+		}
+
+		if (rb->notifier.reclaim_fn) {
+			int32_t res = rb->notifier.reclaim_fn(rb->notifier.instance,
+							      old_chunk_size);
+			if (res < 0) {
+				errno = -res;
+				qb_util_perror(LOG_WARNING, "reclaim_fn");
+				rc = res;
+			}
+		}
+		read_pt = new_read_pt;
+	}
+	if (i == 0) {
+		return rc;
+	}
+
+	/*
+	 * set the new read pointer after clearing the headers
+	 * to prevent a situation where a fast writer will write their
+	 * new chunk between setting the new read pointer and clearing the
+	 * header.
+	 */
+	rb->shared_hdr->read_pt = read_pt;
+	rb->read_pt_cache = read_pt;
+	if (stamped) {
+		rb->shared_hdr->chunks_consumed += i;
+	}
+	if (rb->journal) {
+		/* the new read_pt has to be flushed too */
+		qb_rb_journal_committed(rb, freed);
+	}
+
+	DEBUG_PRINTF("reclaim [%zd]: read: %u -> %u, write: %u\n",
+		     (rb->notifier.q_len_fn ?
+		      rb->notifier.q_len_fn(rb->notifier.instance) : 0),
+		     old_read_pt,
+		     rb->shared_hdr->read_pt,
+		     rb->shared_hdr->write_pt);
+
+	return rc;
+}
+
+static int
+_rb_chunk_reclaim(struct qb_ringbuffer_s * rb)
+{
+	return _rb_chunk_reclaim_n(rb, 1);
+}
+
+/*
+ * Make room for "needed" bytes for an overwriting writer.
+ *
+ * The oldest chunks are dropped in one pass that only follows their size
+ * words: their headers are left as they are (_rb_write_pt_seal() keeps
+ * the reader from running into a stale one) and read_pt is published
+ * once at the end, so a big chunk costs one walk over the small chunks
+ * it replaces rather than a header update and a shared read_pt store
+ * per chunk.
+ */
+static int
+_rb_overwrite_reclaim(struct qb_ringbuffer_s * rb, size_t needed)
+{
+	uint32_t write_pt;
+	uint32_t read_pt;
+	uint32_t old_chunk_size;
+	uint32_t free_words;
+	int rc;
+
+	if (_rb_space_free_get(rb, needed) >= needed) {
+		return 0;
+	}
+	if (rb->flags & QB_RB_FLAG_BROADCAST) {
+		do {
+			rc = _rb_bcast_evict(rb);
+		} while (rc == 0 && _rb_space_free_get(rb, needed) < needed);
+		return rc;
+	}
+
+	write_pt = rb->shared_hdr->write_pt;
+	read_pt = rb->shared_hdr->read_pt;
+	free_words = _rb_space_free_words(rb, write_pt, read_pt);
+	while (free_words * sizeof(uint32_t) < needed) {
+		if (read_pt == write_pt ||
+		    QB_RB_CHUNK_MAGIC_GET(rb, read_pt) != QB_RB_CHUNK_MAGIC) {
+			/* it doesn't fit even in an empty ringbuffer */
+			return -EINVAL;
+		}
+		old_chunk_size = QB_RB_CHUNK_SIZE_GET(rb, read_pt);
+		read_pt = _rb_chunk_step(rb, read_pt, old_chunk_size);
+		if (rb->notifier.reclaim_fn) {
+			(void)rb->notifier.reclaim_fn(rb->notifier.instance,
+						      old_chunk_size);
+		}
+		if (rb->chunk_hdr_words > QB_RB_CHUNK_HEADER_WORDS) {
+			rb->shared_hdr->chunks_dropped++;
+		}
+		if (read_pt == write_pt) {
+			free_words = rb->word_size;
+		} else {
+			free_words = _rb_space_free_words(rb, write_pt,
+							  read_pt);
+		}
+	}
+
+	qb_atomic_int_set_ex((int32_t *)&rb->shared_hdr->read_pt, read_pt,
+			     QB_ATOMIC_RELEASE);
+	rb->read_pt_cache = read_pt;
+	return 0;
+}
+
+void
+qb_rb_chunk_reclaim(struct qb_ringbuffer_s * rb)
+{
+	if (rb == NULL) {
+		return;
+	}
+	_rb_chunk_reclaim(rb);
+}
+
+int32_t
+qb_rb_chunk_reclaim_batch(struct qb_ringbuffer_s * rb, size_t count)
+{
+	if (rb == NULL) {
+		return -EINVAL;
+	}
+	return _rb_chunk_reclaim_n(rb, count);
+}
+
+static inline void
+_rb_cpu_relax(void)
+{
+#ifdef __SSE2__
+	_mm_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield" ::: "memory");
+#endif /* __SSE2__ */
+}
+
+/*
+ * Is there anything for a reader to look at? A resize or an eviction
+ * counts, the read functions have to deal with those.
+ */
+static int32_t
+_rb_busy_poll_ready(struct qb_ringbuffer_s * rb)
+{
+	if (qb_atomic_int_get(&rb->shared_hdr->generation) != rb->generation ||
+	    _rb_bcast_evicted(rb)) {
+		return QB_TRUE;
+	}
+	return _rb_chunk_ready(rb, _rb_reader_pt_get(rb));
+}
+
+/*
+ * Spin for up to the current budget and adapt it to how that went.
+ */
+static int32_t
+_rb_busy_poll(struct qb_ringbuffer_s * rb)
+{
+	uint64_t start;
+	uint64_t now;
+	uint32_t spins = 0;
+	int32_t ready;
+
+	if (_rb_busy_poll_ready(rb)) {
+		/* no need to spin */
+		return QB_TRUE;
+	}
+	start = qb_util_nano_current_get();
+	do {
+		_rb_cpu_relax();
+		ready = _rb_busy_poll_ready(rb);
+		if (++spins % QB_RB_BUSY_POLL_CLOCK_SPINS == 0 || ready) {
+			now = qb_util_nano_current_get();
+		} else {
+			now = start;
+		}
+	} while (!ready && now - start < rb->busy_poll.budget_ns);
+
+	rb->busy_poll.spins++;
+	rb->busy_poll.spin_ns += now - start;
+	if (ready) {
+		rb->busy_poll.spin_hits++;
+		rb->busy_poll.budget_ns = QB_MIN(rb->busy_poll.budget_ns * 2,
+						 rb->busy_poll_max_ns);
+	} else {
+		rb->busy_poll.budget_ns = QB_MAX(rb->busy_poll.budget_ns / 2,
+						 rb->busy_poll_max_ns / 16);
+	}
+	return ready;
+}
+
+/*
+ * Wait for the notifier, after a spin if busy polling is on.
+ */
+static int32_t
+_rb_timedwait(struct qb_ringbuffer_s * rb, int32_t timeout)
+{
+	uint64_t start;
+	int32_t res;
 
-	res = qb_rb_chunk_commit(rb, len);
-	if (res < 0) {
-		return res;
+	if (rb->notifier.timedwait_fn == NULL) {
+		return 0;
 	}
-
-	return len;
+	if (rb->busy_poll_max_ns == 0 || timeout == 0 || _rb_busy_poll(rb)) {
+		return rb->notifier.timedwait_fn(rb->notifier.instance,
+						 timeout);
+	}
+	start = qb_util_nano_current_get();
+	res = rb->notifier.timedwait_fn(rb->notifier.instance, timeout);
+	rb->busy_poll.sleeps++;
+	rb->busy_poll.sleep_ns += qb_util_nano_current_get() - start;
+	return res;
 }
 
-static int
-_rb_chunk_reclaim(struct qb_ringbuffer_s * rb)
+int32_t
+qb_rb_busy_poll_set(struct qb_ringbuffer_s * rb, uint32_t usecs)
 {
-	uint32_t old_read_pt;
-	uint32_t new_read_pt;
-	uint32_t old_chunk_size;
-	uint32_t chunk_magic;
-	int rc = 0;
-
-	old_read_pt = rb->shared_hdr->read_pt;
-	chunk_magic = QB_RB_CHUNK_MAGIC_GET(rb, old_read_pt);
-	if (chunk_magic != QB_RB_CHUNK_MAGIC) {
+	if (rb == NULL || usecs > QB_TIME_US_IN_SEC) {
 		return -EINVAL;
 	}
-
-	old_chunk_size = QB_RB_CHUNK_SIZE_GET(rb, old_read_pt);
-	new_read_pt = qb_rb_chunk_step(rb, old_read_pt);
-
-	/*
-	 * clear the header
-	 */
-	rb->shared_data[old_read_pt] = 0;
-	QB_RB_CHUNK_MAGIC_SET(rb, old_read_pt, QB_RB_CHUNK_MAGIC_DEAD);
-
-	/*
-	 * set the new read pointer after clearing the header
-	 * to prevent a situation where a fast writer will write their
-	 * new chunk between setting the new read pointer and clearing the
-	 * header.
-	 */
-	rb->shared_hdr->read_pt = new_read_pt;
-
-	if (rb->notifier.reclaim_fn) {
-		rc = rb->notifier.reclaim_fn(rb->notifier.instance,
-						 old_chunk_size);
-		if (rc < 0) {
-			errno = -rc;
-			qb_util_perror(LOG_WARNING, "reclaim_fn");
-		}
+	if (usecs > 0 && sysconf(_SC_NPROCESSORS_ONLN) == 1) {
+		/* the writer can't run while we spin */
+		qb_util_log(LOG_DEBUG, "no busy polling on a single cpu");
+		usecs = 0;
 	}
-
-	DEBUG_PRINTF("reclaim [%zd]: read: %u -> %u, write: %u\n",
-		     (rb->notifier.q_len_fn ?
-		      rb->notifier.q_len_fn(rb->notifier.instance) : 0),
-		     old_read_pt,
-		     rb->shared_hdr->read_pt,
-		     rb->shared_hdr->write_pt);
-
-	return rc;
+	rb->busy_poll_max_ns = usecs * QB_TIME_NS_IN_USEC;
+	rb->busy_poll.budget_ns = rb->busy_poll_max_ns;
+	return 0;
 }
 
-void
-qb_rb_chunk_reclaim(struct qb_ringbuffer_s * rb)
+int32_t
+qb_rb_busy_poll(struct qb_ringbuffer_s * rb)
 {
 	if (rb == NULL) {
-		return;
+		return -EINVAL;
 	}
-	_rb_chunk_reclaim(rb);
+	if (rb->busy_poll_max_ns == 0) {
+		return QB_FALSE;
+	}
+	return _rb_busy_poll(rb);
+}
+
+int32_t
+qb_rb_busy_poll_stats_get(struct qb_ringbuffer_s * rb,
+			  struct qb_rb_busy_poll_stats *stats)
+{
+	if (rb == NULL || stats == NULL) {
+		return -EINVAL;
+	}
+	memcpy(stats, &rb->busy_poll, sizeof(*stats));
+	return 0;
 }
 
 ssize_t
@@ -624,15 +2723,12 @@ qb_rb_chunk_peek(struct qb_ringbuffer_s * rb, void **data_out, int32_t timeout)
 {
 	uint32_t read_pt;
 	uint32_t chunk_size;
-	uint32_t chunk_magic;
 	int32_t res = 0;
 
 	if (rb == NULL) {
 		return -EINVAL;
 	}
-	if (rb->notifier.timedwait_fn) {
-		res = rb->notifier.timedwait_fn(rb->notifier.instance, timeout);
-	}
+	res = _rb_timedwait(rb, timeout);
 	if (res < 0 && res != -EIDRM) {
 		if (res == -ETIMEDOUT) {
 			return 0;
@@ -642,34 +2738,102 @@ qb_rb_chunk_peek(struct qb_ringbuffer_s * rb, void **data_out, int32_t timeout)
 		}
 		return res;
 	}
-	read_pt = rb->shared_hdr->read_pt;
-	chunk_magic = QB_RB_CHUNK_MAGIC_GET(rb, read_pt);
-	if (chunk_magic != QB_RB_CHUNK_MAGIC) {
+	if (_rb_bcast_evicted(rb)) {
+		return -EPIPE;
+	}
+	/* if this fails we look at the old segment, which is empty */
+	(void)_rb_generation_check(rb);
+	read_pt = _rb_reader_pt_get(rb);
+	if (!_rb_chunk_ready(rb, read_pt)) {
 		if (rb->notifier.post_fn) {
 			(void)rb->notifier.post_fn(rb->notifier.instance, res);
 		}
 		return 0;
 	}
-	chunk_size = QB_RB_CHUNK_SIZE_GET(rb, read_pt);
-	*data_out = QB_RB_CHUNK_DATA_GET(rb, read_pt);
+	chunk_size = _rb_chunk_size_get(rb, read_pt);
+	*data_out = _rb_chunk_data_get(rb, read_pt);
 	return chunk_size;
 }
 
+ssize_t
+qb_rb_chunk_peek_batch(struct qb_ringbuffer_s * rb, struct iovec *chunks,
+		       size_t max_chunks, int32_t timeout)
+{
+	uint32_t read_pt;
+	size_t n;
+	int32_t res = 0;
+
+	if (rb == NULL || chunks == NULL || max_chunks == 0) {
+		return -EINVAL;
+	}
+	res = _rb_timedwait(rb, timeout);
+	if (res < 0 && res != -EIDRM) {
+		if (res == -ETIMEDOUT) {
+			return 0;
+		} else {
+			errno = -res;
+			qb_util_perror(LOG_ERR, "sem_timedwait");
+		}
+		return res;
+	}
+
+	if (_rb_bcast_evicted(rb)) {
+		return -EPIPE;
+	}
+	(void)_rb_generation_check(rb);
+	if (rb->flags & (QB_RB_FLAG_OVERWRITE | QB_RB_FLAG_MULTI_PRODUCER)) {
+		rb->write_pt_cache =
+			qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->write_pt,
+					     QB_ATOMIC_ACQUIRE);
+	}
+	read_pt = _rb_reader_pt_get(rb);
+	for (n = 0; n < max_chunks; n++) {
+		if (read_pt == rb->write_pt_cache) {
+			rb->write_pt_cache =
+				qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->write_pt,
+						     QB_ATOMIC_ACQUIRE);
+			if (read_pt == rb->write_pt_cache) {
+				break;
+			}
+		}
+		if (!_rb_chunk_ready(rb, read_pt)) {
+			break;
+		}
+		/*
+		 * we waited for the first chunk above, the others must
+		 * have been posted as well before we hand them out.
+		 */
+		if (n > 0 && rb->notifier.timedwait_fn &&
+		    rb->notifier.timedwait_fn(rb->notifier.instance, 0) < 0) {
+			break;
+		}
+		chunks[n].iov_base = _rb_chunk_data_get(rb, read_pt);
+		chunks[n].iov_len = _rb_chunk_size_get(rb, read_pt);
+		if (rb->slot_words) {
+			read_pt = _rb_slot_step(rb, read_pt, 1);
+		} else {
+			read_pt = qb_rb_chunk_step(rb, read_pt);
+		}
+	}
+
+	if (n == 0 && rb->notifier.post_fn) {
+		(void)rb->notifier.post_fn(rb->notifier.instance, res);
+	}
+	return n;
+}
+
 ssize_t
 qb_rb_chunk_read(struct qb_ringbuffer_s * rb, void *data_out, size_t len,
 		 int32_t timeout)
 {
 	uint32_t read_pt;
 	uint32_t chunk_size;
-	uint32_t chunk_magic;
 	int32_t res = 0;
 
 	if (rb == NULL) {
 		return -EINVAL;
 	}
-	if (rb->notifier.timedwait_fn) {
-		res = rb->notifier.timedwait_fn(rb->notifier.instance, timeout);
-	}
+	res = _rb_timedwait(rb, timeout);
 	if (res < 0 && res != -EIDRM) {
 		if (res != -ETIMEDOUT) {
 			errno = -res;
@@ -678,10 +2842,13 @@ qb_rb_chunk_read(struct qb_ringbuffer_s * rb, void *data_out, size_t len,
 		return res;
 	}
 
-	read_pt = rb->shared_hdr->read_pt;
-	chunk_magic = QB_RB_CHUNK_MAGIC_GET(rb, read_pt);
+	if (_rb_bcast_evicted(rb)) {
+		return -EPIPE;
+	}
+	(void)_rb_generation_check(rb);
+	read_pt = _rb_reader_pt_get(rb);
 
-	if (chunk_magic != QB_RB_CHUNK_MAGIC) {
+	if (!_rb_chunk_ready(rb, read_pt)) {
 		if (rb->notifier.timedwait_fn == NULL) {
 			return -ETIMEDOUT;
 		} else {
@@ -694,7 +2861,7 @@ qb_rb_chunk_read(struct qb_ringbuffer_s * rb, void *data_out, size_t len,
 		}
 	}
 
-	chunk_size = QB_RB_CHUNK_SIZE_GET(rb, read_pt);
+	chunk_size = _rb_chunk_size_get(rb, read_pt);
 	if (len < chunk_size) {
 		qb_util_log(LOG_ERR,
 			    "trying to recv chunk of size %d but %d available",
@@ -705,15 +2872,38 @@ qb_rb_chunk_read(struct qb_ringbuffer_s * rb, void *data_out, size_t len,
 		return -ENOBUFS;
 	}
 
-	memcpy(data_out,
-	       QB_RB_CHUNK_DATA_GET(rb, read_pt),
-	       chunk_size);
+	memcpy(data_out, _rb_chunk_data_get(rb, read_pt), chunk_size);
 
-	_rb_chunk_reclaim(rb);
+	if (_rb_chunk_reclaim(rb) == -EPIPE) {
+		/* evicted while copying, the data may have been overwritten */
+		return -EPIPE;
+	}
 
 	return chunk_size;
 }
 
+/*
+ * The magic comes first: a version 1 header has write_pt there (and
+ * read_pt where the version is), so the version alone can't tell.
+ */
+static int32_t
+_rb_shared_hdr_check(struct qb_ringbuffer_shared_s *hdr, const char *name)
+{
+	if (hdr->magic != QB_RB_SHARED_HDR_MAGIC) {
+		qb_util_log(LOG_ERR,
+			    "ringbuffer %s was created by an older libqb "
+			    "(or isn't a ringbuffer)", name);
+		return -EPROTO;
+	}
+	if (hdr->version != QB_RB_SHARED_HDR_VERSION) {
+		qb_util_log(LOG_ERR,
+			    "ringbuffer %s has header version %u, expected %u",
+			    name, hdr->version, QB_RB_SHARED_HDR_VERSION);
+		return -EPROTO;
+	}
+	return 0;
+}
+
 static void
 print_header(struct qb_ringbuffer_s * rb)
 {
@@ -740,20 +2930,80 @@ print_header(struct qb_ringbuffer_s * rb)
  * 4. version
  * 5. header_hash
  *
- * 6. data
+ * 6. data (version 1: right after the header, version 2: at
+ *    QB_RB_FILE_DATA_OFFSET)
  */
 
-ssize_t
-qb_rb_write_to_file(struct qb_ringbuffer_s * rb, int32_t fd)
+/*
+ * Fill the gap between the header and the data. Files get a hole,
+ * pipes and the like real zeroes.
+ */
+static ssize_t
+_rb_file_pad(int32_t fd, size_t len)
+{
+	char zeroes[512];
+	ssize_t res;
+	size_t done = 0;
+
+	if (lseek(fd, len, SEEK_CUR) != (off_t)-1) {
+		return len;
+	}
+	memset(zeroes, 0, sizeof(zeroes));
+	while (done < len) {
+		res = write(fd, zeroes, QB_MIN(sizeof(zeroes), len - done));
+		if (res < 0) {
+			return -errno;
+		}
+		done += res;
+	}
+	return done;
+}
+
+/*
+ * Copy the data segment to fd, straight from the file backing it when
+ * the kernel can do that.
+ */
+static ssize_t
+_rb_file_data_write(struct qb_ringbuffer_s * rb, int32_t fd)
+{
+	size_t len = rb->shared_hdr->word_size * sizeof(uint32_t);
+	int32_t data_fd = -1;
+	ssize_t res = -ENOSYS;
+
+	if (rb->memfd_data >= 0) {
+		res = qb_sys_fd_copy(fd, rb->memfd_data, 0, len);
+	} else if (!(rb->flags & (QB_RB_FLAG_MEMFD | QB_RB_FLAG_READONLY))) {
+		data_fd = open(rb->shared_hdr->data_path, O_RDONLY);
+		if (data_fd >= 0) {
+			res = qb_sys_fd_copy(fd, data_fd, 0, len);
+			close(data_fd);
+		}
+	}
+	if (res != -ENOSYS) {
+		return res;
+	}
+
+	res = write(fd, rb->shared_data, len);
+	if (res != len) {
+		return -errno;
+	}
+	return res;
+}
+
+static ssize_t
+_rb_write_to_file(struct qb_ringbuffer_s * rb, int32_t fd, uint32_t version)
 {
 	ssize_t result;
 	ssize_t written_size = 0;
 	uint32_t hash = 0;
-	uint32_t version = QB_RB_FILE_HEADER_VERSION;
 
 	if (rb == NULL) {
 		return -EINVAL;
 	}
+	if (rb->slot_words || rb->chunk_hdr_words != QB_RB_CHUNK_HEADER_WORDS) {
+		/* the file format has no room for the slot or header layout */
+		return -ENOTSUP;
+	}
 	print_header(rb);
 
 	/*
@@ -791,17 +3041,26 @@ qb_rb_write_to_file(struct qb_ringbuffer_s * rb, int32_t fd)
 	/*
 	 * 5. hash helps us verify header is not corrupted on file read
 	 */
-	hash = rb->shared_hdr->word_size + rb->shared_hdr->write_pt + rb->shared_hdr->read_pt + QB_RB_FILE_HEADER_VERSION;
+	hash = rb->shared_hdr->word_size + rb->shared_hdr->write_pt + rb->shared_hdr->read_pt + version;
 	result = write(fd, &hash, sizeof(uint32_t));
 	if (result != sizeof(uint32_t)) {
 		return -errno;
 	}
 	written_size += result;
 
-	result = write(fd, rb->shared_data,
-		       rb->shared_hdr->word_size * sizeof(uint32_t));
-	if (result != rb->shared_hdr->word_size * sizeof(uint32_t)) {
-		return -errno;
+	/*
+	 * 6. data
+	 */
+	if (version >= QB_RB_FILE_HEADER_VERSION_MAPPABLE) {
+		result = _rb_file_pad(fd, QB_RB_FILE_DATA_OFFSET - written_size);
+		if (result < 0) {
+			return result;
+		}
+		written_size += result;
+	}
+	result = _rb_file_data_write(rb, fd);
+	if (result < 0) {
+		return result;
 	}
 	written_size += result;
 
@@ -810,6 +3069,253 @@ qb_rb_write_to_file(struct qb_ringbuffer_s * rb, int32_t fd)
 	return written_size;
 }
 
+ssize_t
+qb_rb_write_to_file(struct qb_ringbuffer_s * rb, int32_t fd)
+{
+	return _rb_write_to_file(rb, fd, QB_RB_FILE_HEADER_VERSION);
+}
+
+ssize_t
+qb_rb_write_to_file_mappable(struct qb_ringbuffer_s * rb, int32_t fd)
+{
+	return _rb_write_to_file(rb, fd, QB_RB_FILE_HEADER_VERSION_MAPPABLE);
+}
+
+/*
+ * Chunks consumed after the last flush may have reached the disk marked
+ * dead while journal_read_pt still points at them: step over those, up
+ * to write_pt, so that reading resumes at the first live chunk.
+ */
+static void
+_rb_journal_dead_skip(struct qb_ringbuffer_s *rb)
+{
+	uint32_t read_pt = rb->shared_hdr->read_pt;
+	uint32_t write_pt = rb->shared_hdr->write_pt;
+	uint32_t used;
+	uint32_t next;
+
+	while (read_pt != write_pt &&
+	       QB_RB_CHUNK_MAGIC_GET(rb, read_pt) == QB_RB_CHUNK_MAGIC_DEAD) {
+		used = (write_pt + rb->word_size - read_pt) % rb->word_size;
+		next = qb_rb_chunk_step(rb, read_pt);
+		if (next == read_pt ||
+		    (next + rb->word_size - read_pt) % rb->word_size > used) {
+			/* a torn header, don't trust its size */
+			break;
+		}
+		read_pt = next;
+	}
+	rb->shared_hdr->read_pt = read_pt;
+}
+
+/*
+ * Reopen a journal ringbuffer from its header file, at the last flushed
+ * pointers: anything committed after that flush may not have made it to
+ * disk and is dropped.
+ */
+static qb_ringbuffer_t *
+_rb_journal_reopen(int32_t fd, uint32_t flags)
+{
+	struct qb_ringbuffer_s *rb;
+	struct stat st;
+	size_t real_size;
+	void *shm_addr;
+	int32_t fd_data;
+	int32_t error = 0;
+
+	if (fstat(fd, &st) == -1) {
+		return NULL;
+	}
+	if (st.st_size < sizeof(struct qb_ringbuffer_shared_s)) {
+		qb_util_log(LOG_ERR, "journal header is too small");
+		errno = EINVAL;
+		return NULL;
+	}
+	rb = calloc(1, sizeof(struct qb_ringbuffer_s));
+	if (rb == NULL) {
+		return NULL;
+	}
+	rb->memfd_hdr = -1;
+	rb->memfd_data = -1;
+	rb->notifier_fd = -1;
+	rb->bcast_reader = -1;
+	rb->flags = flags | QB_RB_FLAG_CREATE | QB_RB_FLAG_NO_SEMAPHORE;
+
+	rb->shared_hdr = mmap(0, sizeof(struct qb_ringbuffer_shared_s),
+			      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (rb->shared_hdr == MAP_FAILED) {
+		error = -errno;
+		qb_util_log(LOG_ERR, "couldn't create mmap for header");
+		goto cleanup;
+	}
+	qb_atomic_init();
+	error = _rb_shared_hdr_check(rb->shared_hdr, "journal");
+	if (error != 0) {
+		goto cleanup;
+	}
+
+	real_size = rb->shared_hdr->word_size * sizeof(uint32_t);
+	fd_data = open(rb->shared_hdr->data_path, O_RDWR);
+	if (fd_data < 0) {
+		error = -errno;
+		qb_util_perror(LOG_ERR, "couldn't open %s",
+			       rb->shared_hdr->data_path);
+		goto cleanup;
+	}
+	if (fstat(fd_data, &st) == -1 || st.st_size != real_size) {
+		qb_util_log(LOG_ERR, "%s doesn't match its header",
+			    rb->shared_hdr->data_path);
+		close(fd_data);
+		error = -EINVAL;
+		goto cleanup;
+	}
+	/* this function closes fd_data */
+	error = qb_sys_circular_mmap_2(fd_data, &shm_addr, real_size, 0);
+	if (error != 0) {
+		qb_util_log(LOG_ERR, "couldn't create circular mmap on %s",
+			    rb->shared_hdr->data_path);
+		goto cleanup;
+	}
+	rb->shared_data = shm_addr;
+	rb->word_size = rb->shared_hdr->word_size;
+	rb->slot_words = rb->shared_hdr->slot_words;
+	rb->chunk_hdr_words = rb->shared_hdr->chunk_hdr_words;
+	rb->slot_count = rb->shared_hdr->slot_count;
+	rb->generation = rb->shared_hdr->generation & ~1;
+
+	rb->shared_hdr->write_pt = rb->shared_hdr->journal_write_pt;
+	rb->shared_hdr->commit_pt = rb->shared_hdr->journal_write_pt;
+	rb->shared_hdr->read_pt = rb->shared_hdr->journal_read_pt;
+	if (rb->slot_words == 0) {
+		/* whatever made it to disk past write_pt must not look ready */
+		QB_RB_CHUNK_MAGIC_SET(rb, rb->shared_hdr->write_pt,
+				      QB_RB_CHUNK_MAGIC_DEAD);
+		_rb_journal_dead_skip(rb);
+	}
+	rb->shared_hdr->ref_count = 1;
+	rb->read_pt_cache = rb->shared_hdr->read_pt;
+	rb->write_pt_cache = rb->shared_hdr->write_pt;
+
+	error = qb_rb_sem_create(rb, rb->flags);
+	if (error == 0) {
+		error = qb_rb_journal_create(rb);
+	}
+	if (error != 0) {
+		munmap(rb->shared_data, real_size << 1);
+		goto cleanup;
+	}
+	print_header(rb);
+	return rb;
+
+cleanup:
+	if (rb->shared_hdr != MAP_FAILED) {
+		munmap(rb->shared_hdr, sizeof(struct qb_ringbuffer_shared_s));
+	}
+	free(rb);
+	errno = -error;
+	return NULL;
+}
+
+static int32_t
+_rb_file_skip(int32_t fd, size_t len)
+{
+	char buf[512];
+	ssize_t res;
+	size_t done = 0;
+
+	if (lseek(fd, len, SEEK_CUR) != (off_t)-1) {
+		return 0;
+	}
+	while (done < len) {
+		res = read(fd, buf, QB_MIN(sizeof(buf), len - done));
+		if (res <= 0) {
+			return res < 0 ? -errno : -EIO;
+		}
+		done += res;
+	}
+	return 0;
+}
+
+/*
+ * QB_RB_FLAG_READONLY: map the data of a version 2 dump where it is,
+ * copy-on-write so that reading (which clears the chunk headers) leaves
+ * the file alone. The header is private memory. NULL if this file
+ * can't be mapped; the caller copies it instead.
+ */
+static qb_ringbuffer_t *
+_rb_file_map(int32_t fd, size_t skip, uint32_t word_size, uint32_t write_pt,
+	     uint32_t read_pt, uint32_t flags)
+{
+	struct qb_ringbuffer_s *rb;
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t len = word_size * sizeof(uint32_t);
+	struct stat st;
+	void *shm_addr;
+	off_t offset;
+	int32_t data_fd;
+
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset == (off_t)-1 || fstat(fd, &st) == -1) {
+		return NULL;
+	}
+	offset += skip;
+	if (offset % page_size || len % page_size ||
+	    st.st_size < offset + len) {
+		qb_util_log(LOG_DEBUG, "can't map the dump, copying it");
+		return NULL;
+	}
+	data_fd = dup(fd);
+	if (data_fd < 0) {
+		return NULL;
+	}
+
+	rb = calloc(1, sizeof(struct qb_ringbuffer_s));
+	if (rb == NULL) {
+		close(data_fd);
+		return NULL;
+	}
+	rb->memfd_hdr = -1;
+	rb->memfd_data = -1;
+	rb->notifier_fd = -1;
+	rb->bcast_reader = -1;
+	rb->flags = (flags & ~QB_RB_FLAG_CREATE) | QB_RB_FLAG_NO_SEMAPHORE;
+
+	rb->shared_hdr = mmap(0, sizeof(struct qb_ringbuffer_shared_s),
+			      PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (rb->shared_hdr == MAP_FAILED) {
+		close(data_fd);
+		free(rb);
+		return NULL;
+	}
+	/* this function closes data_fd */
+	if (qb_sys_circular_mmap_3(data_fd, &shm_addr, len, offset,
+				   QB_SYS_MMAP_PRIVATE) != 0) {
+		qb_util_perror(LOG_DEBUG, "can't map the dump, copying it");
+		munmap(rb->shared_hdr, sizeof(struct qb_ringbuffer_shared_s));
+		free(rb);
+		return NULL;
+	}
+	rb->shared_data = shm_addr;
+	rb->shared_hdr->magic = QB_RB_SHARED_HDR_MAGIC;
+	rb->shared_hdr->version = QB_RB_SHARED_HDR_VERSION;
+	rb->shared_hdr->word_size = word_size;
+	rb->shared_hdr->write_pt = write_pt;
+	rb->shared_hdr->commit_pt = write_pt;
+	rb->shared_hdr->read_pt = read_pt;
+	rb->shared_hdr->ref_count = 1;
+	rb->shared_hdr->chunk_hdr_words = QB_RB_CHUNK_HEADER_WORDS;
+	rb->chunk_hdr_words = QB_RB_CHUNK_HEADER_WORDS;
+	rb->word_size = word_size;
+	rb->read_pt_cache = read_pt;
+	rb->write_pt_cache = write_pt;
+	(void)qb_rb_sem_create(rb, rb->flags);
+
+	lseek(fd, skip + len, SEEK_CUR);
+	print_header(rb);
+	return rb;
+}
+
 qb_ringbuffer_t *
 qb_rb_create_from_file(int32_t fd, uint32_t flags)
 {
@@ -827,6 +3333,9 @@ qb_rb_create_from_file(int32_t fd, uint32_t flags)
 	if (fd < 0) {
 		return NULL;
 	}
+	if (flags & QB_RB_FLAG_JOURNAL) {
+		return _rb_journal_reopen(fd, flags);
+	}
 
 	/*
 	 * 1. word size
@@ -876,9 +3385,13 @@ qb_rb_create_from_file(int32_t fd, uint32_t flags)
 	if (hash != calculated_hash) {
 		qb_util_log(LOG_ERR, "Corrupt blackbox: File header hash (%d) does not match calculated hash (%d)", hash, calculated_hash);
 		return NULL;
-	} else if (version != QB_RB_FILE_HEADER_VERSION) {
+	} else if (version < 1 || version > QB_RB_FILE_HEADER_VERSION_MAPPABLE) {
 		qb_util_log(LOG_ERR, "Wrong file header version. Expected %d got %d",
-			QB_RB_FILE_HEADER_VERSION, version);
+			QB_RB_FILE_HEADER_VERSION_MAPPABLE, version);
+		return NULL;
+	}
+	if (word_size == 0 || write_pt >= word_size || read_pt >= word_size) {
+		qb_util_log(LOG_ERR, "Corrupt blackbox: pointers out of range");
 		return NULL;
 	}
 
@@ -886,6 +3399,20 @@ qb_rb_create_from_file(int32_t fd, uint32_t flags)
 	 * 6. data
 	 */
 	n_required = (word_size * sizeof(uint32_t));
+	if (version >= QB_RB_FILE_HEADER_VERSION_MAPPABLE) {
+		if (flags & QB_RB_FLAG_READONLY) {
+			rb = _rb_file_map(fd, QB_RB_FILE_DATA_OFFSET - total_read,
+					  word_size, write_pt, read_pt, flags);
+			if (rb != NULL) {
+				return rb;
+			}
+		}
+		if (_rb_file_skip(fd, QB_RB_FILE_DATA_OFFSET - total_read) != 0) {
+			qb_util_perror(LOG_ERR, "Unable to read blackbox file data");
+			return NULL;
+		}
+		total_read = QB_RB_FILE_DATA_OFFSET;
+	}
 	rb = qb_rb_open("create_from_file", n_required,
 			QB_RB_FLAG_CREATE | QB_RB_FLAG_NO_SEMAPHORE, 0);
 	if (rb == NULL) {
@@ -893,6 +3420,8 @@ qb_rb_create_from_file(int32_t fd, uint32_t flags)
 	}
 	rb->shared_hdr->read_pt = read_pt;
 	rb->shared_hdr->write_pt = write_pt;
+	rb->read_pt_cache = read_pt;
+	rb->write_pt_cache = write_pt;
 
 	n_read = read(fd, rb->shared_data, n_required);
 	if (n_read < 0) {
@@ -925,6 +3454,9 @@ qb_rb_chown(struct qb_ringbuffer_s * rb, uid_t owner, gid_t group)
 	if (rb == NULL) {
 		return -EINVAL;
 	}
+	if (rb->flags & QB_RB_FLAG_MEMFD) {
+		return 0;
+	}
 	res = chown(rb->shared_hdr->data_path, owner, group);
 	if (res < 0 && errno != EPERM) {
 		return -errno;
@@ -944,6 +3476,9 @@ qb_rb_chmod(qb_ringbuffer_t * rb, mode_t mode)
 	if (rb == NULL) {
 		return -EINVAL;
 	}
+	if (rb->flags & QB_RB_FLAG_MEMFD) {
+		return 0;
+	}
 	res = chmod(rb->shared_hdr->data_path, mode);
 	if (res < 0) {
 		return -errno;
@@ -20,6 +20,24 @@
  */
 #include "ringbuffer_int.h"
 #include <qb/qbdefs.h>
+#include "atomic_int.h"
+
+#if defined(HAVE_LINUX_FUTEX_H) && defined(HAVE_SYS_SYSCALL_H)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#define QB_RB_HAVE_FUTEX 1
+#endif
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#include <poll.h>
+#endif /* HAVE_SYS_EVENTFD_H */
+
+/*
+ * How many times the futex reader re-checks the counter before it
+ * registers as a waiter and goes to sleep.
+ */
+#define QB_RB_FUTEX_SPINS 200
 
 static int32_t
 my_posix_sem_timedwait(void * instance, int32_t ms_timeout)
@@ -198,6 +216,34 @@ semop_again:
 	return 0;
 }
 
+static int32_t
+my_sysv_sem_post_batch(void * instance, size_t msg_count, size_t total_size)
+{
+	struct qb_ringbuffer_s *rb = (struct qb_ringbuffer_s *)instance;
+	struct sembuf sops[1];
+
+	if ((rb->flags & QB_RB_FLAG_SHARED_PROCESS) == 0) {
+		return 0;
+	}
+
+	sops[0].sem_num = 0;
+	sops[0].sem_op = msg_count;
+	sops[0].sem_flg = 0;
+
+semop_again:
+	if (semop(rb->sem_id, sops, 1) == -1) {
+		if (errno == EINTR) {
+			goto semop_again;
+		} else {
+			qb_util_perror(LOG_ERR,
+				       "could not increment semaphore");
+		}
+
+		return -errno;
+	}
+	return 0;
+}
+
 static ssize_t
 my_sysv_getvalue_fn(void * instance)
 {
@@ -260,6 +306,345 @@ my_sysv_sem_create(void * instance, uint32_t flags)
 	return res;
 }
 
+#if defined(QB_RB_HAVE_FUTEX) || defined(HAVE_SYS_EVENTFD_H)
+/*
+ * futex_count, shared by the futex and eventfd notifiers
+ */
+static int32_t
+my_futex_trydec(struct qb_ringbuffer_s *rb)
+{
+	int32_t count;
+
+	while ((count = qb_atomic_int_get(&rb->shared_hdr->futex_count)) > 0) {
+		if (qb_atomic_int_compare_and_exchange(&rb->shared_hdr->futex_count,
+						       count, count - 1)) {
+			return QB_TRUE;
+		}
+	}
+	return QB_FALSE;
+}
+
+static ssize_t
+my_futex_getvalue_fn(void * instance)
+{
+	struct qb_ringbuffer_s *rb = (struct qb_ringbuffer_s *)instance;
+	return qb_atomic_int_get(&rb->shared_hdr->futex_count);
+}
+#endif /* QB_RB_HAVE_FUTEX || HAVE_SYS_EVENTFD_H */
+
+#ifdef QB_RB_HAVE_FUTEX
+/*
+ * futex_count is the number of committed but unread chunks, the reader
+ * sleeps on it while it is zero. futex_waiters tells the writer whether
+ * anyone is asleep: both sides do an atomic add before looking at the
+ * other side's counter, so either the writer sees the waiter or the
+ * reader sees the new chunk before it sleeps.
+ *
+ * Never FUTEX_PRIVATE_FLAG: every handle (even QB_RB_FLAG_SHARED_THREAD
+ * ones) maps the header at its own address, and private futexes are
+ * keyed on the address.
+ */
+static int32_t
+my_futex(struct qb_ringbuffer_s *rb, int32_t op, int32_t val,
+	 const struct timespec *timeout)
+{
+	return syscall(SYS_futex, &rb->shared_hdr->futex_count, op, val,
+		       timeout, NULL, 0);
+}
+
+static int32_t
+my_futex_timedwait(void * instance, int32_t ms_timeout)
+{
+	struct qb_ringbuffer_s *rb = (struct qb_ringbuffer_s *)instance;
+	struct timespec ts_timeout;
+	struct timespec *ts_pt = NULL;
+	uint64_t end_ns = 0;
+	uint64_t now_ns;
+	int32_t spins;
+	int32_t res;
+
+	for (spins = 0; spins < QB_RB_FUTEX_SPINS; spins++) {
+		if (my_futex_trydec(rb)) {
+			return 0;
+		}
+		if (ms_timeout == 0) {
+			return -ETIMEDOUT;
+		}
+	}
+
+	if (ms_timeout > 0) {
+		end_ns = qb_util_nano_current_get() +
+			((uint64_t)ms_timeout * QB_TIME_NS_IN_MSEC);
+		ts_pt = &ts_timeout;
+	}
+
+	for (;;) {
+		qb_atomic_int_inc(&rb->shared_hdr->futex_waiters);
+		if (my_futex_trydec(rb)) {
+			qb_atomic_int_add(&rb->shared_hdr->futex_waiters, -1);
+			return 0;
+		}
+		if (ts_pt) {
+			now_ns = qb_util_nano_current_get();
+			if (now_ns >= end_ns) {
+				qb_atomic_int_add(&rb->shared_hdr->futex_waiters, -1);
+				return -ETIMEDOUT;
+			}
+			ts_timeout.tv_sec = (end_ns - now_ns) / QB_TIME_NS_IN_SEC;
+			ts_timeout.tv_nsec = (end_ns - now_ns) % QB_TIME_NS_IN_SEC;
+		}
+		res = my_futex(rb, FUTEX_WAIT, 0, ts_pt);
+		if (res == -1) {
+			res = -errno;
+		}
+		qb_atomic_int_add(&rb->shared_hdr->futex_waiters, -1);
+
+		if (res == -ETIMEDOUT) {
+			return my_futex_trydec(rb) ? 0 : -ETIMEDOUT;
+		} else if (res < 0 && res != -EAGAIN && res != -EINTR) {
+			errno = -res;
+			qb_util_perror(LOG_ERR, "error waiting for futex");
+			return res;
+		}
+	}
+}
+
+static int32_t
+my_futex_post(void * instance, size_t msg_size)
+{
+	struct qb_ringbuffer_s *rb = (struct qb_ringbuffer_s *)instance;
+
+	qb_atomic_int_inc(&rb->shared_hdr->futex_count);
+	if (qb_atomic_int_get(&rb->shared_hdr->futex_waiters) == 0) {
+		return 0;
+	}
+	if (my_futex(rb, FUTEX_WAKE, 1, NULL) < 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+static int32_t
+my_futex_post_batch(void * instance, size_t msg_count, size_t total_size)
+{
+	struct qb_ringbuffer_s *rb = (struct qb_ringbuffer_s *)instance;
+
+	qb_atomic_int_add(&rb->shared_hdr->futex_count, msg_count);
+	if (qb_atomic_int_get(&rb->shared_hdr->futex_waiters) == 0) {
+		return 0;
+	}
+	if (my_futex(rb, FUTEX_WAKE, msg_count, NULL) < 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+static int32_t
+my_futex_create(void * instance, uint32_t flags)
+{
+	struct qb_ringbuffer_s *rb = (struct qb_ringbuffer_s *)instance;
+	if (flags & QB_RB_FLAG_CREATE) {
+		rb->shared_hdr->futex_count = 0;
+		rb->shared_hdr->futex_waiters = 0;
+	}
+	return 0;
+}
+
+/*
+ * QB_RB_FLAG_BROADCAST: every reader waits for the write pointer to move
+ * past its own cursor, so there is no count to take chunks from.
+ * futex_count is a sequence number bumped by every post instead and all
+ * the sleeping readers are woken up.
+ */
+static int32_t
+my_bcast_timedwait(void * instance, int32_t ms_timeout)
+{
+	struct qb_ringbuffer_s *rb = (struct qb_ringbuffer_s *)instance;
+	struct timespec ts_timeout;
+	struct timespec *ts_pt = NULL;
+	uint64_t end_ns = 0;
+	uint64_t now_ns;
+	int32_t seq;
+	int32_t res;
+
+	if (ms_timeout > 0) {
+		end_ns = qb_util_nano_current_get() +
+			((uint64_t)ms_timeout * QB_TIME_NS_IN_MSEC);
+		ts_pt = &ts_timeout;
+	}
+
+	for (;;) {
+		seq = qb_atomic_int_get(&rb->shared_hdr->futex_count);
+		if (qb_rb_bcast_ready(rb)) {
+			return 0;
+		}
+		if (ms_timeout == 0) {
+			return -ETIMEDOUT;
+		}
+		if (ts_pt) {
+			now_ns = qb_util_nano_current_get();
+			if (now_ns >= end_ns) {
+				return -ETIMEDOUT;
+			}
+			ts_timeout.tv_sec = (end_ns - now_ns) / QB_TIME_NS_IN_SEC;
+			ts_timeout.tv_nsec = (end_ns - now_ns) % QB_TIME_NS_IN_SEC;
+		}
+		qb_atomic_int_inc(&rb->shared_hdr->futex_waiters);
+		res = my_futex(rb, FUTEX_WAIT, seq, ts_pt);
+		if (res == -1) {
+			res = -errno;
+		}
+		qb_atomic_int_add(&rb->shared_hdr->futex_waiters, -1);
+
+		if (res == -ETIMEDOUT) {
+			return qb_rb_bcast_ready(rb) ? 0 : -ETIMEDOUT;
+		} else if (res < 0 && res != -EAGAIN && res != -EINTR) {
+			errno = -res;
+			qb_util_perror(LOG_ERR, "error waiting for futex");
+			return res;
+		}
+	}
+}
+
+static int32_t
+my_bcast_post_batch(void * instance, size_t msg_count, size_t total_size)
+{
+	struct qb_ringbuffer_s *rb = (struct qb_ringbuffer_s *)instance;
+
+	qb_atomic_int_inc(&rb->shared_hdr->futex_count);
+	if (qb_atomic_int_get(&rb->shared_hdr->futex_waiters) == 0) {
+		return 0;
+	}
+	if (my_futex(rb, FUTEX_WAKE, INT_MAX, NULL) < 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+static int32_t
+my_bcast_post(void * instance, size_t msg_size)
+{
+	return my_bcast_post_batch(instance, 1, msg_size);
+}
+#endif /* QB_RB_HAVE_FUTEX */
+
+#ifdef HAVE_SYS_EVENTFD_H
+/*
+ * The eventfd notifier counts committed but unread chunks in futex_count
+ * just like the futex one. The eventfd itself is only an edge: the writer
+ * bumps it when futex_count goes from zero to non-zero and the reader
+ * clears it when it finds futex_count at zero. So a reader that drains
+ * the ringbuffer on every wakeup sees one eventfd write per burst, not
+ * one per chunk.
+ */
+static int32_t
+my_eventfd_kick(struct qb_ringbuffer_s *rb)
+{
+	eventfd_t one = 1;
+
+	if (rb->notifier_fd < 0) {
+		return -EBADF;
+	}
+	if (eventfd_write(rb->notifier_fd, one) == -1 && errno != EAGAIN) {
+		return -errno;
+	}
+	return 0;
+}
+
+static int32_t
+my_eventfd_post_batch(void * instance, size_t msg_count, size_t total_size)
+{
+	struct qb_ringbuffer_s *rb = (struct qb_ringbuffer_s *)instance;
+
+	if (qb_atomic_int_exchange_and_add(&rb->shared_hdr->futex_count,
+					   msg_count) != 0) {
+		return 0;
+	}
+	return my_eventfd_kick(rb);
+}
+
+static int32_t
+my_eventfd_post(void * instance, size_t msg_size)
+{
+	return my_eventfd_post_batch(instance, 1, msg_size);
+}
+
+static int32_t
+my_eventfd_timedwait(void * instance, int32_t ms_timeout)
+{
+	struct qb_ringbuffer_s *rb = (struct qb_ringbuffer_s *)instance;
+	struct pollfd pfd;
+	eventfd_t val;
+	uint64_t end_ns = 0;
+	uint64_t now_ns;
+	int poll_ms = -1;
+	int32_t res;
+
+	if (ms_timeout > 0) {
+		end_ns = qb_util_nano_current_get() +
+			((uint64_t)ms_timeout * QB_TIME_NS_IN_MSEC);
+	}
+
+	for (;;) {
+		if (my_futex_trydec(rb)) {
+			return 0;
+		}
+		if (rb->notifier_fd < 0) {
+			return -EBADF;
+		}
+
+		/*
+		 * Empty: clear the edge, then look again in case a writer
+		 * got in between (its kick may have been the one we ate).
+		 */
+		(void)eventfd_read(rb->notifier_fd, &val);
+		if (qb_atomic_int_get(&rb->shared_hdr->futex_count) > 0) {
+			(void)my_eventfd_kick(rb);
+			continue;
+		}
+
+		if (ms_timeout == 0) {
+			return -ETIMEDOUT;
+		}
+		if (ms_timeout > 0) {
+			now_ns = qb_util_nano_current_get();
+			if (now_ns >= end_ns) {
+				return -ETIMEDOUT;
+			}
+			poll_ms = QB_MAX(1, (end_ns - now_ns) / QB_TIME_NS_IN_MSEC);
+		}
+		pfd.fd = rb->notifier_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		res = poll(&pfd, 1, poll_ms);
+		if (res == -1 && errno != EINTR) {
+			res = -errno;
+			qb_util_perror(LOG_ERR, "error polling eventfd");
+			return res;
+		}
+	}
+}
+
+static int32_t
+my_eventfd_create(void * instance, uint32_t flags)
+{
+	struct qb_ringbuffer_s *rb = (struct qb_ringbuffer_s *)instance;
+
+	rb->notifier_fd = -1;
+	if ((flags & QB_RB_FLAG_CREATE) == 0) {
+		/* the creator's eventfd comes in through qb_rb_fd_set() */
+		return 0;
+	}
+	rb->notifier_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rb->notifier_fd == -1) {
+		return -errno;
+	}
+	rb->shared_hdr->futex_count = 0;
+	rb->shared_hdr->futex_waiters = 0;
+	return 0;
+}
+#endif /* HAVE_SYS_EVENTFD_H */
+
 int32_t
 qb_rb_sem_create(struct qb_ringbuffer_s * rb, uint32_t flags)
 {
@@ -267,7 +652,8 @@ qb_rb_sem_create(struct qb_ringbuffer_s * rb, uint32_t flags)
 	int32_t use_posix = QB_TRUE;
 
 	if ((flags & QB_RB_FLAG_SHARED_PROCESS) &&
-	    !(flags & QB_RB_FLAG_NO_SEMAPHORE)) {
+	    !(flags & (QB_RB_FLAG_NO_SEMAPHORE | QB_RB_FLAG_FUTEX |
+		       QB_RB_FLAG_EVENTFD | QB_RB_FLAG_BROADCAST))) {
 #if defined(HAVE_POSIX_PSHARED_SEMAPHORE) || \
     defined(HAVE_RPL_PSHARED_SEMAPHORE)
 		use_posix = QB_TRUE;
@@ -284,14 +670,55 @@ qb_rb_sem_create(struct qb_ringbuffer_s * rb, uint32_t flags)
 		rb->notifier.instance = NULL;
 		rb->notifier.timedwait_fn = NULL;
 		rb->notifier.post_fn = NULL;
+		rb->notifier.post_batch_fn = NULL;
 		rb->notifier.q_len_fn = NULL;
 		rb->notifier.space_used_fn = NULL;
 		rb->notifier.destroy_fn = NULL;
+	} else if (flags & QB_RB_FLAG_BROADCAST) {
+#ifdef QB_RB_HAVE_FUTEX
+		rc = my_futex_create(rb, flags);
+		rb->notifier.instance = rb;
+		rb->notifier.timedwait_fn = my_bcast_timedwait;
+		rb->notifier.post_fn = my_bcast_post;
+		rb->notifier.post_batch_fn = my_bcast_post_batch;
+		rb->notifier.q_len_fn = NULL;
+		rb->notifier.space_used_fn = NULL;
+		rb->notifier.destroy_fn = NULL;
+#else
+		rc = -ENOTSUP;
+#endif /* QB_RB_HAVE_FUTEX */
+	} else if (flags & QB_RB_FLAG_FUTEX) {
+#ifdef QB_RB_HAVE_FUTEX
+		rc = my_futex_create(rb, flags);
+		rb->notifier.instance = rb;
+		rb->notifier.timedwait_fn = my_futex_timedwait;
+		rb->notifier.post_fn = my_futex_post;
+		rb->notifier.post_batch_fn = my_futex_post_batch;
+		rb->notifier.q_len_fn = my_futex_getvalue_fn;
+		rb->notifier.space_used_fn = NULL;
+		rb->notifier.destroy_fn = NULL;
+#else
+		rc = -ENOTSUP;
+#endif /* QB_RB_HAVE_FUTEX */
+	} else if (flags & QB_RB_FLAG_EVENTFD) {
+#ifdef HAVE_SYS_EVENTFD_H
+		rc = my_eventfd_create(rb, flags);
+		rb->notifier.instance = rb;
+		rb->notifier.timedwait_fn = my_eventfd_timedwait;
+		rb->notifier.post_fn = my_eventfd_post;
+		rb->notifier.post_batch_fn = my_eventfd_post_batch;
+		rb->notifier.q_len_fn = my_futex_getvalue_fn;
+		rb->notifier.space_used_fn = NULL;
+		rb->notifier.destroy_fn = NULL;
+#else
+		rc = -ENOTSUP;
+#endif /* HAVE_SYS_EVENTFD_H */
 	} else if (use_posix) {
 		rc = my_posix_sem_create(rb, flags);
 		rb->notifier.instance = rb;
 		rb->notifier.timedwait_fn = my_posix_sem_timedwait;
 		rb->notifier.post_fn = my_posix_sem_post;
+		rb->notifier.post_batch_fn = NULL;
 		rb->notifier.q_len_fn = my_posix_getvalue_fn;
 		rb->notifier.space_used_fn = NULL;
 		rb->notifier.destroy_fn = my_posix_sem_destroy;
@@ -300,6 +727,7 @@ qb_rb_sem_create(struct qb_ringbuffer_s * rb, uint32_t flags)
 		rb->notifier.instance = rb;
 		rb->notifier.timedwait_fn = my_sysv_sem_timedwait;
 		rb->notifier.post_fn = my_sysv_sem_post;
+		rb->notifier.post_batch_fn = my_sysv_sem_post_batch;
 		rb->notifier.q_len_fn = my_sysv_getvalue_fn;
 		rb->notifier.space_used_fn = NULL;
 		rb->notifier.destroy_fn = my_sysv_sem_destroy;
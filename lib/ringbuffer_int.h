@@ -38,10 +38,18 @@
 #include <qb/qbrb.h>
 
 struct qb_ringbuffer_s;
+struct qb_rb_journal;
 
 int32_t qb_rb_sem_create(struct qb_ringbuffer_s *rb, uint32_t flags);
 
+int32_t qb_rb_journal_create(struct qb_ringbuffer_s *rb);
+void qb_rb_journal_destroy(struct qb_ringbuffer_s *rb);
+void qb_rb_journal_committed(struct qb_ringbuffer_s *rb, size_t len);
+
 typedef int32_t(*qb_rb_notifier_post_fn_t) (void * instance, size_t msg_size);
+typedef int32_t(*qb_rb_notifier_post_batch_fn_t) (void * instance,
+						  size_t msg_count,
+						  size_t total_size);
 typedef ssize_t(*qb_rb_notifier_q_len_fn_t) (void * instance);
 typedef ssize_t(*qb_rb_notifier_used_fn_t) (void * instance);
 typedef int32_t(*qb_rb_notifier_timedwait_fn_t) (void * instance,
@@ -51,6 +59,8 @@ typedef int32_t(*qb_rb_notifier_destroy_fn_t) (void * instance);
 
 struct qb_rb_notifier {
 	qb_rb_notifier_post_fn_t post_fn;
+	/* optional, otherwise post_fn is called once per chunk */
+	qb_rb_notifier_post_batch_fn_t post_batch_fn;
 	qb_rb_notifier_q_len_fn_t q_len_fn;
 	qb_rb_notifier_used_fn_t space_used_fn;
 	qb_rb_notifier_timedwait_fn_t timedwait_fn;
@@ -59,16 +69,109 @@ struct qb_rb_notifier {
 	void *instance;
 };
 
-struct qb_ringbuffer_shared_s {
-	volatile uint32_t write_pt;
+/*
+ * Layout of the shared header, bumped whenever the fields after the
+ * first three words move. Version 1 was the original layout (write_pt,
+ * read_pt and word_size as the first three words) with neither a magic
+ * nor a version, so it is recognised by the magic being missing.
+ */
+#define QB_RB_SHARED_HDR_MAGIC 0x51425248	/* "QBRH" */
+#define QB_RB_SHARED_HDR_VERSION 2
+#define QB_RB_CACHE_LINE_SIZE 64
+
+/*
+ * QB_RB_FLAG_BROADCAST reader slots
+ */
+#define QB_RB_BCAST_READERS_MAX 64
+
+/*
+ * QB_RB_FLAG_TIMESTAMPS dwell time histogram: log-linear, 8 linear
+ * buckets per power of two of nanoseconds (values below 8 get their
+ * own bucket), i.e. within 12.5% over the whole uint64_t range.
+ */
+#define QB_RB_DWELL_SUB_BITS 3
+#define QB_RB_DWELL_BUCKETS ((64 - QB_RB_DWELL_SUB_BITS + 1) << QB_RB_DWELL_SUB_BITS)
+
+enum qb_rb_bcast_state {
+	QB_RB_BCAST_FREE = 0,
+	QB_RB_BCAST_JOINING,
+	QB_RB_BCAST_ACTIVE,
+	QB_RB_BCAST_EVICTED,
+};
+
+struct qb_rb_bcast_reader {
+	/* written by the reader */
 	volatile uint32_t read_pt;
+	/* written by the reader, except for the writer evicting it */
+	volatile int32_t state;
+} __attribute__ ((aligned(QB_RB_CACHE_LINE_SIZE)));
+
+struct qb_ringbuffer_shared_s {
+	/*
+	 * These never move, whatever the version: they are all another
+	 * libqb can rely on. v1_word_size is where version 1 kept
+	 * word_size and is always 0, so that version 1 peers fail to map
+	 * the data instead of misreading the rest.
+	 */
+	uint32_t magic;
+	uint32_t version;
+	uint32_t v1_word_size;
+
+	/*
+	 * written by the producer(s)
+	 */
+	volatile uint32_t write_pt __attribute__ ((aligned(QB_RB_CACHE_LINE_SIZE)));
+	/* QB_RB_FLAG_MULTI_PRODUCER: next chunk allowed to be published */
+	volatile uint32_t commit_pt;
+	/* QB_RB_FLAG_JOURNAL: write_pt and read_pt as of the last flush */
+	volatile uint32_t journal_write_pt;
+	volatile uint32_t journal_read_pt;
+	/* QB_RB_FLAG_TIMESTAMPS: chunks committed and overwritten */
+	volatile uint32_t chunks_committed;
+	volatile uint32_t chunks_dropped;
+
+	/*
+	 * written by the consumer
+	 */
+	volatile uint32_t read_pt __attribute__ ((aligned(QB_RB_CACHE_LINE_SIZE)));
+	/* QB_RB_FLAG_TIMESTAMPS: chunks read and how long they waited */
+	volatile uint32_t chunks_consumed;
+	volatile uint64_t dwell_max;
+	volatile uint64_t dwell_hist[QB_RB_DWELL_BUCKETS];
+
+	/*
+	 * QB_RB_FLAG_FUTEX and QB_RB_FLAG_EVENTFD notifiers, written by
+	 * both sides
+	 */
+	volatile int32_t futex_count __attribute__ ((aligned(QB_RB_CACHE_LINE_SIZE)));
+	volatile int32_t futex_waiters;
+
+	/*
+	 * QB_RB_FLAG_BROADCAST: one cursor per reader, read_pt above is
+	 * the slowest of them.
+	 */
+	struct qb_rb_bcast_reader readers[QB_RB_BCAST_READERS_MAX];
+
+	/*
+	 * read mostly
+	 */
+	/*
+	 * qb_rb_resize(): odd while the data segment is swapped, even again
+	 * once data_path and word_size describe the new one.
+	 */
+	volatile int32_t generation __attribute__ ((aligned(QB_RB_CACHE_LINE_SIZE)));
 	uint32_t word_size;
+	/* fixed slot ringbuffers: slot size in words (0 if not one) */
+	uint32_t slot_words;
+	uint32_t slot_count;
+	/* chunk header size in words, more with QB_RB_FLAG_TIMESTAMPS */
+	uint32_t chunk_hdr_words;
 	char hdr_path[PATH_MAX];
 	char data_path[PATH_MAX];
 	int32_t ref_count;
 	rpl_sem_t posix_sem;
 	char user_data[1];
-} __attribute__ ((aligned(8)));
+} __attribute__ ((aligned(QB_RB_CACHE_LINE_SIZE)));
 
 struct qb_ringbuffer_s {
 	uint32_t flags;
@@ -76,14 +179,52 @@ struct qb_ringbuffer_s {
 	struct qb_ringbuffer_shared_s *shared_hdr;
 	uint32_t *shared_data;
 
+	/*
+	 * Private copies of the other side's index. read_pt only ever moves
+	 * away from the producer (and write_pt away from the consumer) so a
+	 * stale copy under-estimates the free (or used) space; it is only
+	 * reloaded from the shared header when it looks too small.
+	 */
+	uint32_t read_pt_cache;
+	uint32_t write_pt_cache;
+
+	/* QB_RB_FLAG_MEMFD: kept until handed out by qb_rb_memfds_get() */
+	int32_t memfd_hdr;
+	int32_t memfd_data;
+
+	/* QB_RB_FLAG_EVENTFD: this process's copy of the eventfd */
+	int32_t notifier_fd;
+
+	/* QB_RB_FLAG_BROADCAST: our slot in shared_hdr->readers, or -1 */
+	int32_t bcast_reader;
+
+	/* copies of shared_hdr->slot_words, slot_count and chunk_hdr_words */
+	uint32_t slot_words;
+	uint32_t slot_count;
+	uint32_t chunk_hdr_words;
+
+	/* the data segment we have mapped, see qb_rb_resize() */
+	int32_t generation;
+	uint32_t word_size;
+
+	/* QB_RB_FLAG_JOURNAL: the flusher, see ringbuffer_journal.c */
+	struct qb_rb_journal *journal;
+
+	/* qb_rb_busy_poll_set(): the budget, in ns, as set and as adapted */
+	uint32_t busy_poll_max_ns;
+	struct qb_rb_busy_poll_stats busy_poll;
+
 	struct qb_rb_notifier notifier;
 };
 
 void qb_rb_force_close(qb_ringbuffer_t * rb);
 
+int32_t qb_rb_bcast_ready(struct qb_ringbuffer_s *rb);
+
 qb_ringbuffer_t *qb_rb_open_2(const char *name, size_t size, uint32_t flags,
 			      size_t shared_user_data_size,
-			      struct qb_rb_notifier *notifier);
+			      struct qb_rb_notifier *notifier,
+			      size_t slot_size);
 
 
 #ifndef HAVE_SEMUN
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2026 Red Hat, Inc.
+ *
+ * This file is part of libqb.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "os_base.h"
+#include <pthread.h>
+
+#include "ringbuffer_int.h"
+#include <qb/qbdefs.h>
+#include <qb/qbatomic.h>
+
+#include "atomic_int.h"
+
+/*
+ * QB_RB_FLAG_JOURNAL ringbuffers live in regular files; this makes them
+ * durable.
+ *
+ * Committing (or reclaiming) a chunk only adds its size to "dirty". A
+ * flusher thread, started by the first commit, msync()s the data and then
+ * records the flushed write_pt/read_pt in the header
+ * (journal_write_pt/read_pt) and msync()s that, max_delay_ms after the
+ * first unflushed commit or once max_bytes have been committed, whichever
+ * comes first. Everything committed in between is covered by the same
+ * flush. After a crash the ringbuffer is reopened at the recorded
+ * pointers, see qb_rb_create_from_file().
+ */
+#define QB_RB_JOURNAL_DELAY_DEFAULT	100	/* ms */
+
+struct qb_rb_journal {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* serialises flushes (thread vs. qb_rb_journal_sync()) */
+	pthread_mutex_t flush_lock;
+	pthread_t thread;
+	/* set under lock, peeked at without it by qb_rb_journal_committed() */
+	volatile int32_t thread_started;
+	int32_t stop;
+	uint32_t max_delay_ms;
+	size_t max_bytes;
+	/* when the pending flush is due (ns from epoch), 0 when none is */
+	uint64_t deadline;
+	/*
+	 * bytes committed since the last flush, saturating at INT32_MAX,
+	 * see _journal_dirty_add()
+	 */
+	volatile int32_t dirty;
+};
+
+/*
+ * Adds len to j->dirty without letting it wrap negative, and returns
+ * what it was before. Saturating is enough: past max_bytes all that
+ * matters is that there is something to flush, and a flush only takes
+ * off what it saw, all of which it covers.
+ */
+static int32_t
+_journal_dirty_add(struct qb_rb_journal *j, size_t len)
+{
+	int32_t old;
+	int32_t new;
+
+	do {
+		old = qb_atomic_int_get(&j->dirty);
+		if (len >= (size_t)(INT32_MAX - old)) {
+			new = INT32_MAX;
+		} else {
+			new = old + (int32_t)len;
+		}
+	} while (!qb_atomic_int_compare_and_exchange(&j->dirty, old, new));
+	return old;
+}
+
+static int32_t
+_journal_flush(struct qb_ringbuffer_s *rb)
+{
+	struct qb_rb_journal *j = rb->journal;
+	uint32_t write_pt;
+	uint32_t read_pt;
+	int32_t dirty;
+	int32_t res = 0;
+
+	(void)pthread_mutex_lock(&j->flush_lock);
+	dirty = qb_atomic_int_get(&j->dirty);
+
+	/*
+	 * read_pt first: it can't pass the write_pt we read after it, so the
+	 * pair is consistent.
+	 */
+	read_pt = qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->read_pt,
+				       QB_ATOMIC_ACQUIRE);
+	if (rb->flags & QB_RB_FLAG_MULTI_PRODUCER) {
+		write_pt = qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->commit_pt,
+						QB_ATOMIC_ACQUIRE);
+	} else {
+		write_pt = qb_atomic_int_get_ex((int32_t *)&rb->shared_hdr->write_pt,
+						QB_ATOMIC_ACQUIRE);
+	}
+
+	if (msync(rb->shared_data, rb->word_size * sizeof(uint32_t),
+		  MS_SYNC) == -1) {
+		res = -errno;
+		qb_util_perror(LOG_ERR, "couldn't flush ringbuffer %s",
+			       rb->shared_hdr->data_path);
+		goto unlock;
+	}
+	rb->shared_hdr->journal_write_pt = write_pt;
+	rb->shared_hdr->journal_read_pt = read_pt;
+	if (msync(rb->shared_hdr, sizeof(struct qb_ringbuffer_shared_s),
+		  MS_SYNC) == -1) {
+		res = -errno;
+		qb_util_perror(LOG_ERR, "couldn't flush ringbuffer %s",
+			       rb->shared_hdr->hdr_path);
+		goto unlock;
+	}
+	qb_atomic_int_add(&j->dirty, -dirty);
+
+unlock:
+	(void)pthread_mutex_unlock(&j->flush_lock);
+	return res;
+}
+
+static void *
+_journal_thread(void *arg)
+{
+	struct qb_ringbuffer_s *rb = (struct qb_ringbuffer_s *)arg;
+	struct qb_rb_journal *j = rb->journal;
+	struct timespec ts;
+	uint64_t now;
+	size_t dirty;
+
+	(void)pthread_mutex_lock(&j->lock);
+	while (!j->stop) {
+		dirty = qb_atomic_int_get(&j->dirty);
+		if (dirty == 0 || (j->max_delay_ms == 0 && j->max_bytes > 0 &&
+				   dirty < j->max_bytes)) {
+			/* woken by the first commit or the byte budget */
+			j->deadline = 0;
+			(void)pthread_cond_wait(&j->cond, &j->lock);
+			continue;
+		}
+		if (j->max_bytes == 0 || dirty < j->max_bytes) {
+			now = qb_util_nano_from_epoch_get();
+			if (j->deadline == 0) {
+				j->deadline = now + ((uint64_t)j->max_delay_ms *
+						     QB_TIME_NS_IN_MSEC);
+			}
+			if (now < j->deadline) {
+				ts.tv_sec = j->deadline / QB_TIME_NS_IN_SEC;
+				ts.tv_nsec = j->deadline % QB_TIME_NS_IN_SEC;
+				(void)pthread_cond_timedwait(&j->cond, &j->lock,
+							     &ts);
+				continue;
+			}
+		}
+		j->deadline = 0;
+		(void)pthread_mutex_unlock(&j->lock);
+		(void)_journal_flush(rb);
+		(void)pthread_mutex_lock(&j->lock);
+	}
+	(void)pthread_mutex_unlock(&j->lock);
+	return NULL;
+}
+
+int32_t
+qb_rb_journal_create(struct qb_ringbuffer_s *rb)
+{
+	struct qb_rb_journal *j;
+
+	j = calloc(1, sizeof(struct qb_rb_journal));
+	if (j == NULL) {
+		return -ENOMEM;
+	}
+	(void)pthread_mutex_init(&j->lock, NULL);
+	(void)pthread_mutex_init(&j->flush_lock, NULL);
+	(void)pthread_cond_init(&j->cond, NULL);
+	j->max_delay_ms = QB_RB_JOURNAL_DELAY_DEFAULT;
+	j->max_bytes = (rb->word_size * sizeof(uint32_t)) / 2;
+	rb->journal = j;
+	return 0;
+}
+
+void
+qb_rb_journal_destroy(struct qb_ringbuffer_s *rb)
+{
+	struct qb_rb_journal *j = rb->journal;
+	int32_t started;
+
+	if (j == NULL) {
+		return;
+	}
+	(void)pthread_mutex_lock(&j->lock);
+	j->stop = QB_TRUE;
+	started = j->thread_started;
+	(void)pthread_cond_signal(&j->cond);
+	(void)pthread_mutex_unlock(&j->lock);
+	if (started) {
+		(void)pthread_join(j->thread, NULL);
+	}
+	/* even when clean: a reader in another process moves read_pt too */
+	(void)_journal_flush(rb);
+	(void)pthread_cond_destroy(&j->cond);
+	(void)pthread_mutex_destroy(&j->flush_lock);
+	(void)pthread_mutex_destroy(&j->lock);
+	free(j);
+	rb->journal = NULL;
+}
+
+void
+qb_rb_journal_committed(struct qb_ringbuffer_s *rb, size_t len)
+{
+	struct qb_rb_journal *j = rb->journal;
+	size_t before;
+	size_t dirty;
+
+	if (j->max_delay_ms == 0 && j->max_bytes == 0) {
+		/* no budget: every commit is durable on return */
+		(void)_journal_dirty_add(j, len);
+		(void)_journal_flush(rb);
+		return;
+	}
+
+	before = _journal_dirty_add(j, len);
+	dirty = before + len;
+	if (!qb_atomic_int_get(&j->thread_started)) {
+		(void)pthread_mutex_lock(&j->lock);
+		if (!j->thread_started && !j->stop) {
+			if (pthread_create(&j->thread, NULL,
+					   _journal_thread, rb) == 0) {
+				qb_atomic_int_set(&j->thread_started,
+						  QB_TRUE);
+			} else {
+				qb_util_perror(LOG_ERR,
+					       "couldn't start the journal "
+					       "flusher for %s",
+					       rb->shared_hdr->hdr_path);
+			}
+		}
+		(void)pthread_mutex_unlock(&j->lock);
+	}
+	if (before == 0 ||
+	    (j->max_bytes > 0 && dirty >= j->max_bytes &&
+	     before < j->max_bytes)) {
+		(void)pthread_mutex_lock(&j->lock);
+		(void)pthread_cond_signal(&j->cond);
+		(void)pthread_mutex_unlock(&j->lock);
+	}
+}
+
+int32_t
+qb_rb_journal_ctl(struct qb_ringbuffer_s *rb, uint32_t max_delay_ms,
+		  size_t max_bytes)
+{
+	struct qb_rb_journal *j;
+
+	if (rb == NULL) {
+		return -EINVAL;
+	}
+	j = rb->journal;
+	if (j == NULL) {
+		return -ENOTSUP;
+	}
+	(void)pthread_mutex_lock(&j->lock);
+	j->max_delay_ms = max_delay_ms;
+	j->max_bytes = QB_MIN(max_bytes, INT32_MAX / 2);
+	j->deadline = 0;
+	(void)pthread_cond_signal(&j->cond);
+	(void)pthread_mutex_unlock(&j->lock);
+	return 0;
+}
+
+int32_t
+qb_rb_journal_sync(struct qb_ringbuffer_s *rb)
+{
+	if (rb == NULL) {
+		return -EINVAL;
+	}
+	if (rb->journal == NULL) {
+		return -ENOTSUP;
+	}
+	return _journal_flush(rb);
+}
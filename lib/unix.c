@@ -26,6 +26,9 @@
 #ifdef HAVE_SYS_MMAN_H
 #include <sys/mman.h>
 #endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #include "util_int.h"
 #include <qb/qbdefs.h>
@@ -39,6 +42,17 @@
 #define MAP_ANONYMOUS MAP_ANON
 #endif
 
+#if defined(QB_LINUX) && defined(HAVE_SYS_VFS_H)
+#include <sys/vfs.h>
+#define QB_HAVE_HUGETLBFS 1
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+#endif /* QB_LINUX && HAVE_SYS_VFS_H */
+
+/* memfd_create() limits names to 249 characters */
+#define QB_SYS_MEMFD_NAME_MAX 250
+
 
 char *
 qb_strerror_r(int errnum, char *buf, size_t buflen)
@@ -148,14 +162,181 @@ unlink_exit:
 }
 
 
+int32_t
+qb_sys_hugetlb_file_open(char *path, const char *dir, const char *file,
+			 size_t bytes, uint32_t file_flags)
+{
+	int32_t fd;
+	int32_t res;
+
+	snprintf(path, PATH_MAX, "%s/%s", dir, file);
+	fd = open_mmap_file(path, file_flags);
+	if (fd < 0) {
+		res = -errno;
+		qb_util_perror(LOG_DEBUG, "couldn't open file %s", path);
+		return res;
+	}
+
+	/*
+	 * No need to zero fill, hugetlbfs pages are cleared when they are
+	 * first faulted in (and write() isn't supported anyway).
+	 */
+	if (ftruncate(fd, bytes) == -1) {
+		res = -errno;
+		qb_util_perror(LOG_DEBUG, "couldn't truncate file %s", path);
+		unlink(path);
+		close(fd);
+		return res;
+	}
+	return fd;
+}
+
+ssize_t
+qb_sys_hugetlbfs_get(char *dir)
+{
+#ifdef QB_HAVE_HUGETLBFS
+	FILE *mounts;
+	char line[PATH_MAX + 256];
+	char mnt_dir[PATH_MAX];
+	char mnt_type[64];
+	struct statfs sfs;
+	ssize_t res = -ENOENT;
+
+	mounts = fopen("/proc/mounts", "r");
+	if (mounts == NULL) {
+		return -errno;
+	}
+	while (fgets(line, sizeof(line), mounts) != NULL) {
+		if (sscanf(line, "%*s %4095s %63s", mnt_dir, mnt_type) != 2 ||
+		    strcmp(mnt_type, "hugetlbfs") != 0) {
+			continue;
+		}
+		if (access(mnt_dir, W_OK) != 0 ||
+		    statfs(mnt_dir, &sfs) != 0 ||
+		    sfs.f_type != HUGETLBFS_MAGIC) {
+			continue;
+		}
+		(void)strlcpy(dir, mnt_dir, PATH_MAX);
+		res = sfs.f_bsize;
+		break;
+	}
+	fclose(mounts);
+	return res;
+#else
+	return -ENOTSUP;
+#endif /* QB_HAVE_HUGETLBFS */
+}
+
+/*
+ * Returns the huge page size if fd lives on hugetlbfs, otherwise 0.
+ */
+static size_t
+hugetlb_page_size_get(int32_t fd)
+{
+#ifdef QB_HAVE_HUGETLBFS
+	struct statfs sfs;
+
+	if (fstatfs(fd, &sfs) == 0 && sfs.f_type == HUGETLBFS_MAGIC) {
+		return sfs.f_bsize;
+	}
+#endif /* QB_HAVE_HUGETLBFS */
+	return 0;
+}
+
+int32_t
+qb_sys_memfd_open(char *path, const char *file, size_t *bytes,
+		  uint32_t flags)
+{
+#ifdef HAVE_MEMFD_CREATE
+	char mfd_name[QB_SYS_MEMFD_NAME_MAX];
+	unsigned int mfd_flags = MFD_CLOEXEC;
+	size_t huge_size;
+	int32_t fd;
+	int32_t res;
+
+#ifdef MFD_ALLOW_SEALING
+	mfd_flags |= MFD_ALLOW_SEALING;
+#endif /* MFD_ALLOW_SEALING */
+	if (flags & QB_SYS_MMAP_HUGEPAGE) {
+#ifdef MFD_HUGETLB
+		mfd_flags |= MFD_HUGETLB;
+#else
+		return -ENOTSUP;
+#endif /* MFD_HUGETLB */
+	}
+
+	(void)strlcpy(mfd_name, file, sizeof(mfd_name));
+	fd = memfd_create(mfd_name, mfd_flags);
+	if (fd < 0) {
+		res = -errno;
+		qb_util_perror(LOG_DEBUG, "couldn't create memfd %s", mfd_name);
+		return res;
+	}
+
+	huge_size = hugetlb_page_size_get(fd);
+	if (huge_size) {
+		*bytes = QB_ROUNDUP(*bytes, huge_size);
+	}
+	if (ftruncate(fd, *bytes) == -1) {
+		res = -errno;
+		qb_util_perror(LOG_ERR, "couldn't truncate memfd %s", mfd_name);
+		close(fd);
+		return res;
+	}
+#ifdef F_ADD_SEALS
+	(void)fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif /* F_ADD_SEALS */
+
+	snprintf(path, PATH_MAX, "memfd:%s", mfd_name);
+	return fd;
+#else
+	return -ENOTSUP;
+#endif /* HAVE_MEMFD_CREATE */
+}
+
+void
+qb_sys_mmap_prefault(void *addr, size_t bytes)
+{
+#ifndef MAP_POPULATE
+	long page_size = sysconf(_SC_PAGESIZE);
+	volatile char *p;
+
+	if (page_size > 0) {
+		for (p = addr; p < (char *)addr + bytes; p += page_size) {
+			(void)*p;
+		}
+	}
+#endif /* MAP_POPULATE */
+	if (mlock(addr, bytes) != 0) {
+		qb_util_perror(LOG_DEBUG, "couldn't lock %zd bytes at %p",
+			       bytes, addr);
+	}
+}
+
 int32_t
 qb_sys_circular_mmap(int32_t fd, void **buf, size_t bytes)
+{
+	return qb_sys_circular_mmap_2(fd, buf, bytes, 0);
+}
+
+int32_t
+qb_sys_circular_mmap_2(int32_t fd, void **buf, size_t bytes, uint32_t flags)
+{
+	return qb_sys_circular_mmap_3(fd, buf, bytes, 0, flags);
+}
+
+int32_t
+qb_sys_circular_mmap_3(int32_t fd, void **buf, size_t bytes, off_t offset,
+		       uint32_t flags)
 {
 	void *addr_orig = NULL;
 	void *addr;
 	void *addr_next;
 	int32_t res;
-	int flags = MAP_ANONYMOUS;
+	int flags_reserve = MAP_ANONYMOUS;
+	int flags_map = MAP_FIXED | MAP_SHARED;
+	size_t huge_size = hugetlb_page_size_get(fd);
+	size_t slop;
 
 #ifdef QB_FORCE_SHM_ALIGN
 /* On a number of arches any fixed and shared mmap() mapping address
@@ -165,19 +346,51 @@ qb_sys_circular_mmap(int32_t fd, void **buf, size_t bytes)
  * the address returned by the first one is only page-aligned and not
  * aligned to 16k.
  */
-	flags |= MAP_SHARED;
+	flags_reserve |= MAP_SHARED;
 #else
-	flags |= MAP_PRIVATE;
+	flags_reserve |= MAP_PRIVATE;
 #endif /* QB_FORCE_SHM_ALIGN */
+#ifdef MAP_POPULATE
+	if (flags & QB_SYS_MMAP_POPULATE) {
+		flags_map |= MAP_POPULATE;
+	}
+#endif /* MAP_POPULATE */
+	if (flags & QB_SYS_MMAP_PRIVATE) {
+		flags_map = (flags_map & ~MAP_SHARED) | MAP_PRIVATE;
+	}
 
-	addr_orig = mmap(NULL, bytes << 1, PROT_NONE, flags, -1, 0);
+	if (huge_size && (bytes % huge_size) != 0) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	/*
+	 * hugetlbfs can only be mapped at huge page aligned addresses, so
+	 * reserve a bit extra and trim it down to an aligned window.
+	 */
+	addr_orig = mmap(NULL, (bytes << 1) + huge_size, PROT_NONE,
+			 flags_reserve, -1, 0);
 
 	if (addr_orig == MAP_FAILED) {
-		return -errno;
+		res = -errno;
+		close(fd);
+		return res;
+	}
+	if (huge_size) {
+		slop = huge_size - ((uintptr_t)addr_orig % huge_size);
+		if (slop == huge_size) {
+			slop = 0;
+		}
+		if (slop) {
+			munmap(addr_orig, slop);
+		}
+		munmap((char *)addr_orig + slop + (bytes << 1),
+		       huge_size - slop);
+		addr_orig = (char *)addr_orig + slop;
 	}
 
 	addr = mmap(addr_orig, bytes, PROT_READ | PROT_WRITE,
-		    MAP_FIXED | MAP_SHARED, fd, 0);
+		    flags_map, fd, offset);
 
 	if (addr != addr_orig) {
 		res = -errno;
@@ -189,7 +402,7 @@ qb_sys_circular_mmap(int32_t fd, void **buf, size_t bytes)
 	addr_next = ((char *)addr_orig) + bytes;
 	addr = mmap(addr_next,
 		    bytes, PROT_READ | PROT_WRITE,
-		    MAP_FIXED | MAP_SHARED, fd, 0);
+		    flags_map, fd, offset);
 	if (addr != addr_next) {
 		res = -errno;
 		goto cleanup_fail;
@@ -197,6 +410,15 @@ qb_sys_circular_mmap(int32_t fd, void **buf, size_t bytes)
 #if defined(QB_BSD) && defined(MADV_NOSYNC)
 	madvise(((char *)addr_orig) + bytes, bytes, MADV_NOSYNC);
 #endif
+#ifdef MADV_HUGEPAGE
+	if ((flags & QB_SYS_MMAP_HUGEPAGE) && huge_size == 0) {
+		/* only a hint, shmem THP may well be disabled */
+		(void)madvise(addr_orig, bytes << 1, MADV_HUGEPAGE);
+	}
+#endif /* MADV_HUGEPAGE */
+	if (flags & QB_SYS_MMAP_POPULATE) {
+		qb_sys_mmap_prefault(addr_orig, bytes << 1);
+	}
 
 	res = close(fd);
 	if (res) {
@@ -214,6 +436,58 @@ cleanup_fail:
 	return res;
 }
 
+/* errors that only mean "can't do that between these two fds" */
+static int32_t
+_fd_copy_unsupported(int32_t err)
+{
+	return (err == ENOSYS || err == EINVAL || err == EXDEV ||
+		err == EOPNOTSUPP);
+}
+
+ssize_t
+qb_sys_fd_copy(int32_t out_fd, int32_t in_fd, off_t offset, size_t bytes)
+{
+	size_t done = 0;
+	ssize_t res;
+	int32_t err = ENOSYS;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (done < bytes) {
+		res = copy_file_range(in_fd, &offset, out_fd, NULL,
+				      bytes - done, 0);
+		if (res <= 0) {
+			err = (res < 0) ? errno : EIO;
+			break;
+		}
+		done += res;
+	}
+	if (done == bytes) {
+		return done;
+	}
+	if (done > 0 || !_fd_copy_unsupported(err)) {
+		return -err;
+	}
+#endif /* HAVE_COPY_FILE_RANGE */
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+	while (done < bytes) {
+		res = sendfile(out_fd, in_fd, &offset, bytes - done);
+		if (res <= 0) {
+			err = (res < 0) ? errno : EIO;
+			break;
+		}
+		done += res;
+	}
+	if (done == bytes) {
+		return done;
+	}
+	if (done > 0 || !_fd_copy_unsupported(err)) {
+		return -err;
+	}
+#endif /* HAVE_SENDFILE && HAVE_SYS_SENDFILE_H */
+	/* nothing was written, the caller can still write() it */
+	return -ENOSYS;
+}
+
 int32_t
 qb_sys_fd_nonblock_cloexec_set(int32_t fd)
 {
@@ -75,6 +75,113 @@ int32_t qb_sys_mmap_file_open(char *path, const char *file, size_t bytes,
  */
 int32_t qb_sys_circular_mmap(int32_t fd, void **buf, size_t bytes);
 
+/* fault in (and try to mlock) the pages when they are mapped */
+#define QB_SYS_MMAP_POPULATE	0x01
+/* ask for transparent huge pages on the mapping */
+#define QB_SYS_MMAP_HUGEPAGE	0x02
+/* map copy-on-write: writes never reach the file */
+#define QB_SYS_MMAP_PRIVATE	0x04
+
+/**
+ * Create a shared memory circular buffer.
+ *
+ * Same as qb_sys_circular_mmap() but with QB_SYS_MMAP_* flags. If fd is
+ * on hugetlbfs the mapping is aligned to the huge page size.
+ *
+ * @param fd an open file to use to back the shared memory.
+ * @param buf (out) the pointer to the start of the memory.
+ * @param bytes the size of the shared memory.
+ * @param flags QB_SYS_MMAP_* flags
+ * @return 0 (success) or -errno
+ */
+int32_t qb_sys_circular_mmap_2(int32_t fd, void **buf, size_t bytes,
+			       uint32_t flags);
+
+/**
+ * Create a circular buffer from the middle of a file.
+ *
+ * Same as qb_sys_circular_mmap_2() but maps the bytes starting at
+ * offset, which must be a multiple of the page size.
+ *
+ * @param fd an open file to use to back the shared memory.
+ * @param buf (out) the pointer to the start of the memory.
+ * @param bytes the size of the shared memory.
+ * @param offset where in the file the buffer starts.
+ * @param flags QB_SYS_MMAP_* flags
+ * @return 0 (success) or -errno
+ */
+int32_t qb_sys_circular_mmap_3(int32_t fd, void **buf, size_t bytes,
+			       off_t offset, uint32_t flags);
+
+/**
+ * Fault in and try to lock an existing mapping.
+ *
+ * Failing to lock (e.g. RLIMIT_MEMLOCK) is only logged.
+ *
+ * @param addr start of the mapping.
+ * @param bytes the size of the mapping.
+ */
+void qb_sys_mmap_prefault(void *addr, size_t bytes);
+
+/**
+ * Find a mounted hugetlbfs that we can create files in.
+ *
+ * @param dir (out) the mount point (PATH_MAX long).
+ * @return the huge page size of that mount or -errno.
+ */
+ssize_t qb_sys_hugetlbfs_get(char *dir);
+
+/**
+ * Create a file on hugetlbfs to be used to back shared memory.
+ *
+ * hugetlbfs can't be written to, so unlike qb_sys_mmap_file_open()
+ * the file is only truncated to size.
+ *
+ * @param path (out) the final absolute path of the file.
+ * @param dir (in) the hugetlbfs mount point.
+ * @param file (in) the name of the file to be used.
+ * @param bytes the size (a multiple of the huge page size).
+ * @param file_flags same as passed into open()
+ * @return fd (success) or -errno
+ */
+int32_t qb_sys_hugetlb_file_open(char *path, const char *dir,
+				  const char *file, size_t bytes,
+				  uint32_t file_flags);
+
+/**
+ * Create an anonymous file (memfd) to be used to back shared memory.
+ *
+ * The file has no name in the filesystem, it can only be shared by
+ * passing the fd on. Once sized it is sealed against resizing so a
+ * peer can't make the other side's mapping fault.
+ *
+ * @param path (out) a descriptive name, "memfd:<file>".
+ * @param file (in) the name given to memfd_create().
+ * @param bytes (in/out) the size, rounded up to the huge page size
+ *        when huge pages are used.
+ * @param flags QB_SYS_MMAP_HUGEPAGE to ask for a hugetlb backed memfd.
+ * @return fd (success) or -errno (-ENOTSUP without memfd support).
+ */
+int32_t qb_sys_memfd_open(char *path, const char *file, size_t *bytes,
+			  uint32_t flags);
+
+
+/**
+ * Copy part of a file to another fd without going through user space.
+ *
+ * Uses copy_file_range() and falls back to sendfile(); the data is
+ * written at out_fd's current position.
+ *
+ * @param out_fd where to write.
+ * @param in_fd the file to copy from (its position is left alone).
+ * @param offset where in in_fd to start.
+ * @param bytes how much to copy.
+ * @return bytes (success), -ENOSYS if neither works for these fds and
+ * nothing was written (the caller should write() the data itself), or
+ * another -errno.
+ */
+ssize_t qb_sys_fd_copy(int32_t out_fd, int32_t in_fd, off_t offset,
+		       size_t bytes);
 
 /**
  * Set O_NONBLOCK and FD_CLOEXEC on a file descriptor.
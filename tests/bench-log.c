@@ -43,6 +43,42 @@ bm_finish (const char *operation)
 	       ((float)ITERATIONS) /  qb_util_stopwatch_sec_elapsed_get(sw));
 }
 
+/*
+ * Blackbox stress: lots of tiny records with the odd big one, which has
+ * to overwrite a few hundred of them. Report the worst case as well as
+ * the rate as that is what the logging hot path notices.
+ */
+static void
+bm_blackbox_stress(void)
+{
+	char big[QB_LOG_MAX_LEN / 2];
+	uint64_t start;
+	uint64_t elapsed;
+	uint64_t worst_small = 0;
+	uint64_t worst_big = 0;
+	int i;
+
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+
+	qb_util_stopwatch_start(sw);
+	for (i = 0; i < ITERATIONS; i++) {
+		start = qb_util_nano_current_get();
+		if (i % 100 == 99) {
+			qb_log(LOG_DEBUG, "%s", big);
+			elapsed = qb_util_nano_current_get() - start;
+			worst_big = QB_MAX(worst_big, elapsed);
+		} else {
+			qb_log(LOG_DEBUG, "%d", i);
+			elapsed = qb_util_nano_current_get() - start;
+			worst_small = QB_MAX(worst_small, elapsed);
+		}
+	}
+	bm_finish("qb_log blackbox stress:");
+	printf("  worst case: small %" PRIu64 " ns, big %" PRIu64 " ns\n",
+	       worst_small, worst_big);
+}
+
 int
 main(void)
 {
@@ -82,6 +118,7 @@ main(void)
 		qb_log(LOG_DEBUG, "%i %u %p", -534, 4508, &i);
 	}
 	bm_finish ("qb_log 3 args(int):");
+	bm_blackbox_stress();
 #if defined(HAVE_DICT_WORDS) && defined(HAVE_SLOW_TESTS)
 	qb_util_stopwatch_start(sw);
 	log_dict_words();
@@ -30,9 +30,12 @@ pid_t mypid;
 int32_t blocking = QB_TRUE;
 int32_t events = QB_FALSE;
 int32_t verbose = 0;
+static int32_t latency = QB_FALSE;
+static uint32_t busy_poll = 0;
 static qb_ipcc_connection_t *conn;
 #define MAX_MSG_SIZE (8192*128)
 static qb_util_stopwatch_t *sw;
+static uint64_t round_trips[ITERATIONS];
 
 static void bm_finish(const char *operation, int32_t size)
 {
@@ -49,6 +52,42 @@ static void bm_finish(const char *operation, int32_t size)
 	       size, ops_per_sec, mbs_per_sec);
 }
 
+static int
+uint64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void bm_finish_latency(int32_t size, int32_t count)
+{
+	if (count == 0) {
+		return;
+	}
+	qsort(round_trips, count, sizeof(uint64_t), uint64_cmp);
+	qb_log(LOG_INFO,
+	       "write size, %d, round trip usecs p50, %8.2f, p99, %8.2f, max, %8.2f",
+	       size, round_trips[count / 2] / 1000.0,
+	       round_trips[count * 99 / 100] / 1000.0,
+	       round_trips[count - 1] / 1000.0);
+}
+
+static void bm_busy_poll_stats(void)
+{
+	struct qb_rb_busy_poll_stats st;
+
+	if (qb_ipcc_busy_poll_stats_get(conn, &st) != 0) {
+		return;
+	}
+	qb_log(LOG_INFO,
+	       "busy poll: %"PRIu64" spins (%"PRIu64" found a response), %"PRIu64" usecs spinning; "
+	       "%"PRIu64" sleeps, %"PRIu64" usecs asleep",
+	       st.spins, st.spin_hits, st.spin_ns / 1000,
+	       st.sleeps, st.sleep_ns / 1000);
+}
+
 struct my_req {
 	struct qb_ipc_request_header hdr;
 	char message[1024 * 1024];
@@ -121,6 +160,8 @@ static void show_usage(const char *name)
 	qb_log(LOG_INFO, "\n");
 	qb_log(LOG_INFO, "  -n             non-blocking ipc (default blocking)\n");
 	qb_log(LOG_INFO, "  -e             receive events\n");
+	qb_log(LOG_INFO, "  -l             measure the latency of each round trip\n");
+	qb_log(LOG_INFO, "  -b <usecs>     busy poll for responses (shared memory)\n");
 	qb_log(LOG_INFO, "  -v             verbose\n");
 	qb_log(LOG_INFO, "  -h             show this help text\n");
 	qb_log(LOG_INFO, "\n");
@@ -136,10 +177,11 @@ static void sigterm_handler(int32_t num)
 int32_t
 main(int32_t argc, char *argv[])
 {
-	const char *options = "nevh";
+	const char *options = "nevhlb:";
 	int32_t opt;
 	int32_t i, j;
 	size_t size;
+	uint64_t start;
 
 	mypid = getpid();
 
@@ -157,6 +199,12 @@ main(int32_t argc, char *argv[])
 		case 'e':
 			events = QB_TRUE;
 			break;
+		case 'l':
+			latency = QB_TRUE;
+			break;
+		case 'b':
+			busy_poll = strtoul(optarg, NULL, 0);
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -177,6 +225,10 @@ main(int32_t argc, char *argv[])
 		exit(1);
 	}
 
+	if (busy_poll && qb_ipcc_busy_poll_set(conn, busy_poll) != 0) {
+		qb_log(LOG_WARNING, "busy polling not available");
+	}
+
 	sw =  qb_util_stopwatch_create();
 	size = QB_MAX(sizeof(struct qb_ipc_request_header), 64);
 	for (j = 0; j < 20; j++) {
@@ -184,13 +236,20 @@ main(int32_t argc, char *argv[])
 			break;
 		qb_util_stopwatch_start(sw);
 		for (i = 0; i < ITERATIONS; i++) {
+			start = qb_util_nano_current_get();
 			if (bmc_send_nozc(size) == -1) {
 				break;
 			}
+			round_trips[i] = qb_util_nano_current_get() - start;
+		}
+		if (latency) {
+			bm_finish_latency(size, i);
+		} else {
+			bm_finish("send_nozc", size);
 		}
-		bm_finish("send_nozc", size);
 		size *= 2;
 	}
+	bm_busy_poll_stats();
 
 	qb_ipcc_disconnect(conn);
 	return EXIT_SUCCESS;
@@ -34,6 +34,7 @@ int32_t blocking = QB_TRUE;
 int32_t events = QB_FALSE;
 int32_t use_glib = QB_FALSE;
 int32_t verbose = 0;
+static uint32_t busy_poll = 0;
 
 static qb_loop_t *bms_loop;
 #ifdef HAVE_GLIB
@@ -68,6 +69,11 @@ static void s1_connection_created_fn(qb_ipcs_connection_t *c)
 	qb_log(LOG_NOTICE, "Connection created > active:%d > closed:%d",
 	       srv_stats.active_connections,
 	       srv_stats.closed_connections);
+
+	if (busy_poll &&
+	    qb_ipcs_connection_busy_poll_set(c, busy_poll) != 0) {
+		qb_log(LOG_WARNING, "busy polling not available");
+	}
 }
 
 static void s1_connection_destroyed_fn(qb_ipcs_connection_t *c)
@@ -153,6 +159,7 @@ static void show_usage(const char *name)
 	qb_log(LOG_INFO, "  -s             use sysv message queues\n");
 	qb_log(LOG_INFO, "  -u             use unix sockets\n");
 	qb_log(LOG_INFO, "  -g             use glib mainloop\n");
+	qb_log(LOG_INFO, "  -b <usecs>     busy poll for requests (shared memory)\n");
 	qb_log(LOG_INFO, "\n");
 }
 
@@ -255,7 +262,7 @@ static int32_t my_dispatch_del(int32_t fd)
 
 int32_t main(int32_t argc, char *argv[])
 {
-	const char *options = "nevhmpsug";
+	const char *options = "nevhmpsugb:";
 	int32_t opt;
 	int32_t rc;
 	enum qb_ipc_type ipc_type = QB_IPC_SHM;
@@ -298,6 +305,9 @@ int32_t main(int32_t argc, char *argv[])
 		case 'g':
 			use_glib = QB_TRUE;
 			break;
+		case 'b':
+			busy_poll = strtoul(optarg, NULL, 0);
+			break;
 		case 'v':
 			verbose++;
 			break;
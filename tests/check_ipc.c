@@ -23,6 +23,8 @@
 
 #include "os_base.h"
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <signal.h>
 #include <check.h>
 
@@ -31,6 +33,7 @@
 #include <qb/qbipcc.h>
 #include <qb/qbipcs.h>
 #include <qb/qbloop.h>
+#include <qb/qbrb.h>
 
 static const char *ipc_name = "ipc_test";
 
@@ -49,6 +52,9 @@ static int CALCULATED_DGRAM_MAX_MSG_SIZE = 0;
 #define GIANT_MSG_DATA_SIZE MAX_MSG_SIZE - sizeof(struct qb_ipc_response_header) - 8
 
 static int enforce_server_buffer=0;
+static uint32_t server_workers = 0;
+static uint32_t server_msg_batch = 0;
+static uint32_t server_busy_poll = 0;
 static qb_ipcc_connection_t *conn;
 static enum qb_ipc_type ipc_type;
 
@@ -65,8 +71,18 @@ enum my_msg_ids {
 	IPC_MSG_RES_SERVER_FAIL,
 	IPC_MSG_REQ_SERVER_DISCONNECT,
 	IPC_MSG_RES_SERVER_DISCONNECT,
+	IPC_MSG_REQ_ZERO_COPY,
+	IPC_MSG_RES_ZERO_COPY,
+	IPC_MSG_REQ_BROADCAST,
+	IPC_MSG_RES_BROADCAST,
+	IPC_MSG_REQ_RECV_RETRIES,
+	IPC_MSG_RES_RECV_RETRIES,
 };
 
+#define ZERO_COPY_MSG_SIZE 1024
+#define BROADCAST_CLIENTS 3
+#define BROADCAST_PAYLOAD_SIZE 100
+
 /* Test Cases
  *
  * 1) basic send & recv differnet message sizes
@@ -228,6 +244,76 @@ s1_msg_process_fn(qb_ipcs_connection_t *c,
 		exit(0);
 	} else if (req_pt->id == IPC_MSG_REQ_SERVER_DISCONNECT) {
 		qb_ipcs_disconnect(c);
+	} else if (req_pt->id == IPC_MSG_REQ_ZERO_COPY) {
+		struct qb_ipc_response_header *hdr;
+
+		/* build both in place, committing less than was allocated */
+		hdr = qb_ipcs_response_alloc(c, 2 * ZERO_COPY_MSG_SIZE);
+		if (hdr == NULL) {
+			qb_perror(LOG_INFO, "qb_ipcs_response_alloc");
+			return 0;
+		}
+		hdr->size = ZERO_COPY_MSG_SIZE;
+		hdr->id = IPC_MSG_RES_ZERO_COPY;
+		hdr->error = 0;
+		memset(hdr + 1, 'r', ZERO_COPY_MSG_SIZE - sizeof(*hdr));
+		res = qb_ipcs_response_commit(c, ZERO_COPY_MSG_SIZE);
+		if (res != ZERO_COPY_MSG_SIZE) {
+			qb_log(LOG_INFO, "qb_ipcs_response_commit %zd", res);
+		}
+
+		hdr = qb_ipcs_event_alloc(c, ZERO_COPY_MSG_SIZE);
+		if (hdr == NULL) {
+			qb_perror(LOG_INFO, "qb_ipcs_event_alloc");
+			return 0;
+		}
+		hdr->size = ZERO_COPY_MSG_SIZE;
+		hdr->id = IPC_MSG_RES_ZERO_COPY;
+		hdr->error = 0;
+		memset(hdr + 1, 'e', ZERO_COPY_MSG_SIZE - sizeof(*hdr));
+		res = qb_ipcs_event_commit(c, ZERO_COPY_MSG_SIZE);
+		if (res != ZERO_COPY_MSG_SIZE) {
+			qb_log(LOG_INFO, "qb_ipcs_event_commit %zd", res);
+		}
+	} else if (req_pt->id == IPC_MSG_REQ_BROADCAST) {
+		char payload[BROADCAST_PAYLOAD_SIZE];
+		struct iovec iov[2];
+
+		memset(payload, 'b', sizeof(payload));
+		response.size = sizeof(response) + sizeof(payload);
+		response.id = IPC_MSG_RES_BROADCAST;
+		response.error = 0;
+		iov[0].iov_base = &response;
+		iov[0].iov_len = sizeof(response);
+		iov[1].iov_base = payload;
+		iov[1].iov_len = sizeof(payload);
+		res = qb_ipcs_event_broadcast(s1, iov, 2, NULL, NULL);
+		if (res != BROADCAST_CLIENTS) {
+			qb_log(LOG_INFO, "qb_ipcs_event_broadcast %zd", res);
+		}
+	} else if (req_pt->id == IPC_MSG_REQ_RECV_RETRIES) {
+		struct qb_ipcs_connection_stats_2 *stats;
+
+		stats = qb_ipcs_connection_stats_get_2(c, QB_FALSE);
+		response.size = sizeof(response);
+		response.id = IPC_MSG_RES_RECV_RETRIES;
+		response.error = stats->recv_retries;
+		free(stats);
+		res = qb_ipcs_response_send(c, &response, response.size);
+		ck_assert_int_eq(res, sizeof(response));
+	}
+	return 0;
+}
+
+static int32_t
+s1_msg_process_batch_fn(qb_ipcs_connection_t *c,
+			const struct iovec *msgs, size_t n_msgs)
+{
+	size_t i;
+
+	fail_if(n_msgs > server_msg_batch);
+	for (i = 0; i < n_msgs; i++) {
+		(void)s1_msg_process_fn(c, msgs[i].iov_base, msgs[i].iov_len);
 	}
 	return 0;
 }
@@ -339,6 +425,10 @@ s1_connection_created(qb_ipcs_connection_t *c)
 		qb_ipcs_context_set(c, context);
 	}
 
+	if (server_busy_poll) {
+		ck_assert_int_eq(qb_ipcs_connection_busy_poll_set(c, server_busy_poll),
+				 ipc_type == QB_IPC_SHM ? 0 : -ENOTSUP);
+	}
 
 	ck_assert_int_eq(max, qb_ipcs_connection_get_buffer_size(c));
 
@@ -380,6 +470,16 @@ run_ipc_server(void)
 		qb_ipcs_enforce_buffer_size(s1, max_size);
 	}
 	qb_ipcs_poll_handlers_set(s1, &ph);
+	if (server_workers > 0) {
+		res = qb_ipcs_workers_set(s1, server_workers,
+					  QB_IPCS_WORKER_LEAST_LOADED);
+		ck_assert_int_eq(res, 0);
+	}
+	if (server_msg_batch > 0) {
+		res = qb_ipcs_msg_process_batch_set(s1, s1_msg_process_batch_fn,
+						    server_msg_batch);
+		ck_assert_int_eq(res, 0);
+	}
 
 	res = qb_ipcs_run(s1);
 	ck_assert_int_eq(res, 0);
@@ -1227,79 +1327,263 @@ test_ipc_server_fail(void)
 	verify_graceful_stop(pid);
 }
 
-START_TEST(test_ipc_server_fail_soc)
+static void
+test_ipc_zero_copy(void)
+{
+	struct qb_ipc_request_header req_header;
+	struct qb_ipc_request_header *req_pt;
+	struct qb_ipc_response_header *res_header;
+	struct qb_ipc_response_header *peek_header;
+	char buf[ZERO_COPY_MSG_SIZE];
+	void *msg;
+	int32_t c = 0;
+	int32_t j = 0;
+	int32_t i;
+	pid_t pid;
+	ssize_t res;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+
+	req_header.id = IPC_MSG_REQ_ZERO_COPY;
+	req_header.size = sizeof(struct qb_ipc_request_header);
+	res_header = (struct qb_ipc_response_header *)buf;
+
+	for (i = 0; i < 10; i++) {
+		if (i % 2) {
+			res = qb_ipcc_send(conn, &req_header, req_header.size);
+			ck_assert_int_eq(res, req_header.size);
+
+			res = qb_ipcc_recv(conn, buf, sizeof(buf), 5000);
+			ck_assert_int_eq(res, ZERO_COPY_MSG_SIZE);
+			ck_assert_int_eq(res_header->id, IPC_MSG_RES_ZERO_COPY);
+			ck_assert_int_eq(buf[sizeof(*res_header)], 'r');
+			ck_assert_int_eq(buf[sizeof(buf) - 1], 'r');
+		} else {
+			/* the client side in place too */
+			req_pt = qb_ipcc_send_alloc(conn, 4 * req_header.size);
+			fail_if(req_pt == NULL);
+			memcpy(req_pt, &req_header, req_header.size);
+			res = qb_ipcc_send_commit(conn, req_header.size);
+			ck_assert_int_eq(res, req_header.size);
+
+			res = qb_ipcc_recv_peek(conn, &msg, 5000);
+			ck_assert_int_eq(res, ZERO_COPY_MSG_SIZE);
+			peek_header = msg;
+			ck_assert_int_eq(peek_header->id, IPC_MSG_RES_ZERO_COPY);
+			ck_assert_int_eq(((char *)msg)[sizeof(*peek_header)], 'r');
+			ck_assert_int_eq(((char *)msg)[res - 1], 'r');
+			qb_ipcc_recv_release(conn);
+		}
+
+		res = qb_ipcc_event_recv(conn, buf, sizeof(buf), 5000);
+		ck_assert_int_eq(res, ZERO_COPY_MSG_SIZE);
+		ck_assert_int_eq(res_header->id, IPC_MSG_RES_ZERO_COPY);
+		ck_assert_int_eq(buf[sizeof(*res_header)], 'e');
+		ck_assert_int_eq(buf[sizeof(buf) - 1], 'e');
+	}
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_zero_copy_us)
 {
 	qb_enter();
 	ipc_type = QB_IPC_SOCKET;
 	ipc_name = __func__;
-	test_ipc_server_fail();
+	test_ipc_zero_copy();
 	qb_leave();
 }
 END_TEST
 
-START_TEST(test_ipc_disp_shm)
+START_TEST(test_ipc_zero_copy_shm)
 {
 	qb_enter();
 	ipc_type = QB_IPC_SHM;
 	ipc_name = __func__;
-	test_ipc_dispatch();
+	test_ipc_zero_copy();
 	qb_leave();
 }
 END_TEST
 
-START_TEST(test_ipc_stress_test_shm)
+#define WORKERS_CLIENTS 4
+
+static void
+test_ipc_workers(void)
+{
+	qb_ipcc_connection_t *conns[WORKERS_CLIENTS];
+	int32_t i;
+	int32_t j;
+	int32_t c = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	server_workers = 2;
+	pid = run_function_in_new_process(run_ipc_server);
+	server_workers = 0;
+	fail_if(pid == -1);
+	sleep(1);
+
+	for (i = 0; i < WORKERS_CLIENTS; i++) {
+		do {
+			conns[i] = qb_ipcc_connect(ipc_name, max_size);
+			if (conns[i] == NULL) {
+				j = waitpid(pid, NULL, WNOHANG);
+				ck_assert_int_eq(j, 0);
+				sleep(1);
+				c++;
+			}
+		} while (conns[i] == NULL && c < 5);
+		fail_if(conns[i] == NULL);
+	}
+
+	/* interleave the clients so that every worker has requests queued */
+	for (j = 0; j < 200; j++) {
+		for (i = 0; i < WORKERS_CLIENTS; i++) {
+			conn = conns[i];
+			ck_assert_int_eq(send_and_check(IPC_MSG_REQ_TX_RX, 64,
+							recv_timeout, QB_TRUE),
+					 sizeof(struct qb_ipc_response_header));
+		}
+	}
+	/* events go out from the workers too */
+	for (i = 0; i < WORKERS_CLIENTS; i++) {
+		conn = conns[i];
+		ck_assert_int_eq(send_and_check(IPC_MSG_REQ_DISPATCH, 64,
+						recv_timeout, QB_TRUE),
+				 sizeof(struct qb_ipc_response_header));
+	}
+
+	conn = conns[0];
+	request_server_exit();
+	for (i = 0; i < WORKERS_CLIENTS; i++) {
+		qb_ipcc_disconnect(conns[i]);
+	}
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_workers_us)
 {
 	qb_enter();
-	send_event_on_created = QB_FALSE;
-	ipc_type = QB_IPC_SHM;
+	ipc_type = QB_IPC_SOCKET;
 	ipc_name = __func__;
-	test_ipc_stress_test();
+	test_ipc_workers();
 	qb_leave();
 }
 END_TEST
 
-START_TEST(test_ipc_bulk_events_shm)
+START_TEST(test_ipc_workers_shm)
 {
 	qb_enter();
 	ipc_type = QB_IPC_SHM;
 	ipc_name = __func__;
-	test_ipc_bulk_events();
+	test_ipc_workers();
 	qb_leave();
 }
 END_TEST
 
-START_TEST(test_ipc_event_on_created_shm)
+#define MSG_BATCH_DEPTH 8
+
+static void
+test_ipc_msg_batch(void)
+{
+	struct qb_ipc_request_header req_header;
+	struct qb_ipc_response_header res_header;
+	int32_t i;
+	int32_t j;
+	int32_t c = 0;
+	ssize_t res;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	server_msg_batch = MSG_BATCH_DEPTH / 2;
+	pid = run_function_in_new_process(run_ipc_server);
+	server_msg_batch = 0;
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+
+	req_header.id = IPC_MSG_REQ_TX_RX;
+	req_header.size = sizeof(req_header);
+	for (j = 0; j < 50; j++) {
+		/* queue requests up so that the server sees several at once */
+		for (i = 0; i < MSG_BATCH_DEPTH; i++) {
+			res = qb_ipcc_send(conn, &req_header, req_header.size);
+			ck_assert_int_eq(res, req_header.size);
+		}
+		for (i = 0; i < MSG_BATCH_DEPTH; i++) {
+			res = qb_ipcc_recv(conn, &res_header,
+					   sizeof(res_header), recv_timeout);
+			ck_assert_int_eq(res, sizeof(res_header));
+			ck_assert_int_eq(res_header.id, IPC_MSG_RES_TX_RX);
+		}
+	}
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_msg_batch_us)
 {
 	qb_enter();
-	send_event_on_created = QB_TRUE;
-	ipc_type = QB_IPC_SHM;
+	ipc_type = QB_IPC_SOCKET;
 	ipc_name = __func__;
-	test_ipc_event_on_created();
+	test_ipc_msg_batch();
 	qb_leave();
 }
 END_TEST
 
-START_TEST(test_ipc_server_fail_shm)
+START_TEST(test_ipc_msg_batch_shm)
 {
 	qb_enter();
 	ipc_type = QB_IPC_SHM;
 	ipc_name = __func__;
-	test_ipc_server_fail();
+	test_ipc_msg_batch();
 	qb_leave();
 }
 END_TEST
 
 static void
-test_ipc_service_ref_count(void)
+test_ipc_busy_poll(void)
 {
+	struct qb_ipc_request_header req_header;
+	struct qb_ipc_response_header res_header;
+	struct qb_rb_busy_poll_stats st;
+	int32_t j;
 	int32_t c = 0;
-	int32_t j = 0;
+	ssize_t res;
 	pid_t pid;
 	uint32_t max_size = MAX_MSG_SIZE;
 
-	reference_count_test = QB_TRUE;
-
+	server_busy_poll = 50;
 	pid = run_function_in_new_process(run_ipc_server);
+	server_busy_poll = 0;
 	fail_if(pid == -1);
 	sleep(1);
 
@@ -1314,101 +1598,811 @@ test_ipc_service_ref_count(void)
 	} while (conn == NULL && c < 5);
 	fail_if(conn == NULL);
 
-	sleep(5);
+	if (ipc_type == QB_IPC_SHM) {
+		ck_assert_int_eq(qb_ipcc_busy_poll_set(conn, 50), 0);
+	} else {
+		ck_assert_int_eq(qb_ipcc_busy_poll_set(conn, 50), -ENOTSUP);
+	}
 
-	kill_server(pid);
-}
+	req_header.id = IPC_MSG_REQ_TX_RX;
+	req_header.size = sizeof(req_header);
+	for (j = 0; j < 500; j++) {
+		res = qb_ipcc_send(conn, &req_header, req_header.size);
+		ck_assert_int_eq(res, req_header.size);
+		res = qb_ipcc_recv(conn, &res_header,
+				   sizeof(res_header), recv_timeout);
+		ck_assert_int_eq(res, sizeof(res_header));
+		ck_assert_int_eq(res_header.id, IPC_MSG_RES_TX_RX);
+	}
+
+	if (ipc_type == QB_IPC_SHM) {
+		ck_assert_int_eq(qb_ipcc_busy_poll_stats_get(conn, &st), 0);
+		if (sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+			fail_unless(st.spins > 0);
+		} else {
+			ck_assert_int_eq(st.spins, 0);
+		}
+		fail_unless(st.spin_hits <= st.spins);
+		fail_unless(st.budget_ns <= 50 * 1000);
+	} else {
+		ck_assert_int_eq(qb_ipcc_busy_poll_stats_get(conn, &st),
+				 -ENOTSUP);
+	}
 
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
 
-START_TEST(test_ipc_service_ref_count_shm)
+START_TEST(test_ipc_busy_poll_us)
 {
 	qb_enter();
-	ipc_type = QB_IPC_SHM;
+	ipc_type = QB_IPC_SOCKET;
 	ipc_name = __func__;
-	test_ipc_service_ref_count();
+	test_ipc_busy_poll();
 	qb_leave();
 }
 END_TEST
 
-START_TEST(test_ipc_service_ref_count_us)
+START_TEST(test_ipc_busy_poll_shm)
 {
 	qb_enter();
-	ipc_type = QB_IPC_SOCKET;
+	ipc_type = QB_IPC_SHM;
 	ipc_name = __func__;
-	test_ipc_service_ref_count();
+	test_ipc_busy_poll();
 	qb_leave();
 }
 END_TEST
 
-static void test_max_dgram_size(void)
+static void
+test_ipc_event_broadcast(uint32_t workers)
 {
-	/* most implementations will not let you set a dgram buffer 
-	 * of 1 million bytes. This test verifies that the we can detect
-	 * the max dgram buffersize regardless, and that the value we detect
-	 * is consistent. */
-	int32_t init;
+	qb_ipcc_connection_t *conns[BROADCAST_CLIENTS];
+	struct qb_ipc_request_header req_header;
+	struct qb_ipc_response_header *res_header;
+	char buf[sizeof(*res_header) + BROADCAST_PAYLOAD_SIZE];
 	int32_t i;
+	int32_t j;
+	int32_t c = 0;
+	ssize_t res;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
 
-	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_REMOVE,
-			  QB_LOG_FILTER_FILE, "*", LOG_TRACE);
+	/* with workers, from a worker's thread to its own and the others' */
+	server_workers = workers;
+	pid = run_function_in_new_process(run_ipc_server);
+	server_workers = 0;
+	fail_if(pid == -1);
+	sleep(1);
 
-	init = qb_ipcc_verify_dgram_max_msg_size(1000000);
-	fail_if(init <= 0);
-	for (i = 0; i < 100; i++) {
-		int try = qb_ipcc_verify_dgram_max_msg_size(1000000);
-		ck_assert_int_eq(init, try);
+	for (i = 0; i < BROADCAST_CLIENTS; i++) {
+		do {
+			conns[i] = qb_ipcc_connect(ipc_name, max_size);
+			if (conns[i] == NULL) {
+				j = waitpid(pid, NULL, WNOHANG);
+				ck_assert_int_eq(j, 0);
+				sleep(1);
+				c++;
+			}
+		} while (conns[i] == NULL && c < 5);
+		fail_if(conns[i] == NULL);
 	}
 
-	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
-			  QB_LOG_FILTER_FILE, "*", LOG_TRACE);
+	req_header.id = IPC_MSG_REQ_BROADCAST;
+	req_header.size = sizeof(req_header);
+	for (j = 0; j < 10; j++) {
+		/* one request, an event for everybody */
+		res = qb_ipcc_send(conns[j % BROADCAST_CLIENTS], &req_header,
+				   req_header.size);
+		ck_assert_int_eq(res, req_header.size);
+
+		for (i = 0; i < BROADCAST_CLIENTS; i++) {
+			res = qb_ipcc_event_recv(conns[i], buf, sizeof(buf),
+						 recv_timeout);
+			ck_assert_int_eq(res, sizeof(buf));
+			res_header = (struct qb_ipc_response_header *)buf;
+			ck_assert_int_eq(res_header->id, IPC_MSG_RES_BROADCAST);
+			ck_assert_int_eq(buf[sizeof(*res_header)], 'b');
+			ck_assert_int_eq(buf[sizeof(buf) - 1], 'b');
+		}
+	}
+
+	conn = conns[0];
+	request_server_exit();
+	for (i = 0; i < BROADCAST_CLIENTS; i++) {
+		qb_ipcc_disconnect(conns[i]);
+	}
+	verify_graceful_stop(pid);
 }
 
-START_TEST(test_ipc_max_dgram_size)
+START_TEST(test_ipc_event_broadcast_us)
 {
 	qb_enter();
-	test_max_dgram_size();
+	ipc_type = QB_IPC_SOCKET;
+	ipc_name = __func__;
+	test_ipc_event_broadcast(0);
 	qb_leave();
 }
 END_TEST
 
-static Suite *
-make_shm_suite(void)
+START_TEST(test_ipc_event_broadcast_shm)
 {
-	TCase *tc;
-	Suite *s = suite_create("shm");
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	ipc_name = __func__;
+	test_ipc_event_broadcast(0);
+	qb_leave();
+}
+END_TEST
 
-	tc = tcase_create("ipc_txrx_shm_timeout");
-	tcase_add_test(tc, test_ipc_txrx_shm_timeout);
-	tcase_set_timeout(tc, 30);
-	suite_add_tcase(s, tc);
+START_TEST(test_ipc_event_broadcast_workers_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	ipc_name = __func__;
+	test_ipc_event_broadcast(2);
+	qb_leave();
+}
+END_TEST
 
-	tc = tcase_create("ipc_server_fail_shm");
-	tcase_add_test(tc, test_ipc_server_fail_shm);
-	tcase_set_timeout(tc, 8);
-	suite_add_tcase(s, tc);
+#define ASYNC_WINDOW 8
+#define ASYNC_REQUESTS 500
 
-	tc = tcase_create("ipc_txrx_shm_block");
-	tcase_add_test(tc, test_ipc_txrx_shm_block);
-	tcase_set_timeout(tc, 8);
-	suite_add_tcase(s, tc);
+static uint64_t async_sent;
+static uint64_t async_done;
+static uint64_t async_cancelled;
 
-	tc = tcase_create("ipc_txrx_shm_tmo");
-	tcase_add_test(tc, test_ipc_txrx_shm_tmo);
-	tcase_set_timeout(tc, 8);
-	suite_add_tcase(s, tc);
+static void async_send_more(qb_loop_t *cl);
 
-	tc = tcase_create("ipc_fc_shm");
-	tcase_add_test(tc, test_ipc_fc_shm);
-	tcase_set_timeout(tc, 8);
-	suite_add_tcase(s, tc);
+static void
+async_response_fn(qb_ipcc_connection_t *c, uint64_t id,
+		  const void *response, ssize_t size, void *data)
+{
+	const struct qb_ipc_response_header *res_header = response;
+	qb_loop_t *cl = (qb_loop_t *)data;
 
-	tc = tcase_create("ipc_dispatch_shm");
-	tcase_add_test(tc, test_ipc_disp_shm);
-	tcase_set_timeout(tc, 16);
-	suite_add_tcase(s, tc);
+	if (size == -ECANCELED) {
+		async_cancelled++;
+		return;
+	}
+	ck_assert_int_eq(size, sizeof(struct qb_ipc_response_header));
+	ck_assert_int_eq(res_header->id, IPC_MSG_RES_TX_RX);
+	/* responses come back in the order the requests went out */
+	ck_assert_int_eq(id, async_done);
+	async_done++;
 
-	tc = tcase_create("ipc_stress_test_shm");
-	tcase_add_test(tc, test_ipc_stress_test_shm);
+	if (async_done == ASYNC_REQUESTS) {
+		qb_loop_stop(cl);
+	} else {
+		async_send_more(cl);
+	}
+}
+
+static void
+async_send_more(qb_loop_t *cl)
+{
+	struct qb_ipc_request_header req_header;
+	struct iovec iov;
+	ssize_t res;
+
+	req_header.id = IPC_MSG_REQ_TX_RX;
+	req_header.size = sizeof(req_header);
+	iov.iov_base = &req_header;
+	iov.iov_len = sizeof(req_header);
+
+	while (async_sent < ASYNC_REQUESTS) {
+		res = qb_ipcc_send_async(conn, &iov, 1, async_sent,
+					 async_response_fn, cl);
+		if (res == -EAGAIN) {
+			break;
+		}
+		ck_assert_int_eq(res, sizeof(req_header));
+		async_sent++;
+	}
+}
+
+static void
+async_disconnect_fn(qb_ipcc_connection_t *c, uint64_t id,
+		    const void *response, ssize_t size, void *data)
+{
+	qb_loop_t *cl = (qb_loop_t *)data;
+
+	if (size == -ECANCELED) {
+		async_cancelled++;
+		return;
+	}
+	ck_assert_int_eq(size, sizeof(struct qb_ipc_response_header));
+	async_done++;
+
+	/* the others are cancelled before this returns */
+	qb_ipcc_disconnect(c);
+	conn = NULL;
+	ck_assert_int_eq(async_cancelled, ASYNC_WINDOW - 1);
+	qb_loop_stop(cl);
+}
+
+static void
+test_ipc_async(void)
+{
+	struct qb_ipc_request_header req_header;
+	struct qb_ipc_response_header res_header;
+	struct iovec iov;
+	qb_ipcc_connection_t *sync_conn = NULL;
+	qb_loop_t *cl;
+	int32_t i;
+	int32_t j;
+	int32_t c = 0;
+	ssize_t res;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect_2(ipc_name, max_size,
+					 QB_IPCC_FLAG_ASYNC);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+
+	cl = qb_loop_create();
+	if (ipc_type == QB_IPC_SHM) {
+		/* responses aren't signalled on an fd unless asked for */
+		sync_conn = qb_ipcc_connect(ipc_name, max_size);
+		fail_if(sync_conn == NULL);
+		ck_assert_int_eq(qb_ipcc_async_start(sync_conn, cl,
+						     ASYNC_WINDOW), -ENOTSUP);
+	}
+	ck_assert_int_eq(qb_ipcc_async_start(conn, cl, ASYNC_WINDOW), 0);
+	ck_assert_int_eq(qb_ipcc_async_start(conn, cl, ASYNC_WINDOW), -EBUSY);
+
+	async_sent = 0;
+	async_done = 0;
+	async_cancelled = 0;
+	async_send_more(cl);
+	/* nothing has been dispatched yet, so the window is full */
+	ck_assert_int_eq(async_sent, ASYNC_WINDOW);
+	qb_loop_run(cl);
+	ck_assert_int_eq(async_done, ASYNC_REQUESTS);
+
+	/* stopping cancels what's in flight, the responses stay queued */
+	async_sent = 0;
+	async_send_more(cl);
+	qb_ipcc_async_stop(conn);
+	ck_assert_int_eq(async_cancelled, ASYNC_WINDOW);
+	for (i = 0; i < ASYNC_WINDOW; i++) {
+		res = qb_ipcc_recv(conn, &res_header, sizeof(res_header),
+				   recv_timeout);
+		ck_assert_int_eq(res, sizeof(res_header));
+		ck_assert_int_eq(res_header.id, IPC_MSG_RES_TX_RX);
+	}
+
+	/* a callback may disconnect */
+	ck_assert_int_eq(qb_ipcc_async_start(conn, cl, ASYNC_WINDOW), 0);
+	async_done = 0;
+	async_cancelled = 0;
+	req_header.id = IPC_MSG_REQ_TX_RX;
+	req_header.size = sizeof(req_header);
+	iov.iov_base = &req_header;
+	iov.iov_len = sizeof(req_header);
+	for (i = 0; i < ASYNC_WINDOW; i++) {
+		res = qb_ipcc_send_async(conn, &iov, 1, i,
+					 async_disconnect_fn, cl);
+		ck_assert_int_eq(res, sizeof(req_header));
+	}
+	qb_loop_run(cl);
+	ck_assert_int_eq(async_done, 1);
+	ck_assert_int_eq(async_cancelled, ASYNC_WINDOW - 1);
+	fail_unless(conn == NULL);
+
+	kill_server(pid);
+	if (sync_conn) {
+		qb_ipcc_disconnect(sync_conn);
+	}
+	qb_loop_destroy(cl);
+}
+
+START_TEST(test_ipc_async_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	ipc_name = __func__;
+	test_ipc_async();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_async_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	ipc_name = __func__;
+	test_ipc_async();
+	qb_leave();
+}
+END_TEST
+
+#define EVENTFD_ROUNDS 100
+
+static void
+test_ipc_eventfd(void)
+{
+	struct qb_ipc_request_header req_header;
+	struct qb_ipc_response_header res_header;
+	struct iovec iov;
+	int32_t i;
+	int32_t j;
+	int32_t c = 0;
+	ssize_t res;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+
+	for (i = 0; i < EVENTFD_ROUNDS; i++) {
+		ck_assert_int_eq(send_and_check(IPC_MSG_REQ_TX_RX, 0,
+						recv_timeout, QB_TRUE),
+				 sizeof(res_header));
+		ck_assert_int_eq(send_and_check(IPC_MSG_REQ_DISPATCH, 0,
+						recv_timeout, QB_TRUE),
+				 sizeof(res_header));
+	}
+
+	/*
+	 * Each request is an eventfd edge; finding the ringbuffer empty
+	 * afterwards is how the server clears it, not a retry.
+	 */
+	req_header.id = IPC_MSG_REQ_RECV_RETRIES;
+	req_header.size = sizeof(req_header);
+	iov.iov_base = &req_header;
+	iov.iov_len = sizeof(req_header);
+	res = qb_ipcc_sendv_recv(conn, &iov, 1, &res_header,
+				 sizeof(res_header), recv_timeout);
+	ck_assert_int_eq(res, sizeof(res_header));
+	ck_assert_int_eq(res_header.id, IPC_MSG_RES_RECV_RETRIES);
+	ck_assert_int_eq(res_header.error, 0);
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_eventfd_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	ipc_name = __func__;
+	recv_timeout = 1000;
+	test_ipc_eventfd();
+	qb_leave();
+}
+END_TEST
+
+/*
+ * The handshake of a client from before the connection flags: they were
+ * padding, so it sends 0, opens the ringbuffers by name and signals
+ * every message with a byte on the setup socket.
+ */
+struct old_connection_request {
+	struct qb_ipc_request_header hdr;
+	uint32_t max_msg_size;
+	uint32_t padding;
+} __attribute__ ((aligned(8)));
+
+struct old_connection_response {
+	struct qb_ipc_response_header hdr;
+	int32_t connection_type;
+	uint32_t max_msg_size;
+	intptr_t connection;
+	char request[PATH_MAX];
+	char response[PATH_MAX];
+	char event[PATH_MAX];
+} __attribute__ ((aligned(8)));
+
+static int32_t
+old_client_connect(struct old_connection_response *r)
+{
+	struct old_connection_request req;
+	struct sockaddr_un address;
+	socklen_t addr_len;
+	char *p = (char *)r;
+	size_t done = 0;
+	ssize_t res;
+	int on = 1;
+	int sock;
+
+	sock = socket(PF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		return -errno;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+#if defined(QB_LINUX) || defined(QB_CYGWIN)
+	/* abstract */
+	snprintf(address.sun_path + 1, sizeof(address.sun_path) - 1, "%s",
+		 ipc_name);
+	addr_len = sizeof(address);
+#else
+	snprintf(address.sun_path, sizeof(address.sun_path), "%s/%s",
+		 SOCKETDIR, ipc_name);
+	addr_len = SUN_LEN(&address);
+#endif
+	if (connect(sock, (struct sockaddr *)&address, addr_len) < 0) {
+		res = -errno;
+		close(sock);
+		return res;
+	}
+#ifdef QB_LINUX
+	setsockopt(sock, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
+#endif
+
+	memset(&req, 0, sizeof(req));
+	req.hdr.id = QB_IPC_MSG_AUTHENTICATE;
+	req.hdr.size = sizeof(req);
+	req.max_msg_size = MAX_MSG_SIZE;
+	ck_assert_int_eq(send(sock, &req, sizeof(req), 0), sizeof(req));
+
+	while (done < sizeof(*r)) {
+		res = recv(sock, p + done, sizeof(*r) - done, 0);
+		if (res <= 0) {
+			close(sock);
+			return -EIO;
+		}
+		done += res;
+	}
+	ck_assert_int_eq(r->hdr.error, 0);
+	return sock;
+}
+
+static void
+test_ipc_old_client(void)
+{
+	struct old_connection_response r;
+	struct qb_ipc_request_header req_header;
+	struct qb_ipc_response_header res_header;
+	qb_ringbuffer_t *request_rb;
+	qb_ringbuffer_t *response_rb;
+	qb_ringbuffer_t *event_rb;
+	char one = 1;
+	int32_t sock = -1;
+	int32_t i;
+	int32_t c = 0;
+	ssize_t res;
+	pid_t pid;
+
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		sock = old_client_connect(&r);
+		if (sock < 0) {
+			ck_assert_int_eq(waitpid(pid, NULL, WNOHANG), 0);
+			sleep(1);
+			c++;
+		}
+	} while (sock < 0 && c < 5);
+	fail_if(sock < 0);
+
+	request_rb = qb_rb_open(r.request, r.max_msg_size,
+				QB_RB_FLAG_SHARED_PROCESS, sizeof(int32_t));
+	fail_if(request_rb == NULL);
+	response_rb = qb_rb_open(r.response, r.max_msg_size,
+				 QB_RB_FLAG_SHARED_PROCESS, 0);
+	fail_if(response_rb == NULL);
+	event_rb = qb_rb_open(r.event, r.max_msg_size,
+			      QB_RB_FLAG_SHARED_PROCESS, 0);
+	fail_if(event_rb == NULL);
+
+	req_header.size = sizeof(req_header);
+	for (i = 0; i < EVENTFD_ROUNDS; i++) {
+		req_header.id = IPC_MSG_REQ_TX_RX;
+		res = qb_rb_chunk_write(request_rb, &req_header,
+					sizeof(req_header));
+		ck_assert_int_eq(res, sizeof(req_header));
+		ck_assert_int_eq(send(sock, &one, 1, 0), 1);
+		res = qb_rb_chunk_read(response_rb, &res_header,
+				       sizeof(res_header), recv_timeout);
+		ck_assert_int_eq(res, sizeof(res_header));
+		ck_assert_int_eq(res_header.id, IPC_MSG_RES_TX_RX);
+
+		req_header.id = IPC_MSG_REQ_DISPATCH;
+		res = qb_rb_chunk_write(request_rb, &req_header,
+					sizeof(req_header));
+		ck_assert_int_eq(res, sizeof(req_header));
+		ck_assert_int_eq(send(sock, &one, 1, 0), 1);
+		res = qb_rb_chunk_read(event_rb, &res_header,
+				       sizeof(res_header), recv_timeout);
+		ck_assert_int_eq(res, sizeof(res_header));
+		ck_assert_int_eq(res_header.id, IPC_MSG_RES_DISPATCH);
+		/* the byte the server sent with the event */
+		ck_assert_int_eq(recv(sock, &one, 1, 0), 1);
+	}
+
+	req_header.id = IPC_MSG_REQ_SERVER_FAIL;
+	res = qb_rb_chunk_write(request_rb, &req_header, sizeof(req_header));
+	ck_assert_int_eq(res, sizeof(req_header));
+	ck_assert_int_eq(send(sock, &one, 1, 0), 1);
+	verify_graceful_stop(pid);
+
+	qb_rb_close(event_rb);
+	qb_rb_close(response_rb);
+	qb_rb_close(request_rb);
+	close(sock);
+}
+
+START_TEST(test_ipc_old_client_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	ipc_name = __func__;
+	recv_timeout = 1000;
+	test_ipc_old_client();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_server_fail_soc)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	ipc_name = __func__;
+	test_ipc_server_fail();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_disp_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	ipc_name = __func__;
+	test_ipc_dispatch();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_stress_test_shm)
+{
+	qb_enter();
+	send_event_on_created = QB_FALSE;
+	ipc_type = QB_IPC_SHM;
+	ipc_name = __func__;
+	test_ipc_stress_test();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_bulk_events_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	ipc_name = __func__;
+	test_ipc_bulk_events();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_event_on_created_shm)
+{
+	qb_enter();
+	send_event_on_created = QB_TRUE;
+	ipc_type = QB_IPC_SHM;
+	ipc_name = __func__;
+	test_ipc_event_on_created();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_server_fail_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	ipc_name = __func__;
+	test_ipc_server_fail();
+	qb_leave();
+}
+END_TEST
+
+static void
+test_ipc_service_ref_count(void)
+{
+	int32_t c = 0;
+	int32_t j = 0;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	reference_count_test = QB_TRUE;
+
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+
+	sleep(5);
+
+	kill_server(pid);
+}
+
+
+START_TEST(test_ipc_service_ref_count_shm)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SHM;
+	ipc_name = __func__;
+	test_ipc_service_ref_count();
+	qb_leave();
+}
+END_TEST
+
+START_TEST(test_ipc_service_ref_count_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	ipc_name = __func__;
+	test_ipc_service_ref_count();
+	qb_leave();
+}
+END_TEST
+
+static void
+test_ipc_recv_short_buffer(void)
+{
+	struct qb_ipc_request_header req_header;
+	struct qb_ipc_response_header res_header;
+	int32_t j;
+	int32_t c = 0;
+	ssize_t res;
+	pid_t pid;
+	uint32_t max_size = MAX_MSG_SIZE;
+
+	pid = run_function_in_new_process(run_ipc_server);
+	fail_if(pid == -1);
+	sleep(1);
+
+	do {
+		conn = qb_ipcc_connect(ipc_name, max_size);
+		if (conn == NULL) {
+			j = waitpid(pid, NULL, WNOHANG);
+			ck_assert_int_eq(j, 0);
+			sleep(1);
+			c++;
+		}
+	} while (conn == NULL && c < 5);
+	fail_if(conn == NULL);
+
+	req_header.id = IPC_MSG_REQ_TX_RX;
+	req_header.size = sizeof(req_header);
+
+	/* a response that doesn't fit is dropped, not written past the end */
+	res = qb_ipcc_send(conn, &req_header, req_header.size);
+	ck_assert_int_eq(res, req_header.size);
+	res = qb_ipcc_recv(conn, &res_header, sizeof(res_header) - 1,
+			   recv_timeout);
+	ck_assert_int_eq(res, -EMSGSIZE);
+
+	/* and the next one comes through whole */
+	res = qb_ipcc_send(conn, &req_header, req_header.size);
+	ck_assert_int_eq(res, req_header.size);
+	res = qb_ipcc_recv(conn, &res_header, sizeof(res_header),
+			   recv_timeout);
+	ck_assert_int_eq(res, sizeof(res_header));
+	ck_assert_int_eq(res_header.id, IPC_MSG_RES_TX_RX);
+
+	request_server_exit();
+	qb_ipcc_disconnect(conn);
+	verify_graceful_stop(pid);
+}
+
+START_TEST(test_ipc_recv_short_buffer_us)
+{
+	qb_enter();
+	ipc_type = QB_IPC_SOCKET;
+	ipc_name = __func__;
+	test_ipc_recv_short_buffer();
+	qb_leave();
+}
+END_TEST
+
+static void test_max_dgram_size(void)
+{
+	/* most implementations will not let you set a dgram buffer 
+	 * of 1 million bytes. This test verifies that the we can detect
+	 * the max dgram buffersize regardless, and that the value we detect
+	 * is consistent. */
+	int32_t init;
+	int32_t i;
+
+	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_REMOVE,
+			  QB_LOG_FILTER_FILE, "*", LOG_TRACE);
+
+	init = qb_ipcc_verify_dgram_max_msg_size(1000000);
+	fail_if(init <= 0);
+	for (i = 0; i < 100; i++) {
+		int try = qb_ipcc_verify_dgram_max_msg_size(1000000);
+		ck_assert_int_eq(init, try);
+	}
+
+	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
+			  QB_LOG_FILTER_FILE, "*", LOG_TRACE);
+}
+
+START_TEST(test_ipc_max_dgram_size)
+{
+	qb_enter();
+	test_max_dgram_size();
+	qb_leave();
+}
+END_TEST
+
+static Suite *
+make_shm_suite(void)
+{
+	TCase *tc;
+	Suite *s = suite_create("shm");
+
+	tc = tcase_create("ipc_txrx_shm_timeout");
+	tcase_add_test(tc, test_ipc_txrx_shm_timeout);
+	tcase_set_timeout(tc, 30);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_server_fail_shm");
+	tcase_add_test(tc, test_ipc_server_fail_shm);
+	tcase_set_timeout(tc, 8);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_txrx_shm_block");
+	tcase_add_test(tc, test_ipc_txrx_shm_block);
+	tcase_set_timeout(tc, 8);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_txrx_shm_tmo");
+	tcase_add_test(tc, test_ipc_txrx_shm_tmo);
+	tcase_set_timeout(tc, 8);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_fc_shm");
+	tcase_add_test(tc, test_ipc_fc_shm);
+	tcase_set_timeout(tc, 8);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_dispatch_shm");
+	tcase_add_test(tc, test_ipc_disp_shm);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_stress_test_shm");
+	tcase_add_test(tc, test_ipc_stress_test_shm);
 	tcase_set_timeout(tc, 16);
 	suite_add_tcase(s, tc);
 
@@ -1427,11 +2421,56 @@ make_shm_suite(void)
 	tcase_set_timeout(tc, 10);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("ipc_zero_copy_shm");
+	tcase_add_test(tc, test_ipc_zero_copy_shm);
+	tcase_set_timeout(tc, 8);
+	suite_add_tcase(s, tc);
+
 	tc = tcase_create("ipc_service_ref_count_shm");
 	tcase_add_test(tc, test_ipc_service_ref_count_shm);
 	tcase_set_timeout(tc, 10);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("ipc_workers_shm");
+	tcase_add_test(tc, test_ipc_workers_shm);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_msg_batch_shm");
+	tcase_add_test(tc, test_ipc_msg_batch_shm);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_busy_poll_shm");
+	tcase_add_test(tc, test_ipc_busy_poll_shm);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_event_broadcast_shm");
+	tcase_add_test(tc, test_ipc_event_broadcast_shm);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_event_broadcast_workers_shm");
+	tcase_add_test(tc, test_ipc_event_broadcast_workers_shm);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_async_shm");
+	tcase_add_test(tc, test_ipc_async_shm);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_eventfd_shm");
+	tcase_add_test(tc, test_ipc_eventfd_shm);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_old_client_shm");
+	tcase_add_test(tc, test_ipc_old_client_shm);
+	tcase_set_timeout(tc, 16);
+	suite_add_tcase(s, tc);
+
 	return s;
 }
 
@@ -1451,6 +2490,11 @@ make_soc_suite(void)
 	tcase_set_timeout(tc, 30);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("ipc_recv_short_buffer_us");
+	tcase_add_test(tc, test_ipc_recv_short_buffer_us);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
 	tc = tcase_create("ipc_server_fail_soc");
 	tcase_add_test(tc, test_ipc_server_fail_soc);
 	tcase_set_timeout(tc, 8);
@@ -1501,11 +2545,41 @@ make_soc_suite(void)
 	tcase_set_timeout(tc, 10);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("ipc_zero_copy_us");
+	tcase_add_test(tc, test_ipc_zero_copy_us);
+	tcase_set_timeout(tc, 8);
+	suite_add_tcase(s, tc);
+
 	tc = tcase_create("ipc_service_ref_count_us");
 	tcase_add_test(tc, test_ipc_service_ref_count_us);
 	tcase_set_timeout(tc, 10);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("ipc_workers_us");
+	tcase_add_test(tc, test_ipc_workers_us);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_msg_batch_us");
+	tcase_add_test(tc, test_ipc_msg_batch_us);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_busy_poll_us");
+	tcase_add_test(tc, test_ipc_busy_poll_us);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_event_broadcast_us");
+	tcase_add_test(tc, test_ipc_event_broadcast_us);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("ipc_async_us");
+	tcase_add_test(tc, test_ipc_async_us);
+	tcase_set_timeout(tc, 10);
+	suite_add_tcase(s, tc);
+
 	return s;
 }
 
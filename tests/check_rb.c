@@ -25,10 +25,18 @@
 #include <stdlib.h>
 #include <syslog.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <check.h>
 
 #include <qb/qbdefs.h>
 #include <qb/qbrb.h>
+#include <qb/qbatomic.h>
 #include <qb/qbipc_common.h>
 #include <qb/qblog.h>
 
@@ -188,6 +196,1235 @@ START_TEST(test_ring_buffer4)
 }
 END_TEST
 
+#define MP_WRITERS 4
+#define MP_CHUNKS_PER_WRITER 20000
+
+struct mp_chunk {
+	int32_t writer;
+	int32_t seq;
+};
+
+static void *
+mp_writer_thread(void *arg)
+{
+	qb_ringbuffer_t *t = arg;
+	static int32_t next_writer = 0;
+	struct mp_chunk c;
+	ssize_t l;
+
+	c.writer = qb_atomic_int_exchange_and_add(&next_writer, 1);
+	for (c.seq = 0; c.seq < MP_CHUNKS_PER_WRITER; c.seq++) {
+		do {
+			l = qb_rb_chunk_write(t, &c, sizeof(c));
+		} while (l == -EAGAIN);
+		if (l != sizeof(c)) {
+			return (void *)1;
+		}
+	}
+	return NULL;
+}
+
+START_TEST(test_ring_buffer_multi_producer)
+{
+	qb_ringbuffer_t *t;
+	pthread_t writers[MP_WRITERS];
+	int32_t next_seq[MP_WRITERS];
+	struct mp_chunk c;
+	void *retval;
+	ssize_t l;
+	int32_t i;
+
+	t = qb_rb_open("test5", 1000,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_MULTI_PRODUCER |
+		       QB_RB_FLAG_OVERWRITE, 0);
+	fail_unless(t == NULL);
+
+	t = qb_rb_open("test5", 1000,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_MULTI_PRODUCER |
+		       QB_RB_FLAG_SHARED_THREAD, 0);
+	fail_if(t == NULL);
+
+	fail_unless(qb_rb_chunk_alloc(t, sizeof(c)) == NULL);
+	ck_assert_int_eq(errno, ENOTSUP);
+
+	for (i = 0; i < MP_WRITERS; i++) {
+		next_seq[i] = 0;
+		ck_assert_int_eq(pthread_create(&writers[i], NULL,
+						mp_writer_thread, t), 0);
+	}
+
+	/*
+	 * every writer's chunks must come out complete and in the order
+	 * that writer wrote them
+	 */
+	for (i = 0; i < MP_WRITERS * MP_CHUNKS_PER_WRITER; i++) {
+		l = qb_rb_chunk_read(t, &c, sizeof(c), 5000);
+		ck_assert_int_eq(l, sizeof(c));
+		fail_unless(c.writer >= 0 && c.writer < MP_WRITERS);
+		ck_assert_int_eq(c.seq, next_seq[c.writer]);
+		next_seq[c.writer]++;
+	}
+	ck_assert_int_eq(qb_rb_chunks_used(t), 0);
+
+	for (i = 0; i < MP_WRITERS; i++) {
+		pthread_join(writers[i], &retval);
+		fail_unless(retval == NULL);
+	}
+	qb_rb_close(t);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_multi_producer_abandoned)
+{
+	qb_ringbuffer_t *t;
+	long page_size = sysconf(_SC_PAGESIZE);
+	char *buf;
+	int32_t status;
+	int32_t i;
+	int32_t v;
+	ssize_t l;
+	pid_t pid;
+
+	t = qb_rb_open("test26", 16 * page_size,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_MULTI_PRODUCER |
+		       QB_RB_FLAG_SHARED_PROCESS, 0);
+	fail_if(t == NULL);
+	i = 1;
+	ck_assert_int_eq(qb_rb_chunk_write(t, &i, sizeof(i)), sizeof(i));
+
+	/* a writer that dies copying its chunk in, after reserving it */
+	pid = fork();
+	fail_if(pid == -1);
+	if (pid == 0) {
+		buf = mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		(void)mprotect(buf + page_size, page_size, PROT_NONE);
+		(void)qb_rb_chunk_write(t, buf, 2 * page_size);
+		_exit(0);
+	}
+	ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+	fail_unless(WIFSIGNALED(status));
+
+	/* the next writer gives that up after a while instead of hanging */
+	i = 2;
+	ck_assert_int_eq(qb_rb_chunk_write(t, &i, sizeof(i)), sizeof(i));
+	for (i = 1; i <= 2; i++) {
+		l = qb_rb_chunk_read(t, &v, sizeof(v), 0);
+		ck_assert_int_eq(l, sizeof(v));
+		ck_assert_int_eq(v, i);
+	}
+	fail_unless(qb_rb_chunk_read(t, &v, sizeof(v), 0) < 0);
+	ck_assert_int_eq(qb_rb_chunks_used(t), 0);
+	qb_rb_close(t);
+}
+END_TEST
+
+static void *
+futex_writer_thread(void *arg)
+{
+	qb_ringbuffer_t *t = arg;
+	int32_t i;
+
+	for (i = 0; i < 1000; i++) {
+		if (i % 100 == 0) {
+			/* make the reader go to sleep now and then */
+			usleep(10000);
+		}
+		while (qb_rb_chunk_write(t, &i, sizeof(i)) == -EAGAIN) {
+			usleep(1000);
+		}
+	}
+	return NULL;
+}
+
+START_TEST(test_ring_buffer_futex)
+{
+	qb_ringbuffer_t *t;
+	pthread_t writer;
+	int32_t i;
+	int32_t v;
+	ssize_t l;
+
+	t = qb_rb_open("test6", 200,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_FUTEX |
+		       QB_RB_FLAG_SHARED_THREAD, 0);
+	fail_if(t == NULL);
+
+	l = qb_rb_chunk_read(t, &v, sizeof(v), 0);
+	ck_assert_int_eq(l, -ETIMEDOUT);
+	l = qb_rb_chunk_read(t, &v, sizeof(v), 10);
+	ck_assert_int_eq(l, -ETIMEDOUT);
+
+	ck_assert_int_eq(pthread_create(&writer, NULL,
+					futex_writer_thread, t), 0);
+	for (i = 0; i < 1000; i++) {
+		l = qb_rb_chunk_read(t, &v, sizeof(v), -1);
+		ck_assert_int_eq(l, sizeof(v));
+		ck_assert_int_eq(v, i);
+	}
+	pthread_join(writer, NULL);
+	ck_assert_int_eq(qb_rb_chunks_used(t), 0);
+	qb_rb_close(t);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_split_handles)
+{
+	qb_ringbuffer_t *r;
+	qb_ringbuffer_t *w;
+	char buf[64];
+	int32_t written = 0;
+	int32_t i;
+	ssize_t l;
+
+	/*
+	 * separate reader and writer handles only see each other's index
+	 * through the shared header, make sure their private copies catch up
+	 */
+	r = qb_rb_open("test7", 1000,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_NO_SEMAPHORE, 0);
+	fail_if(r == NULL);
+	w = qb_rb_open("test7", 1000, QB_RB_FLAG_NO_SEMAPHORE, 0);
+	fail_if(w == NULL);
+
+	ck_assert_int_eq(qb_rb_space_used(r), 0);
+	memset(buf, 'x', sizeof(buf));
+	while (qb_rb_chunk_write(w, buf, sizeof(buf)) == sizeof(buf)) {
+		written++;
+	}
+	fail_unless(written > 0);
+	fail_unless(qb_rb_space_used(r) > written * sizeof(buf));
+
+	for (i = 0; i < 3 * written; i++) {
+		l = qb_rb_chunk_read(r, buf, sizeof(buf), 0);
+		ck_assert_int_eq(l, sizeof(buf));
+		l = qb_rb_chunk_write(w, buf, sizeof(buf));
+		ck_assert_int_eq(l, sizeof(buf));
+	}
+	for (i = 0; i < written; i++) {
+		l = qb_rb_chunk_read(r, buf, sizeof(buf), 0);
+		ck_assert_int_eq(l, sizeof(buf));
+	}
+	ck_assert_int_eq(qb_rb_space_used(r), 0);
+	ck_assert_int_eq(qb_rb_chunk_read(r, buf, sizeof(buf), 0), -ETIMEDOUT);
+
+	qb_rb_close(w);
+	qb_rb_close(r);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_v1_file)
+{
+	/*
+	 * A version 1 dump: one "hello" chunk at the start of a 1024 word
+	 * ringbuffer.
+	 */
+	uint32_t hdr[5] = { 1024, 4, 0, 1, 1024 + 4 + 0 + 1 };
+	uint32_t data[1024];
+	char tmpfile[] = "/tmp/check_rb_v1_XXXXXX";
+	qb_ringbuffer_t *t;
+	char out[32];
+	ssize_t l;
+	int fd;
+
+	memset(data, 0, sizeof(data));
+	data[0] = 6;
+	data[1] = 0xA1A1A1A1;
+	memcpy(&data[2], "hello", 6);
+
+	fd = mkstemp(tmpfile);
+	fail_if(fd < 0);
+	unlink(tmpfile);
+	ck_assert_int_eq(write(fd, hdr, sizeof(hdr)), sizeof(hdr));
+	ck_assert_int_eq(write(fd, data, sizeof(data)), sizeof(data));
+	lseek(fd, 0, SEEK_SET);
+
+	t = qb_rb_create_from_file(fd, 0);
+	fail_if(t == NULL);
+	l = qb_rb_chunk_read(t, out, sizeof(out), 0);
+	ck_assert_int_eq(l, 6);
+	ck_assert_str_eq(out, "hello");
+	qb_rb_close(t);
+	close(fd);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_batch)
+{
+	qb_ringbuffer_t *t;
+	struct iovec chunks[64];
+	char out[32];
+	ssize_t n;
+	ssize_t l;
+	int32_t i;
+	int32_t b;
+
+	t = qb_rb_open("test8", 1000, QB_RB_FLAG_CREATE, 0);
+	fail_if(t == NULL);
+
+	for (b = 0; b < 10; b++) {
+		for (i = 0; i < 16; i++) {
+			chunks[i].iov_len = i + 1;
+		}
+		n = qb_rb_chunk_alloc_batch(t, chunks, 16);
+		ck_assert_int_eq(n, 16);
+		for (i = 0; i < 16; i++) {
+			memset(chunks[i].iov_base, 'a' + i, chunks[i].iov_len);
+		}
+		ck_assert_int_eq(qb_rb_chunk_commit_batch(t, chunks, 16), 0);
+		ck_assert_int_eq(qb_rb_chunks_used(t), 16);
+
+		n = qb_rb_chunk_peek_batch(t, chunks, 10, 0);
+		ck_assert_int_eq(n, 10);
+		for (i = 0; i < 10; i++) {
+			ck_assert_int_eq(chunks[i].iov_len, i + 1);
+			ck_assert_int_eq(((char *)chunks[i].iov_base)[i], 'a' + i);
+		}
+		ck_assert_int_eq(qb_rb_chunk_reclaim_batch(t, 10), 0);
+
+		/* the single chunk api sees the same stream */
+		l = qb_rb_chunk_read(t, out, sizeof(out), 0);
+		ck_assert_int_eq(l, 11);
+		ck_assert_int_eq(out[10], 'a' + 10);
+
+		n = qb_rb_chunk_peek_batch(t, chunks, 64, 0);
+		ck_assert_int_eq(n, 5);
+		ck_assert_int_eq(chunks[0].iov_len, 12);
+		ck_assert_int_eq(qb_rb_chunk_reclaim_batch(t, 5), 0);
+		ck_assert_int_eq(qb_rb_chunk_peek_batch(t, chunks, 64, 0), 0);
+		ck_assert_int_eq(qb_rb_space_used(t), 0);
+	}
+
+	/* a batch bigger than the ringbuffer is cut short */
+	for (i = 0; i < 64; i++) {
+		chunks[i].iov_len = 100;
+	}
+	n = qb_rb_chunk_alloc_batch(t, chunks, 64);
+	fail_unless(n > 0 && n < 64);
+	ck_assert_int_eq(qb_rb_chunk_commit_batch(t, chunks, n), 0);
+	ck_assert_int_eq(qb_rb_chunk_alloc_batch(t, chunks, 64), -EAGAIN);
+	ck_assert_int_eq(qb_rb_chunk_peek_batch(t, chunks, 64, 0), n);
+	ck_assert_int_eq(qb_rb_chunk_reclaim_batch(t, n), 0);
+	ck_assert_int_eq(qb_rb_chunk_reclaim_batch(t, 1), -EINVAL);
+
+	qb_rb_close(t);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_hugepages)
+{
+	qb_ringbuffer_t *t;
+	qb_ringbuffer_t *peer;
+	char buf[1024];
+	int32_t i;
+	ssize_t l;
+
+	/*
+	 * Without a hugetlbfs mount this exercises the fallback path.
+	 */
+	t = qb_rb_open("test9", 64 * 1024,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_HUGEPAGES |
+		       QB_RB_FLAG_PREFAULT | QB_RB_FLAG_SHARED_PROCESS, 0);
+	fail_if(t == NULL);
+	fail_if(qb_rb_space_free(t) < 64 * 1024);
+
+	peer = qb_rb_open("test9", 64 * 1024,
+			  QB_RB_FLAG_PREFAULT | QB_RB_FLAG_SHARED_PROCESS, 0);
+	fail_if(peer == NULL);
+
+	memset(buf, 'h', sizeof(buf));
+	for (i = 0; i < 200; i++) {
+		l = qb_rb_chunk_write(peer, buf, sizeof(buf));
+		ck_assert_int_eq(l, sizeof(buf));
+		l = qb_rb_chunk_read(t, buf, sizeof(buf), 0);
+		ck_assert_int_eq(l, sizeof(buf));
+		ck_assert_int_eq(buf[sizeof(buf) - 1], 'h');
+	}
+	qb_rb_close(peer);
+	qb_rb_close(t);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_memfd)
+{
+	qb_ringbuffer_t *t;
+	qb_ringbuffer_t *peer;
+	int32_t hdr_fd;
+	int32_t data_fd;
+	char path[PATH_MAX];
+	char buf[64];
+	ssize_t l;
+
+	t = qb_rb_open("test10", 1000,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_MEMFD |
+		       QB_RB_FLAG_SHARED_PROCESS, 0);
+	if (t == NULL && errno == ENOTSUP) {
+		return;
+	}
+	fail_if(t == NULL);
+
+	/* nothing in the filesystem */
+	snprintf(path, PATH_MAX, "/dev/shm/qb-test10-header");
+	fail_unless(access(path, F_OK) == -1 && errno == ENOENT);
+
+	peer = qb_rb_open("test10", 1000, QB_RB_FLAG_SHARED_PROCESS, 0);
+	fail_unless(peer == NULL);
+
+	ck_assert_int_eq(qb_rb_memfds_get(t, &hdr_fd, &data_fd), 0);
+	ck_assert_int_eq(qb_rb_memfds_get(t, &hdr_fd, &data_fd), -EBADF);
+	peer = qb_rb_open_from_memfds(hdr_fd, data_fd,
+				      QB_RB_FLAG_SHARED_PROCESS);
+	fail_if(peer == NULL);
+	ck_assert_int_eq(qb_rb_refcount_get(t), 2);
+
+	l = qb_rb_chunk_write(peer, "from the peer", 14);
+	ck_assert_int_eq(l, 14);
+	l = qb_rb_chunk_read(t, buf, sizeof(buf), 0);
+	ck_assert_int_eq(l, 14);
+	ck_assert_str_eq(buf, "from the peer");
+
+	qb_rb_close(peer);
+	qb_rb_close(t);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_eventfd)
+{
+	qb_ringbuffer_t *r;
+	qb_ringbuffer_t *w;
+	struct pollfd pfd;
+	pthread_t writer;
+	int32_t fd;
+	int32_t i;
+	int32_t v;
+	ssize_t l;
+
+	r = qb_rb_open("test11", 200,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_EVENTFD |
+		       QB_RB_FLAG_SHARED_PROCESS, 0);
+	if (r == NULL && errno == ENOTSUP) {
+		return;
+	}
+	fail_if(r == NULL);
+	ck_assert_int_eq(qb_rb_fd_get(r, &fd), 0);
+
+	w = qb_rb_open("test11", 200,
+		       QB_RB_FLAG_EVENTFD | QB_RB_FLAG_SHARED_PROCESS, 0);
+	fail_if(w == NULL);
+	ck_assert_int_eq(qb_rb_fd_get(w, &v), -EBADF);
+	ck_assert_int_eq(qb_rb_fd_set(w, dup(fd)), 0);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	ck_assert_int_eq(poll(&pfd, 1, 0), 0);
+
+	for (i = 0; i < 3; i++) {
+		ck_assert_int_eq(qb_rb_chunk_write(w, &i, sizeof(i)), sizeof(i));
+	}
+	ck_assert_int_eq(poll(&pfd, 1, 0), 1);
+
+	/* one wakeup, drain everything */
+	for (i = 0; i < 3; i++) {
+		l = qb_rb_chunk_read(r, &v, sizeof(v), 0);
+		ck_assert_int_eq(l, sizeof(v));
+		ck_assert_int_eq(v, i);
+	}
+	l = qb_rb_chunk_read(r, &v, sizeof(v), 0);
+	ck_assert_int_eq(l, -ETIMEDOUT);
+	ck_assert_int_eq(poll(&pfd, 1, 0), 0);
+	l = qb_rb_chunk_read(r, &v, sizeof(v), 10);
+	ck_assert_int_eq(l, -ETIMEDOUT);
+
+	/* and a blocking reader */
+	ck_assert_int_eq(pthread_create(&writer, NULL,
+					futex_writer_thread, w), 0);
+	for (i = 0; i < 1000; i++) {
+		l = qb_rb_chunk_read(r, &v, sizeof(v), -1);
+		ck_assert_int_eq(l, sizeof(v));
+		ck_assert_int_eq(v, i);
+	}
+	pthread_join(writer, NULL);
+	ck_assert_int_eq(qb_rb_chunks_used(r), 0);
+
+	qb_rb_close(w);
+	qb_rb_close(r);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_broadcast)
+{
+	qb_ringbuffer_t *w;
+	qb_ringbuffer_t *r[3];
+	pthread_t writer;
+	char buf[64];
+	int32_t i;
+	int32_t j;
+	int32_t v;
+	ssize_t l;
+
+	w = qb_rb_open("test12", 2000,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_BROADCAST |
+		       QB_RB_FLAG_SHARED_PROCESS, 0);
+	if (w == NULL && errno == ENOTSUP) {
+		return;
+	}
+	fail_if(w == NULL);
+
+	/* nobody listening: nothing to keep */
+	memset(buf, 'x', sizeof(buf));
+	for (i = 0; i < 100; i++) {
+		ck_assert_int_eq(qb_rb_chunk_write(w, buf, sizeof(buf)),
+				 sizeof(buf));
+	}
+
+	for (j = 0; j < 3; j++) {
+		r[j] = qb_rb_open("test12", 2000,
+				  QB_RB_FLAG_BROADCAST |
+				  QB_RB_FLAG_SHARED_PROCESS, 0);
+		fail_if(r[j] == NULL);
+		l = qb_rb_chunk_read(r[j], &v, sizeof(v), 0);
+		ck_assert_int_eq(l, -ETIMEDOUT);
+	}
+
+	for (i = 0; i < 5; i++) {
+		ck_assert_int_eq(qb_rb_chunk_write(w, &i, sizeof(i)), sizeof(i));
+	}
+	for (j = 0; j < 3; j++) {
+		for (i = 0; i < 5; i++) {
+			l = qb_rb_chunk_read(r[j], &v, sizeof(v), 10);
+			ck_assert_int_eq(l, sizeof(v));
+			ck_assert_int_eq(v, i);
+		}
+		l = qb_rb_chunk_read(r[j], &v, sizeof(v), 0);
+		ck_assert_int_eq(l, -ETIMEDOUT);
+	}
+
+	/* r[2] stops reading, the writer has to wait for it */
+	i = 0;
+	while (qb_rb_chunk_write(w, &i, sizeof(i)) == sizeof(i)) {
+		for (j = 0; j < 2; j++) {
+			l = qb_rb_chunk_read(r[j], &v, sizeof(v), 0);
+			ck_assert_int_eq(l, sizeof(v));
+			ck_assert_int_eq(v, i);
+		}
+		i++;
+	}
+	fail_unless(i > 10);
+	ck_assert_int_eq(qb_rb_chunk_write(w, &i, sizeof(i)), -EAGAIN);
+
+	qb_rb_close(r[2]);
+	ck_assert_int_eq(qb_rb_chunk_write(w, &i, sizeof(i)), sizeof(i));
+	for (j = 0; j < 2; j++) {
+		l = qb_rb_chunk_read(r[j], &v, sizeof(v), 0);
+		ck_assert_int_eq(l, sizeof(v));
+		ck_assert_int_eq(v, i);
+		qb_rb_close(r[j]);
+	}
+	qb_rb_close(w);
+
+	/* and with eviction */
+	w = qb_rb_open("test13", 2000,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_BROADCAST |
+		       QB_RB_FLAG_OVERWRITE | QB_RB_FLAG_SHARED_PROCESS, 0);
+	fail_if(w == NULL);
+	for (j = 0; j < 2; j++) {
+		r[j] = qb_rb_open("test13", 2000,
+				  QB_RB_FLAG_BROADCAST |
+				  QB_RB_FLAG_SHARED_PROCESS, 0);
+		fail_if(r[j] == NULL);
+	}
+	for (i = 0; i < 1000; i++) {
+		ck_assert_int_eq(qb_rb_chunk_write(w, &i, sizeof(i)), sizeof(i));
+		l = qb_rb_chunk_read(r[0], &v, sizeof(v), 0);
+		ck_assert_int_eq(l, sizeof(v));
+		ck_assert_int_eq(v, i);
+	}
+	l = qb_rb_chunk_read(r[1], &v, sizeof(v), 0);
+	ck_assert_int_eq(l, -EPIPE);
+
+	qb_rb_close(r[1]);
+	qb_rb_close(r[0]);
+	qb_rb_close(w);
+
+	/* readers sleeping on the writer */
+	w = qb_rb_open("test14", 200,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_BROADCAST |
+		       QB_RB_FLAG_SHARED_THREAD, 0);
+	fail_if(w == NULL);
+	for (j = 0; j < 2; j++) {
+		r[j] = qb_rb_open("test14", 200,
+				  QB_RB_FLAG_BROADCAST |
+				  QB_RB_FLAG_SHARED_THREAD, 0);
+		fail_if(r[j] == NULL);
+	}
+	ck_assert_int_eq(pthread_create(&writer, NULL,
+					futex_writer_thread, w), 0);
+	for (i = 0; i < 1000; i++) {
+		for (j = 0; j < 2; j++) {
+			l = qb_rb_chunk_read(r[j], &v, sizeof(v), -1);
+			ck_assert_int_eq(l, sizeof(v));
+			ck_assert_int_eq(v, i);
+		}
+	}
+	pthread_join(writer, NULL);
+	qb_rb_close(r[1]);
+	qb_rb_close(r[0]);
+	qb_rb_close(w);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_overwrite_bulk)
+{
+	qb_ringbuffer_t *t;
+	char big[2000];
+	char out[sizeof(big)];
+	int32_t i;
+	int32_t v;
+	int32_t last = -1;
+	ssize_t l;
+
+	t = qb_rb_open("test15", 4096, QB_RB_FLAG_CREATE | QB_RB_FLAG_OVERWRITE, 0);
+	fail_if(t == NULL);
+	for (i = 0; i < 2000; i++) {
+		l = qb_rb_chunk_write(t, &i, sizeof(i));
+		ck_assert_int_eq(l, sizeof(i));
+	}
+
+	/* one big chunk replaces a few hundred small ones in one go */
+	memset(big, 'x', sizeof(big));
+	l = qb_rb_chunk_write(t, big, sizeof(big));
+	ck_assert_int_eq(l, sizeof(big));
+
+	/* what is left of the small chunks is still in order */
+	for (;;) {
+		l = qb_rb_chunk_read(t, out, sizeof(out), 0);
+		ck_assert_int_gt(l, 0);
+		if (l != sizeof(v)) {
+			break;
+		}
+		memcpy(&v, out, sizeof(v));
+		if (last >= 0) {
+			ck_assert_int_eq(v, last + 1);
+		}
+		last = v;
+	}
+	ck_assert_int_eq(last, 1999);
+	ck_assert_int_eq(l, sizeof(big));
+	fail_unless(memcmp(big, out, sizeof(big)) == 0);
+
+	/* and the stale headers behind read_pt don't look like data */
+	l = qb_rb_chunk_read(t, out, sizeof(out), 0);
+	ck_assert_int_lt(l, 0);
+	ck_assert_int_eq(qb_rb_space_used(t), 0);
+
+	/* bigger than the whole ringbuffer */
+	fail_unless(qb_rb_chunk_alloc(t, 8192) == NULL);
+	ck_assert_int_eq(errno, EINVAL);
+
+	qb_rb_close(t);
+}
+END_TEST
+
+struct slot_record {
+	int32_t seq;
+	int32_t data[5];
+};
+
+START_TEST(test_ring_buffer_slots)
+{
+	qb_ringbuffer_t *w;
+	qb_ringbuffer_t *r;
+	struct slot_record rec;
+	struct iovec chunks[16];
+	char big[64];
+	ssize_t l;
+	int32_t i;
+	int32_t n;
+
+	w = qb_rb_open_slots("test16", sizeof(rec), 100, QB_RB_FLAG_CREATE, 0);
+	fail_if(w == NULL);
+	/* readers don't need to know it's a fixed slot ringbuffer */
+	r = qb_rb_open("test16", 0, 0, 0);
+	fail_if(r == NULL);
+
+	ck_assert_int_eq(qb_rb_chunk_write(w, big, sizeof(big)), -EINVAL);
+	ck_assert_int_eq(qb_rb_chunk_alloc_batch(w, chunks, 2), -ENOTSUP);
+
+	memset(&rec, 0, sizeof(rec));
+	for (n = 0; ; n++) {
+		rec.seq = n;
+		l = qb_rb_chunk_write(w, &rec, sizeof(rec));
+		if (l == -EAGAIN) {
+			break;
+		}
+		ck_assert_int_eq(l, sizeof(rec));
+	}
+	/* at least what was asked for, and no slot lost to full vs empty */
+	ck_assert_int_ge(n, 100);
+	ck_assert_int_eq(qb_rb_space_free(w), 0);
+	ck_assert_int_eq(qb_rb_space_used(r), n * sizeof(rec));
+
+	for (i = 0; i < n; i++) {
+		l = qb_rb_chunk_read(r, &rec, sizeof(rec), 0);
+		ck_assert_int_eq(l, sizeof(rec));
+		ck_assert_int_eq(rec.seq, i);
+	}
+	l = qb_rb_chunk_read(r, &rec, sizeof(rec), 0);
+	ck_assert_int_lt(l, 0);
+	ck_assert_int_eq(qb_rb_space_used(r), 0);
+
+	/* a few laps around the ringbuffer with peek/reclaim */
+	for (i = 0; i < 10 * n; i += 10) {
+		for (rec.seq = i; rec.seq < i + 10; rec.seq++) {
+			l = qb_rb_chunk_write(w, &rec, sizeof(rec));
+			ck_assert_int_eq(l, sizeof(rec));
+		}
+		l = qb_rb_chunk_peek_batch(r, chunks, 16, 0);
+		ck_assert_int_eq(l, 10);
+		ck_assert_int_eq(chunks[0].iov_len, sizeof(rec));
+		ck_assert_int_eq(((struct slot_record *)chunks[0].iov_base)->seq, i);
+		ck_assert_int_eq(((struct slot_record *)chunks[9].iov_base)->seq, i + 9);
+		ck_assert_int_eq(qb_rb_chunk_reclaim_batch(r, 10), 0);
+	}
+	qb_rb_close(r);
+	qb_rb_close(w);
+
+	/* overwriting drops the oldest slots */
+	w = qb_rb_open_slots("test17", sizeof(int32_t), 8,
+			     QB_RB_FLAG_CREATE | QB_RB_FLAG_OVERWRITE, 0);
+	fail_if(w == NULL);
+	n = qb_rb_space_free(w) / sizeof(int32_t);
+	for (i = 0; i < n + 10; i++) {
+		l = qb_rb_chunk_write(w, &i, sizeof(i));
+		ck_assert_int_eq(l, sizeof(i));
+	}
+	for (i = 10; i < n + 10; i++) {
+		l = qb_rb_chunk_read(w, &rec.seq, sizeof(rec.seq), 0);
+		ck_assert_int_eq(l, sizeof(rec.seq));
+		ck_assert_int_eq(rec.seq, i);
+	}
+	qb_rb_close(w);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_resize)
+{
+	qb_ringbuffer_t *w;
+	qb_ringbuffer_t *r;
+	char big[20000];
+	char out[sizeof(big)];
+	ssize_t free_before;
+	ssize_t l;
+	int32_t i;
+	int32_t v;
+
+	w = qb_rb_open("test18", 1000, QB_RB_FLAG_CREATE, 0);
+	fail_if(w == NULL);
+	r = qb_rb_open("test18", 1000, 0, 0);
+	fail_if(r == NULL);
+	free_before = qb_rb_space_free(w);
+	fail_unless(qb_rb_chunk_write(w, big, sizeof(big)) < 0);
+
+	for (i = 0; i < 3; i++) {
+		l = qb_rb_chunk_write(w, &i, sizeof(i));
+		ck_assert_int_eq(l, sizeof(i));
+	}
+	/* not while there is something to read */
+	ck_assert_int_eq(qb_rb_resize(w, sizeof(big)), -EAGAIN);
+	for (i = 0; i < 3; i++) {
+		l = qb_rb_chunk_read(r, &v, sizeof(v), 0);
+		ck_assert_int_eq(l, sizeof(v));
+		ck_assert_int_eq(v, i);
+	}
+
+	/* grow */
+	ck_assert_int_eq(qb_rb_resize(w, sizeof(big)), 0);
+	fail_unless(qb_rb_space_free(w) > free_before);
+	for (i = 0; i < sizeof(big); i++) {
+		big[i] = i % 251;
+	}
+	for (i = 0; i < 5; i++) {
+		l = qb_rb_chunk_write(w, big, sizeof(big));
+		ck_assert_int_eq(l, sizeof(big));
+		l = qb_rb_chunk_read(r, out, sizeof(out), 0);
+		ck_assert_int_eq(l, sizeof(big));
+		fail_unless(memcmp(big, out, sizeof(big)) == 0);
+	}
+
+	/* and shrink again */
+	ck_assert_int_eq(qb_rb_resize(w, 1000), 0);
+	ck_assert_int_eq(qb_rb_space_free(w), free_before);
+	for (i = 0; i < 1000; i++) {
+		l = qb_rb_chunk_write(w, &i, sizeof(i));
+		ck_assert_int_eq(l, sizeof(i));
+		l = qb_rb_chunk_read(r, &v, sizeof(v), 0);
+		ck_assert_int_eq(l, sizeof(v));
+		ck_assert_int_eq(v, i);
+	}
+	qb_rb_close(r);
+	qb_rb_close(w);
+
+	/* fixed slots get more slots */
+	w = qb_rb_open_slots("test19", sizeof(int32_t), 8, QB_RB_FLAG_CREATE, 0);
+	fail_if(w == NULL);
+	free_before = qb_rb_space_free(w);
+	ck_assert_int_eq(qb_rb_resize(w, 4 * free_before), 0);
+	ck_assert_int_eq(qb_rb_space_free(w), 4 * free_before);
+	qb_rb_close(w);
+
+	/* readers of a memfd segment have no path to find the new one by */
+	w = qb_rb_open("test19", 4096, QB_RB_FLAG_CREATE | QB_RB_FLAG_MEMFD, 0);
+	if (w != NULL) {
+		ck_assert_int_eq(qb_rb_resize(w, 4 * 4096), -ENOTSUP);
+		qb_rb_close(w);
+	}
+}
+END_TEST
+
+START_TEST(test_ring_buffer_journal)
+{
+	qb_ringbuffer_t *w;
+	qb_ringbuffer_t *r;
+	qb_ringbuffer_t *r2;
+	ssize_t l;
+	int32_t fd;
+	int32_t i;
+	int32_t v;
+
+	w = qb_rb_open("test20", 1000,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_JOURNAL |
+		       QB_RB_FLAG_BROADCAST, 0);
+	fail_unless(w == NULL);
+	w = qb_rb_open("test20", 1000, QB_RB_FLAG_CREATE, 0);
+	fail_if(w == NULL);
+	ck_assert_int_eq(qb_rb_journal_sync(w), -ENOTSUP);
+	qb_rb_close(w);
+
+	w = qb_rb_open("test20", 1000,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_JOURNAL, 0);
+	fail_if(w == NULL);
+	for (i = 0; i < 10; i++) {
+		l = qb_rb_chunk_write(w, &i, sizeof(i));
+		ck_assert_int_eq(l, sizeof(i));
+	}
+	ck_assert_int_eq(qb_rb_journal_sync(w), 0);
+
+	/* these never reach the disk before the "crash" */
+	ck_assert_int_eq(qb_rb_journal_ctl(w, 60000, 0), 0);
+	for (i = 10; i < 20; i++) {
+		l = qb_rb_chunk_write(w, &i, sizeof(i));
+		ck_assert_int_eq(l, sizeof(i));
+	}
+
+	fd = open("./test20-header", O_RDWR);
+	fail_if(fd < 0);
+	r = qb_rb_create_from_file(fd, QB_RB_FLAG_JOURNAL);
+	fail_if(r == NULL);
+	for (i = 0; i < 10; i++) {
+		l = qb_rb_chunk_read(r, &v, sizeof(v), 0);
+		ck_assert_int_eq(l, sizeof(v));
+		ck_assert_int_eq(v, i);
+	}
+	fail_unless(qb_rb_chunk_read(r, &v, sizeof(v), 0) < 0);
+
+	/* the flusher picks these up on its own */
+	ck_assert_int_eq(qb_rb_journal_ctl(r, 10, 0), 0);
+	for (i = 100; i < 105; i++) {
+		l = qb_rb_chunk_write(r, &i, sizeof(i));
+		ck_assert_int_eq(l, sizeof(i));
+	}
+	usleep(200000);
+	r2 = qb_rb_create_from_file(fd, QB_RB_FLAG_JOURNAL);
+	fail_if(r2 == NULL);
+	for (i = 100; i < 105; i++) {
+		l = qb_rb_chunk_read(r2, &v, sizeof(v), 0);
+		ck_assert_int_eq(l, sizeof(v));
+		ck_assert_int_eq(v, i);
+	}
+	fail_unless(qb_rb_chunk_read(r2, &v, sizeof(v), 0) < 0);
+	close(fd);
+
+	qb_rb_close(r2);
+	qb_rb_close(r);
+	qb_rb_close(w);
+	fail_unless(access("./test20-header", F_OK) == 0);
+	unlink("./test20-header");
+	unlink("./test20-data");
+
+	/* partly read, then closed */
+	w = qb_rb_open("test20", 1000,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_JOURNAL, 0);
+	fail_if(w == NULL);
+	for (i = 0; i < 3; i++) {
+		l = qb_rb_chunk_write(w, &i, sizeof(i));
+		ck_assert_int_eq(l, sizeof(i));
+	}
+	ck_assert_int_eq(qb_rb_journal_sync(w), 0);
+	l = qb_rb_chunk_read(w, &v, sizeof(v), 0);
+	ck_assert_int_eq(l, sizeof(v));
+	ck_assert_int_eq(v, 0);
+	qb_rb_close(w);
+
+	fd = open("./test20-header", O_RDWR);
+	fail_if(fd < 0);
+	r = qb_rb_create_from_file(fd, QB_RB_FLAG_JOURNAL);
+	fail_if(r == NULL);
+	for (i = 1; i < 3; i++) {
+		l = qb_rb_chunk_read(r, &v, sizeof(v), 0);
+		ck_assert_int_eq(l, sizeof(v));
+		ck_assert_int_eq(v, i);
+	}
+	fail_unless(qb_rb_chunk_read(r, &v, sizeof(v), 0) < 0);
+
+	/* partly read, then crashed before read_pt was flushed */
+	ck_assert_int_eq(qb_rb_journal_ctl(r, 60000, 0), 0);
+	for (i = 3; i < 6; i++) {
+		l = qb_rb_chunk_write(r, &i, sizeof(i));
+		ck_assert_int_eq(l, sizeof(i));
+	}
+	ck_assert_int_eq(qb_rb_journal_sync(r), 0);
+	l = qb_rb_chunk_read(r, &v, sizeof(v), 0);
+	ck_assert_int_eq(l, sizeof(v));
+	ck_assert_int_eq(v, 3);
+	r2 = qb_rb_create_from_file(fd, QB_RB_FLAG_JOURNAL);
+	fail_if(r2 == NULL);
+	for (i = 4; i < 6; i++) {
+		l = qb_rb_chunk_read(r2, &v, sizeof(v), 0);
+		ck_assert_int_eq(l, sizeof(v));
+		ck_assert_int_eq(v, i);
+	}
+	fail_unless(qb_rb_chunk_read(r2, &v, sizeof(v), 0) < 0);
+	close(fd);
+	qb_rb_close(r2);
+	qb_rb_close(r);
+	unlink("./test20-header");
+	unlink("./test20-data");
+}
+END_TEST
+
+START_TEST(test_ring_buffer_dump)
+{
+	qb_ringbuffer_t *w;
+	qb_ringbuffer_t *t;
+	char tmpfile[] = "/tmp/check_rb_dump_XXXXXX";
+	char tmpfile2[] = "/tmp/check_rb_dump_XXXXXX";
+	uint32_t version;
+	char in[100];
+	char out[sizeof(in)];
+	ssize_t l;
+	int32_t pass;
+	int32_t i;
+	int fd;
+
+	w = qb_rb_open("test21", 4096, QB_RB_FLAG_CREATE, 0);
+	fail_if(w == NULL);
+	/* move the pointers around so that some chunk wraps */
+	for (i = 0; i < 100; i++) {
+		memset(in, i, sizeof(in));
+		l = qb_rb_chunk_write(w, in, sizeof(in));
+		ck_assert_int_eq(l, sizeof(in));
+		if (i < 95) {
+			l = qb_rb_chunk_read(w, out, sizeof(out), 0);
+			ck_assert_int_eq(l, sizeof(out));
+		}
+	}
+
+	/* the default dump keeps the version 1 layout older tools read */
+	fd = mkstemp(tmpfile);
+	fail_if(fd < 0);
+	unlink(tmpfile);
+	l = qb_rb_write_to_file(w, fd);
+	/* the header, then the data right away */
+	ck_assert_int_eq(l % 4096, 5 * sizeof(uint32_t));
+	ck_assert_int_eq(pread(fd, &version, sizeof(version),
+			       3 * sizeof(uint32_t)), sizeof(version));
+	ck_assert_int_eq(version, 1);
+	lseek(fd, 0, SEEK_SET);
+	t = qb_rb_create_from_file(fd, QB_RB_FLAG_READONLY);
+	fail_if(t == NULL);
+	for (i = 95; i < 100; i++) {
+		memset(in, i, sizeof(in));
+		l = qb_rb_chunk_read(t, out, sizeof(out), 0);
+		ck_assert_int_eq(l, sizeof(out));
+		fail_unless(memcmp(in, out, sizeof(in)) == 0);
+	}
+	/* copied, so writable */
+	ck_assert_int_eq(qb_rb_chunk_write(t, in, sizeof(in)), sizeof(in));
+	qb_rb_close(t);
+	close(fd);
+
+	fd = mkstemp(tmpfile2);
+	fail_if(fd < 0);
+	unlink(tmpfile2);
+	fail_unless(qb_rb_write_to_file_mappable(w, fd) > 0);
+	ck_assert_int_eq(pread(fd, &version, sizeof(version),
+			       3 * sizeof(uint32_t)), sizeof(version));
+	ck_assert_int_eq(version, 2);
+	qb_rb_close(w);
+
+	/* copied, then mapped twice: reading mustn't change the file */
+	for (pass = 0; pass < 3; pass++) {
+		lseek(fd, 0, SEEK_SET);
+		t = qb_rb_create_from_file(fd, pass ? QB_RB_FLAG_READONLY : 0);
+		fail_if(t == NULL);
+		for (i = 95; i < 100; i++) {
+			memset(in, i, sizeof(in));
+			l = qb_rb_chunk_read(t, out, sizeof(out), 0);
+			ck_assert_int_eq(l, sizeof(out));
+			fail_unless(memcmp(in, out, sizeof(in)) == 0);
+		}
+		fail_unless(qb_rb_chunk_read(t, out, sizeof(out), 0) < 0);
+		if (pass) {
+			ck_assert_int_eq(qb_rb_chunk_write(t, in, sizeof(in)),
+					 -EROFS);
+		}
+		qb_rb_close(t);
+	}
+	close(fd);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_timestamps)
+{
+	qb_ringbuffer_t *w;
+	qb_ringbuffer_t *r;
+	struct qb_rb_dwell_stats stats;
+	struct iovec chunks[4];
+	ssize_t l;
+	int32_t i;
+	int32_t v;
+
+	w = qb_rb_open("test22", 4096,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_TIMESTAMPS |
+		       QB_RB_FLAG_MULTI_PRODUCER, 0);
+	fail_unless(w == NULL);
+	w = qb_rb_open("test22", 4096, QB_RB_FLAG_CREATE, 0);
+	fail_if(w == NULL);
+	ck_assert_int_eq(qb_rb_dwell_stats_get(w, &stats), -ENOTSUP);
+	qb_rb_close(w);
+
+	w = qb_rb_open("test22", 4096,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_TIMESTAMPS, 0);
+	fail_if(w == NULL);
+	r = qb_rb_open("test22", 4096, 0, 0);
+	fail_if(r == NULL);
+
+	for (i = 0; i < 6; i++) {
+		l = qb_rb_chunk_write(w, &i, sizeof(i));
+		ck_assert_int_eq(l, sizeof(i));
+	}
+	for (i = 0; i < 4; i++) {
+		chunks[i].iov_len = sizeof(v);
+	}
+	ck_assert_int_eq(qb_rb_chunk_alloc_batch(w, chunks, 4), 4);
+	for (i = 0; i < 4; i++) {
+		v = 6 + i;
+		memcpy(chunks[i].iov_base, &v, sizeof(v));
+	}
+	ck_assert_int_eq(qb_rb_chunk_commit_batch(w, chunks, 4), 0);
+
+	ck_assert_int_eq(qb_rb_dwell_stats_get_by_name("test22", &stats), 0);
+	ck_assert_int_eq(stats.count, 0);
+	ck_assert_int_eq(stats.chunks_used, 10);
+	fail_unless(stats.bytes_used >= 10 * sizeof(int32_t));
+
+	usleep(20000);
+	for (i = 0; i < 10; i++) {
+		l = qb_rb_chunk_read(r, &v, sizeof(v), 0);
+		ck_assert_int_eq(l, sizeof(v));
+		ck_assert_int_eq(v, i);
+	}
+
+	ck_assert_int_eq(qb_rb_dwell_stats_get(w, &stats), 0);
+	ck_assert_int_eq(stats.count, 10);
+	ck_assert_int_eq(stats.chunks_used, 0);
+	ck_assert_int_eq(stats.bytes_used, 0);
+	fail_unless(stats.p50_ns >= 20000000);
+	fail_unless(stats.p50_ns <= stats.p99_ns);
+	fail_unless(stats.p99_ns <= stats.p999_ns);
+	fail_unless(stats.p999_ns <= stats.max_ns);
+
+	qb_rb_close(r);
+	qb_rb_close(w);
+	ck_assert_int_eq(qb_rb_dwell_stats_get_by_name("test22", &stats),
+			 -ENOENT);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_writev)
+{
+	qb_ringbuffer_t *t;
+	struct iovec iov[3];
+	char hdr[7] = "header";
+	char *big;
+	char *out;
+	char *data;
+	size_t big_len = 64 * 1024 + 3;
+	ssize_t l;
+	ssize_t n;
+
+	big = malloc(big_len);
+	out = malloc(big_len + sizeof(hdr));
+	fail_if(big == NULL || out == NULL);
+	for (l = 0; l < big_len; l++) {
+		big[l] = l % 251;
+	}
+
+	t = qb_rb_open("test23", 256 * 1024,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_NT_STORES, 0);
+	fail_if(t == NULL);
+
+	/* small and big (streamed) writes come back as one chunk each */
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = big;
+	iov[1].iov_len = 10;
+	ck_assert_int_eq(qb_rb_chunk_writev(t, iov, 2), sizeof(hdr) + 10);
+	iov[1].iov_len = big_len;
+	ck_assert_int_eq(qb_rb_chunk_writev(t, iov, 2), sizeof(hdr) + big_len);
+	ck_assert_int_eq(qb_rb_chunk_writev(t, iov, 0), 0);
+
+	l = qb_rb_chunk_read(t, out, big_len + sizeof(hdr), 0);
+	ck_assert_int_eq(l, sizeof(hdr) + 10);
+	ck_assert_str_eq(out, "header");
+	fail_unless(memcmp(out + sizeof(hdr), big, 10) == 0);
+	l = qb_rb_chunk_read(t, out, big_len + sizeof(hdr), 0);
+	ck_assert_int_eq(l, sizeof(hdr) + big_len);
+	ck_assert_str_eq(out, "header");
+	fail_unless(memcmp(out + sizeof(hdr), big, big_len) == 0);
+	ck_assert_int_eq(qb_rb_chunk_read(t, out, big_len, 0), 0);
+
+	/* reserve, fill in bit by bit, commit what was used */
+	n = qb_rb_chunk_reserve(t, 16, (void **)&data);
+	fail_unless(n >= 16);
+	fail_unless(n <= qb_rb_space_free(t));
+	memcpy(data, hdr, sizeof(hdr));
+	memcpy(data + sizeof(hdr), big, 100);
+	ck_assert_int_eq(qb_rb_chunk_commit(t, sizeof(hdr) + 100), 0);
+	l = qb_rb_chunk_read(t, out, big_len, 0);
+	ck_assert_int_eq(l, sizeof(hdr) + 100);
+	fail_unless(memcmp(out + sizeof(hdr), big, 100) == 0);
+
+	n = qb_rb_chunk_reserve(t, 1024 * 1024, (void **)&data);
+	ck_assert_int_eq(n, -EAGAIN);
+	qb_rb_close(t);
+
+	/* several writers */
+	t = qb_rb_open("test23", 4096,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_MULTI_PRODUCER, 0);
+	fail_if(t == NULL);
+	iov[1].iov_len = 100;
+	iov[2].iov_base = hdr;
+	iov[2].iov_len = sizeof(hdr);
+	ck_assert_int_eq(qb_rb_chunk_writev(t, iov, 3), 2 * sizeof(hdr) + 100);
+	ck_assert_int_eq(qb_rb_chunk_reserve(t, 16, (void **)&data), -ENOTSUP);
+	l = qb_rb_chunk_read(t, out, big_len, 0);
+	ck_assert_int_eq(l, 2 * sizeof(hdr) + 100);
+	ck_assert_str_eq(out + sizeof(hdr) + 100, "header");
+	qb_rb_close(t);
+
+	free(out);
+	free(big);
+}
+END_TEST
+
+START_TEST(test_ring_buffer_hdr_version)
+{
+	struct qb_rb_dwell_stats stats;
+	qb_ringbuffer_t *rb;
+	uint32_t v1[3];
+	int32_t fd;
+
+	/* write_pt, read_pt and word_size: the layout before it had a magic */
+	fd = open("./test25-header", O_RDWR | O_CREAT | O_TRUNC, 0600);
+	fail_if(fd < 0);
+	v1[0] = 16;
+	v1[1] = 8;
+	v1[2] = 1024;
+	ck_assert_int_eq(write(fd, v1, sizeof(v1)), sizeof(v1));
+	ck_assert_int_eq(ftruncate(fd, 64 * 1024), 0);
+
+	ck_assert_int_eq(qb_rb_dwell_stats_get_by_name("./test25", &stats),
+			 -EPROTO);
+	rb = qb_rb_create_from_file(fd, QB_RB_FLAG_JOURNAL);
+	fail_unless(rb == NULL);
+	ck_assert_int_eq(errno, EPROTO);
+
+	close(fd);
+	unlink("./test25-header");
+}
+END_TEST
+
+START_TEST(test_ring_buffer_busy_poll)
+{
+	struct qb_rb_busy_poll_stats st;
+	qb_ringbuffer_t *t;
+	pthread_t writer;
+	int32_t i;
+	int32_t v;
+	ssize_t l;
+
+	t = qb_rb_open("test24", 2000,
+		       QB_RB_FLAG_CREATE | QB_RB_FLAG_SHARED_THREAD, 0);
+	fail_if(t == NULL);
+	ck_assert_int_eq(qb_rb_busy_poll_set(t, 2000000), -EINVAL);
+	ck_assert_int_eq(qb_rb_busy_poll(t), 0);
+	if (sysconf(_SC_NPROCESSORS_ONLN) == 1) {
+		/* nobody to spin for */
+		ck_assert_int_eq(qb_rb_busy_poll_set(t, 1000), 0);
+		ck_assert_int_eq(qb_rb_busy_poll(t), 0);
+		qb_rb_close(t);
+		return;
+	}
+
+	/* nothing comes in: spin, sleep, and spin less next time */
+	ck_assert_int_eq(qb_rb_busy_poll_set(t, 1000), 0);
+	l = qb_rb_chunk_read(t, &v, sizeof(v), 1);
+	ck_assert_int_eq(l, -ETIMEDOUT);
+	ck_assert_int_eq(qb_rb_busy_poll_stats_get(t, &st), 0);
+	ck_assert_int_eq(st.spins, 1);
+	ck_assert_int_eq(st.spin_hits, 0);
+	ck_assert_int_eq(st.sleeps, 1);
+	fail_unless(st.spin_ns >= 1000 * 1000);
+	fail_unless(st.sleep_ns > 0);
+	ck_assert_int_eq(st.budget_ns, 500 * 1000);
+	for (i = 0; i < 10; i++) {
+		ck_assert_int_eq(qb_rb_busy_poll(t), 0);
+	}
+	ck_assert_int_eq(qb_rb_busy_poll_stats_get(t, &st), 0);
+	ck_assert_int_eq(st.spins, 11);
+	ck_assert_int_eq(st.budget_ns, 1000 * 1000 / 16);
+
+	/* no need to spin for a chunk that is already there */
+	ck_assert_int_eq(qb_rb_chunk_write(t, &i, sizeof(i)), sizeof(i));
+	ck_assert_int_eq(qb_rb_busy_poll(t), 1);
+	l = qb_rb_chunk_read(t, &v, sizeof(v), -1);
+	ck_assert_int_eq(l, sizeof(v));
+	ck_assert_int_eq(qb_rb_busy_poll_stats_get(t, &st), 0);
+	ck_assert_int_eq(st.spins, 11);
+
+	/* a writer that pauses now and then */
+	ck_assert_int_eq(qb_rb_busy_poll_set(t, 100), 0);
+	ck_assert_int_eq(pthread_create(&writer, NULL,
+					futex_writer_thread, t), 0);
+	for (i = 0; i < 1000; i++) {
+		l = qb_rb_chunk_read(t, &v, sizeof(v), -1);
+		ck_assert_int_eq(l, sizeof(v));
+		ck_assert_int_eq(v, i);
+	}
+	pthread_join(writer, NULL);
+	ck_assert_int_eq(qb_rb_busy_poll_stats_get(t, &st), 0);
+	fail_unless(st.spins > 11);
+	fail_unless(st.spin_hits <= st.spins);
+	fail_unless(st.sleeps > 1);
+	fail_unless(st.budget_ns <= 100 * 1000);
+
+	ck_assert_int_eq(qb_rb_busy_poll_set(t, 0), 0);
+	ck_assert_int_eq(qb_rb_busy_poll(t), 0);
+	qb_rb_close(t);
+}
+END_TEST
+
 static Suite *rb_suite(void)
 {
 	TCase *tc;
@@ -209,6 +1446,80 @@ static Suite *rb_suite(void)
 	tcase_add_test(tc, test_ring_buffer4);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("multi_producer");
+	tcase_add_test(tc, test_ring_buffer_multi_producer);
+	tcase_add_test(tc, test_ring_buffer_multi_producer_abandoned);
+	tcase_set_timeout(tc, 30);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("futex");
+	tcase_add_test(tc, test_ring_buffer_futex);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("split_handles");
+	tcase_add_test(tc, test_ring_buffer_split_handles);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("v1_file");
+	tcase_add_test(tc, test_ring_buffer_v1_file);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("batch");
+	tcase_add_test(tc, test_ring_buffer_batch);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("hugepages");
+	tcase_add_test(tc, test_ring_buffer_hugepages);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("memfd");
+	tcase_add_test(tc, test_ring_buffer_memfd);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("eventfd");
+	tcase_add_test(tc, test_ring_buffer_eventfd);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("broadcast");
+	tcase_add_test(tc, test_ring_buffer_broadcast);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("overwrite_bulk");
+	tcase_add_test(tc, test_ring_buffer_overwrite_bulk);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("slots");
+	tcase_add_test(tc, test_ring_buffer_slots);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("resize");
+	tcase_add_test(tc, test_ring_buffer_resize);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("journal");
+	tcase_add_test(tc, test_ring_buffer_journal);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("dump");
+	tcase_add_test(tc, test_ring_buffer_dump);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("timestamps");
+	tcase_add_test(tc, test_ring_buffer_timestamps);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("writev");
+	tcase_add_test(tc, test_ring_buffer_writev);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("hdr_version");
+	tcase_add_test(tc, test_ring_buffer_hdr_version);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("busy_poll");
+	tcase_add_test(tc, test_ring_buffer_busy_poll);
+	suite_add_tcase(s, tc);
+
 	return s;
 }
 
@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2026 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This file is part of libqb.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Ringbuffer benchmark matrix.
+ *
+ * One writer thread and one reader thread, each with its own handle on
+ * the ringbuffer, for every combination of message size, ringbuffer
+ * size, notifier, normal/overwrite and same-core/cross-core placement.
+ * Every message carries its send time so the reader can build a
+ * latency histogram. The results are CSV on stdout, one line per run,
+ * so that runs of two builds can be diffed or plotted.
+ *
+ * Overwrite mode is the flight recorder case: the writer reclaims the
+ * oldest chunks itself, which races with a concurrent reader, so there
+ * the reader only drains what is left once the writer has stopped and
+ * the latencies are how long the survivors sat in the ringbuffer.
+ */
+#include "os_base.h"
+#include <pthread.h>
+#include <sched.h>
+
+#include <qb/qbrb.h>
+#include <qb/qbdefs.h>
+#include <qb/qbutil.h>
+#include <qb/qblog.h>
+
+#define MAX_LIST 16
+
+/* log-linear latency histogram, 8 buckets per power of two */
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct notifier_type {
+	const char *name;
+	uint32_t flags;
+};
+
+static const struct notifier_type notifiers[] = {
+	{ "sem", QB_RB_FLAG_SHARED_PROCESS },
+	{ "futex", QB_RB_FLAG_SHARED_PROCESS | QB_RB_FLAG_FUTEX },
+	{ "eventfd", QB_RB_FLAG_SHARED_PROCESS | QB_RB_FLAG_EVENTFD },
+	{ "none", QB_RB_FLAG_SHARED_PROCESS | QB_RB_FLAG_NO_SEMAPHORE },
+};
+
+struct bench_run {
+	size_t msg_size;
+	size_t rb_size;
+	const struct notifier_type *notifier;
+	int32_t overwrite;
+	int32_t cross_core;
+
+	qb_ringbuffer_t *w;
+	qb_ringbuffer_t *r;
+	volatile int32_t stop_writer;
+	volatile int32_t writer_done;
+
+	uint64_t writes;
+	uint64_t full;
+	uint64_t reads;
+	uint64_t hist[HIST_BUCKETS];
+	uint64_t lat_max;
+};
+
+static int32_t bench_ms = 1000;
+static int32_t cpu_a = -1;
+static int32_t cpu_b = -1;
+
+static uint32_t
+hist_bucket(uint64_t ns)
+{
+	uint32_t msb;
+
+	if (ns < (1 << HIST_SUB_BITS)) {
+		return ns;
+	}
+	msb = 63 - __builtin_clzll(ns);
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+		((ns >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static uint64_t
+hist_bucket_min(uint32_t i)
+{
+	uint32_t group = i >> HIST_SUB_BITS;
+	uint64_t sub = i & ((1 << HIST_SUB_BITS) - 1);
+
+	if (group == 0) {
+		return i;
+	}
+	return ((1 << HIST_SUB_BITS) + sub) << (group - 1);
+}
+
+static uint64_t
+hist_percentile(struct bench_run *run, uint32_t per_mille)
+{
+	uint64_t wanted = (run->reads * per_mille + 999) / 1000;
+	uint64_t seen = 0;
+	uint32_t i;
+
+	if (run->reads == 0) {
+		return 0;
+	}
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		seen += run->hist[i];
+		if (seen >= wanted) {
+			break;
+		}
+	}
+	if (i == HIST_BUCKETS - 1) {
+		return run->lat_max;
+	}
+	return QB_MIN(hist_bucket_min(i + 1) - 1, run->lat_max);
+}
+
+static void
+cpu_pin(int32_t cpu)
+{
+#if defined(QB_LINUX) && defined(CPU_SET)
+	cpu_set_t set;
+
+	if (cpu < 0) {
+		return;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+		perror("sched_setaffinity");
+	}
+#endif /* QB_LINUX && CPU_SET */
+}
+
+/* pick two cpus we may run on, cpu_b stays -1 if there is only one */
+static void
+cpus_pick(void)
+{
+#if defined(QB_LINUX) && defined(CPU_SET)
+	cpu_set_t set;
+	int32_t i;
+
+	if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+		return;
+	}
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (!CPU_ISSET(i, &set)) {
+			continue;
+		}
+		if (cpu_a < 0) {
+			cpu_a = i;
+		} else {
+			cpu_b = i;
+			break;
+		}
+	}
+#endif /* QB_LINUX && CPU_SET */
+}
+
+static void *
+writer_thread(void *arg)
+{
+	struct bench_run *run = arg;
+	char *buffer = calloc(1, run->msg_size);
+	uint64_t now;
+	ssize_t res;
+
+	cpu_pin(cpu_a);
+	while (!run->stop_writer) {
+		now = qb_util_nano_current_get();
+		memcpy(buffer, &now, sizeof(now));
+		res = qb_rb_chunk_write(run->w, buffer, run->msg_size);
+		if (res == run->msg_size) {
+			run->writes++;
+		} else if (res == -EAGAIN) {
+			run->full++;
+			sched_yield();
+		} else {
+			errno = -res;
+			perror("qb_rb_chunk_write");
+			break;
+		}
+	}
+	run->writer_done = QB_TRUE;
+	free(buffer);
+	return NULL;
+}
+
+static void *
+reader_thread(void *arg)
+{
+	struct bench_run *run = arg;
+	char *buffer = malloc(run->msg_size);
+	int32_t timeout = (run->notifier->flags & QB_RB_FLAG_NO_SEMAPHORE) ?
+		0 : 100;
+	uint64_t stamp;
+	uint64_t now;
+	uint64_t lat;
+	ssize_t res;
+
+	cpu_pin(run->cross_core ? cpu_b : cpu_a);
+	while (run->overwrite && !run->writer_done) {
+		usleep(1000);
+	}
+	for (;;) {
+		res = qb_rb_chunk_read(run->r, buffer, run->msg_size, timeout);
+		if (res < 0) {
+			if (run->writer_done) {
+				break;
+			}
+			if (timeout == 0) {
+				sched_yield();
+			}
+			continue;
+		}
+		now = qb_util_nano_current_get();
+		memcpy(&stamp, buffer, sizeof(stamp));
+		run->reads++;
+		/* an overwritten chunk can be torn, don't count it */
+		if (stamp > now) {
+			continue;
+		}
+		lat = now - stamp;
+		run->hist[hist_bucket(lat)]++;
+		run->lat_max = QB_MAX(run->lat_max, lat);
+	}
+	free(buffer);
+	return NULL;
+}
+
+static int32_t
+bench_open(struct bench_run *run)
+{
+	uint32_t flags = run->notifier->flags;
+	int32_t fd;
+
+	if (run->overwrite) {
+		flags |= QB_RB_FLAG_OVERWRITE;
+	}
+	run->w = qb_rb_open("rbbench", run->rb_size,
+			    flags | QB_RB_FLAG_CREATE, 0);
+	if (run->w == NULL) {
+		return -errno;
+	}
+	run->r = qb_rb_open("rbbench", run->rb_size, flags, 0);
+	if (run->r == NULL) {
+		qb_rb_close(run->w);
+		return -errno;
+	}
+	if (flags & QB_RB_FLAG_EVENTFD) {
+		if (qb_rb_fd_get(run->w, &fd) != 0 ||
+		    qb_rb_fd_set(run->r, dup(fd)) != 0) {
+			qb_rb_close(run->r);
+			qb_rb_close(run->w);
+			return -ENOTSUP;
+		}
+	}
+	return 0;
+}
+
+static void
+bench_one(struct bench_run *run)
+{
+	qb_util_stopwatch_t *sw;
+	pthread_t writer;
+	pthread_t reader;
+	uint64_t ops;
+	float secs;
+	int32_t res;
+
+	res = bench_open(run);
+	if (res != 0) {
+		fprintf(stderr, "skipping %s: %s\n", run->notifier->name,
+			strerror(-res));
+		return;
+	}
+	sw = qb_util_stopwatch_create();
+	pthread_create(&reader, NULL, reader_thread, run);
+	qb_util_stopwatch_start(sw);
+	pthread_create(&writer, NULL, writer_thread, run);
+	usleep(bench_ms * 1000);
+	run->stop_writer = QB_TRUE;
+	pthread_join(writer, NULL);
+	pthread_join(reader, NULL);
+	qb_util_stopwatch_stop(sw);
+	secs = qb_util_stopwatch_sec_elapsed_get(sw);
+	/* in overwrite mode the reader only sees the survivors */
+	ops = run->overwrite ? run->writes : run->reads;
+
+	printf("%zu,%zu,%s,%s,%s,%.3f,%" PRIu64 ",%" PRIu64 ",%" PRIu64
+	       ",%.1f,%.3f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+	       run->msg_size, run->rb_size, run->notifier->name,
+	       run->overwrite ? "overwrite" : "normal",
+	       run->cross_core ? "cross-core" : "same-core",
+	       secs, run->writes, run->reads, run->full,
+	       ops / secs, ops * run->msg_size / (secs * 1024 * 1024),
+	       hist_percentile(run, 500), hist_percentile(run, 990),
+	       hist_percentile(run, 999), run->lat_max);
+	fflush(stdout);
+
+	qb_util_stopwatch_free(sw);
+	qb_rb_close(run->r);
+	qb_rb_close(run->w);
+}
+
+static int32_t
+list_parse(const char *arg, size_t *list)
+{
+	char *copy = strdup(arg);
+	char *tok;
+	char *save = NULL;
+	int32_t n = 0;
+
+	for (tok = strtok_r(copy, ",", &save); tok && n < MAX_LIST;
+	     tok = strtok_r(NULL, ",", &save)) {
+		list[n++] = strtoul(tok, NULL, 0);
+	}
+	free(copy);
+	return n;
+}
+
+static void show_usage(const char *name)
+{
+	printf("usage: \n");
+	printf("%s <options>\n", name);
+	printf("\n");
+	printf("  options:\n");
+	printf("\n");
+	printf("  -s <sizes>     message sizes, comma separated (default 16,64,256,1024,4096)\n");
+	printf("  -r <sizes>     ringbuffer sizes, comma separated (default 65536,1048576)\n");
+	printf("  -n <notifier>  only this notifier (sem, futex, eventfd, none)\n");
+	printf("  -d <ms>        duration of each run (default 1000)\n");
+	printf("  -v             verbose\n");
+	printf("  -h             show this help text\n");
+	printf("\n");
+}
+
+int32_t main(int32_t argc, char *argv[])
+{
+	const char *options = "s:r:n:d:vh";
+	size_t msg_sizes[MAX_LIST] = { 16, 64, 256, 1024, 4096 };
+	size_t rb_sizes[MAX_LIST] = { 64 * 1024, 1024 * 1024 };
+	int32_t n_msg_sizes = 5;
+	int32_t n_rb_sizes = 2;
+	const char *only = NULL;
+	struct bench_run run;
+	int32_t verbose = 0;
+	int32_t opt;
+	int32_t m, r, n, o, c;
+
+	while ((opt = getopt(argc, argv, options)) != -1) {
+		switch (opt) {
+		case 's':
+			n_msg_sizes = list_parse(optarg, msg_sizes);
+			break;
+		case 'r':
+			n_rb_sizes = list_parse(optarg, rb_sizes);
+			break;
+		case 'n':
+			only = optarg;
+			break;
+		case 'd':
+			bench_ms = atoi(optarg);
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case 'h':
+		default:
+			show_usage(argv[0]);
+			exit(0);
+			break;
+		}
+	}
+
+	qb_log_init("rbbench", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
+			  QB_LOG_FILTER_FILE, "*", LOG_WARNING + verbose);
+	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
+
+	cpus_pick();
+	if (cpu_b < 0) {
+		fprintf(stderr, "only one cpu, skipping cross-core runs\n");
+	}
+
+	printf("msg_size,rb_size,notifier,mode,placement,secs,writes,reads,"
+	       "full,ops_per_sec,mb_per_sec,lat_p50_ns,lat_p99_ns,"
+	       "lat_p999_ns,lat_max_ns\n");
+	for (m = 0; m < n_msg_sizes; m++) {
+	for (r = 0; r < n_rb_sizes; r++) {
+	for (n = 0; n < sizeof(notifiers) / sizeof(notifiers[0]); n++) {
+	for (o = 0; o < 2; o++) {
+	for (c = 0; c < 2; c++) {
+		if (only && strcmp(only, notifiers[n].name) != 0) {
+			continue;
+		}
+		if (c && cpu_b < 0) {
+			continue;
+		}
+		/* the timestamp has to fit, and a message in the ring */
+		if (msg_sizes[m] < sizeof(uint64_t) ||
+		    msg_sizes[m] > rb_sizes[r] / 4) {
+			continue;
+		}
+		memset(&run, 0, sizeof(run));
+		run.msg_size = msg_sizes[m];
+		run.rb_size = rb_sizes[r];
+		run.notifier = &notifiers[n];
+		run.overwrite = o;
+		run.cross_core = c;
+		bench_one(&run);
+	}
+	}
+	}
+	}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This file is part of libqb.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * First write latency benchmark.
+ *
+ * A ringbuffer is created and then opened a second time (as a client
+ * process would) and the second handle fills it exactly once, timing
+ * every write. Without QB_RB_FLAG_PREFAULT each new page costs a page
+ * fault on the first write that touches it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <qb/qbrb.h>
+#include <qb/qbdefs.h>
+#include <qb/qbutil.h>
+#include <qb/qblog.h>
+
+static size_t rb_size = 64 * 1024 * 1024;
+static size_t write_size = 64;
+
+static int
+_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+_benchmark(uint32_t extra_flags, const char *desc)
+{
+	qb_ringbuffer_t *rb_creator;
+	qb_ringbuffer_t *rb;
+	uint32_t flags = QB_RB_FLAG_SHARED_PROCESS | QB_RB_FLAG_NO_SEMAPHORE;
+	uint64_t *lat;
+	uint64_t start;
+	uint64_t open_ns;
+	uint64_t sum = 0;
+	size_t count;
+	size_t i;
+	char *buffer;
+	ssize_t res;
+
+	count = rb_size / (write_size + 16);
+	lat = calloc(count, sizeof(uint64_t));
+	buffer = calloc(1, write_size);
+	if (lat == NULL || buffer == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	memset(buffer, 'f', write_size);
+
+	start = qb_util_nano_current_get();
+	rb_creator = qb_rb_open("rbfirstwrite", rb_size,
+				flags | QB_RB_FLAG_CREATE | extra_flags, 0);
+	if (rb_creator == NULL) {
+		perror("qb_rb_open(create)");
+		exit(1);
+	}
+	rb = qb_rb_open("rbfirstwrite", rb_size, flags | extra_flags, 0);
+	if (rb == NULL) {
+		perror("qb_rb_open");
+		exit(1);
+	}
+	open_ns = qb_util_nano_current_get() - start;
+
+	for (i = 0; i < count; i++) {
+		start = qb_util_nano_current_get();
+		res = qb_rb_chunk_write(rb, buffer, write_size);
+		lat[i] = qb_util_nano_current_get() - start;
+		if (res != write_size) {
+			count = i;
+			break;
+		}
+		sum += lat[i];
+	}
+	qsort(lat, count, sizeof(uint64_t), _cmp_u64);
+
+	printf("%-20s ", desc);
+	printf("open %8.3f ms ", (float)open_ns / QB_TIME_NS_IN_MSEC);
+	printf("%8zu writes ", count);
+	printf("mean %7.0f ns ", count ? (float)sum / count : 0.0);
+	printf("p99 %7" PRIu64 " ns ", count ? lat[count * 99 / 100] : 0);
+	printf("max %9" PRIu64 " ns ", count ? lat[count - 1] : 0);
+	printf("fill %8.3f ms\n", (float)sum / QB_TIME_NS_IN_MSEC);
+
+	qb_rb_close(rb);
+	qb_rb_close(rb_creator);
+	free(buffer);
+	free(lat);
+}
+
+static void show_usage(const char *name)
+{
+	printf("usage: \n");
+	printf("%s <options>\n", name);
+	printf("\n");
+	printf("  options:\n");
+	printf("\n");
+	printf("  -m <MB>        ringbuffer size (default 64)\n");
+	printf("  -s <size>      bytes per write (default 64)\n");
+	printf("  -v             verbose\n");
+	printf("  -h             show this help text\n");
+	printf("\n");
+}
+
+int32_t main(int32_t argc, char *argv[])
+{
+	const char *options = "m:s:vh";
+	int32_t opt;
+	int32_t verbose = 0;
+
+	while ((opt = getopt(argc, argv, options)) != -1) {
+		switch (opt) {
+		case 'm':
+			rb_size = (size_t)atol(optarg) * 1024 * 1024;
+			break;
+		case 's':
+			write_size = QB_MAX(atol(optarg), 1);
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case 'h':
+		default:
+			show_usage(argv[0]);
+			exit(0);
+			break;
+		}
+	}
+
+	qb_log_init("rbfirstwrite", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
+			  QB_LOG_FILTER_FILE, "*", LOG_INFO + verbose);
+	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
+
+	_benchmark(0, "default");
+	_benchmark(QB_RB_FLAG_PREFAULT, "prefault");
+	_benchmark(QB_RB_FLAG_HUGEPAGES, "hugepages");
+	_benchmark(QB_RB_FLAG_HUGEPAGES | QB_RB_FLAG_PREFAULT,
+		   "hugepages+prefault");
+	return EXIT_SUCCESS;
+}
@@ -22,6 +22,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/resource.h>
 
 #include <qb/qbdefs.h>
 #include <qb/qbrb.h>
@@ -40,9 +41,39 @@ static void sigterm_handler(int32_t num)
 	keep_reading = QB_FALSE;
 }
 
+static void show_usage(const char *name)
+{
+	printf("usage: \n");
+	printf("%s <options>\n", name);
+	printf("\n");
+	printf("  options:\n");
+	printf("\n");
+	printf("  -f             use a futex notifier (default semaphore)\n");
+	printf("  -h             show this help text\n");
+	printf("\n");
+}
+
 int32_t main(int32_t argc, char *argv[])
 {
+	const char *options = "fh";
+	int32_t opt;
+	uint32_t flags = QB_RB_FLAG_SHARED_PROCESS | QB_RB_FLAG_CREATE;
 	ssize_t num_read;
+	uint64_t read_count = 0;
+	struct rusage usage;
+
+	while ((opt = getopt(argc, argv, options)) != -1) {
+		switch (opt) {
+		case 'f':
+			flags |= QB_RB_FLAG_FUTEX;
+			break;
+		case 'h':
+		default:
+			show_usage(argv[0]);
+			exit(0);
+			break;
+		}
+	}
 
 	signal(SIGINT, sigterm_handler);
 
@@ -52,9 +83,7 @@ int32_t main(int32_t argc, char *argv[])
 			  QB_LOG_FILTER_FILE, "*", LOG_TRACE);
 	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
 
-	rb = qb_rb_open("tester", ONE_MEG * 3,
-			QB_RB_FLAG_SHARED_PROCESS |
-			QB_RB_FLAG_CREATE, 0);
+	rb = qb_rb_open("tester", ONE_MEG * 3, flags, 0);
 
 	if (rb == NULL) {
 		qb_perror(LOG_ERR, "failed to create ringbuffer");
@@ -62,14 +91,26 @@ int32_t main(int32_t argc, char *argv[])
 	}
 	while (keep_reading) {
 		num_read = qb_rb_chunk_read(rb, buffer,
-					    ONE_MEG, 0);
-		if (num_read == -ETIMEDOUT) {
-			usleep(100000);
-		} else if (num_read < 0) {
+					    ONE_MEG, 100);
+		if (num_read >= 0) {
+			read_count++;
+		} else if (num_read != -ETIMEDOUT && num_read != -EINTR) {
 			errno = -num_read;
 			qb_perror(LOG_ERR, "nothing to read");
 		}
 	}
+
+	/*
+	 * Every time the reader has to sleep on the notifier it gives up
+	 * the cpu, so the voluntary context switches show how often the
+	 * reader really needed the kernel to wait for data.
+	 */
+	getrusage(RUSAGE_SELF, &usage);
+	printf("%9lu messages read ", (unsigned long)read_count);
+	printf("%9ld voluntary context switches ", usage.ru_nvcsw);
+	printf("%9ld involuntary ", usage.ru_nivcsw);
+	printf("%7.3f sys secs\n",
+	       usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0);
 	qb_rb_close(rb);
 	return 0;
 }
@@ -29,6 +29,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/resource.h>
 
 #include <qb/qbrb.h>
 #include <qb/qbdefs.h>
@@ -59,8 +60,11 @@ _benchmark(ssize_t write_size)
 	ssize_t res;
 	int write_count = 0;
 	float secs;
+	struct rusage usage_start;
+	struct rusage usage_end;
 
 	alarm_notice = 0;
+	getrusage(RUSAGE_SELF, &usage_start);
 
 	alarm (10);
 
@@ -76,14 +80,18 @@ _benchmark(ssize_t write_size)
 	}
 	qb_util_stopwatch_stop(sw);
 	secs = qb_util_stopwatch_sec_elapsed_get(sw);
+	getrusage(RUSAGE_SELF, &usage_end);
 
 	printf ("%5d messages sent ", write_count);
 	printf ("%5ld bytes per write ", (long int) write_size);
 	printf ("%7.3f Seconds runtime ", secs);
 	printf ("%9.3f TP/s ",
 		((float)write_count) / secs);
-	printf ("%7.3f MB/s.\n",
+	printf ("%7.3f MB/s ",
 		((float)write_count) * ((float)write_size) / secs);
+	printf ("%7.3f sys secs.\n",
+		(usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) +
+		(usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec) / 1000000.0);
 }
 
 
@@ -113,7 +121,7 @@ static void show_usage(const char *name)
 	printf("\n");
 	printf("  options:\n");
 	printf("\n");
-	printf("  -n             non-blocking ipc (default blocking)\n");
+	printf("  -f             use a futex notifier (default semaphore)\n");
 	printf("  -v             verbose\n");
 	printf("  -h             show this help text\n");
 	printf("\n");
@@ -121,12 +129,16 @@ static void show_usage(const char *name)
 
 int32_t main(int32_t argc, char *argv[])
 {
-	const char *options = "vh";
+	const char *options = "fvh";
 	int32_t opt;
 	int32_t verbose = 0;
+	uint32_t flags = QB_RB_FLAG_SHARED_PROCESS;
 
 	while ((opt = getopt(argc, argv, options)) != -1) {
 		switch (opt) {
+		case 'f':
+			flags |= QB_RB_FLAG_FUTEX;
+			break;
 		case 'v':
 			verbose++;
 			break;
@@ -146,8 +158,11 @@ int32_t main(int32_t argc, char *argv[])
 			  QB_LOG_FILTER_FILE, "*", LOG_INFO + verbose);
 	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
 
-	rb = qb_rb_open("tester", ONE_MEG * 3,
-			QB_RB_FLAG_SHARED_PROCESS, 0);
+	rb = qb_rb_open("tester", ONE_MEG * 3, flags, 0);
+	if (rb == NULL) {
+		qb_perror(LOG_ERR, "failed to open ringbuffer");
+		return -1;
+	}
 	do_throughput_benchmark();
 	qb_rb_close(rb);
 	return EXIT_SUCCESS;
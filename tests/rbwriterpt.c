@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * All rights reserved.
+ *
+ * This file is part of libqb.
+ *
+ * libqb is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * libqb is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with libqb.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Writer contention benchmark.
+ *
+ * N writer threads push fixed size chunks into one ringbuffer while a
+ * single reader thread drains it. Each thread count is run twice: once
+ * with the writers serialised by a mutex around a normal (single
+ * producer) ringbuffer and once with QB_RB_FLAG_MULTI_PRODUCER.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <qb/qbrb.h>
+#include <qb/qbdefs.h>
+#include <qb/qbutil.h>
+#include <qb/qblog.h>
+
+#define MAX_WRITERS 16
+#define RB_SIZE (1024 * 1024)
+
+static qb_ringbuffer_t *rb = NULL;
+static pthread_mutex_t rb_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int32_t use_mutex;
+static volatile int32_t stop_writers;
+static volatile int32_t stop_reader;
+static size_t write_size = 64;
+static int32_t bench_secs = 3;
+
+struct writer_ctx {
+	pthread_t thread;
+	uint64_t count;
+	uint64_t eagain;
+};
+
+static void *
+writer_thread(void *arg)
+{
+	struct writer_ctx *ctx = arg;
+	char buffer[RB_SIZE / 4];
+	ssize_t res;
+
+	memset(buffer, 'w', write_size);
+	while (!stop_writers) {
+		if (use_mutex) {
+			pthread_mutex_lock(&rb_mutex);
+			res = qb_rb_chunk_write(rb, buffer, write_size);
+			pthread_mutex_unlock(&rb_mutex);
+		} else {
+			res = qb_rb_chunk_write(rb, buffer, write_size);
+		}
+		if (res == write_size) {
+			ctx->count++;
+		} else if (res == -EAGAIN) {
+			ctx->eagain++;
+			sched_yield();
+		} else {
+			errno = -res;
+			perror("qb_rb_chunk_write");
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void *
+reader_thread(void *arg)
+{
+	char buffer[RB_SIZE / 4];
+	ssize_t res;
+
+	for (;;) {
+		res = qb_rb_chunk_read(rb, buffer, sizeof(buffer), 100);
+		if (res == -ETIMEDOUT && stop_reader) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void
+_benchmark(int32_t writers, int32_t mutex)
+{
+	struct writer_ctx ctx[MAX_WRITERS];
+	qb_util_stopwatch_t *sw;
+	pthread_t reader;
+	uint64_t total = 0;
+	uint64_t eagain = 0;
+	uint32_t flags = QB_RB_FLAG_CREATE | QB_RB_FLAG_SHARED_THREAD;
+	float secs;
+	int32_t i;
+
+	if (!mutex) {
+		flags |= QB_RB_FLAG_MULTI_PRODUCER;
+	}
+	rb = qb_rb_open("rbwriterpt", RB_SIZE, flags, 0);
+	if (rb == NULL) {
+		perror("qb_rb_open");
+		exit(1);
+	}
+	use_mutex = mutex;
+	stop_writers = QB_FALSE;
+	stop_reader = QB_FALSE;
+	memset(ctx, 0, sizeof(ctx));
+
+	sw = qb_util_stopwatch_create();
+	pthread_create(&reader, NULL, reader_thread, NULL);
+	qb_util_stopwatch_start(sw);
+	for (i = 0; i < writers; i++) {
+		pthread_create(&ctx[i].thread, NULL, writer_thread, &ctx[i]);
+	}
+	sleep(bench_secs);
+	stop_writers = QB_TRUE;
+	for (i = 0; i < writers; i++) {
+		pthread_join(ctx[i].thread, NULL);
+		total += ctx[i].count;
+		eagain += ctx[i].eagain;
+	}
+	qb_util_stopwatch_stop(sw);
+	stop_reader = QB_TRUE;
+	pthread_join(reader, NULL);
+	secs = qb_util_stopwatch_sec_elapsed_get(sw);
+
+	printf("%-14s ", mutex ? "mutex" : "multi-producer");
+	printf("%2d writers ", writers);
+	printf("%5ld bytes per write ", (long int)write_size);
+	printf("%7.3f Seconds runtime ", secs);
+	printf("%12.3f TP/s ", ((float)total) / secs);
+	printf("%9.3f MB/s ",
+	       ((float)total) * ((float)write_size) / (secs * 1024 * 1024));
+	printf("%9lu full\n", (unsigned long)eagain);
+
+	qb_util_stopwatch_free(sw);
+	qb_rb_close(rb);
+	rb = NULL;
+}
+
+static void show_usage(const char *name)
+{
+	printf("usage: \n");
+	printf("%s <options>\n", name);
+	printf("\n");
+	printf("  options:\n");
+	printf("\n");
+	printf("  -t <threads>   maximum number of writer threads (default 8)\n");
+	printf("  -s <size>      bytes per write (default 64)\n");
+	printf("  -d <seconds>   duration of each run (default 3)\n");
+	printf("  -v             verbose\n");
+	printf("  -h             show this help text\n");
+	printf("\n");
+}
+
+int32_t main(int32_t argc, char *argv[])
+{
+	const char *options = "t:s:d:vh";
+	int32_t opt;
+	int32_t verbose = 0;
+	int32_t max_writers = 8;
+	int32_t writers;
+
+	while ((opt = getopt(argc, argv, options)) != -1) {
+		switch (opt) {
+		case 't':
+			max_writers = QB_MIN(atoi(optarg), MAX_WRITERS);
+			break;
+		case 's':
+			write_size = QB_MIN(atol(optarg), RB_SIZE / 4);
+			break;
+		case 'd':
+			bench_secs = atoi(optarg);
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case 'h':
+		default:
+			show_usage(argv[0]);
+			exit(0);
+			break;
+		}
+	}
+
+	qb_log_init("rbwriterpt", LOG_USER, LOG_EMERG);
+	qb_log_ctl(QB_LOG_SYSLOG, QB_LOG_CONF_ENABLED, QB_FALSE);
+	qb_log_filter_ctl(QB_LOG_STDERR, QB_LOG_FILTER_ADD,
+			  QB_LOG_FILTER_FILE, "*", LOG_INFO + verbose);
+	qb_log_ctl(QB_LOG_STDERR, QB_LOG_CONF_ENABLED, QB_TRUE);
+
+	for (writers = 1; writers <= max_writers; writers *= 2) {
+		_benchmark(writers, QB_TRUE);
+		_benchmark(writers, QB_FALSE);
+	}
+	return EXIT_SUCCESS;
+}